@@ -8,6 +8,9 @@
  *  version. See http://www.gnu.org/licenses/
  */
 
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE  /* dl_iterate_phdr */
+#endif
 #include "bfd_symbolizer.h"
 #include <pthread.h>
 #include <stdlib.h>
@@ -21,6 +24,8 @@
 #include <unistd.h>
 #include <errno.h>
 #include <limits.h>
+#include <stddef.h>
+#include <link.h>
 #include <bfd.h>
 
 #ifdef BFDS_UNWIND
@@ -68,6 +73,17 @@ typedef struct lib_t {
 typedef struct ctx_t {
   pthread_mutex_t       mtx;
   lib_t*                libs;
+  /* Modules sorted by begin address, for binary search in find_lib(). */
+  lib_t**               index;
+  int                   index_size;
+  int                   index_capacity;
+  /* Incremented whenever the module list changes,
+   * invalidates the per-thread caches. The only field read w/o mtx. */
+  unsigned              libs_gen;
+  /* dl_iterate_phdr() load/unload counters at the last module list update. */
+  unsigned long long    dl_adds;
+  unsigned long long    dl_subs;
+  int                   is_dl_gen_valid;
   int                   maps_size;
   uint32_t              maps_crc;
   uint32_t              crc_tab [256];
@@ -87,7 +103,41 @@ typedef struct sym_t {
 } sym_t;
 
 
+/* Per-thread cache of the resolved addresses, so that parallel
+ * symbolization of the same addresses does not contend on ctx.mtx.
+ * Symbols are kept mangled, demangling is done on every request. */
+#define CACHE_SIZE 512
+#define CACHE_BUF_SIZE 4096
+
+
+typedef struct cache_entry_t {
+  void*                 addr;
+  int                   key;
+  unsigned              libs_gen;
+  /* ctx.dl_* when the address was resolved. */
+  unsigned long long    dl_adds;
+  unsigned long long    dl_subs;
+  int                   is_dl_gen_valid;
+  char*                 symbol;
+  char*                 module;
+  char*                 filename;
+  int                   source_line;
+  int                   symbol_offset;
+} cache_entry_t;
+
+
+typedef struct cache_t {
+  cache_entry_t         entries [CACHE_SIZE];
+  char                  symbol [CACHE_BUF_SIZE];
+  char                  module [CACHE_BUF_SIZE];
+  char                  filename [CACHE_BUF_SIZE];
+} cache_t;
+
+
 static struct ctx_t ctx = {PTHREAD_MUTEX_INITIALIZER};
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cache_key;
+static int is_cache_key_valid;
 
 
 static int var_sort_pred(void const* p1, void const* p2) {
@@ -95,6 +145,20 @@ static int var_sort_pred(void const* p1, void const* p2) {
 }
 
 
+static int lib_sort_pred(void const* p1, void const* p2) {
+  lib_t*                l1;
+  lib_t*                l2;
+
+  l1 = *(lib_t**)p1;
+  l2 = *(lib_t**)p2;
+  if (l1->begin < l2->begin)
+    return -1;
+  if (l1->begin > l2->begin)
+    return 1;
+  return 0;
+}
+
+
 static int var_search_pred(void const* p1, void const* p2) {
   var_t*                v0;
   var_t*                v1;
@@ -240,6 +304,33 @@ static lib_t* update_lib(lib_t* prev, void* lbegin, void* lend, char const* lnam
 }
 
 
+static void build_index() {
+  lib_t*                lib;
+  lib_t**               index;
+  int                   count;
+
+  count = 0;
+  for (lib = ctx.libs; lib != 0; lib = lib->next)
+    count += 1;
+  if (count > ctx.index_capacity) {
+    index = (lib_t**)realloc(ctx.index, count * 2 * sizeof(lib_t*));
+    if (index == 0) {
+      ERR("realloc(%d) failed (%s)\n",
+          (int)(count * 2 * sizeof(lib_t*)), strerror(errno));
+      ctx.index_size = 0;
+      return;
+    }
+    ctx.index = index;
+    ctx.index_capacity = count * 2;
+  }
+
+  ctx.index_size = 0;
+  for (lib = ctx.libs; lib != 0; lib = lib->next)
+    ctx.index[ctx.index_size++] = lib;
+  qsort(ctx.index, ctx.index_size, sizeof(lib_t*), lib_sort_pred);
+}
+
+
 static void update_libs_impl(char* data, int sz) {
   uint32_t              crc;
   char*                 pos;
@@ -288,6 +379,9 @@ static void update_libs_impl(char* data, int sz) {
     }
   }
 
+  build_index();
+  __sync_fetch_and_add(&ctx.libs_gen, 1);
+
   DBG("refresh completed\n");
   DBG("module list:\n");
   for (lib = ctx.libs; lib != 0; lib = lib->next) {
@@ -296,11 +390,74 @@ static void update_libs_impl(char* data, int sz) {
 }
 
 
+static int dl_gen_callback(struct dl_phdr_info* info, size_t size, void* data) {
+  unsigned long long*   gen;
+
+  /* The counters are present only in newer versions of the structure. */
+  if (size < offsetof(struct dl_phdr_info, dlpi_subs) + sizeof(info->dlpi_subs))
+    return -1;
+  gen = (unsigned long long*)data;
+  gen[0] = info->dlpi_adds;
+  gen[1] = info->dlpi_subs;
+  return 1;
+}
+
+
+/* Returns 0 and the numbers of loaded and unloaded modules so far,
+ * or non-zero if they are not available. */
+static int get_dl_gen(unsigned long long* adds, unsigned long long* subs) {
+  unsigned long long    gen [2];
+
+  if (dl_iterate_phdr(dl_gen_callback, gen) != 1)
+    return 1;
+  *adds = gen[0];
+  *subs = gen[1];
+  return 0;
+}
+
+
+/* Returns non-zero if no modules were loaded or unloaded
+ * since the address of the entry was resolved. */
+static int is_dl_gen_unchanged(cache_entry_t* e) {
+  unsigned long long    adds;
+  unsigned long long    subs;
+
+  if (e->is_dl_gen_valid == 0 || get_dl_gen(&adds, &subs))
+    return 0;
+  return adds == e->dl_adds && subs == e->dl_subs;
+}
+
+
+/* Reads ctx.libs_gen w/o ctx.mtx. The cached results which were put
+ * before the returned generation was published are visible. */
+static unsigned load_libs_gen() {
+  unsigned              libs_gen;
+
+  libs_gen = *(volatile unsigned*)&ctx.libs_gen;
+  __sync_synchronize();
+  return libs_gen;
+}
+
+
 static void update_libs() {
   int                   f;
   int                   fsz;
   off_t                 res;
   char*                 data;
+  unsigned long long    adds;
+  unsigned long long    subs;
+  int                   is_dl_gen_valid;
+
+  /* Modules are loaded and unloaded only by the dynamic loader, so there is
+   * nothing to re-read if its counters are not changed. */
+  adds = 0;
+  subs = 0;
+  is_dl_gen_valid = get_dl_gen(&adds, &subs) == 0;
+  if (is_dl_gen_valid && ctx.is_dl_gen_valid
+      && adds == ctx.dl_adds && subs == ctx.dl_subs) {
+    DBG("loaded modules are not changed\n");
+    return;
+  }
 
   DBG("refreshing /proc/self/maps\n");
   f = open("/proc/self/maps", O_RDONLY);
@@ -345,16 +502,31 @@ static void update_libs() {
   update_libs_impl(data, fsz);
   free(data);
   close(f);
+  ctx.dl_adds = adds;
+  ctx.dl_subs = subs;
+  ctx.is_dl_gen_valid = is_dl_gen_valid;
 }
 
 
 static lib_t* find_lib(void* addr) {
   lib_t*                lib;
-
-  for (lib = ctx.libs; lib != 0; lib = lib->next) {
-    if (addr >= lib->begin && addr < lib->end)
-      break;
+  int                   lo;
+  int                   hi;
+  int                   mid;
+
+  /* Find the last module that begins at or below addr. */
+  lo = 0;
+  hi = ctx.index_size;
+  while (lo != hi) {
+    mid = lo + (hi - lo) / 2;
+    if (ctx.index[mid]->begin <= addr)
+      lo = mid + 1;
+    else
+      hi = mid;
   }
+  lib = 0;
+  if (lo != 0 && addr < ctx.index[lo - 1]->end)
+    lib = ctx.index[lo - 1];
 
   if (lib != 0) {
     DBG("found lib '%s' %p-%p\n",
@@ -692,45 +864,185 @@ static int process_demangle(char* symbol, int symbol_size, bfds_opts_e opts) {
 }
 
 
-int   bfds_symbolize    (void*                  addr,
-                         bfds_opts_e            opts,
-                         char*                  symbol,
-                         int                    symbol_size,
-                         char*                  module,
-                         int                    module_size,
-                         char*                  filename,
-                         int                    filename_size,
-                         int*                   source_line,
-                         int*                   symbol_offset) {
-  lib_t*                lib;
+static void cache_entry_clear(cache_entry_t* e) {
+  free(e->symbol);
+  free(e->module);
+  free(e->filename);
+  e->symbol = 0;
+  e->module = 0;
+  e->filename = 0;
+}
 
-  pthread_mutex_lock(&ctx.mtx);
 
-  DBG("request for addr %p (%s)\n", addr, (opts & bfds_opt_data ? "data" : "code"));
+static void cache_free(void* p) {
+  cache_t*              cache;
+  int                   i;
+
+  cache = (cache_t*)p;
+  for (i = 0; i != CACHE_SIZE; i += 1)
+    cache_entry_clear(&cache->entries[i]);
+  free(cache);
+}
+
+
+static void cache_init() {
+  is_cache_key_valid = pthread_key_create(&cache_key, cache_free) == 0;
+}
+
+
+static cache_t* get_cache() {
+  cache_t*              cache;
+
+  pthread_once(&cache_once, cache_init);
+  if (is_cache_key_valid == 0)
+    return 0;
+  cache = (cache_t*)pthread_getspecific(cache_key);
+  if (cache == 0) {
+    cache = (cache_t*)calloc(1, sizeof(cache_t));
+    if (cache == 0)
+      return 0;
+    if (pthread_setspecific(cache_key, cache)) {
+      free(cache);
+      return 0;
+    }
+  }
+  return cache;
+}
+
+
+static cache_entry_t* cache_lookup(cache_t* cache, void* addr, int key) {
+  uintptr_t             h;
+
+  h = (uintptr_t)addr;
+  h ^= h >> 9;
+  h ^= key;
+  return &cache->entries[h % CACHE_SIZE];
+}
+
+
+static void cache_put(cache_entry_t* e, void* addr, int key, unsigned libs_gen, unsigned long long dl_adds, unsigned long long dl_subs, int is_dl_gen_valid, cache_t* cache, int source_line, int symbol_offset) {
+  cache_entry_clear(e);
+  e->symbol = strdup(cache->symbol);
+  e->module = strdup(cache->module);
+  e->filename = strdup(cache->filename);
+  if (e->symbol == 0 || e->module == 0 || e->filename == 0) {
+    cache_entry_clear(e);
+    return;
+  }
+  e->addr = addr;
+  e->key = key;
+  e->libs_gen = libs_gen;
+  e->dl_adds = dl_adds;
+  e->dl_subs = dl_subs;
+  e->is_dl_gen_valid = is_dl_gen_valid;
+  e->source_line = source_line;
+  e->symbol_offset = symbol_offset;
+}
+
+
+static int symbolize_locked(void* addr, bfds_opts_e opts, char* symbol, int symbol_size, char* module, int module_size, char* filename, int filename_size, int* source_line, int* symbol_offset) {
+  lib_t*                lib;
 
   if (process_lib(&lib, addr, opts & bfds_opt_update_libs, module, module_size)) {
     ERR("module for address %p is not found\n", addr);
-    pthread_mutex_unlock(&ctx.mtx);
     return 1;
   }
 
   if (opts & bfds_opt_data) {
     if (process_data(lib, addr, symbol, symbol_size, filename, filename_size, source_line, symbol_offset)) {
       ERR("symbol for data address %p is not found\n", addr);
-      pthread_mutex_unlock(&ctx.mtx);
       return 1;
     }
   } else {
     if (process_code(lib, addr, symbol, symbol_size, filename, filename_size, source_line, symbol_offset)) {
       ERR("symbol for code address %p is not found\n", addr);
-      pthread_mutex_unlock(&ctx.mtx);
       return 1;
     }
   }
+  return 0;
+}
+
+
+int   bfds_symbolize    (void*                  addr,
+                         bfds_opts_e            opts,
+                         char*                  symbol,
+                         int                    symbol_size,
+                         char*                  module,
+                         int                    module_size,
+                         char*                  filename,
+                         int                    filename_size,
+                         int*                   source_line,
+                         int*                   symbol_offset) {
+  cache_t*              cache;
+  cache_entry_t*        e;
+  int                   key;
+  unsigned              libs_gen;
+  unsigned long long    dl_adds;
+  unsigned long long    dl_subs;
+  int                   is_dl_gen_valid;
+  int                   line;
+  int                   offset;
+  int                   res;
+
+  DBG("request for addr %p (%s)\n", addr, (opts & bfds_opt_data ? "data" : "code"));
+
+  /* Only the data flag affects the cached result.
+   * With bfds_opt_update_libs a hit also asks the loader whether modules
+   * were loaded or unloaded since the entry was put. */
+  key = opts & bfds_opt_data;
+  cache = get_cache();
+  e = 0;
+  if (cache != 0) {
+    e = cache_lookup(cache, addr, key);
+    if (e->symbol != 0 && e->addr == addr && e->key == key
+        && e->libs_gen == load_libs_gen()
+        && ((opts & bfds_opt_update_libs) == 0 || is_dl_gen_unchanged(e))) {
+      DBG("found addr %p in the cache\n", addr);
+      strcopy(symbol, symbol_size, e->symbol);
+      strcopy(module, module_size, e->module);
+      strcopy(filename, filename_size, e->filename);
+      if (source_line != 0)
+        *source_line = e->source_line;
+      if (symbol_offset != 0)
+        *symbol_offset = e->symbol_offset;
+      process_demangle(symbol, symbol_size, opts);
+      return 0;
+    }
+  }
+
+  pthread_mutex_lock(&ctx.mtx);
+  if (cache != 0) {
+    cache->symbol[0] = 0;
+    cache->module[0] = 0;
+    cache->filename[0] = 0;
+    line = 0;
+    offset = 0;
+    res = symbolize_locked(addr, opts, cache->symbol, CACHE_BUF_SIZE, cache->module, CACHE_BUF_SIZE, cache->filename, CACHE_BUF_SIZE, &line, &offset);
+    libs_gen = ctx.libs_gen;
+    dl_adds = ctx.dl_adds;
+    dl_subs = ctx.dl_subs;
+    is_dl_gen_valid = ctx.is_dl_gen_valid;
+    pthread_mutex_unlock(&ctx.mtx);
+    if (cache->module[0] != 0)
+      strcopy(module, module_size, cache->module);
+    if (res == 0) {
+      cache_put(e, addr, key, libs_gen, dl_adds, dl_subs, is_dl_gen_valid, cache, line, offset);
+      strcopy(symbol, symbol_size, cache->symbol);
+      strcopy(filename, filename_size, cache->filename);
+      if (source_line != 0)
+        *source_line = line;
+      if (symbol_offset != 0)
+        *symbol_offset = offset;
+    }
+  } else {
+    res = symbolize_locked(addr, opts, symbol, symbol_size, module, module_size, filename, filename_size, source_line, symbol_offset);
+    pthread_mutex_unlock(&ctx.mtx);
+  }
+  if (res)
+    return 1;
 
   if (process_demangle(symbol, symbol_size, opts)) {
     ERR("demangling for address %p is failed\n", addr);
-    pthread_mutex_unlock(&ctx.mtx);
     return 1;
   }
 
@@ -739,7 +1051,6 @@ int   bfds_symbolize    (void*                  addr,
       source_line ? *source_line : -1,
       symbol_offset ? *symbol_offset : -1);
 
-  pthread_mutex_unlock(&ctx.mtx);
   return 0;
 }
 
@@ -5,6 +5,7 @@
 #include <stdio.h>
 #include <string>
 #include <dlfcn.h>
+#include <pthread.h>
 #include <vector>
 
 int foo1_line = __LINE__; extern "C" void foo1(int, int) {}
@@ -100,6 +101,40 @@ void test_stack_unwind() {
   printf("OK\n");
 }
 
+void* symbolize_thread(void*) {
+  for (int iter = 0; iter < 10000; iter++) {
+    char buf [1024];
+    int line = -1;
+    if (bfds_symbolize((void*)&foo2, bfds_opt_demangle, buf, sizeof(buf), 0, 0, 0, 0, &line, 0)
+        || strcmp(buf, "foo2") || line != foo2_line)
+      return (void*)1;
+    if (bfds_symbolize((void*)&foo1, bfds_opt_update_libs, buf, sizeof(buf), 0, 0, 0, 0, &line, 0)
+        || strcmp(buf, "foo1") || line != foo1_line)
+      return (void*)1;
+    if (bfds_symbolize((char*)&foo6, bfds_opt_data, buf, sizeof(buf), 0, 0, 0, 0, 0, 0)
+        || strcmp(buf, "foo6"))
+      return (void*)1;
+  }
+  return 0;
+}
+
+void test_threads() {
+  printf("%-40s...", "threads");
+  pthread_t th [8];
+  int const cnt = sizeof(th)/sizeof(*th);
+  for (int i = 0; i < cnt; i++)
+    pthread_create(&th[i], 0, symbolize_thread, 0);
+  for (int i = 0; i < cnt; i++) {
+    void* res = 0;
+    pthread_join(th[i], &res);
+    if (res) {
+      printf("symbolize failed in thread %d\n", i);
+      exit(1);
+    }
+  }
+  printf("OK\n");
+}
+
 namespace bar {
 struct Foo {
   Foo() {
@@ -215,6 +250,19 @@ int main() {
   }
  
   test_stack_unwind();
+  test_threads();
+
+  // A reloaded library is resolved again, and its cached results
+  // are not returned with update_libs once it is unloaded.
+  dl = dlopen(dynname, RTLD_LOCAL | RTLD_NOW);
+  dyn21 = dlsym(dl, "dyn21");
+  check(dyn21,     (bfds_opts_e)(bfds_opt_update_libs | bfds_opt_demangle), "dyn21",          dynname, "test_dyn2.cc", 1, 0);
+  check(dyn21,     bfds_opt_update_libs, "dyn21",          dynname, "test_dyn2.cc", 1, 0);
+  dlclose(dl);
+  if (0 == bfds_symbolize(dyn21, bfds_opt_update_libs, 0, 0, 0, 0, 0, 0, 0, 0)) {
+    printf("bfds_symbolize(%d) failed\n", __LINE__);
+    exit(1);
+  }
  
   printf("OK\n");
   return 0;
@@ -0,0 +1,219 @@
+/* Relite
+ * Copyright (c) 2011, Google Inc.
+ * All rights reserved.
+ * Author: Dmitry Vyukov (dvyukov)
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "relite_clock.h"
+#include "relite_hook.h"
+#include "relite_dbg.h"
+#include <sched.h>
+#include <sys/mman.h>
+
+
+#define LOCKED                              1
+#define UNLOCKED                            0
+
+
+static void             sync_clock_lock     (relite_sync_clock_t* sc) {
+  while (atomic_uint32_exchange
+      (&sc->mtx, LOCKED, memory_order_acquire) != UNLOCKED)
+    sched_yield();
+}
+
+
+static void             sync_clock_unlock   (relite_sync_clock_t* sc) {
+  atomic_uint32_store(&sc->mtx, UNLOCKED, memory_order_release);
+}
+
+
+void                    relite_sync_clock_init
+                                            (relite_sync_clock_t* sc) {
+  atomic_uint32_store(&sc->mtx, UNLOCKED, memory_order_relaxed);
+  sc->size = 0;
+  sc->capacity = SYNC_CLOCK_INLINE_SIZE;
+  sc->last_release_tid = CLOCK_NIL;
+  sc->last_release_time = 0;
+  sc->acquired_tid = CLOCK_NIL;
+  sc->acquired_epoch = 0;
+  sc->entries = sc->inline_entries;
+}
+
+
+void                    relite_sync_clock_free
+                                            (relite_sync_clock_t* sc) {
+  if (sc->entries != sc->inline_entries) {
+    munmap(sc->entries, sc->capacity * sizeof(relite_clock_entry_t));
+    sc->entries = sc->inline_entries;
+  }
+}
+
+
+static void             sync_clock_grow     (relite_sync_clock_t* sc) {
+  uint32_t const capacity = sc->capacity * 2;
+  relite_clock_entry_t* entries = (relite_clock_entry_t*)relite_malloc
+      (capacity * sizeof(relite_clock_entry_t));
+  if (entries == MAP_FAILED || entries == 0)
+    relite_fatal("failed to allocate sync clock");
+  uint32_t i;
+  for (i = 0; i != sc->size; i += 1)
+    entries[i] = sc->entries[i];
+  relite_sync_clock_free(sc);
+  sc->entries = entries;
+  sc->capacity = capacity;
+}
+
+
+static void             sync_clock_update   (relite_sync_clock_t* sc,
+                                             thrid_t tid,
+                                             timestamp_t ts) {
+  // binary search for the entry
+  uint32_t lo = 0;
+  uint32_t hi = sc->size;
+  while (lo != hi) {
+    uint32_t const mid = (lo + hi) / 2;
+    if (sc->entries[mid].tid < tid)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo != sc->size && sc->entries[lo].tid == tid) {
+    if (sc->entries[lo].ts < ts)
+      sc->entries[lo].ts = ts;
+    return;
+  }
+  // a new thread, insert the entry
+  if (sc->size == sc->capacity)
+    sync_clock_grow(sc);
+  uint32_t i;
+  for (i = sc->size; i != lo; i -= 1)
+    sc->entries[i] = sc->entries[i - 1];
+  sc->entries[lo].tid = tid;
+  sc->entries[lo].ts = ts;
+  sc->size += 1;
+}
+
+
+void                    relite_clock_acquire(relite_thr_t* thr,
+                                             relite_sync_clock_t* sc) {
+  sync_clock_lock(sc);
+  if (sc->acquired_tid == thr->id && sc->acquired_epoch == thr->clock_epoch) {
+    sync_clock_unlock(sc);
+    return;
+  }
+  uint32_t i;
+  for (i = 0; i != sc->size; i += 1) {
+    thrid_t const tid = sc->entries[i].tid;
+    timestamp_t const ts = sc->entries[i].ts;
+    if (thr->clock[tid] < ts) {
+      thr->clock[tid] = ts;
+      relite_clock_touch(thr, tid);
+    }
+  }
+  sc->acquired_tid = thr->id;
+  sc->acquired_epoch = thr->clock_epoch;
+  sync_clock_unlock(sc);
+}
+
+
+void                    relite_clock_release(relite_thr_t* thr,
+                                             relite_sync_clock_t* sc) {
+  // the own entry has been just increased
+  relite_clock_touch(thr, thr->id);
+  sync_clock_lock(sc);
+  thrid_t tid;
+  int is_merged = 0;
+  if (sc->last_release_tid == thr->id) {
+    // the thread was the last one to release into the sync object,
+    // so only the entries changed since that release are to be merged
+    // (unless there are too many of them)
+    timestamp_t const since = sc->last_release_time;
+    uint32_t const limit = sc->size / 8 + 1;
+    uint32_t count = 0;
+    for (tid = thr->clock_tail; ; tid = thr->clock_prev[tid]) {
+      if (tid == CLOCK_NIL || thr->clock_changed[tid] < since) {
+        is_merged = 1;
+        break;
+      }
+      if (count++ == limit)
+        break;
+      sync_clock_update(sc, tid, thr->clock[tid]);
+    }
+  }
+  if (is_merged == 0) {
+    // merge the existing entries in one pass,
+    // then insert the threads which are new for the sync object
+    uint32_t present = 0;
+    uint32_t i;
+    for (i = 0; i != sc->size; i += 1) {
+      timestamp_t const ts = thr->clock[sc->entries[i].tid];
+      present += (ts != 0);
+      if (sc->entries[i].ts < ts)
+        sc->entries[i].ts = ts;
+    }
+    if (present != thr->clock_size) {
+      for (tid = thr->clock_head; tid != CLOCK_NIL; tid = thr->clock_next[tid])
+        sync_clock_update(sc, tid, thr->clock[tid]);
+    }
+  }
+  sc->last_release_tid = thr->id;
+  sc->last_release_time = thr->own_clock;
+  // the sync clock stays not greater than the thread clock
+  // only if it was so before the release
+  if (sc->acquired_tid != thr->id || sc->acquired_epoch != thr->clock_epoch)
+    sc->acquired_tid = CLOCK_NIL;
+  sync_clock_unlock(sc);
+}
+
+
+void                    relite_clock_init   (relite_thr_t* thr) {
+  thrid_t tid;
+  for (tid = 0; tid != MAX_THREADS; tid += 1) {
+    thr->clock[tid] = 0;
+    thr->clock_next[tid] = CLOCK_NIL;
+    thr->clock_prev[tid] = CLOCK_NIL;
+  }
+  thr->clock_head = CLOCK_NIL;
+  thr->clock_tail = CLOCK_NIL;
+  thr->clock_size = 0;
+  thr->clock_epoch = 0;
+}
+
+
+void                    relite_clock_reset  (relite_thr_t* thr) {
+  thrid_t tid = thr->clock_head;
+  while (tid != CLOCK_NIL) {
+    thrid_t const next = thr->clock_next[tid];
+    thr->clock[tid] = 0;
+    thr->clock_next[tid] = CLOCK_NIL;
+    thr->clock_prev[tid] = CLOCK_NIL;
+    tid = next;
+  }
+  thr->clock_head = CLOCK_NIL;
+  thr->clock_tail = CLOCK_NIL;
+  thr->clock_size = 0;
+  thr->clock_epoch += 1;
+}
+
+
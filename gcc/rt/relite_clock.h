@@ -0,0 +1,123 @@
+/* Relite
+ * Copyright (c) 2011, Google Inc.
+ * All rights reserved.
+ * Author: Dmitry Vyukov (dvyukov)
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef RELITE_CLOCK_H_INCLUDED
+#define RELITE_CLOCK_H_INCLUDED
+
+#include "relite_defs.h"
+#include "relite_atomic.h"
+#include "relite_thr.h"
+
+
+// Vector clocks.
+// A thread keeps a dense clock (so that an access check is a single load),
+// plus the list of its non-zero entries ordered by the time of the last
+// change (see relite_thr_t). A sync object keeps a sparse clock: only
+// the threads that released into it have entries, so the sync object
+// does not grow with MAX_THREADS.
+// Acquire walks the entries of the sync clock, unless the sync clock is
+// known to be not greater than the thread clock (e.g. the thread acquires
+// a mutex which nobody else has released since the thread's last acquire).
+// Release walks only the thread entries that changed since the previous
+// release of the same thread into the same sync object, or all non-zero
+// thread entries if another thread has released into it since then.
+
+
+#define SYNC_CLOCK_INLINE_SIZE              250
+#define CLOCK_NIL                           ((thrid_t)-1)
+
+
+typedef struct relite_clock_entry_t {
+  thrid_t                                   tid;
+  timestamp_t                               ts;
+} relite_clock_entry_t;
+
+
+typedef struct relite_sync_clock_t {
+  atomic_uint32_t                           mtx;
+  uint32_t                                  size;
+  uint32_t                                  capacity;
+  thrid_t                                   last_release_tid;
+  timestamp_t                               last_release_time;
+  // the sync clock is not greater than the clock of this thread
+  thrid_t                                   acquired_tid;
+  uint32_t                                  acquired_epoch;
+  // sorted by tid, points either to inline_entries or to a separate block
+  relite_clock_entry_t*                     entries;
+  relite_clock_entry_t                      inline_entries
+                                                [SYNC_CLOCK_INLINE_SIZE];
+} relite_sync_clock_t;
+
+
+void                    relite_sync_clock_init
+                                            (relite_sync_clock_t* sc);
+void                    relite_sync_clock_free
+                                            (relite_sync_clock_t* sc);
+
+void                    relite_clock_acquire(relite_thr_t* thr,
+                                             relite_sync_clock_t* sc);
+void                    relite_clock_release(relite_thr_t* thr,
+                                             relite_sync_clock_t* sc);
+
+// Initializes the clock of a new thread descriptor.
+void                    relite_clock_init   (relite_thr_t* thr);
+// Zeroes the clock of a reused thread descriptor.
+void                    relite_clock_reset  (relite_thr_t* thr);
+
+
+// Moves the entry to the tail of the thread's list of changed entries.
+// Must be called after thr->clock[tid] is increased.
+static inline void      relite_clock_touch  (relite_thr_t* thr,
+                                             thrid_t tid) {
+  assert(tid < MAX_THREADS && thr->clock[tid] != 0);
+  thr->clock_changed[tid] = thr->own_clock;
+  if (thr->clock_tail == tid)
+    return;
+  thrid_t const prev = thr->clock_prev[tid];
+  thrid_t const next = thr->clock_next[tid];
+  if (next != CLOCK_NIL) {
+    // already in the list, unlink
+    thr->clock_prev[next] = prev;
+    if (prev != CLOCK_NIL)
+      thr->clock_next[prev] = next;
+    else
+      thr->clock_head = next;
+  } else {
+    thr->clock_size += 1;
+  }
+  thr->clock_prev[tid] = thr->clock_tail;
+  thr->clock_next[tid] = CLOCK_NIL;
+  if (thr->clock_tail != CLOCK_NIL)
+    thr->clock_next[thr->clock_tail] = tid;
+  else
+    thr->clock_head = tid;
+  thr->clock_tail = tid;
+}
+
+
+#endif
+
@@ -27,6 +27,7 @@
 
 #include "relite_rt.h"
 #include "relite_thr.h"
+#include "relite_clock.h"
 #include "relite_atomic.h"
 #include "relite_report.h"
 #include "relite_hook.h"
@@ -82,8 +83,7 @@ typedef struct rl_rt_context_t {
 
 
 typedef struct rl_rt_sync_t {
-  size_t                        clock_size;
-  timestamp_t                   clock [MAX_THREADS];
+  relite_sync_clock_t           clock;
 } rl_rt_sync_t;
 
 
@@ -212,14 +212,6 @@ static inline atomic_uint64_t* get_shadow(addr_t addr) {
 }
 
 
-static void   clock_assign_max    (timestamp_t* dest, timestamp_t const* src) {
-  int i;
-  for (i = 0; i != MAX_THREADS; i += 1) {
-    if (dest[i] < src[i])
-      dest[i] = src[i];
-  }
-}
-
 /*
 static int is_aligned(uintptr_t addr, size_t sz) {
   return ((addr & ((1 << (3 - sz)) - 1)) == 0);
@@ -637,7 +629,7 @@ void            handle_sync_create   (addr_t addr) {
   rl_rt_sync_t* sync = relite_malloc(sizeof(rl_rt_sync_t));
   if (sync == 0)
     return;
-  relite_memset(sync, 0, sizeof(rl_rt_sync_t));
+  relite_sync_clock_init(&sync->clock);
   //!!! assert(sync);
   assert(((uint64_t)sync & STATE_SYNC_MASK) == 0);
   atomic_uint64_t* shadow = get_shadow(addr);
@@ -654,6 +646,7 @@ void                    handle_sync_destroy (addr_t addr) {
     return;
   rl_rt_sync_t* sync = (rl_rt_sync_t*)(state & ~STATE_SYNC_MASK);
   assert(sync != 0);
+  relite_sync_clock_free(&sync->clock);
   relite_free(sync);
   //TODO(dvyukov): mute use CAS,
   // otherwise 2 threads(rl_rt_sync_t*)(state & ~STATE_SYNC_MASK) can free sync simultaneously
@@ -670,7 +663,7 @@ void            handle_sync_acquire  (addr_t addr, int is_mtx) {
     return;
   rl_rt_sync_t* sync = (rl_rt_sync_t*)(state & ~STATE_SYNC_MASK);
   relite_thr_t* self = g_thr;
-  clock_assign_max(self->clock, sync->clock);
+  relite_clock_acquire(self, &sync->clock);
 }
 
 
@@ -685,7 +678,7 @@ void            handle_sync_release  (addr_t addr, int is_mtx) {
     sync = relite_malloc(sizeof(rl_rt_sync_t));
     if (sync == 0)
       return;
-    relite_memset(sync, 0, sizeof(rl_rt_sync_t));
+    relite_sync_clock_init(&sync->clock);
     uint64_t new_state = STATE_SYNC_MASK | (uint64_t)sync;
     //TODO(dvyukov): perhaps it's better to do that with CAS
     // in order to prevent potential races and memory leaks
@@ -696,7 +689,7 @@ void            handle_sync_release  (addr_t addr, int is_mtx) {
   relite_thr_t* self = g_thr;
   self->own_clock += 1;
   self->clock[self->id] += 1;
-  clock_assign_max(sync->clock, self->clock);
+  relite_clock_release(self, &sync->clock);
 }
 
 
@@ -26,6 +26,7 @@
  */
 
 #include "relite_thr.h"
+#include "relite_clock.h"
 #include "relite_atomic.h"
 #include "relite_dbg.h"
 #include <sys/mman.h>
@@ -71,16 +72,14 @@ relite_thr_t*           relite_thr_init     () {
     cache->free_head = cache->free_head->prev;
     cache->free_head->next = 0;
     cache->free_count -= 1;
-    int i;
-    for (i = 0; i != MAX_THREADS; i += 1) {
-      thr->clock[i] = 0;
-    }
+    relite_clock_reset(thr);
   } else if (cache->total_count < MAX_THREADS) {
     thr = (relite_thr_t*)mmap(0, sizeof(relite_thr_t),
                                 PROT_READ | PROT_WRITE,
                                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
     if (thr == 0)
       relite_fatal("failed to allocate thread descriptor");
+    relite_clock_init(thr);
     thr->id = cache->total_count++;
     thr->rand = (unsigned)pthread_self() + (unsigned)time(0);
     DBG("thread start %u", thr->id);
@@ -113,6 +112,7 @@ relite_thr_t*           relite_thr_init     () {
   relite_dbg_tid = thr->id;
   thr->own_clock += 1;
   thr->clock[thr->id] = thr->own_clock;
+  relite_clock_touch(thr, thr->id);
   return thr;
 }
 
@@ -38,6 +38,16 @@ typedef struct relite_thr_t {
   unsigned                                  rand;
   timestamp_t                               own_clock;
   timestamp_t                               clock [MAX_THREADS];
+  // non-zero entries of clock, ordered by the time of the last change
+  // (own_clock at that moment, see relite_clock.h)
+  timestamp_t                               clock_changed [MAX_THREADS];
+  thrid_t                                   clock_next [MAX_THREADS];
+  thrid_t                                   clock_prev [MAX_THREADS];
+  thrid_t                                   clock_head;
+  thrid_t                                   clock_tail;
+  uint32_t                                  clock_size;
+  // incremented each time the clock is reset
+  uint32_t                                  clock_epoch;
 } relite_thr_t;
 
 
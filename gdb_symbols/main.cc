@@ -34,6 +34,19 @@ int main(int argc, char *argv[]) {
       printf("symbolization of %p failed\n", addr);
     }
   }
+  // The same in one batch.
+  const int kNumAddresses = sizeof(addresses) / sizeof(void*);
+  AddrInfo infos[kNumAddresses];
+  for (int i = 0; i < kNumAddresses; ++i) infos[i].addr = addresses[i];
+  st->GetAddrInfoBatch(infos, kNumAddresses);
+  for (int i = 0; i < kNumAddresses; ++i) {
+    if (infos[i].ok) {
+      printf("%p is <%s> at line %d of %s\n", infos[i].addr,
+             infos[i].symbol, infos[i].line, infos[i].file);
+    } else {
+      printf("symbolization of %p failed\n", infos[i].addr);
+    }
+  }
   delete st;
   return 0;
 }
@@ -38,28 +38,75 @@
 #include <stdio.h>  // TODO(glider): remove
 
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <link.h>
 #include <poll.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+// The in-memory part of the build-id keyed cache, see LookupCache().
+static const int kMaxBuildIdSize = 64;
+
+struct CachedAddrInfo {
+  uintptr_t offset;
+  bool ok;
+  int line;
+  char *symbol;
+  char *file;
+};
+
+struct CachedModule {
+  char build_id[kMaxBuildIdSize * 2 + 1];
+  CachedAddrInfo *entries;  // Sorted by offset.
+  int size, capacity;
+};
+
 SymbolTable::SymbolTable(const char *binary) {
   gdb_in = -1;
   gdb_out = -1;
+  gdb_started = false;
   finalized = false;
+  out_pos = out_len = 0;
+  modules = NULL;
+  num_modules = 0;
+  memset(binary_name, 0, sizeof(binary_name));
   if (binary) {
-    strncpy(binary_name, binary, sizeof(binary_name));
+    strncpy(binary_name, binary, sizeof(binary_name) - 1);
   } else {
-    readlink("/proc/self/exe", binary_name, sizeof(binary_name));
+    readlink("/proc/self/exe", binary_name, sizeof(binary_name) - 1);
   }
-  OpenPipe();
-  MapBinary(binary_name, strlen(binary_name));
-  LoadProcMaps();
+  memset(cache_dir, 0, sizeof(cache_dir));
+  const char *dir = getenv(kCacheDirEnv);
+  if (dir) strncpy(cache_dir, dir, sizeof(cache_dir) - 1);
 }
 
 SymbolTable::~SymbolTable() {
   if (!finalized) Finalize();
+  for (int i = 0; i < num_modules; i++) {
+    for (int j = 0; j < modules[i].size; j++) {
+      free(modules[i].entries[j].symbol);
+      free(modules[i].entries[j].file);
+    }
+    free(modules[i].entries);
+  }
+  free(modules);
+}
+
+// gdb is only started on the first cache miss, so that a run with all the
+// addresses in the on-disk cache doesn't pay for loading the debug info.
+bool SymbolTable::StartGdb() {
+  if (!gdb_started) {
+    gdb_started = true;
+    if (OpenPipe()) {
+      MapBinary(binary_name, strlen(binary_name));
+      LoadProcMaps();
+    }
+  }
+  return gdb_in != -1;
 }
 
 // TODO(glider): {Before,After}Fork* should execute callbacks set by the user.
@@ -173,6 +220,8 @@ int SymbolTable::OpenPipe() {
       ReadBuffer(prompt, sizeof(prompt));
       write(gdb_in, "set prompt\n", 11);
       write(gdb_in, "set confirm 0\n", 14);
+      write(gdb_in, "set width 0\n", 12);
+      return 1;
     }
   }
 }
@@ -225,6 +274,7 @@ void SymbolTable::ConsumeLines() {
 }
 
 void SymbolTable::MapBinary(const char *path, int path_size) {
+  if (!StartGdb()) return;
   write(gdb_in, "file ", 5);
   write(gdb_in, path, path_size);
   write(gdb_in, "\n", 1);
@@ -232,6 +282,7 @@ void SymbolTable::MapBinary(const char *path, int path_size) {
 
 void SymbolTable::MapSharedLibrary(const char *path, int path_size,
                                    uintptr_t offset) {
+  if (!StartGdb()) return;
   write(gdb_in, "add-symbol-file ", 16);
   write(gdb_in, path, path_size);
   write(gdb_in, " ", 1);
@@ -240,100 +291,422 @@ void SymbolTable::MapSharedLibrary(const char *path, int path_size,
   ConsumeLines();
 }
 
-bool SymbolTable::GetAddrInfoNocache(void *addr,
-                                     /*out*/char *symbol, int symbol_buf_size,
-                                     /*out*/char *file, int file_size,
-                                     /*out*/int *line) {
-  write(gdb_in, "info line *", 11);
-  WriteHexAddr((uintptr_t)addr);
-  write(gdb_in, "\n", 1);
-  char buf[1000];
-  memset(buf, 0, sizeof(buf));
-  ReadBuffer(buf, sizeof(buf));
+// The end of each reply is marked by "echo kReplyEnd\n", so that we never
+// have to guess how many lines gdb has printed.
+static const char kReplyEnd[] = "--gdb-symbols-end-of-reply--";
+
+static void CopyString(char *dst, int dst_size, const char *src, int src_len) {
+  if (dst_size > src_len) {
+    memcpy(dst, src, src_len);
+    dst[src_len] = '\0';
+  } else {
+    dst[0] = '\0';
+  }
+}
+
+// Parses the reply to "info line *<addr>". Returns true if the line number
+// has been found. Otherwise only the symbol name may be filled in.
+static bool ParseInfoLine(const char *buf, AddrInfo *info) {
   if (strstr(buf, "No line") == buf) {
-    *line = 0;
-    symbol[0] = '\0';
-    file[0] = '\0';
     // We've got the response that may look like:
     //   No line number information available for address 0x400d84 <foo>
     // Let's extract the symbol name from it:
-    char *symbol_start, *symbol_end;
-    int symbol_len;
-    if (symbol_start = strchr(buf, '<')) {
+    const char *symbol_start, *symbol_end;
+    if ((symbol_start = strchr(buf, '<'))) {
       symbol_start++;  // skip '<'.
-      if (symbol_end = strchr(symbol_start, '>')) {
-        symbol_len = symbol_end - symbol_start;
-        if (symbol_buf_size > symbol_len) {
-          memcpy(symbol, symbol_start, symbol_len);
-          symbol[symbol_len] = '\0';
-        }
-      }
-    }
-    // Fall back to "info symbol <addr>"
-    write(gdb_in, "info symbol ", 12);
-    WriteHexAddr((uintptr_t)addr);
-    write(gdb_in, "\n", 1);
-    memset(buf, 0, sizeof(buf));
-    ReadBuffer(buf, sizeof(buf));
-    if (strstr(buf, "No symbol") == buf) {
-      return false;
-    } else {
-      // We've got the line looking like:
-      //   GLOB in section .bss
-      // or:
-      //   malloc in section .text of /lib/libc-2.11.1.so
-      char *module_start, *module_end;
-      int module_len;
-      if (module_start = strstr(buf, " of ")) {
-        module_start += 4; // skip " of ".
-        module_end = strchr(module_start, '\n');
-        *module_end = '\0';
-        strncpy(file, module_start, file_size);
-      } else {
-        strncpy(file, binary_name, file_size);
+      if ((symbol_end = strchr(symbol_start, '>'))) {
+        CopyString(info->symbol, sizeof(info->symbol),
+                   symbol_start, symbol_end - symbol_start);
       }
-      return true;
     }
     return false;
+  }
+  // Assuming that we've got the line in the following format:
+  //   Line 9 of "main.cc" starts at address 0x400b24 <main(int, char**)>
+  //     and ends at 0x400b41 <main(int, char**)+29>.
+  const char kLine_[] = "Line ";
+  if (strstr(buf, kLine_) != buf) return false;
+  int index = sizeof(kLine_) - 1;  // without the trailing \0.
+  int tmp_line = 0;
+  while ((buf[index] >= '0') && (buf[index] <= '9')) {
+    tmp_line *= 10;
+    tmp_line += buf[index] - '0';
+    index++;
+  }
+  if (strstr(&buf[index], " of \"") != &buf[index]) return false;
+  const char *start_file = &(buf[index+5]);  // skip " of \"".
+  const char *end_file = strchr(start_file, '"');
+  if (!end_file) return false;
+  const char *start_symbol = strchr(end_file, '<');
+  if (!start_symbol) return false;
+  start_symbol++;  // skip "<".
+  const char *end_symbol = strchr(start_symbol, '>');
+  if (!end_symbol) return false;
+  info->line = tmp_line;
+  CopyString(info->file, sizeof(info->file), start_file, end_file - start_file);
+  CopyString(info->symbol, sizeof(info->symbol),
+             start_symbol, end_symbol - start_symbol);
+  return true;
+}
+
+// Parses the reply to "info symbol <addr>". Returns false if gdb knows
+// nothing about the address.
+static bool ParseInfoSymbol(const char *buf, const char *binary_name,
+                            AddrInfo *info) {
+  // We've got the line looking like:
+  //   GLOB in section .bss
+  // or:
+  //   malloc in section .text of /lib/libc-2.11.1.so
+  const char *section = strstr(buf, " in section ");
+  if (!section) return false;
+  if (info->symbol[0] == '\0') {
+    const char *symbol_end = strstr(buf, " + ");
+    if (!symbol_end || symbol_end > section) symbol_end = section;
+    CopyString(info->symbol, sizeof(info->symbol), buf, symbol_end - buf);
+  }
+  const char *module_start, *module_end;
+  if ((module_start = strstr(section, " of "))) {
+    module_start += 4;  // skip " of ".
+    module_end = strchr(module_start, '\n');
+    if (!module_end) module_end = module_start + strlen(module_start);
+    CopyString(info->file, sizeof(info->file),
+               module_start, module_end - module_start);
   } else {
-    // Assuming that we've got the line in the following format:
-    //   Line 9 of "main.cc" starts at address 0x400b24 <main(int, char**)> \
-    //     and ends at 0x400b41 <main(int, char**)+29>.
-    const char kLine_[] = "Line ";
-    assert(strstr(buf, kLine_) == buf);
-    int index = sizeof(kLine_) - 1;  // without the trailing \0.
-    int tmp_line = 0;
-    while ((buf[index] >= '0') && (buf[index] <= '9')) {
-      tmp_line *= 10;
-      tmp_line += buf[index] - '0';
-      index++;
+    CopyString(info->file, sizeof(info->file),
+               binary_name, strlen(binary_name));
+  }
+  return true;
+}
+
+// Reads a line of gdb output without the trailing '\n'. Lines longer than
+// |size| are truncated. Returns false if gdb has closed the pipe.
+bool SymbolTable::ReadLine(char *line, int size) {
+  int len = 0;
+  while (true) {
+    if (out_pos == out_len) {
+      int bytes_read = read(gdb_out, out_buf, sizeof(out_buf));
+      if (bytes_read < 0 && errno == EINTR) continue;
+      if (bytes_read <= 0) {
+        line[len] = '\0';
+        return false;
+      }
+      out_pos = 0;
+      out_len = bytes_read;
     }
-    *line = tmp_line;
-    assert(buf[index] == ' ');
-    char *start_file = &(buf[index+5]);  // skip " of \"".
-    char *end_file = strstr(start_file, "\"");
-    assert(end_file);
-    int file_len = end_file - start_file;
-    if (file_size > file_len) {
-      strncpy(file, start_file, file_len);
-      file[file_len] = '\0';
-    } else {
-      file[0] = '\0';
+    char c = out_buf[out_pos++];
+    if (c == '\n') break;
+    if (len < size - 1) line[len++] = c;
+  }
+  line[len] = '\0';
+  return true;
+}
+
+// Reads everything gdb has printed up to the next kReplyEnd.
+bool SymbolTable::ReadReply(char *buf, int size) {
+  char line[1000];
+  int len = 0;
+  buf[0] = '\0';
+  while (ReadLine(line, sizeof(line))) {
+    if (strstr(line, kReplyEnd)) return true;
+    int line_len = strlen(line);
+    if (len + line_len + 1 < size) {
+      memcpy(buf + len, line, line_len);
+      len += line_len;
+      buf[len++] = '\n';
+      buf[len] = '\0';
     }
-    char *start_symbol = strstr(end_file, "<");
-    assert(start_symbol);
-    start_symbol++;  // skip "<".
-    char *end_symbol = strstr(start_symbol, ">");
-    assert(end_symbol);
-    int symbol_len = end_symbol - start_symbol;
-    if (symbol_buf_size > symbol_len) {
-      strncpy(symbol, start_symbol, symbol_len);
-      symbol[symbol_len] = '\0';
+  }
+  return false;
+}
+
+void SymbolTable::WriteCommand(const char *command, uintptr_t addr) {
+  char buf[100];
+  int len = snprintf(buf, sizeof(buf), "%s", command);
+  write(gdb_in, buf, len);
+  WriteHexAddr(addr);
+  len = snprintf(buf, sizeof(buf), "\necho %s\\n\n", kReplyEnd);
+  write(gdb_in, buf, len);
+}
+
+// Skips whatever gdb has printed so far (e.g. the output of
+// "add-symbol-file"), so that the next line read is the reply to the
+// next command.
+bool SymbolTable::Sync() {
+  char buf[100];
+  int len = snprintf(buf, sizeof(buf), "echo %s\\n\n", kReplyEnd);
+  write(gdb_in, buf, len);
+  char line[1000];
+  while (ReadLine(line, sizeof(line))) {
+    if (strstr(line, kReplyEnd)) return true;
+  }
+  return false;
+}
+
+// Sends all the "info line" queries at once, then all the "info symbol"
+// queries for the addresses without line info. Returns false if gdb has
+// not answered all of them.
+bool SymbolTable::QueryGdb(AddrInfo **infos, int n) {
+  assert(n <= kBatchSize);
+  for (int i = 0; i < n; i++) {
+    infos[i]->ok = false;
+    infos[i]->line = 0;
+    infos[i]->symbol[0] = '\0';
+    infos[i]->file[0] = '\0';
+  }
+  if (!StartGdb() || !Sync()) return false;
+  for (int i = 0; i < n; i++) {
+    WriteCommand("info line *", (uintptr_t)infos[i]->addr);
+  }
+  char buf[2000];
+  AddrInfo *no_line[kBatchSize];
+  int num_no_line = 0;
+  for (int i = 0; i < n; i++) {
+    if (!ReadReply(buf, sizeof(buf))) return false;
+    if (ParseInfoLine(buf, infos[i])) {
+      infos[i]->ok = true;
     } else {
-      symbol[0] = '\0';
+      no_line[num_no_line++] = infos[i];
     }
-    return true;
   }
+  // Fall back to "info symbol <addr>"
+  for (int i = 0; i < num_no_line; i++) {
+    WriteCommand("info symbol ", (uintptr_t)no_line[i]->addr);
+  }
+  for (int i = 0; i < num_no_line; i++) {
+    if (!ReadReply(buf, sizeof(buf))) return false;
+    no_line[i]->ok = ParseInfoSymbol(buf, binary_name, no_line[i]);
+  }
+  return true;
+}
+
+bool SymbolTable::GetAddrInfoNocache(void *addr,
+                                     /*out*/char *symbol, int symbol_buf_size,
+                                     /*out*/char *file, int file_size,
+                                     /*out*/int *line) {
+  AddrInfo info;
+  AddrInfo *infos[1] = { &info };
+  info.addr = addr;
+  QueryGdb(infos, 1);
+  *line = info.line;
+  CopyString(symbol, symbol_buf_size, info.symbol, strlen(info.symbol));
+  CopyString(file, file_size, info.file, strlen(info.file));
+  return info.ok;
+}
+
+void SymbolTable::GetAddrInfoBatch(AddrInfo *infos, int n) {
+  AddrInfo *misses[kBatchSize];
+  int num_misses = 0;
+  for (int i = 0; i < n; i++) {
+    if (!LookupCache(&infos[i])) misses[num_misses++] = &infos[i];
+    if (num_misses == kBatchSize || (i == n - 1 && num_misses > 0)) {
+      bool answered = QueryGdb(misses, num_misses);
+      // Don't remember the failures if gdb is not there at all.
+      for (int j = 0; j < num_misses; j++) {
+        if (answered || misses[j]->ok) StoreCache(misses[j]);
+      }
+      num_misses = 0;
+    }
+  }
+}
+
+// ---- Build-id keyed cache ----
+// The results are keyed by the build-id of the module and the offset of the
+// address from the module base, so they stay valid across runs (and ASLR)
+// as long as the module is not rebuilt. If the cache directory is set,
+// each module has a file named after its build-id there with a line per
+// address:
+//   <offset in hex>\t<ok>\t<line>\t<symbol>\t<file>
+// New results are appended to the file with a single write() per line, so
+// concurrent runs don't tear each other's lines.
+
+struct FindModuleArg {
+  uintptr_t addr;
+  uintptr_t base;
+  char build_id[kMaxBuildIdSize * 2 + 1];
+};
+
+static uintptr_t AlignUp(uintptr_t x, uintptr_t align) {
+  return (x + align - 1) & ~(align - 1);
+}
+
+// dl_iterate_phdr() callback looking for the module containing arg->addr.
+// The build-id is read from the PT_NOTE segments mapped into memory.
+static int FindModuleCallback(struct dl_phdr_info *info, size_t size,
+                              void *data) {
+  FindModuleArg *arg = (FindModuleArg*)data;
+  bool found = false;
+  for (int i = 0; i < info->dlpi_phnum; i++) {
+    const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+    uintptr_t start = info->dlpi_addr + phdr->p_vaddr;
+    if (phdr->p_type == PT_LOAD &&
+        arg->addr >= start && arg->addr < start + phdr->p_memsz) {
+      found = true;
+    }
+  }
+  if (!found) return 0;
+  arg->base = info->dlpi_addr;
+  for (int i = 0; i < info->dlpi_phnum; i++) {
+    const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+    if (phdr->p_type != PT_NOTE) continue;
+    uintptr_t align = phdr->p_align == 8 ? 8 : 4;
+    uintptr_t note = info->dlpi_addr + phdr->p_vaddr;
+    uintptr_t end = note + phdr->p_memsz;
+    while (note + sizeof(ElfW(Nhdr)) <= end) {
+      const ElfW(Nhdr) *nhdr = (const ElfW(Nhdr)*)note;
+      const char *name = (const char*)(note + sizeof(*nhdr));
+      const unsigned char *desc = (const unsigned char*)
+          AlignUp((uintptr_t)name + nhdr->n_namesz, align);
+      if (nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == 4 &&
+          memcmp(name, "GNU", 4) == 0 && nhdr->n_descsz <= kMaxBuildIdSize) {
+        for (unsigned j = 0; j < nhdr->n_descsz; j++) {
+          snprintf(&arg->build_id[2 * j], 3, "%02x", desc[j]);
+        }
+        return 1;
+      }
+      note = AlignUp((uintptr_t)desc + nhdr->n_descsz, align);
+    }
+  }
+  return 1;
+}
+
+static int CompareCachedAddrInfo(const void *a, const void *b) {
+  uintptr_t offset_a = ((const CachedAddrInfo*)a)->offset;
+  uintptr_t offset_b = ((const CachedAddrInfo*)b)->offset;
+  if (offset_a != offset_b) return offset_a < offset_b ? -1 : 1;
+  return 0;
+}
+
+static void AddCachedAddrInfo(CachedModule *module, const CachedAddrInfo &e) {
+  if (module->size == module->capacity) {
+    module->capacity = module->capacity ? module->capacity * 2 : 64;
+    module->entries = (CachedAddrInfo*)realloc(
+        module->entries, module->capacity * sizeof(CachedAddrInfo));
+  }
+  module->entries[module->size++] = e;
+}
+
+// Parses a cache file line. Returns false if the line is malformed,
+// e.g. it is the last line of a file written by a crashed process.
+static bool ParseCacheLine(char *line, CachedAddrInfo *e) {
+  char *fields[5];
+  fields[0] = line;
+  for (int i = 1; i < 5; i++) {
+    char *tab = strchr(fields[i - 1], '\t');
+    if (!tab) return false;
+    *tab = '\0';
+    fields[i] = tab + 1;
+  }
+  e->offset = strtoul(fields[0], NULL, 16);
+  e->ok = fields[1][0] == '1';
+  e->line = atoi(fields[2]);
+  e->symbol = strdup(fields[3]);
+  e->file = strdup(fields[4]);
+  return true;
+}
+
+static void LoadCacheFile(const char *path, CachedModule *module) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return;
+  struct stat st;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    char *data = (char*)malloc(st.st_size + 1);
+    int total_read = 0;
+    while (total_read < st.st_size) {
+      int bytes_read = read(fd, data + total_read, st.st_size - total_read);
+      if (bytes_read <= 0) break;
+      total_read += bytes_read;
+    }
+    data[total_read] = '\0';
+    char *line = data, *nl;
+    while ((nl = strchr(line, '\n'))) {
+      *nl = '\0';
+      CachedAddrInfo e;
+      if (ParseCacheLine(line, &e)) AddCachedAddrInfo(module, e);
+      line = nl + 1;
+    }
+    free(data);
+    qsort(module->entries, module->size, sizeof(CachedAddrInfo),
+          CompareCachedAddrInfo);
+  }
+  close(fd);
+}
+
+// Returns the cache for the module containing |addr|, or NULL if the module
+// has no build-id.
+CachedModule *SymbolTable::FindCachedModule(void *addr, uintptr_t *offset) {
+  FindModuleArg arg;
+  arg.addr = (uintptr_t)addr;
+  arg.build_id[0] = '\0';
+  if (!dl_iterate_phdr(FindModuleCallback, &arg) || !arg.build_id[0]) {
+    return NULL;
+  }
+  *offset = arg.addr - arg.base;
+  for (int i = 0; i < num_modules; i++) {
+    if (!strcmp(modules[i].build_id, arg.build_id)) return &modules[i];
+  }
+  modules = (CachedModule*)realloc(modules,
+                                   (num_modules + 1) * sizeof(CachedModule));
+  CachedModule *module = &modules[num_modules++];
+  strcpy(module->build_id, arg.build_id);
+  module->entries = NULL;
+  module->size = module->capacity = 0;
+  if (cache_dir[0]) {
+    char path[2000];
+    snprintf(path, sizeof(path), "%s/%s", cache_dir, module->build_id);
+    LoadCacheFile(path, module);
+  }
+  return module;
+}
+
+bool SymbolTable::LookupCache(AddrInfo *info) {
+  uintptr_t offset;
+  CachedModule *module = FindCachedModule(info->addr, &offset);
+  if (!module) return false;
+  CachedAddrInfo key;
+  key.offset = offset;
+  CachedAddrInfo *e = (CachedAddrInfo*)bsearch(
+      &key, module->entries, module->size, sizeof(CachedAddrInfo),
+      CompareCachedAddrInfo);
+  if (!e) return false;
+  info->ok = e->ok;
+  info->line = e->line;
+  CopyString(info->symbol, sizeof(info->symbol), e->symbol, strlen(e->symbol));
+  CopyString(info->file, sizeof(info->file), e->file, strlen(e->file));
+  return true;
+}
+
+void SymbolTable::StoreCache(const AddrInfo *info) {
+  uintptr_t offset;
+  CachedModule *module = FindCachedModule(info->addr, &offset);
+  if (!module) return;
+  // The fields are separated by tabs.
+  if (strpbrk(info->symbol, "\t\n") || strpbrk(info->file, "\t\n")) return;
+  CachedAddrInfo e;
+  e.offset = offset;
+  e.ok = info->ok;
+  e.line = info->line;
+  e.symbol = strdup(info->symbol);
+  e.file = strdup(info->file);
+  AddCachedAddrInfo(module, e);
+  // Keep the entries sorted: move the new one into place.
+  int i = module->size - 1;
+  while (i > 0 && module->entries[i - 1].offset > offset) {
+    module->entries[i] = module->entries[i - 1];
+    i--;
+  }
+  module->entries[i] = e;
+  if (!cache_dir[0]) return;
+  mkdir(cache_dir, 0755);  // May already exist.
+  char path[2000];
+  snprintf(path, sizeof(path), "%s/%s", cache_dir, module->build_id);
+  int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (fd < 0) return;
+  char line[2000];
+  int len = snprintf(line, sizeof(line), "%lx\t%d\t%d\t%s\t%s\n",
+                     (unsigned long)offset, e.ok ? 1 : 0, e.line,
+                     e.symbol, e.file);
+  if (len < (int)sizeof(line)) write(fd, line, len);
+  close(fd);
 }
 
 // /proc/self/maps line looks like follows:
@@ -7,6 +7,19 @@
 #include <stdint.h>
 
 static const char kGdbPath[] = "/usr/bin/gdb";
+// If set, the directory where the symbolization results are kept between
+// runs, one file per module build-id.
+static const char kCacheDirEnv[] = "GDB_SYMBOLS_CACHE_DIR";
+
+struct AddrInfo {
+  void *addr;  // in
+  bool ok;
+  int line;
+  char symbol[512];
+  char file[1000];
+};
+
+struct CachedModule;
 
 class SymbolTable {
  public:
@@ -18,22 +31,44 @@ class SymbolTable {
                           /*out*/char *symbol, int symbol_size,
                           /*out*/char *file, int file_size,
                           /*out*/int *line);
+  // Symbolizes infos[0..n-1] (e.g. a whole stack or a set of reports).
+  // The addresses found in the on-disk cache are not sent to gdb at all,
+  // the rest are sent in batches of kBatchSize, one exchange per batch.
+  void GetAddrInfoBatch(/*in/out*/AddrInfo *infos, int n);
+  static const int kBatchSize = 64;
  protected:
   bool BeforeFork();
   bool AfterForkChild();
   bool AfterForkParent();
  private:
   int OpenPipe();
+  bool StartGdb();
   void Finalize();
   void WriteHexAddr(uintptr_t addr);
   void ConsumeLines();
   void LoadProcMaps();
   void ProcessProcMapsLine(char *line);
   int ReadBuffer(char *buf, int size);
+  bool ReadLine(char *line, int size);
+  bool ReadReply(char *buf, int size);
+  void WriteCommand(const char *command, uintptr_t addr);
+  bool Sync();
+  bool QueryGdb(AddrInfo **infos, int n);
+  CachedModule *FindCachedModule(void *addr, uintptr_t *offset);
+  bool LookupCache(AddrInfo *info);
+  void StoreCache(const AddrInfo *info);
   // File descriptors used to interact with gdb.
   int gdb_in, gdb_out;
+  bool gdb_started;
   bool finalized;
   char binary_name[1000];
+  // Buffered gdb output, see ReadLine().
+  char out_buf[4096];
+  int out_pos, out_len;
+  // The on-disk cache, disabled if cache_dir is empty.
+  char cache_dir[1000];
+  CachedModule *modules;
+  int num_modules;
 };
 
 #endif  // SYMBOL_TABLE_H_
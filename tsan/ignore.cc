@@ -5,6 +5,8 @@
 IgnoreLists *g_ignore_lists;
 vector<string>* g_ignore_obj;
 IgnoreLists *g_white_lists;
+CompiledIgnoreLists *g_compiled_ignore_lists;
+CompiledIgnoreLists *g_compiled_white_lists;
 
 static void SplitStringIntoLinesAndRemoveBlanksAndComments(
     const string &str, vector<string> *lines) {
@@ -73,6 +75,29 @@ void ReadIgnoresFromString(const string& ignoreString, IgnoreLists *ignore_lists
   }
 }
 
+// True iff each component of the triple is either empty or matches the
+// corresponding string.
+static bool TripleMatchKnown(const IgnoreTriple& t,
+                             const string& fun,
+                             const string& obj,
+                             const string& file) {
+  if ((fun.size() == 0 || ThreadSanitizerStringMatch(t.fun, fun)) &&
+      (obj.size() == 0 || ThreadSanitizerStringMatch(t.obj, obj)) &&
+      (file.size() == 0 || ThreadSanitizerStringMatch(t.file, file))) {
+    if ((fun.size() == 0 || t.fun == "*") &&
+        (obj.size() == 0 || t.obj == "*") &&
+        (file.size() == 0 || t.file == "*")) {
+      // At least one of the matched features should be either non-empty
+      // or match a non-trivial pattern.
+      // For example, a <*, *, filename.ext> triple should NOT match
+      // fun="fun", obj="obj.o", file="".
+      return false;
+    }
+    return true;
+  }
+  return false;
+}
+
 // True iff there exists a triple each of which components is either empty
 // or matches the corresponding string.
 bool TripleVectorMatchKnown(const vector<IgnoreTriple>& v,
@@ -80,22 +105,84 @@ bool TripleVectorMatchKnown(const vector<IgnoreTriple>& v,
                        const string& obj,
                        const string& file) {
   for (size_t i = 0; i < v.size(); i++) {
-    if ((fun.size() == 0 || ThreadSanitizerStringMatch(v[i].fun, fun)) &&
-        (obj.size() == 0 || ThreadSanitizerStringMatch(v[i].obj, obj)) &&
-        (file.size() == 0 || ThreadSanitizerStringMatch(v[i].file, file))) {
-      if ((fun.size() == 0 || v[i].fun == "*") &&
-          (obj.size() == 0 || v[i].obj == "*") &&
-          (file.size() == 0 || v[i].file == "*")) {
-        // At least one of the matched features should be either non-empty
-        // or match a non-trivial pattern.
-        // For example, a <*, *, filename.ext> triple should NOT match
-        // fun="fun", obj="obj.o", file="".
-        continue;
-      } else {
-        return true;
-      }
+    if (TripleMatchKnown(v[i], fun, obj, file))
+      return true;
+  }
+  return false;
+}
+
+void WildcardIndex::Add(const string &pattern, size_t id) {
+  all_.push_back(id);
+  size_t first = pattern.find_first_of("*?");
+  if (first == string::npos) {
+    exact_[pattern].push_back(id);
+  } else if (first > 0) {
+    by_prefix_[pattern.substr(0, first)].push_back(id);
+    prefix_sizes_.insert(first);
+  } else {
+    size_t suffix_size = pattern.size() - pattern.find_last_of("*?") - 1;
+    if (suffix_size > 0) {
+      by_suffix_[pattern.substr(pattern.size() - suffix_size)].push_back(id);
+      suffix_sizes_.insert(suffix_size);
+    } else {
+      other_.push_back(id);
     }
   }
+}
+
+static void AppendIds(const map<string, vector<size_t> > &m, const string &key,
+                      vector<size_t> *res) {
+  map<string, vector<size_t> >::const_iterator it = m.find(key);
+  if (it != m.end())
+    res->insert(res->end(), it->second.begin(), it->second.end());
+}
+
+void WildcardIndex::GetCandidates(const string &name,
+                                  vector<size_t> *res) const {
+  res->insert(res->end(), other_.begin(), other_.end());
+  AppendIds(exact_, name, res);
+  for (set<size_t>::const_iterator it = prefix_sizes_.begin();
+       it != prefix_sizes_.end() && *it <= name.size(); ++it) {
+    AppendIds(by_prefix_, name.substr(0, *it), res);
+  }
+  for (set<size_t>::const_iterator it = suffix_sizes_.begin();
+       it != suffix_sizes_.end() && *it <= name.size(); ++it) {
+    AppendIds(by_suffix_, name.substr(name.size() - *it), res);
+  }
+}
+
+void WildcardIndex::GetAll(vector<size_t> *res) const {
+  res->insert(res->end(), all_.begin(), all_.end());
+}
+
+IgnoreTripleMatcher::IgnoreTripleMatcher(const vector<IgnoreTriple>& v)
+    : triples_(v) {
+  for (size_t i = 0; i < triples_.size(); i++) {
+    const IgnoreTriple &t = triples_[i];
+    if (t.fun != "*")
+      fun_.Add(t.fun, i);
+    else if (t.obj != "*")
+      obj_.Add(t.obj, i);
+    else
+      file_.Add(t.file, i);
+  }
+}
+
+bool IgnoreTripleMatcher::Match(const string& fun, const string& obj,
+                                const string& file) const {
+  // An empty name matches any pattern, so all the triples indexed by that
+  // component have to be checked.
+  vector<size_t> candidates;
+  if (fun.empty()) fun_.GetAll(&candidates);
+  else fun_.GetCandidates(fun, &candidates);
+  if (obj.empty()) obj_.GetAll(&candidates);
+  else obj_.GetCandidates(obj, &candidates);
+  if (file.empty()) file_.GetAll(&candidates);
+  else file_.GetCandidates(file, &candidates);
+  for (size_t i = 0; i < candidates.size(); i++) {
+    if (TripleMatchKnown(triples_[candidates[i]], fun, obj, file))
+      return true;
+  }
   return false;
 }
 
@@ -35,11 +35,67 @@ struct IgnoreLists {
   vector<IgnoreTriple> ignores_hist;
 };
 
+// The patterns of one component of the triples (fun, obj or file) indexed by
+// their literal parts: a literal pattern by itself, 'foo*bar' by the prefix
+// 'foo' and '*foo' by the suffix 'foo'. Only the patterns like '*foo*' have
+// to be tried on every name.
+class WildcardIndex {
+ public:
+  void Add(const string &pattern, size_t id);
+
+  // Appends the ids of the patterns which may match 'name'.
+  void GetCandidates(const string &name, vector<size_t> *res) const;
+
+  // Appends the ids of all patterns.
+  void GetAll(vector<size_t> *res) const;
+
+ private:
+  typedef map<string, vector<size_t> > Map;
+  Map exact_;
+  Map by_prefix_;
+  Map by_suffix_;
+  set<size_t> prefix_sizes_;
+  set<size_t> suffix_sizes_;
+  vector<size_t> other_;
+  vector<size_t> all_;
+};
+
+// A compiled form of vector<IgnoreTriple>. Each triple is indexed by its
+// first component which is not "*", so Match() only checks the triples
+// which may match.
+class IgnoreTripleMatcher {
+ public:
+  explicit IgnoreTripleMatcher(const vector<IgnoreTriple>& v);
+
+  // Same as TripleVectorMatchKnown(v, fun, obj, file).
+  bool Match(const string& fun, const string& obj, const string& file) const;
+
+ private:
+  vector<IgnoreTriple> triples_;
+  WildcardIndex fun_;
+  WildcardIndex obj_;
+  WildcardIndex file_;
+};
+
+struct CompiledIgnoreLists {
+  explicit CompiledIgnoreLists(const IgnoreLists& lists)
+      : ignores(lists.ignores), ignores_r(lists.ignores_r),
+        ignores_hist(lists.ignores_hist) {}
+
+  IgnoreTripleMatcher ignores;
+  IgnoreTripleMatcher ignores_r;
+  IgnoreTripleMatcher ignores_hist;
+};
+
 extern IgnoreLists *g_ignore_lists;
 extern vector<string> *g_ignore_obj;
 
 extern IgnoreLists *g_white_lists;
 
+// Built from g_ignore_lists and g_white_lists once they are read.
+extern CompiledIgnoreLists *g_compiled_ignore_lists;
+extern CompiledIgnoreLists *g_compiled_white_lists;
+
 void ReadIgnoresFromString(const string& ignoreString,
     IgnoreLists* ignoreLists);
 
@@ -43,6 +43,9 @@ enum LocationType {
 struct Location {
   LocationType type;
   string name;
+  // Set when the suppressions are compiled. Names without '*' and '?'
+  // are compared with operator==.
+  bool has_wildcards;
 };
 
 struct StackTraceTemplate {
@@ -181,7 +184,7 @@ bool ThreadSanitizerParser::ParseSuppressionToolsLine(Suppression* supp, string
 
 bool ThreadSanitizerParser::ParseStackTraceLine(StackTraceTemplate* trace, string line) {
   if (line == "...") {
-    Location location = {LT_STAR, ""};
+    Location location = {LT_STAR, "", false};
     trace->locations.push_back(location);
     return true;
   } else {
@@ -190,11 +193,11 @@ bool ThreadSanitizerParser::ParseStackTraceLine(StackTraceTemplate* trace, strin
     string s1 = line.substr(0, idx);
     string s2 = line.substr(idx + 1);
     if (s1 == "obj") {
-      Location location = {LT_OBJ, s2};
+      Location location = {LT_OBJ, s2, false};
       trace->locations.push_back(location);
       return true;
     } else if (s1 == "fun") {
-      Location location = {LT_FUN, s2};
+      Location location = {LT_FUN, s2, false};
       // A suppression frame can only have ( or ) if it comes from Objective-C,
       // i.e. starts with +[ or -[ or =[
       PARSER_CHECK(s2.find_first_of("()") == string::npos ||
@@ -321,12 +324,144 @@ bool ThreadSanitizerParser::NextSuppression(Suppression* supp) {
   return true;
 }
 
+// A stack trace template, referred to by its position in the file order.
+// If several templates match, the first one gives the suppression name.
+struct TemplateRef {
+  size_t supp;
+  size_t tmpl;
+
+  bool operator<(const TemplateRef &other) const {
+    return supp != other.supp ? supp < other.supp : tmpl < other.tmpl;
+  }
+  bool operator==(const TemplateRef &other) const {
+    return supp == other.supp && tmpl == other.tmpl;
+  }
+};
+
+// The templates of one tool:warning_name pair, indexed by the first frame.
+// A literal first frame is looked up as is, a wildcard one by its literal
+// prefix (e.g. 'fun:Foo*' by 'Foo'). Only the templates starting with '...'
+// or with a wildcard character have to be tried on every stack trace.
+struct TemplateIndex {
+  typedef map<string, vector<TemplateRef> > Map;
+  Map by_fun;
+  Map by_obj;
+  Map by_fun_prefix;
+  Map by_obj_prefix;
+  set<size_t> fun_prefix_sizes;
+  set<size_t> obj_prefix_sizes;
+  vector<TemplateRef> other;
+};
+
 struct ThreadSanitizerSuppressions::SuppressionsRep {
+  SuppressionsRep() : compiled(false) {}
+
   vector<Suppression> suppressions;
   string error_string_;
   int error_line_no_;
+
+  // Built by Compile() on the first lookup after ReadFromString().
+  bool compiled;
+  map<string, TemplateIndex> index;  // Keyed by "tool:warning_name".
+
+  void Compile();
+  void GetCandidates(const TemplateIndex &idx,
+                     const vector<string>& function_names_mangled,
+                     const vector<string>& function_names_demangled,
+                     const vector<string>& object_names,
+                     vector<TemplateRef> *res);
 };
 
+static bool HasWildcards(const string &name) {
+  return name.find_first_of("*?") != string::npos;
+}
+
+static void AddToIndex(const Location &location, const TemplateRef &ref,
+                       TemplateIndex *idx) {
+  CHECK(location.type == LT_FUN || location.type == LT_OBJ);
+  bool fun = location.type == LT_FUN;
+  if (!location.has_wildcards) {
+    (fun ? idx->by_fun : idx->by_obj)[location.name].push_back(ref);
+    return;
+  }
+  size_t prefix_size = location.name.find_first_of("*?");
+  if (prefix_size == 0) {
+    idx->other.push_back(ref);
+    return;
+  }
+  (fun ? idx->by_fun_prefix : idx->by_obj_prefix)[
+      location.name.substr(0, prefix_size)].push_back(ref);
+  (fun ? idx->fun_prefix_sizes : idx->obj_prefix_sizes).insert(prefix_size);
+}
+
+void ThreadSanitizerSuppressions::SuppressionsRep::Compile() {
+  index.clear();
+  for (size_t i = 0; i < suppressions.size(); i++) {
+    Suppression &supp = suppressions[i];
+    for (size_t j = 0; j < supp.templates.size(); j++) {
+      vector<Location> &locations = supp.templates[j].locations;
+      for (size_t k = 0; k < locations.size(); k++) {
+        locations[k].has_wildcards = HasWildcards(locations[k].name);
+      }
+      TemplateRef ref = {i, j};
+      for (set<string>::iterator it = supp.tools.begin();
+           it != supp.tools.end(); ++it) {
+        TemplateIndex &idx = index[*it + ":" + supp.warning_name];
+        if (locations.empty() || locations[0].type == LT_STAR)
+          idx.other.push_back(ref);
+        else
+          AddToIndex(locations[0], ref, &idx);
+      }
+    }
+  }
+  compiled = true;
+}
+
+static void AppendTemplateRefs(const TemplateIndex::Map &m,
+                               const string &key, vector<TemplateRef> *res) {
+  TemplateIndex::Map::const_iterator it = m.find(key);
+  if (it != m.end())
+    res->insert(res->end(), it->second.begin(), it->second.end());
+}
+
+static void AppendTemplateRefsByPrefix(const TemplateIndex::Map &m,
+                                       const set<size_t> &prefix_sizes,
+                                       const string &name,
+                                       vector<TemplateRef> *res) {
+  for (set<size_t>::const_iterator it = prefix_sizes.begin();
+       it != prefix_sizes.end() && *it <= name.size(); ++it) {
+    AppendTemplateRefs(m, name.substr(0, *it), res);
+  }
+}
+
+// Collects the templates which may match the given stack trace, in the file
+// order.
+void ThreadSanitizerSuppressions::SuppressionsRep::GetCandidates(
+    const TemplateIndex &idx,
+    const vector<string>& function_names_mangled,
+    const vector<string>& function_names_demangled,
+    const vector<string>& object_names,
+    vector<TemplateRef> *res) {
+  res->assign(idx.other.begin(), idx.other.end());
+  if (function_names_mangled.empty())
+    return;
+  const string &mangled = function_names_mangled[0];
+  const string &demangled = function_names_demangled[0];
+  AppendTemplateRefs(idx.by_fun, mangled, res);
+  AppendTemplateRefsByPrefix(idx.by_fun_prefix, idx.fun_prefix_sizes,
+                             mangled, res);
+  if (demangled != mangled) {
+    AppendTemplateRefs(idx.by_fun, demangled, res);
+    AppendTemplateRefsByPrefix(idx.by_fun_prefix, idx.fun_prefix_sizes,
+                               demangled, res);
+  }
+  AppendTemplateRefs(idx.by_obj, object_names[0], res);
+  AppendTemplateRefsByPrefix(idx.by_obj_prefix, idx.obj_prefix_sizes,
+                             object_names[0], res);
+  sort(res->begin(), res->end());
+  res->erase(unique(res->begin(), res->end()), res->end());
+}
+
 ThreadSanitizerSuppressions::ThreadSanitizerSuppressions()
   : rep_(new SuppressionsRep) {
 }
@@ -341,7 +476,10 @@ int ThreadSanitizerSuppressions::ReadFromString(const string &str) {
   Suppression *supp = new Suppression();
   while (parser->NextSuppression(supp)) {
     rep_->suppressions.push_back(*supp);
+    // Don't let the next suppression inherit the tools and templates.
+    *supp = Suppression();
   }
+  rep_->compiled = false;
   int res = -1;
   if (parser->GetError()) {
     rep_->error_string_ = parser->GetErrorString();
@@ -379,6 +517,12 @@ struct MatcherContext {
   StackTraceTemplate* tmpl;
 };
 
+static bool MatchLocation(const Location &location, const string &name) {
+  if (!location.has_wildcards)
+    return location.name == name;
+  return ThreadSanitizerStringMatch(location.name, name);
+}
+
 static bool MatchStackTraceRecursive(MatcherContext ctx,
                                      size_t trace_index,
                                      size_t tmpl_index) {
@@ -396,12 +540,12 @@ static bool MatchStackTraceRecursive(MatcherContext ctx,
     } else {
       bool match = false;
       if (location.type == LT_OBJ) {
-        match = ThreadSanitizerStringMatch(location.name, ctx.object_names[trace_index]);
+        match = MatchLocation(location, ctx.object_names[trace_index]);
       } else {
         CHECK(location.type == LT_FUN);
         match =
-          ThreadSanitizerStringMatch(location.name, ctx.function_names_mangled[trace_index]) ||
-          ThreadSanitizerStringMatch(location.name, ctx.function_names_demangled[trace_index]);
+          MatchLocation(location, ctx.function_names_mangled[trace_index]) ||
+          MatchLocation(location, ctx.function_names_demangled[trace_index]);
       }
       if (match) {
         ++trace_index;
@@ -420,21 +564,24 @@ bool ThreadSanitizerSuppressions::StackTraceSuppressed(const string& tool_name,
     const vector<string>& function_names_demangled,
     const vector<string>& object_names,
     string *name_of_suppression) {
+  if (!rep_->compiled)
+    rep_->Compile();
+  map<string, TemplateIndex>::iterator idx =
+      rep_->index.find(tool_name + ":" + warning_name);
+  if (idx == rep_->index.end())
+    return false;
+  vector<TemplateRef> candidates;
+  rep_->GetCandidates(idx->second, function_names_mangled,
+                      function_names_demangled, object_names, &candidates);
+
   MatcherContext ctx(function_names_mangled, function_names_demangled,
       object_names);
-  for (vector<Suppression>::iterator it = rep_->suppressions.begin();
-       it != rep_->suppressions.end(); ++it) {
-    if (it->warning_name != warning_name ||
-        it->tools.find(tool_name) == it->tools.end())
-      continue;
-    for (vector<StackTraceTemplate>::iterator it2 = it->templates.begin();
-         it2 != it->templates.end(); ++it2) {
-      ctx.tmpl = &*it2;
-      bool result = MatchStackTraceRecursive(ctx, 0, 0);
-      if (result) {
-        *name_of_suppression = it->name;
-        return true;
-      }
+  for (size_t i = 0; i < candidates.size(); i++) {
+    Suppression &supp = rep_->suppressions[candidates[i].supp];
+    ctx.tmpl = &supp.templates[candidates[i].tmpl];
+    if (MatchStackTraceRecursive(ctx, 0, 0)) {
+      *name_of_suppression = supp.name;
+      return true;
     }
   }
   return false;
@@ -52,7 +52,9 @@ class ThreadSanitizerSuppressions {
   // Returns the line number of the last error. Undefined if there was no error.
   int GetErrorLineNo();
 
-  // Checks if a given stack trace is suppressed.
+  // Checks if a given stack trace is suppressed. The suppressions read so far
+  // are indexed by the tool, the warning name and the first frame on the
+  // first call after ReadFromString().
   bool StackTraceSuppressed(const string& tool_name, const string& warning_name,
       const vector<string>& function_names_mangled,
       const vector<string>& function_names_demangled,
@@ -531,6 +531,116 @@ TEST_F(FailingSuppressionsTest, StacktraceWithAngleBraces) {
 }
 
 
+// The first matching suppression in the file order wins, whether or not its
+// first frame can be looked up in the index.
+TEST_F(BaseSuppressionsTest, FirstMatchingSuppressionWins) {
+  const string data =
+      "{\n"
+      "  wild\n"
+      "  test_tool:test_warning_type\n"
+      "  ...\n"
+      "  fun:function2\n"
+      "}\n"
+      "{\n"
+      "  exact\n"
+      "  test_tool:test_warning_type\n"
+      "  fun:function1\n"
+      "}\n";
+  ASSERT_EQ(2, supp_.ReadFromString(data));
+  string m[] = {"function1", "function2"};
+  string d[] = {"aaa", "bbb"};
+  string o[] = {"object1", "object2"};
+  string name;
+  ASSERT_TRUE(supp_.StackTraceSuppressed("test_tool", "test_warning_type",
+      VEC(m), VEC(d), VEC(o), &name));
+  EXPECT_EQ("wild", name);
+  string m2[] = {"function1", "function3"};
+  ASSERT_TRUE(supp_.StackTraceSuppressed("test_tool", "test_warning_type",
+      VEC(m2), VEC(d), VEC(o), &name));
+  EXPECT_EQ("exact", name);
+}
+
+// Suppressions read after a lookup are used by the next lookups.
+TEST_F(BaseSuppressionsTest, ReadAfterLookup) {
+  string m[] = {"function1"};
+  string d[] = {"aaa"};
+  string o[] = {"object1"};
+  const string data1 =
+      "{\n"
+      "  name1\n"
+      "  test_tool:test_warning_type\n"
+      "  obj:object2\n"
+      "}\n";
+  const string data2 =
+      "{\n"
+      "  name2\n"
+      "  test_tool:test_warning_type\n"
+      "  obj:object1\n"
+      "}\n";
+  ASSERT_EQ(1, supp_.ReadFromString(data1));
+  ASSERT_FALSE(IsSuppressed(VEC(m), VEC(d), VEC(o)));
+  ASSERT_EQ(1, supp_.ReadFromString(data2));
+  ASSERT_TRUE(IsSuppressed(VEC(m), VEC(d), VEC(o)));
+}
+
+// Matches a few thousand stack traces against a few thousand suppressions,
+// which is what happens on a noisy binary with a big suppressions file.
+TEST_F(BaseSuppressionsTest, Benchmark) {
+  const int kNumSuppressions = 3000;
+  const int kNumTraces = 3000;
+  const int kDepth = 10;
+  string data;
+  for (int i = 0; i < kNumSuppressions; i++) {
+    char buf[200];
+    switch (i % 4) {
+      case 0:
+        snprintf(buf, sizeof(buf), "{\n  s%d\n  test_tool:test_warning_type\n"
+                 "  fun:func%d\n  ...\n  fun:caller%d\n}\n", i, i, i);
+        break;
+      case 1:
+        snprintf(buf, sizeof(buf), "{\n  s%d\n  test_tool:test_warning_type\n"
+                 "  obj:libobj%d.so\n}\n", i, i);
+        break;
+      case 2:
+        snprintf(buf, sizeof(buf), "{\n  s%d\n  test_tool:test_warning_type\n"
+                 "  fun:wild%d_*\n}\n", i, i);
+        break;
+      default:
+        snprintf(buf, sizeof(buf), "{\n  s%d\n  other_tool:test_warning_type\n"
+                 "  ...\n  fun:func%d\n}\n", i, i);
+        break;
+    }
+    data += buf;
+  }
+  ASSERT_EQ(kNumSuppressions, supp_.ReadFromString(data));
+
+  size_t start = TimeInMilliSeconds();
+  int n_suppressed = 0;
+  for (int i = 0; i < kNumTraces; i++) {
+    vector<string> m, d, o;
+    for (int j = 0; j < kDepth; j++) {
+      char buf[100];
+      snprintf(buf, sizeof(buf), j == 0 ? "func%d" :
+               j == kDepth - 1 ? "caller%d" : "frame%d", i);
+      m.push_back(buf);
+      d.push_back(buf);
+      snprintf(buf, sizeof(buf), "obj%d.so", j);
+      o.push_back(buf);
+    }
+    string name;
+    if (supp_.StackTraceSuppressed("test_tool", "test_warning_type",
+                                   m, d, o, &name)) {
+      char expected[100];
+      snprintf(expected, sizeof(expected), "s%d", i);
+      EXPECT_EQ(expected, name);
+      n_suppressed++;
+    }
+  }
+  EXPECT_EQ((kNumTraces + 3) / 4, n_suppressed);
+  printf("Matched %d stack traces against %d suppressions in %ld ms\n",
+         kNumTraces, kNumSuppressions, (long)(TimeInMilliSeconds() - start));
+}
+
 TEST(WildcardTest, Simple) {
   EXPECT_TRUE(ThreadSanitizerStringMatch("abc", "abc"));
   EXPECT_FALSE(ThreadSanitizerStringMatch("abcd", "abc"));
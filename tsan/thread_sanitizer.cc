@@ -37,13 +37,18 @@
 #include "ignore.h"
 #include "ts_lock.h"
 #include "ts_atomic_int.h"
-#include "dense_multimap.h"
+#include "ts_set_table.h"
+#include "ts_vts_kernels.h"
+#include "ts_compressed_line.h"
 #include <stdarg.h>
 // -------- Constants --------------- {{{1
 // Segment ID (SID)      is in range [1, kMaxSID-1]
 // Segment Set ID (SSID) is in range [-kMaxSID+1, -1]
 // This is not a compile-time constant, but it can only be changed at startup.
-int kMaxSID = (1 << 23);
+// SIDs are recycled and the segments are allocated on demand, so the limit
+// is large enough not to be reached by the number of live segments;
+// the memory limit (--max_mem_in_mb) is reached first.
+int kMaxSID = (1 << 30);
 // Flush state after so many SIDs have been allocated. Set by command line flag.
 int kMaxSIDBeforeFlush;
 
@@ -120,7 +125,6 @@ class TIL {
 };
 
 static TSLock *ts_lock;
-static TSLock *ts_ignore_below_lock;
 
 #ifdef TS_LLVM
 void ThreadSanitizerLockAcquire() {
@@ -297,6 +301,7 @@ const char *c_default = "";
 static void ForgetAllStateAndStartOver(TSanThread *thr, const char *reason);
 static void FlushStateIfOutOfSegments(TSanThread *thr);
 static int32_t raw_tid(TSanThread *t);
+static ThreadLocalStats *thread_stats(TSanThread *t);
 // -------- Simple Cache ------ {{{1
 #include "ts_simple_cache.h"
 // -------- PairCache & IntPairToIntCache ------ {{{1
@@ -423,6 +428,7 @@ class FreeList {
  public:
   FreeList(int obj_size, int chunk_size)
     : list_(0),
+      n_chunks_(0),
       obj_size_(obj_size),
       chunk_size_(chunk_size) {
     CHECK_GE(obj_size_, static_cast<int>(sizeof(NULL)));
@@ -448,10 +454,16 @@ class FreeList {
     list_ = new_head;
   }
 
+  // The memory is never given back, so this includes the free objects.
+  size_t allocated_bytes() const {
+    return n_chunks_ * obj_size_ * chunk_size_;
+  }
+
  private:
   void AllocateNewChunk() {
     CHECK(list_ == NULL);
     uint8_t *new_mem = new uint8_t[obj_size_ * chunk_size_];
+    n_chunks_++;
     if (TSAN_DEBUG) {
       memset(new_mem, 0xab, obj_size_ * chunk_size_);
     }
@@ -465,6 +477,7 @@ class FreeList {
     struct List *next;
   };
   List *list_;
+  size_t n_chunks_;
 
 
   const int obj_size_;
@@ -492,6 +505,14 @@ class StackTraceFreeList {
     }
   }
 
+  size_t MemoryUsageInBytes() {
+    size_t res = 0;
+    for (size_t i = 1; i <= (size_t)G_flags->num_callers; i++) {
+      res += free_lists_[i]->allocated_bytes();
+    }
+    return res;
+  }
+
  private:
   FreeList **free_lists_;  // Array of G_flags->num_callers lists.
 };
@@ -537,6 +558,8 @@ class StackTrace {
     return arr_[i];
   }
 
+  const uintptr_t *pcs() const { return arr_; }
+
   static bool CutStackBelowFunc(const string func_name) {
     for (size_t i = 0; i < G_flags->cut_stack_below.size(); i++) {
       if (ThreadSanitizerStringMatch(G_flags->cut_stack_below[i], func_name)) {
@@ -631,6 +654,298 @@ class StackTrace {
   uintptr_t arr_[];
 };
 
+// -------- StackDepot -------------- {{{1
+// Interns call stacks (arrays of PCs, the top frame first) and gives each
+// distinct stack a 32-bit id; 0 is the id of the empty stack.
+// Used for the history stacks of segments, which are mostly duplicates.
+//
+// The stacks are reference counted. A segment holds a reference to its
+// history stack until it is recycled or all state is forgotten, so the
+// depot keeps only the stacks of live segments and their ids are reused.
+//
+// The depot is split into kNumParts parts by the stack hash, each with its
+// own lock, hash table and ids (id % kNumParts is the part). The table is
+// open addressed and keeps the hash next to the id, so a lookup usually
+// touches one cache line of the table and one node; it grows with the
+// number of stacks. Get() takes no lock: the caller holds a reference to
+// the stack, so it can not be freed concurrently.
+class StackDepot {
+ public:
+  StackDepot() {
+    for (size_t i = 0; i < kNumParts; i++) {
+      Part *part = &parts_[i];
+      part->lock = new TSLock;
+      part->n_slots = kMinSlots;
+      part->slots = new Slot[kMinSlots];
+      memset(part->slots, 0, kMinSlots * sizeof(Slot));
+      part->n_stacks = 0;
+      part->n_ids = 0;
+      part->chunks = new Node**[kMaxChunks];
+      memset(part->chunks, 0, kMaxChunks * sizeof(Node**));
+      memset(part->free_nodes, 0, sizeof(part->free_nodes));
+    }
+  }
+
+  // Returns the id of the stack and a new reference to it.
+  uint32_t Put(const uintptr_t *pcs, size_t size) {
+    if (size == 0) return 0;
+    uint32_t hash = Hash(pcs, size);
+    Part *part = &parts_[hash % kNumParts];
+    ScopedLock lock(part->lock);
+    size_t mask = part->n_slots - 1;
+    size_t i = HomeSlot(part, hash);
+    for (; part->slots[i].id != 0; i = (i + 1) & mask) {
+      Slot &slot = part->slots[i];
+      if (slot.hash != hash) continue;
+      Node *node = GetNode(slot.id);
+      if (node->Equals(pcs, size)) {
+        node->ref_count++;
+        return node->id;
+      }
+    }
+    Node *node = CreateNode(part, pcs, size);
+    part->slots[i].hash = hash;
+    part->slots[i].id = node->id;
+    // Keep the load factor under 1/2, the probe sequences stay short.
+    if (++part->n_stacks * 2 > part->n_slots) {
+      Rehash(part, part->n_slots * 2);
+    }
+    return node->id;
+  }
+
+  void Ref(uint32_t id) {
+    if (id == 0) return;
+    Part *part = &parts_[id % kNumParts];
+    ScopedLock lock(part->lock);
+    GetNode(id)->ref_count++;
+  }
+
+  // Deletes the stack when the last reference is gone.
+  void Unref(uint32_t id) {
+    if (id == 0) return;
+    Part *part = &parts_[id % kNumParts];
+    ScopedLock lock(part->lock);
+    Node *node = GetNode(id);
+    DCHECK(node->ref_count > 0);
+    if (--node->ref_count > 0) return;
+    RemoveSlot(part, id, Hash(node->pcs, node->size));
+    uint32_t idx = id / kNumParts;
+    part->chunks[idx / kChunkSize][idx % kChunkSize] = NULL;
+    part->free_ids.push_back(idx);
+    part->n_stacks--;
+    size_t capacity;
+    Node *&free_nodes = part->free_nodes[SizeClass(node->size, &capacity)];
+    DCHECK(node->capacity == capacity);
+    node->next = free_nodes;
+    free_nodes = node;
+  }
+
+  // Returns NULL and 0 for the id 0.
+  const uintptr_t *Get(uint32_t id, size_t *size) {
+    if (id == 0) {
+      *size = 0;
+      return NULL;
+    }
+    Node *node = GetNode(id);
+    *size = node->size;
+    return node->pcs;
+  }
+
+  size_t NumberOfStacks() {
+    size_t res = 0;
+    for (size_t i = 0; i < kNumParts; i++) {
+      res += parts_[i].n_stacks;
+    }
+    return res;
+  }
+
+  // Walks all stacks, should be called rarely.
+  size_t MemoryUsageInBytes() {
+    size_t res = 0;
+    for (size_t i = 0; i < kNumParts; i++) {
+      Part *part = &parts_[i];
+      ScopedLock lock(part->lock);
+      res += part->n_slots * sizeof(Slot) + kMaxChunks * sizeof(Node**) +
+          part->free_ids.capacity() * sizeof(uint32_t);
+      for (size_t c = 0; c < kMaxChunks && part->chunks[c]; c++) {
+        res += kChunkSize * sizeof(Node*);
+        for (size_t j = 0; j < kChunkSize; j++) {
+          Node *node = part->chunks[c][j];
+          if (node) res += NodeSize(node->capacity);
+        }
+      }
+      for (size_t c = 0; c < kNumSizeClasses; c++) {
+        for (Node *node = part->free_nodes[c]; node; node = node->next) {
+          res += NodeSize(node->capacity);
+        }
+      }
+    }
+    return res;
+  }
+
+ private:
+  static const size_t kNumSizeClasses = 16;
+
+  struct Node {
+    Node *next;  // In the list of free nodes.
+    uint32_t id;
+    uint32_t size;
+    uint32_t capacity;
+    uint32_t ref_count;
+    uintptr_t pcs[1];  // Actually, 'capacity' elements.
+
+    bool Equals(const uintptr_t *pcs2, size_t size2) const {
+      if (size != size2) return false;
+      for (size_t i = 0; i < size2; i++) {
+        if (pcs[i] != pcs2[i]) return false;
+      }
+      return true;
+    }
+  };
+
+  // A free slot has the id 0.
+  struct Slot {
+    uint32_t hash;
+    uint32_t id;
+  };
+
+  struct Part {
+    TSLock *lock;
+    Slot *slots;
+    size_t n_slots;    // A power of two.
+    size_t n_stacks;
+    uint32_t n_ids;    // The ids ever used, the first one is 1.
+    vector<uint32_t> free_ids;
+    // The deleted nodes are reused, there is a list for each size class.
+    Node *free_nodes[kNumSizeClasses];
+    Node ***chunks;    // id / kNumParts => Node*.
+  };
+
+  // The node capacities are the history stack size times a power of two,
+  // so any free node of the size class of a stack can hold it.
+  // Most stacks are history stacks and fall into the class 0.
+  static size_t SizeClass(size_t size, size_t *capacity) {
+    size_t c = 0;
+    *capacity = (size_t)max(kSizeOfHistoryStackTrace, 1);
+    while (*capacity < size) {
+      *capacity *= 2;
+      c++;
+    }
+    CHECK(c < kNumSizeClasses);
+    return c;
+  }
+
+  static size_t NodeSize(size_t n_pcs) {
+    return sizeof(Node) + (n_pcs - 1) * sizeof(uintptr_t);
+  }
+
+  static uint32_t Hash(const uintptr_t *pcs, size_t size) {
+    uint64_t h = size;
+    for (size_t i = 0; i < size; i++) {
+      h = (h ^ pcs[i]) * 0x9E3779B97F4A7C15ULL;
+    }
+    return (uint32_t)(h ^ (h >> 32));
+  }
+
+  // The low bits of the hash select the part.
+  static size_t HomeSlot(Part *part, uint32_t hash) {
+    return (hash / kNumParts) & (part->n_slots - 1);
+  }
+
+  // Called under the part lock. Shifts the following slots of the probe
+  // sequence back, so no tombstones are needed.
+  void RemoveSlot(Part *part, uint32_t id, uint32_t hash) {
+    size_t mask = part->n_slots - 1;
+    size_t i = HomeSlot(part, hash);
+    while (part->slots[i].id != id) {
+      DCHECK(part->slots[i].id != 0);
+      i = (i + 1) & mask;
+    }
+    for (size_t j = (i + 1) & mask; part->slots[j].id != 0;
+         j = (j + 1) & mask) {
+      size_t home = HomeSlot(part, part->slots[j].hash);
+      // Move slot j to i unless its home lies cyclically in (i, j].
+      bool home_in_between = i <= j ? (i < home && home <= j)
+                                    : (i < home || home <= j);
+      if (!home_in_between) {
+        part->slots[i] = part->slots[j];
+        i = j;
+      }
+    }
+    part->slots[i].id = 0;
+  }
+
+  INLINE Node *GetNode(uint32_t id) {
+    uint32_t idx = id / kNumParts;
+    Node *node = parts_[id % kNumParts].chunks[idx / kChunkSize]
+                                              [idx % kChunkSize];
+    DCHECK(node && node->id == id);
+    return node;
+  }
+
+  // Called under the part lock.
+  Node *CreateNode(Part *part, const uintptr_t *pcs, size_t size) {
+    ScopedMallocCostCenter cc("StackDepot::CreateNode");
+    uint32_t idx;
+    if (!part->free_ids.empty()) {
+      idx = part->free_ids.back();
+      part->free_ids.pop_back();
+    } else {
+      idx = ++part->n_ids;
+      CHECK(idx < kMaxChunks * kChunkSize);
+    }
+    Node **&chunk = part->chunks[idx / kChunkSize];
+    if (chunk == NULL) {
+      chunk = new Node*[kChunkSize];
+      memset(chunk, 0, kChunkSize * sizeof(Node*));
+    }
+    size_t capacity;
+    Node *&free_nodes = part->free_nodes[SizeClass(size, &capacity)];
+    Node *node = free_nodes;
+    if (node) {
+      DCHECK(node->capacity == capacity);
+      free_nodes = node->next;
+    } else {
+      node = (Node*)new uint8_t[NodeSize(capacity)];
+      node->capacity = capacity;
+    }
+    node->next = NULL;
+    node->id = idx * kNumParts + (part - parts_);
+    node->size = size;
+    node->ref_count = 1;
+    memcpy(node->pcs, pcs, size * sizeof(uintptr_t));
+    chunk[idx % kChunkSize] = node;
+    return node;
+  }
+
+  // Called under the part lock.
+  void Rehash(Part *part, size_t n_slots) {
+    ScopedMallocCostCenter cc("StackDepot::Rehash");
+    Slot *old_slots = part->slots;
+    size_t old_n_slots = part->n_slots;
+    part->slots = new Slot[n_slots];
+    memset(part->slots, 0, n_slots * sizeof(Slot));
+    part->n_slots = n_slots;
+    size_t mask = n_slots - 1;
+    for (size_t i = 0; i < old_n_slots; i++) {
+      if (old_slots[i].id == 0) continue;
+      size_t j = HomeSlot(part, old_slots[i].hash);
+      while (part->slots[j].id != 0) j = (j + 1) & mask;
+      part->slots[j] = old_slots[i];
+    }
+    delete [] old_slots;
+  }
+
+  static const size_t kNumParts = 16;
+  static const size_t kMinSlots = 1 << 10;
+  static const size_t kChunkSize = 1 << 12;
+  static const size_t kMaxChunks = 1 << 14;
+
+  Part parts_[kNumParts];
+};
+
+static StackDepot *G_stack_depot;
+
 
 
 // -------- Lock -------------------- {{{1
@@ -648,13 +963,15 @@ class Lock {
     res->rd_held_ = 0;
     res->wr_held_ = 0;
     res->is_pure_happens_before_ = G_flags->pure_happens_before;
+    StackTrace::Delete(res->last_lock_site_);
     res->last_lock_site_ = NULL;
     return res;
   }
 
+  // Keeps the Lock object and its LID: a lock created later at the same
+  // address reuses them (see Create). The LID can not be given to another
+  // lock since locksets and segments referring to it are never reclaimed.
   static void Destroy(uintptr_t lock_addr) {
-//    Printf("Lock::Destroy: %p\n", lock_addr);
-  //  map_.erase(lock_addr);
   }
 
   static NOINLINE Lock *LookupOrCreate(uintptr_t lock_addr) {
@@ -663,7 +980,9 @@ class Lock {
     if (*lock == NULL) {
 //      Printf("Lock::LookupOrCreate: %p\n", lock_addr);
       ScopedMallocCostCenter cc_lock("new Lock");
-      *lock = new Lock(lock_addr, map_->size());
+      int32_t lid = lid_to_lock_->size();
+      *lock = new Lock(lock_addr, lid);
+      lid_to_lock_->push_back(*lock);
     }
     return *lock;
   }
@@ -740,14 +1059,9 @@ class Lock {
   }
 
   static Lock *LIDtoLock(LID lid) {
-    // slow, but needed only for reports.
-    for (Map::iterator it = map_->begin(); it != map_->end(); ++it) {
-      Lock *l = it->second;
-      if (l->lid_ == lid) {
-        return l;
-      }
-    }
-    return NULL;
+    uint32_t idx = lid.raw();
+    if (idx >= lid_to_lock_->size()) return NULL;
+    return (*lid_to_lock_)[idx];
   }
 
   static string ToString(LID lid) {
@@ -776,6 +1090,8 @@ class Lock {
 
   static void InitClassMembers() {
     map_ = new Lock::Map;
+    // LIDs start from 1.
+    lid_to_lock_ = new vector<Lock*>(1, (Lock*)NULL);
   }
 
  private:
@@ -800,12 +1116,15 @@ class Lock {
   TID       thread_holding_me_in_write_mode_;
 
   // Static members
-  typedef map<uintptr_t, Lock*> Map;
+  typedef unordered_map<uintptr_t, Lock*> Map;
   static Map *map_;
+  // Indexed by LID, never shrinks.
+  static vector<Lock*> *lid_to_lock_;
 };
 
 
 Lock::Map *Lock::map_;
+vector<Lock*> *Lock::lid_to_lock_;
 
 // Returns a string like "L123,L234".
 static string SetOfLocksToString(const set<LID> &locks) {
@@ -865,13 +1184,20 @@ class LockSet {
     }
     LSID res;
     if (lsid.IsSingleton()) {
-      LSSet set(lsid.GetSingleton(), lid);
+      LID singleton = lsid.GetSingleton();
+      LID set[2] = {min(singleton, lid), max(singleton, lid)};
       G_stats->ls_add_to_singleton++;
-      res = ComputeId(set);
+      res = ComputeId(set, 2);
     } else {
-      LSSet set(Get(lsid), lid);
+      LSSet prev_set = Get(lsid);
+      FixedArray<LID, 64> set(prev_set.size() + 1);
+      LSSet::const_iterator it = upper_bound(prev_set.begin(),
+                                             prev_set.end(), lid);
+      LID *pos = copy(prev_set.begin(), it, set.begin());
+      *pos = lid;
+      copy(it, prev_set.end(), pos + 1);
       G_stats->ls_add_to_multi++;
-      res = ComputeId(set);
+      res = ComputeId(set.begin(), prev_set.size() + 1);
     }
     ls_add_cache_->Insert(lsid.raw(), lid.raw(), res.raw());
     return res;
@@ -899,12 +1225,14 @@ class LockSet {
       return true;
     }
 
-    LSSet &prev_set = Get(lsid);
-    if (!prev_set.has(lid)) return false;
-    LSSet set(prev_set, LSSet::REMOVE, lid);
-    CHECK(set.size() == prev_set.size() - 1);
+    LSSet prev_set = Get(lsid);
+    LSSet::const_iterator it = lower_bound(prev_set.begin(),
+                                           prev_set.end(), lid);
+    if (it == prev_set.end() || *it != lid) return false;
+    FixedArray<LID, 64> set(prev_set.size() - 1);
+    copy(it + 1, prev_set.end(), copy(prev_set.begin(), it, set.begin()));
     G_stats->ls_remove_from_multi++;
-    LSID res = ComputeId(set);
+    LSID res = ComputeId(set.begin(), prev_set.size() - 1);
     ls_rem_cache_->Insert(lsid.raw(), lid.raw(), res.raw());
     *new_lsid = res;
     return true;
@@ -922,13 +1250,13 @@ class LockSet {
 
     // first is singleton, second is not
     if (lsid1.IsSingleton()) {
-      const LSSet &set2 = Get(lsid2);
+      LSSet set2 = Get(lsid2);
       return set2.has(LID(lsid1.raw())) == false;
     }
 
     // second is singleton, first is not
     if (lsid2.IsSingleton()) {
-      const LSSet &set1 = Get(lsid1);
+      LSSet set1 = Get(lsid1);
       return set1.has(LID(lsid2.raw())) == false;
     }
 
@@ -945,8 +1273,8 @@ class LockSet {
         return ret;
       cache_hit = true;
     }
-    const LSSet &set1 = Get(lsid1);
-    const LSSet &set2 = Get(lsid2);
+    LSSet set1 = Get(lsid1);
+    LSSet set2 = Get(lsid2);
 
     FixedArray<LID> intersection(min(set1.size(), set2.size()));
     LID *end = set_intersection(set1.begin(), set1.end(),
@@ -964,7 +1292,7 @@ class LockSet {
     if (lsid.IsSingleton())
       return !Lock::LIDtoLock(LID(lsid.raw()))->is_pure_happens_before();
 
-    LSSet &set = Get(lsid);
+    LSSet set = Get(lsid);
     for (LSSet::const_iterator it = set.begin(); it != set.end(); ++it)
       if (!Lock::LIDtoLock(*it)->is_pure_happens_before())
         return true;
@@ -977,7 +1305,7 @@ class LockSet {
     } else if (lsid.IsSingleton()) {
       return "{" + Lock::ToString(lsid.GetSingleton()) + "}";
     }
-    const LSSet &set = Get(lsid);
+    LSSet set = Get(lsid);
     string res = "{";
     for (LSSet::const_iterator it = set.begin(); it != set.end(); ++it) {
       if (it != set.begin()) res += ", ";
@@ -998,7 +1326,7 @@ class LockSet {
                                            locks_reported->count(lid) == 0);
       locks_reported->insert(lid);
     } else {
-      const LSSet &set = Get(lsid);
+      LSSet set = Get(lsid);
       for (LSSet::const_iterator it = set.begin(); it != set.end(); ++it) {
         LID lid = *it;
         Lock::ReportLockWithOrWithoutContext(lid,
@@ -1013,7 +1341,7 @@ class LockSet {
     if (lsid.IsSingleton()) {
       locks->insert(lsid.GetSingleton());
     } else {
-      const LSSet &set = Get(lsid);
+      LSSet set = Get(lsid);
       for (LSSet::const_iterator it = set.begin(); it != set.end(); ++it) {
         locks->insert(*it);
       }
@@ -1021,12 +1349,12 @@ class LockSet {
   }
 
 
+  static size_t MemoryUsageInBytes() { return table_->n_bytes(); }
+
   static void InitClassMembers() {
-    map_ = new LockSet::Map;
-    vec_ = new LockSet::Vec;
+    table_ = new LockSet::Table;
     ls_add_cache_ = new LSCache;
     ls_rem_cache_ = new LSCache;
-    ls_rem_cache_ = new LSCache;
     ls_intersection_cache_ = new LSIntersectionCache;
   }
 
@@ -1034,72 +1362,60 @@ class LockSet {
   // No instances are allowed.
   LockSet() { }
 
-  typedef DenseMultimap<LID, 3> LSSet;
+  // Lock sets with more than one lock are hash-consed in table_,
+  // the lsid of such a set is -(its id in the table).
+  typedef SetTable<LID> Table;
+  typedef Table::Set LSSet;
 
-  static LSSet &Get(LSID lsid) {
-    ScopedMallocCostCenter cc(__FUNCTION__);
-    int idx = -lsid.raw() - 1;
-    DCHECK(idx >= 0);
-    DCHECK(idx < static_cast<int>(vec_->size()));
-    return (*vec_)[idx];
+  static LSSet Get(LSID lsid) {
+    return table_->Get(-lsid.raw());
   }
 
-  static LSID ComputeId(const LSSet &set) {
-    CHECK(set.size() > 0);
-    if (set.size() == 1) {
+  // 'set' is a sorted array of 'size' locks.
+  static LSID ComputeId(const LID *set, size_t size) {
+    CHECK(size > 0);
+    if (size == 1) {
       // signleton lock set has lsid == lid.
-      return LSID(set.begin()->raw());
+      return LSID(set[0].raw());
     }
-    DCHECK(map_);
-    DCHECK(vec_);
+    DCHECK(table_);
     // multiple locks.
-    ScopedMallocCostCenter cc("LockSet::ComputeId");
-    int32_t *id = &(*map_)[set];
-    if (*id == 0) {
-      vec_->push_back(set);
-      *id = map_->size();
-      if      (set.size() == 2) G_stats->ls_size_2++;
-      else if (set.size() == 3) G_stats->ls_size_3++;
-      else if (set.size() == 4) G_stats->ls_size_4++;
-      else if (set.size() == 5) G_stats->ls_size_5++;
-      else                      G_stats->ls_size_other++;
-      if (*id >= 4096 && ((*id & (*id - 1)) == 0)) {
+    bool is_new;
+    int32_t id = table_->Intern(set, size, &is_new);
+    if (is_new) {
+      ScopedMallocCostCenter cc("LockSet::ComputeId");
+      if      (size == 2) G_stats->ls_size_2++;
+      else if (size == 3) G_stats->ls_size_3++;
+      else if (size == 4) G_stats->ls_size_4++;
+      else if (size == 5) G_stats->ls_size_5++;
+      else                G_stats->ls_size_other++;
+      if (id >= 4096 && ((id & (id - 1)) == 0)) {
         Report("INFO: %d LockSet IDs have been allocated "
                "(2: %ld 3: %ld 4: %ld 5: %ld o: %ld)\n",
-               *id,
+               id,
                G_stats->ls_size_2, G_stats->ls_size_3,
                G_stats->ls_size_4, G_stats->ls_size_5,
                G_stats->ls_size_other
                );
       }
     }
-    return LSID(-*id);
+    return LSID(-id);
   }
 
-  typedef map<LSSet, int32_t> Map;
-  static Map *map_;
-
-  static const char *kLockSetVecAllocCC;
-  typedef vector<LSSet> Vec;
-  static Vec *vec_;
+  static Table *table_;
 
-//  static const int kPrimeSizeOfLsCache = 307;
-//  static const int kPrimeSizeOfLsCache = 499;
-  static const int kPrimeSizeOfLsCache = 1021;
-  typedef IntPairToIntCache<kPrimeSizeOfLsCache> LSCache;
+  // The add/remove caches grow with the working set of lock sets.
+  typedef AdaptiveIntPairToIntCache<1024, 1 << 16> LSCache;
   static LSCache *ls_add_cache_;
   static LSCache *ls_rem_cache_;
-  static LSCache *ls_int_cache_;
+  static const int kPrimeSizeOfLsCache = 1021;
   typedef IntPairToBoolCache<kPrimeSizeOfLsCache> LSIntersectionCache;
   static LSIntersectionCache *ls_intersection_cache_;
 };
 
-LockSet::Map *LockSet::map_;
-LockSet::Vec *LockSet::vec_;
-const char *LockSet::kLockSetVecAllocCC = "kLockSetVecAllocCC";
+LockSet::Table *LockSet::table_;
 LockSet::LSCache *LockSet::ls_add_cache_;
 LockSet::LSCache *LockSet::ls_rem_cache_;
-LockSet::LSCache *LockSet::ls_int_cache_;
 LockSet::LSIntersectionCache *LockSet::ls_intersection_cache_;
 
 
@@ -1204,44 +1520,40 @@ class VTS {
     CHECK(vts_a->ref_count_);
     CHECK(vts_b->ref_count_);
     FixedArray<TS> result_ts(vts_a->size() + vts_b->size());
-    TS *t = result_ts.begin();
-    const TS *a = &vts_a->arr_[0];
-    const TS *b = &vts_b->arr_[0];
-    const TS *a_max = a + vts_a->size();
-    const TS *b_max = b + vts_b->size();
+    size_t size = VtsJoin(kernel_, vts_a->arr_, vts_a->size(),
+                          vts_b->arr_, vts_b->size(), result_ts.begin());
+    VTS *res = VTS::Create(size);
+    for (size_t i = 0; i < res->size(); i++) {
+      res->arr_[i] = result_ts[i];
+    }
+    return res;
+  }
+
+  // The component-wise minimum of two VTSs.
+  // Returns NULL if the VTSs have no threads in common.
+  static VTS *Meet(const VTS *vts_a, const VTS *vts_b) {
+    CHECK(vts_a->ref_count_);
+    CHECK(vts_b->ref_count_);
+    FixedArray<TS> result_ts(min(vts_a->size(), vts_b->size()));
+    size_t size = 0;
+    const TS *a = vts_a->arr_, *a_max = a + vts_a->size();
+    const TS *b = vts_b->arr_, *b_max = b + vts_b->size();
     while (a < a_max && b < b_max) {
       if (a->tid < b->tid) {
-        *t = *a;
         a++;
-        t++;
       } else if (a->tid > b->tid) {
-        *t = *b;
         b++;
-        t++;
       } else {
-        if (a->clk >= b->clk) {
-          *t = *a;
-        } else {
-          *t = *b;
-        }
+        result_ts[size].tid = a->tid;
+        result_ts[size].clk = min(a->clk, b->clk);
+        size++;
         a++;
         b++;
-        t++;
       }
     }
-    while (a < a_max) {
-      *t = *a;
-      a++;
-      t++;
-    }
-    while (b < b_max) {
-      *t = *b;
-      b++;
-      t++;
-    }
-
-    VTS *res = VTS::Create(t - result_ts.begin());
-    for (size_t i = 0; i < res->size(); i++) {
+    if (size == 0) return NULL;
+    VTS *res = VTS::Create(size);
+    for (size_t i = 0; i < size; i++) {
       res->arr_[i] = result_ts[i];
     }
     return res;
@@ -1279,35 +1591,16 @@ class VTS {
     CHECK(vts_a->ref_count_);
     CHECK(vts_b->ref_count_);
     G_stats->n_vts_hb++;
-    const TS *a = &vts_a->arr_[0];
-    const TS *b = &vts_b->arr_[0];
-    const TS *a_max = a + vts_a->size();
-    const TS *b_max = b + vts_b->size();
-    bool a_less_than_b = false;
-    while (a < a_max && b < b_max) {
-      if (a->tid < b->tid) {
-        // a->tid is not present in b.
-        return false;
-      } else if (a->tid > b->tid) {
-        // b->tid is not present in a.
-        a_less_than_b = true;
-        b++;
-      } else {
-        // this tid is present in both VTSs. Compare clocks.
-        if (a->clk > b->clk) return false;
-        if (a->clk < b->clk) a_less_than_b = true;
-        a++;
-        b++;
-      }
-    }
-    if (a < a_max) {
-      // Some tids are present in a and not in b
-      return false;
-    }
-    if (b < b_max) {
-      return true;
-    }
-    return a_less_than_b;
+    return VtsHappensBefore(kernel_, vts_a->arr_, vts_a->size(),
+                            vts_b->arr_, vts_b->size());
+  }
+
+  // Same as HappensBefore(), but may be called w/o the lock
+  // (does not update G_stats).
+  static INLINE bool HappensBeforeUnlocked(const VTS *vts_a,
+                                           const VTS *vts_b) {
+    return VtsHappensBefore(kernel_, vts_a->arr_, vts_a->size_,
+                            vts_b->arr_, vts_b->size_);
   }
 
   size_t size() const {
@@ -1405,6 +1698,7 @@ class VTS {
   }
 
   static void InitClassMembers() {
+    kernel_ = VtsBestKernel();
     hb_cache_ = new HBCache;
     free_lists_ = new FreeList *[kNumberOfFreeLists+1];
     free_lists_[0] = 0;
@@ -1414,6 +1708,15 @@ class VTS {
     }
   }
 
+  // Only the small VTSs, which are allocated from the free lists.
+  static size_t MemoryUsageInBytes() {
+    size_t res = 0;
+    for (size_t i = 1; i <= kNumberOfFreeLists; i++) {
+      res += free_lists_[i]->allocated_bytes();
+    }
+    return res;
+  }
+
   int32_t uniq_id() const { return uniq_id_; }
 
  private:
@@ -1427,10 +1730,7 @@ class VTS {
   }
   ~VTS() {}
 
-  struct TS {
-    int32_t tid;
-    int32_t clk;
-  };
+  typedef VtsEntry TS;
 
 
   // data members
@@ -1449,9 +1749,12 @@ class VTS {
   static const size_t kNumberOfFreeLists = 512;  // Must be power of two.
 //  static const size_t kNumberOfFreeLists = 64; // Must be power of two.
   static FreeList **free_lists_;  // Array of kNumberOfFreeLists elements.
+  // Kernel of Join() and HappensBefore(), see ts_vts_kernels.h.
+  static VtsKernel kernel_;
 };
 
 int32_t VTS::uniq_id_counter_;
+VtsKernel VTS::kernel_;
 VTS::HBCache *VTS::hb_cache_;
 FreeList **VTS::free_lists_;
 
@@ -1723,37 +2026,33 @@ class Segment {
 
   // static methods
 
-  static INLINE uintptr_t *embedded_stack_trace(SID sid) {
-    DCHECK(sid.valid());
-    DCHECK(kSizeOfHistoryStackTrace > 0);
-    size_t chunk_idx = (unsigned)sid.raw() / kChunkSizeForStacks;
-    size_t idx       = (unsigned)sid.raw() % kChunkSizeForStacks;
-    DCHECK(chunk_idx < n_stack_chunks_);
-    DCHECK(all_stacks_[chunk_idx] != NULL);
-    return &all_stacks_[chunk_idx][idx * kSizeOfHistoryStackTrace];
+  // The id of the history stack trace in G_stack_depot.
+  static INLINE uint32_t stack_id(SID sid) {
+    return GetInternal(sid)->stack_id_;
   }
 
-  static void ensure_space_for_stack_trace(SID sid) {
-    ScopedMallocCostCenter malloc_cc(__FUNCTION__);
-    DCHECK(sid.valid());
-    DCHECK(kSizeOfHistoryStackTrace > 0);
-    size_t chunk_idx = (unsigned)sid.raw() / kChunkSizeForStacks;
-    DCHECK(chunk_idx < n_stack_chunks_);
-    if (all_stacks_[chunk_idx])
-      return;
-    for (size_t i = 0; i <= chunk_idx; i++) {
-      if (all_stacks_[i]) continue;
-      all_stacks_[i] = new uintptr_t[
-          kChunkSizeForStacks * kSizeOfHistoryStackTrace];
-      // we don't clear this memory, it will be clreared later lazily.
-      // We also never delete it because it will be used until the very end.
-    }
+  // The segment holds a reference to its stack in G_stack_depot.
+  static INLINE void set_stack_id(SID sid, uint32_t stack_id) {
+    Segment *seg = GetInternal(sid);
+    uint32_t old_stack_id = seg->stack_id_;
+    if (old_stack_id == stack_id) return;
+    G_stack_depot->Ref(stack_id);
+    seg->stack_id_ = stack_id;
+    G_stack_depot->Unref(old_stack_id);
+  }
+
+  // The top PC of the history stack trace, 0 if it is empty.
+  static uintptr_t StackTopPc(SID sid) {
+    size_t size;
+    const uintptr_t *pcs = G_stack_depot->Get(stack_id(sid), &size);
+    return size ? pcs[0] : 0;
   }
 
   static string StackTraceString(SID sid) {
     DCHECK(kSizeOfHistoryStackTrace > 0);
-    return StackTrace::EmbeddedStackTraceToString(
-        embedded_stack_trace(sid), kSizeOfHistoryStackTrace);
+    size_t size;
+    const uintptr_t *pcs = G_stack_depot->Get(stack_id(sid), &size);
+    return StackTrace::EmbeddedStackTraceToString(pcs, size);
   }
 
   // Allocate `n` fresh segments, put SIDs into `fresh_sids`.
@@ -1781,21 +2080,18 @@ class Segment {
     for (; i < n; i++) {
       G_stats->seg_create++;
       CHECK(n_segments_ < kMaxSID);
+      if ((n_segments_ & (kSegmentChunkSize - 1)) == 0) {
+        EnsureSegmentChunk(n_segments_ >> kSegmentChunkSizeBits);
+      }
       Segment *seg = GetSegmentByIndex(n_segments_);
-
-      // This VTS may not be empty due to ForgetAllState().
-      VTS::Unref(seg->vts_);
-      seg->vts_ = 0;
-      seg->seg_ref_count_ = 0;
+      DCHECK(seg->vts_ == NULL);
+      DCHECK(seg->seg_ref_count_ == 0);
 
       if (ProfileSeg(SID(n_segments_))) {
        Printf("Segment: allocated SID %d\n", n_segments_);
       }
 
-      SID sid = fresh_sids[i] = SID(n_segments_);
-      if (kSizeOfHistoryStackTrace > 0) {
-        ensure_space_for_stack_trace(sid);
-      }
+      fresh_sids[i] = SID(n_segments_);
       n_segments_++;
     }
   }
@@ -1815,9 +2111,7 @@ class Segment {
     seg->lsid_[1] = wr_lockset;
     seg->vts_ = vts;
     seg->lock_era_ = g_lock_era;
-    if (kSizeOfHistoryStackTrace) {
-      embedded_stack_trace(sid)[0] = 0;
-    }
+    DCHECK(seg->stack_id_ == 0);
   }
 
   static INLINE SID AddNewSegment(TID tid, VTS *vts,
@@ -1875,7 +2169,10 @@ class Segment {
     DCHECK(sid.raw() < n_segments_);
     if (!seg->vts()) return false;  // Already recycled.
     VTS::Unref(seg->vts_);
+    G_stack_depot->Unref(seg->stack_id_);
+    seg->stack_id_ = 0;
     RecycleOneFreshSid(sid);
+    G_stats->seg_recycle++;
     return true;
   }
 
@@ -1910,9 +2207,37 @@ class Segment {
 
 
   static void ForgetAllState() {
+    for (int32_t i = 1; i < n_segments_; i++) {
+      Segment *seg = GetSegmentByIndex(i);
+      VTS::Unref(seg->vts_);
+      seg->vts_ = NULL;
+      seg->seg_ref_count_ = 0;
+      G_stack_depot->Unref(seg->stack_id_);
+      seg->stack_id_ = 0;
+    }
     n_segments_ = 1;
     reusable_sids_->clear();
-    // vts_'es will be freed in AddNewSegment.
+    ReleaseChunksAbove(1);
+  }
+
+  // Give the chunks which contain only reusable segments back to the OS.
+  // Called after the StateCollector has recycled many segments.
+  static void ReleaseUnusedChunks() {
+    if (reusable_sids_->size() < (size_t)kSegmentChunkSize) return;
+    int32_t old_n_segments = n_segments_;
+    // Drop the reusable SIDs from the top of the range.
+    sort(reusable_sids_->begin(), reusable_sids_->end());
+    while (!reusable_sids_->empty() &&
+           reusable_sids_->back().raw() == n_segments_ - 1) {
+      DCHECK(GetSegmentByIndex(n_segments_ - 1)->vts_ == NULL);
+      reusable_sids_->pop_back();
+      n_segments_--;
+    }
+    // Reuse the low SIDs first, so that the top chunks stay free.
+    reverse(reusable_sids_->begin(), reusable_sids_->end());
+    if (n_segments_ != old_n_segments) {
+      ReleaseChunksAbove(n_segments_);
+    }
   }
 
   static string ToString(SID sid) {
@@ -1961,7 +2286,32 @@ class Segment {
     return res;
   }
 
+  // Same as HappensBefore(), but may be called w/o the lock.
+  static bool INLINE HappensBeforeUnlocked(SID a, SID b) {
+    DCHECK(a != b);
+    return VTS::HappensBeforeUnlocked(Get(a)->vts(), Get(b)->vts());
+  }
+
+  // Whether the segment happens-before the given VTS, see StateCollector.
+  static bool INLINE HappensBefore(SID a, const VTS *vts_b) {
+    return VTS::HappensBeforeCached(Get(a)->vts(), vts_b);
+  }
+
   static int32_t NumberOfSegments() { return n_segments_; }
+  // Excluding the recycled segments which are ready to be reused.
+  static int32_t NumberOfLiveSegments() {
+    return n_segments_ - reusable_sids_->size();
+  }
+
+  static size_t MemoryUsageInBytes() {
+    size_t res = 0;
+    for (size_t i = 0; i < n_segment_chunks_; i++) {
+      if (segment_chunks_[i]) {
+        res += kSegmentChunkSize * sizeof(Segment);
+      }
+    }
+    return res;
+  }
 
   static void ShowSegmentStats() {
     Printf("Segment::ShowSegmentStats:\n");
@@ -1984,36 +2334,50 @@ class Segment {
     if (G_flags->keep_history == 0)
       kSizeOfHistoryStackTrace = 0;
     if (G_flags->verbosity >= 0) {
-      Report("INFO: Allocating %ldMb (%ld * %ldM) for Segments.\n",
-          (sizeof(Segment) * kMaxSID) >> 20,
-          sizeof(Segment), kMaxSID >> 20);
-      if (kSizeOfHistoryStackTrace) {
-        Report("INFO: Will allocate up to %ldMb for 'previous' stack traces.\n",
-            (kSizeOfHistoryStackTrace * sizeof(uintptr_t) * kMaxSID) >> 20);
-      }
+      Report("INFO: Segments are allocated on demand, %ldKb (%d * %ld bytes) "
+             "at a time, up to %d segments.\n",
+             (long)((kSegmentChunkSize * sizeof(Segment)) >> 10),
+             kSegmentChunkSize, (long)sizeof(Segment), kMaxSID);
     }
 
-    all_segments_  = new Segment[kMaxSID];
-    // initialization all segments to 0.
-    memset(all_segments_, 0, kMaxSID * sizeof(Segment));
-    // initialize all_segments_[0] with garbage
-    memset(all_segments_, -1, sizeof(Segment));
+    n_segment_chunks_ = ((size_t)kMaxSID + kSegmentChunkSize - 1) /
+        kSegmentChunkSize;
+    segment_chunks_ = new Segment*[n_segment_chunks_];
+    memset(segment_chunks_, 0, sizeof(Segment*) * n_segment_chunks_);
+    EnsureSegmentChunk(0);
+    // initialize the segment 0 with garbage
+    memset(GetSegmentByIndex(0), -1, sizeof(Segment));
 
-    if (kSizeOfHistoryStackTrace > 0) {
-      n_stack_chunks_ = kMaxSID / kChunkSizeForStacks;
-      if (n_stack_chunks_ * kChunkSizeForStacks < (size_t)kMaxSID)
-        n_stack_chunks_++;
-      all_stacks_ = new uintptr_t*[n_stack_chunks_];
-      memset(all_stacks_, 0, sizeof(uintptr_t*) * n_stack_chunks_);
-    }
     n_segments_    = 1;
     reusable_sids_ = new vector<SID>;
   }
 
  private:
   static INLINE Segment *GetSegmentByIndex(int32_t index) {
-    return &all_segments_[index];
+    DCHECK(segment_chunks_[index >> kSegmentChunkSizeBits]);
+    return &segment_chunks_[index >> kSegmentChunkSizeBits]
+                           [index & (kSegmentChunkSize - 1)];
+  }
+
+  static void EnsureSegmentChunk(size_t chunk_idx) {
+    ScopedMallocCostCenter malloc_cc(__FUNCTION__);
+    DCHECK(chunk_idx < n_segment_chunks_);
+    if (segment_chunks_[chunk_idx]) return;
+    Segment *chunk = new Segment[kSegmentChunkSize];
+    memset(chunk, 0, kSegmentChunkSize * sizeof(Segment));
+    segment_chunks_[chunk_idx] = chunk;
+  }
+
+  // Delete the chunks which contain only the SIDs >= n_used.
+  // These segments must have been recycled.
+  static void ReleaseChunksAbove(int32_t n_used) {
+    size_t first_free = (n_used + kSegmentChunkSize - 1) / kSegmentChunkSize;
+    for (size_t i = first_free; i < n_segment_chunks_; i++) {
+      delete [] segment_chunks_[i];
+      segment_chunks_[i] = NULL;
+    }
   }
+
   static INLINE Segment *GetInternal(SID sid) {
     DCHECK(sid.valid());
     DCHECK(sid.raw() < INTERNAL_ANNOTATE_UNPROTECTED_READ(n_segments_));
@@ -2026,30 +2390,29 @@ class Segment {
   LSID     lsid_[2];
   TID      tid_;
   uint32_t lock_era_;
+  // The history stack trace is kept in G_stack_depot since most of them
+  // are duplicates.
+  uint32_t stack_id_;
   VTS *vts_;
 
   // static class members.
 
-  // One large array of segments. The size is set by a command line (--max-sid)
+  // The segments are stored in chunks which are allocated on demand.
+  // The max number of segments is set by a command line (--max-sid)
   // and never changes. Once we are out of vacant segments, we flush the state.
-  static Segment *all_segments_;
-  // We store stack traces separately because their size is unknown
-  // at compile time and because they are needed less often.
-  // The stacks are stored as an array of chunks, instead of one array, 
-  // so that for small tests we do not require too much RAM.
-  // We don't use vector<> or another resizable array to avoid expensive 
-  // resizing.
-  enum { kChunkSizeForStacks = TSAN_DEBUG ? 512 : 1 * 1024 * 1024 };
-  static uintptr_t **all_stacks_;
-  static size_t      n_stack_chunks_;
+  // The chunks above the used SIDs are deleted by ForgetAllState()
+  // and ReleaseUnusedChunks().
+  static const int32_t kSegmentChunkSizeBits = TSAN_DEBUG ? 12 : 16;
+  static const int32_t kSegmentChunkSize = 1 << kSegmentChunkSizeBits;
+  static Segment **segment_chunks_;
+  static size_t    n_segment_chunks_;
 
   static int32_t n_segments_;
   static vector<SID> *reusable_sids_;
 };
 
-Segment          *Segment::all_segments_;
-uintptr_t       **Segment::all_stacks_;
-size_t            Segment::n_stack_chunks_;
+Segment         **Segment::segment_chunks_;
+size_t            Segment::n_segment_chunks_;
 int32_t           Segment::n_segments_;
 vector<SID>      *Segment::reusable_sids_;
 
@@ -2061,9 +2424,18 @@ class SegmentSet {
 
   static INLINE SSID AddSegmentToTupleSS(SSID ssid, SID new_sid);
   static INLINE SSID RemoveSegmentFromTupleSS(SSID old_ssid, SID sid_to_remove);
+  // Returns the set of those segments of 'ssid' which do not happen-before
+  // 'vts'. No reference to the result is taken.
+  static SSID RemoveSegmentsBefore(SSID ssid, const VTS *vts);
+
+  // Same as AddSegmentToSS(), but may be called w/o the lock.
+  // A reference to the result is taken if it differs from old_ssid.
+  // Returns an invalid SSID if the result was not computed.
+  static SSID AddSegmentToSSUnlocked(SSID old_ssid, SID new_sid,
+                                     vector<SSID> *dead_ssids);
 
   SSID ComputeSSID() {
-    SSID res = map_->GetIdOrZero(this);
+    SSID res = Lookup(this);
     CHECK_NE(res.raw(), 0);
     return res;
   }
@@ -2078,9 +2450,9 @@ class SegmentSet {
       } else {
         DCHECK(ssid.IsTuple());
         int idx = -ssid.raw()-1;
-        DCHECK(idx < static_cast<int>(vec_->size()));
+        DCHECK(idx < INTERNAL_ANNOTATE_UNPROTECTED_READ(n_segment_sets_));
         DCHECK(idx >= 0);
-        SegmentSet *res = (*vec_)[idx];
+        SegmentSet *res = GetByIndex(idx);
         DCHECK(res);
         DCHECK(res->ref_count_ >= 0);
         res->Validate(line);
@@ -2098,22 +2470,22 @@ class SegmentSet {
     DCHECK(ssid.valid());
     DCHECK(!ssid.IsSingleton());
     int idx = -ssid.raw()-1;
-    ANNOTATE_IGNORE_READS_BEGIN();
-    DCHECK(idx < static_cast<int>(vec_->size()) && idx >= 0);
-    ANNOTATE_IGNORE_READS_END();
-    SegmentSet *res = (*vec_)[idx];
+    DCHECK(idx < INTERNAL_ANNOTATE_UNPROTECTED_READ(n_segment_sets_) &&
+           idx >= 0);
+    SegmentSet *res = GetByIndex(idx);
     DCHECK(res);
     DCHECK(res->size() >= 2);
     return res;
   }
 
+  // The caller has changed ref_count_ from 0 to -1.
   void RecycleOneSegmentSet(SSID ssid) {
-    DCHECK(ref_count_ == 0);
+    DCHECK(ref_count_ == -1);
     DCHECK(ssid.valid());
     DCHECK(!ssid.IsSingleton());
     int idx = -ssid.raw()-1;
-    DCHECK(idx < static_cast<int>(vec_->size()) && idx >= 0);
-    CHECK((*vec_)[idx] == this);
+    DCHECK(idx < n_segment_sets_ && idx >= 0);
+    CHECK(GetByIndex(idx) == this);
     // Printf("SegmentSet::RecycleOneSegmentSet: %d\n", ssid.raw());
     //
     // Recycle segments
@@ -2122,15 +2494,16 @@ class SegmentSet {
       if (sid.raw() == 0) break;
       Segment::Unref(sid, "SegmentSet::Recycle");
     }
-    ref_count_ = -1;
 
-    map_->Erase(this);
+    Erase(idx);
     ready_to_be_reused_->push_back(ssid);
     G_stats->ss_recycle++;
   }
 
+  // The reference counters are atomic. A set whose counter drops to zero
+  // stays in the table (and may be referenced again) until it is recycled
+  // under the lock, see below; the counter of a recycled set is -1.
   static void INLINE Ref(SSID ssid, const char *where) {
-    AssertTILHeld(); // The reference counting logic below is not thread-safe
     DCHECK(ssid.valid());
     if (ssid.IsSingleton()) {
       Segment::Ref(ssid.GetSingleton(), where);
@@ -2138,59 +2511,75 @@ class SegmentSet {
       SegmentSet *sset = Get(ssid);
       // Printf("SSRef   : %d ref=%d %s\n", ssid.raw(), sset->ref_count_, where);
       DCHECK(sset->ref_count_ >= 0);
-      sset->ref_count_++;
+      AtomicIncrementRefcount(&sset->ref_count_);
     }
   }
 
+  // Decrements the counter of a tuple and returns the new value.
+  // May be called w/o the lock; if the result is zero, the caller should
+  // pass ssid to AddToRecycleQueue() under the lock.
+  static INLINE int32_t UnrefNoRecycle(SSID ssid) {
+    DCHECK(ssid.IsTuple());
+    SegmentSet *sset = Get(ssid);
+    DCHECK(sset->ref_count_ > 0);
+    return AtomicDecrementRefcount(&sset->ref_count_);
+  }
+
   static void INLINE Unref(SSID ssid, const char *where) {
-    AssertTILHeld(); // The reference counting logic below is not thread-safe
+    AssertTILHeld(); // The recycle queue is not thread-safe.
     DCHECK(ssid.valid());
     if (ssid.IsSingleton()) {
       Segment::Unref(ssid.GetSingleton(), where);
     } else {
-      SegmentSet *sset = Get(ssid);
-      // Printf("SSUnref : %d ref=%d %s\n", ssid.raw(), sset->ref_count_, where);
-      DCHECK(sset->ref_count_ > 0);
-      sset->ref_count_--;
-      if (sset->ref_count_ == 0) {
-        // We don't delete unused SSID straightaway due to performance reasons
-        // (to avoid flushing caches too often and because SSID may be reused
-        // again soon)
-        //
-        // Instead, we use two queues (deques):
-        //    ready_to_be_recycled_ and ready_to_be_reused_.
-        // The algorithm is following:
-        // 1) When refcount_ becomes zero, we push the SSID into
-        //    ready_to_be_recycled_.
-        // 2) When ready_to_be_recycled_ becomes too large, we call
-        //    FlushRecycleQueue().
-        //    In FlushRecycleQueue(), we pop the first half of
-        //    ready_to_be_recycled_ and for each popped SSID we do
-        //     * if "refcount_ > 0", do nothing (this SSID is in use again)
-        //     * otherwise, we recycle this SSID (delete its VTS, etc) and push
-        //       it into ready_to_be_reused_
-        // 3) When a new SegmentSet is about to be created, we re-use SSID from
-        //    ready_to_be_reused_ (if available)
-        ready_to_be_recycled_->push_back(ssid);
-        if (UNLIKELY(ready_to_be_recycled_->size() >
-                     2 * G_flags->segment_set_recycle_queue_size)) {
-          FlushRecycleQueue();
-        }
+      // Printf("SSUnref : %d %s\n", ssid.raw(), where);
+      if (UnrefNoRecycle(ssid) == 0) {
+        AddToRecycleQueue(ssid);
       }
     }
   }
 
+  static void AddToRecycleQueue(SSID ssid) {
+    AssertTILHeld();
+    // We don't delete unused SSID straightaway due to performance reasons
+    // (to avoid flushing caches too often and because SSID may be reused
+    // again soon)
+    //
+    // Instead, we use two queues (deques):
+    //    ready_to_be_recycled_ and ready_to_be_reused_.
+    // The algorithm is following:
+    // 1) When refcount_ becomes zero, we push the SSID into
+    //    ready_to_be_recycled_.
+    // 2) When ready_to_be_recycled_ becomes too large, we call
+    //    FlushRecycleQueue().
+    //    In FlushRecycleQueue(), we pop the first half of
+    //    ready_to_be_recycled_ and for each popped SSID we do
+    //     * if "refcount_ > 0", do nothing (this SSID is in use again)
+    //     * otherwise, we recycle this SSID (delete its VTS, etc) and push
+    //       it into ready_to_be_reused_
+    // 3) When a new SegmentSet is about to be created, we re-use SSID from
+    //    ready_to_be_reused_ (if available)
+    ready_to_be_recycled_->push_back(ssid);
+    if (UNLIKELY(ready_to_be_recycled_->size() >
+                 2 * G_flags->segment_set_recycle_queue_size)) {
+      FlushRecycleQueue();
+    }
+  }
+
   static void FlushRecycleQueue() {
-    while (ready_to_be_recycled_->size() >
-        G_flags->segment_set_recycle_queue_size) {
+    FlushRecycleQueue(G_flags->segment_set_recycle_queue_size);
+  }
+
+  // Recycle the oldest SSIDs until at most max_size remain in the queue.
+  static void FlushRecycleQueue(size_t max_size) {
+    while (ready_to_be_recycled_->size() > max_size) {
       SSID rec_ssid = ready_to_be_recycled_->front();
       ready_to_be_recycled_->pop_front();
       int idx = -rec_ssid.raw()-1;
-      SegmentSet *rec_ss = (*vec_)[idx];
+      SegmentSet *rec_ss = GetByIndex(idx);
       DCHECK(rec_ss);
-      DCHECK(rec_ss == Get(rec_ssid));
-      // We should check that this SSID haven't been referenced again.
-      if (rec_ss->ref_count_ == 0) {
+      // We should check that this SSID haven't been referenced again
+      // (maybe concurrently, by AddSegmentToSSUnlocked).
+      if (AtomicCompareAndSwap(&rec_ss->ref_count_, 0, -1)) {
         rec_ss->RecycleOneSegmentSet(rec_ssid);
       }
     }
@@ -2224,12 +2613,18 @@ class SegmentSet {
     remove_segment_cache_->Flush();
   }
 
-  static void ForgetAllState() {
-    for (size_t i = 0; i < vec_->size(); i++) {
-      delete (*vec_)[i];
+  static size_t MemoryUsageInBytes() {
+    size_t res = kNumBuckets * sizeof(buckets_[0]);
+    for (size_t i = 0; i < (size_t)kMaxSID / kChunkSize + 1; i++) {
+      if (chunks_[i]) res += kChunkSize * sizeof(SegmentSet);
     }
-    map_->Clear();
-    vec_->clear();
+    return res;
+  }
+
+  static void ForgetAllState() {
+    // The chunks are kept, their contents is reset in AllocateAndCopy().
+    n_segment_sets_ = 0;
+    memset(buckets_, 0, kNumBuckets * sizeof(buckets_[0]));
     ready_to_be_reused_->clear();
     ready_to_be_recycled_->clear();
     FlushCaches();
@@ -2293,12 +2688,16 @@ class SegmentSet {
 
   void NOINLINE Validate(int line) const;
 
-  static size_t NumberOfSegmentSets() { return vec_->size(); }
+  static size_t NumberOfSegmentSets() { return n_segment_sets_; }
 
 
   static void InitClassMembers() {
-    map_    = new Map;
-    vec_    = new vector<SegmentSet *>;
+    size_t n_chunks = kMaxSID / kChunkSize + 1;
+    chunks_ = new SegmentSet*[n_chunks];
+    memset(chunks_, 0, n_chunks * sizeof(chunks_[0]));
+    n_segment_sets_ = 0;
+    buckets_ = new int32_t[kNumBuckets];
+    memset(buckets_, 0, kNumBuckets * sizeof(buckets_[0]));
     ready_to_be_recycled_ = new deque<SSID>;
     ready_to_be_reused_ = new deque<SSID>;
     add_segment_cache_ = new SsidSidToSidCache;
@@ -2307,7 +2706,7 @@ class SegmentSet {
 
  private:
   SegmentSet()  // Private CTOR
-    : ref_count_(0) {
+    : ref_count_(0), next_(0) {
     // sids_ are filled with zeroes due to SID default CTOR.
     if (TSAN_DEBUG) {
       for (int i = 0; i < kMaxSegmentSetSize; i++)
@@ -2335,32 +2734,33 @@ class SegmentSet {
       res_ssid = ready_to_be_reused_->front();
       ready_to_be_reused_->pop_front();
       int idx = -res_ssid.raw()-1;
-      res_ss = (*vec_)[idx];
+      res_ss = GetByIndex(idx);
       DCHECK(res_ss);
       DCHECK(res_ss->ref_count_ == -1);
       G_stats->ss_reuse++;
-      for (int i = 0; i < kMaxSegmentSetSize; i++) {
-        res_ss->sids_[i] = SID(0);
-      }
     } else {
       // create a new one
       ScopedMallocCostCenter cc("SegmentSet::CreateNewSegmentSet");
       G_stats->ss_create++;
-      res_ss = new SegmentSet;
-      vec_->push_back(res_ss);
-      res_ssid = SSID(-((int32_t)vec_->size()));
+      int32_t idx = AllocateNewIndex();
+      res_ss = GetByIndex(idx);
+      res_ss->ref_count_ = -1;
+      res_ssid = SSID(-(idx + 1));
       CHECK(res_ssid.valid());
     }
     DCHECK(res_ss);
-    res_ss->ref_count_ = 0;
+    // A reused set may still be seen by AddSegmentToSSUnlocked() in
+    // other threads; they ignore it while ref_count_ is -1.
     for (int i = 0; i < kMaxSegmentSetSize; i++) {
-      SID sid = ss->GetSID(i);
-      if (sid.raw() == 0) break;
-      Segment::Ref(sid, "SegmentSet::FindExistingOrAlocateAndCopy");
-      res_ss->SetSID(i, sid);
+      SID sid = ss->sids_[i];
+      if (sid.raw() != 0) {
+        Segment::Ref(sid, "SegmentSet::FindExistingOrAlocateAndCopy");
+      }
+      res_ss->sids_[i] = sid;
     }
+    CHECK(AtomicCompareAndSwap(&res_ss->ref_count_, -1, 0));
     DCHECK(res_ss == Get(res_ssid));
-    map_->Insert(res_ss, res_ssid);
+    Insert(-res_ssid.raw() - 1);
     return res_ssid;
   }
 
@@ -2374,7 +2774,7 @@ class SegmentSet {
     }
 
     // First, check if there is such set already.
-    SSID ssid = map_->GetIdOrZero(ss);
+    SSID ssid = Lookup(ss);
     if (ssid.raw() != 0) {  // Found.
       AssertLive(ssid, __LINE__);
       G_stats->ss_find++;
@@ -2404,114 +2804,158 @@ class SegmentSet {
     return Get(ssid);
   }
 
-  // static data members
-  struct Less {
-    INLINE bool operator() (const SegmentSet *ss1,
-                            const SegmentSet *ss2) const {
-      for (int i = 0; i < kMaxSegmentSetSize; i++) {
-        SID sid1 = ss1->sids_[i],
-            sid2 = ss2->sids_[i];
-        if (sid1 != sid2) return sid1 < sid2;
-      }
-      return false;
-    }
-  };
+  // Computes the SIDs of Get(ssid) + new_sid, see AddSegmentToTupleSS().
+  // Returns 0 if the set does not change, otherwise the new size.
+  static int32_t AddSegmentToSids(SSID ssid, SID new_sid, SID *res_sids,
+                                  bool locked);
 
-  struct SSEq {
-    INLINE bool operator() (const SegmentSet *ss1,
-                            const SegmentSet *ss2) const {
-      G_stats->sseq_calls++;
+  // -------- Storage.
+  // The sets are allocated in chunks which are never freed, so that
+  // GetByIndex() works w/o the lock; idx is -ssid - 1.
+  enum { kChunkSize = 1 << 12 };
 
-      for (int i = 0; i < kMaxSegmentSetSize; i++) {
-        SID sid1 = ss1->sids_[i],
-            sid2 = ss2->sids_[i];
-        if (sid1 != sid2) return false;
-      }
-      return true;
-    }
-  };
+  static INLINE SegmentSet *GetByIndex(int32_t idx) {
+    DCHECK(idx >= 0);
+    return &chunks_[idx / kChunkSize][idx % kChunkSize];
+  }
 
-  struct SSHash {
-    INLINE size_t operator() (const SegmentSet *ss) const {
-      uintptr_t res = 0;
-      uint32_t* sids_array = (uint32_t*)ss->sids_;
-      // We must have even number of SIDs.
-      DCHECK((kMaxSegmentSetSize % 2) == 0);
-
-      G_stats->sshash_calls++;
-      // xor all SIDs together, half of them bswap-ed.
-      for (int i = 0; i < kMaxSegmentSetSize; i += 2) {
-        uintptr_t t1 = sids_array[i];
-        uintptr_t t2 = sids_array[i+1];
-        if (t2) t2 = tsan_bswap(t2);
-        res = res ^ t1 ^ t2;
+  // Returns the index of a set which has never been used since the last
+  // ForgetAllState(). May be called w/o the lock.
+  static int32_t AllocateNewIndex() {
+    int32_t idx = NoBarrier_AtomicIncrement(&n_segment_sets_) - 1;
+    CHECK(idx + 1 < kMaxSID);
+    SegmentSet **chunk = &chunks_[idx / kChunkSize];
+    if (*(SegmentSet *volatile *)chunk == NULL) {
+      SegmentSet *new_chunk = new SegmentSet[kChunkSize];
+      if (!AtomicCompareAndSwap((uintptr_t*)chunk, 0,
+                                (uintptr_t)new_chunk)) {
+        delete [] new_chunk;  // Another thread was faster.
       }
-      return res;
     }
-  };
+    return idx;
+  }
 
-  struct SSTraits {
-    enum {
-      // These values are taken from the hash_compare defaults.
-      bucket_size = 4,  // Must be greater than zero.
-      min_buckets = 8,  // Must be power of 2.
-    };
+  // -------- Interning table.
+  // A hash table with a fixed number of buckets, each bucket is a list of
+  // sets linked through next_. Lists are stored as idx + 1, 0 is the end.
+  // New sets are pushed to the head of a list with a CAS, by AllocateAndCopy()
+  // under the lock or by FindOrCreateAndRefUnlocked() w/o it. Sets are
+  // removed from the lists only under the lock (when they are recycled).
+  //
+  // Threads which do not hold the lock may see a set while it is being
+  // recycled or reused; they ignore sets with ref_count_ == -1 and re-check
+  // the SIDs after taking a reference. Such a thread may also miss a set
+  // and create a duplicate of it, which is harmless: equal sets with
+  // different SSIDs only make the state machine do some extra work.
+  enum { kNumBuckets = 1 << 18 };
 
-    INLINE size_t operator()(const SegmentSet *ss) const {
-      SSHash sshash;
-      return sshash(ss);
-    }
+  static INLINE int32_t LoadNoBarrier(const int32_t *ptr) {
+    return *(const volatile int32_t *)ptr;
+  }
 
-    INLINE bool operator()(const SegmentSet *ss1, const SegmentSet *ss2) const {
-      Less less;
-      return less(ss1, ss2);
+  static INLINE int32_t *Bucket(const SID *sids) {
+    uint32_t hash = 0;
+    for (int i = 0; i < kMaxSegmentSetSize; i++) {
+      hash = (hash ^ (uint32_t)sids[i].raw()) * 0x9e3779b1U;
     }
-  };
-
-  template <class MapType>
-  static SSID GetIdOrZeroFromMap(MapType *map, SegmentSet *ss) {
-    typename MapType::iterator it = map->find(ss);
-    if (it == map->end())
-      return SSID(0);
-    return it->second;
+    hash ^= hash >> 16;
+    return &buckets_[hash & (kNumBuckets - 1)];
   }
 
-  class Map {
-   public:
-    SSID GetIdOrZero(SegmentSet *ss) {
-      return GetIdOrZeroFromMap(&map_, ss);
+  static INLINE bool SameSids(const SID *sids1, const SID *sids2) {
+    for (int i = 0; i < kMaxSegmentSetSize; i++) {
+      if (sids1[i] != sids2[i]) return false;
     }
+    return true;
+  }
 
-    void Insert(SegmentSet *ss, SSID id) {
-      map_[ss] = id;
+  // Under the lock. Returns SSID(0) if there is no such set.
+  static SSID Lookup(const SegmentSet *ss) {
+    G_stats->sshash_calls++;
+    for (int32_t i = LoadNoBarrier(Bucket(ss->sids_)); i != 0;
+         i = LoadNoBarrier(&GetByIndex(i - 1)->next_)) {
+      G_stats->sseq_calls++;
+      if (SameSids(GetByIndex(i - 1)->sids_, ss->sids_))
+        return SSID(-i);
     }
+    return SSID(0);
+  }
 
-    void Erase(SegmentSet *ss) {
-      CHECK(map_.erase(ss));
+  static void Insert(int32_t idx) {
+    SegmentSet *ss = GetByIndex(idx);
+    int32_t *bucket = Bucket(ss->sids_);
+    while (true) {
+      int32_t head = LoadNoBarrier(bucket);
+      ss->next_ = head;
+      if (AtomicCompareAndSwap(bucket, head, idx + 1)) break;
     }
+  }
 
-    void Clear() {
-      map_.clear();
+  // Under the lock.
+  static void Erase(int32_t idx) {
+    SegmentSet *ss = GetByIndex(idx);
+    int32_t *bucket = Bucket(ss->sids_);
+    // Other threads may only push new sets to the head of the list.
+    if (AtomicCompareAndSwap(bucket, idx + 1, ss->next_)) return;
+    for (int32_t i = LoadNoBarrier(bucket); ; ) {
+      CHECK(i != 0);
+      SegmentSet *prev = GetByIndex(i - 1);
+      if (prev->next_ == idx + 1) {
+        prev->next_ = ss->next_;
+        return;
+      }
+      i = prev->next_;
     }
+  }
 
-   private:
-    // TODO(timurrrr): consider making a custom hash_table.
-#if defined(_MSC_VER)
-    typedef stdext::hash_map<SegmentSet*, SSID, SSTraits > MapType__;
-#elif 1
-    typedef unordered_map<SegmentSet*, SSID, SSHash, SSEq > MapType__;
-#else
-    // Old code, may be useful for debugging.
-    typedef map<SegmentSet*, SSID, Less > MapType__;
-#endif
-    MapType__ map_;
-  };
+  // Takes a reference unless the set is being recycled.
+  static INLINE bool TryRef(SegmentSet *ss) {
+    while (true) {
+      int32_t ref_count = LoadNoBarrier(&ss->ref_count_);
+      if (ref_count < 0) return false;
+      if (AtomicCompareAndSwap(&ss->ref_count_, ref_count, ref_count + 1))
+        return true;
+    }
+  }
 
-//  typedef map<SegmentSet*, SSID, Less> Map;
+  // May be called w/o the lock. Returns the SSID of a set equal to 'ss'
+  // with a reference taken, creating the set if needed, or an invalid SSID
+  // if the lookup was not conclusive. If a reference has to be dropped
+  // and the counter becomes zero, the SSID is appended to dead_ssids.
+  static SSID FindOrCreateAndRefUnlocked(const SegmentSet *ss,
+                                         vector<SSID> *dead_ssids) {
+    int32_t *bucket = Bucket(ss->sids_);
+    int n_steps = 0;
+    for (int32_t i = LoadNoBarrier(bucket); i != 0;
+         i = LoadNoBarrier(&GetByIndex(i - 1)->next_)) {
+      // The list may be modified concurrently, don't follow it forever.
+      if (++n_steps > 64) return SSID();
+      SegmentSet *cand = GetByIndex(i - 1);
+      if (!SameSids(cand->sids_, ss->sids_) || !TryRef(cand))
+        continue;
+      // The set could have been reused before we took the reference.
+      if (SameSids(cand->sids_, ss->sids_))
+        return SSID(-i);
+      if (AtomicDecrementRefcount(&cand->ref_count_) == 0)
+        dead_ssids->push_back(SSID(-i));
+    }
+    int32_t idx = AllocateNewIndex();
+    SegmentSet *res = GetByIndex(idx);
+    for (int i = 0; i < kMaxSegmentSetSize; i++) {
+      SID sid = ss->sids_[i];
+      if (sid.raw() != 0) {
+        Segment::Ref(sid, "SegmentSet::FindOrCreateAndRefUnlocked");
+      }
+      res->sids_[i] = sid;
+    }
+    res->ref_count_ = 1;
+    Insert(idx);
+    return SSID(-(idx + 1));
+  }
 
-  static Map                  *map_;
-  // TODO(kcc): use vector<SegmentSet> instead.
-  static vector<SegmentSet *> *vec_;
+  static SegmentSet         **chunks_;
+  static int32_t              n_segment_sets_;
+  static int32_t             *buckets_;
   static deque<SSID>         *ready_to_be_reused_;
   static deque<SSID>         *ready_to_be_recycled_;
 
@@ -2523,10 +2967,12 @@ class SegmentSet {
   // Contains zeros at the end if size < kMaxSegmentSetSize.
   SID     sids_[kMaxSegmentSetSize];
   int32_t ref_count_;
+  int32_t next_;  // Next set in the same bucket, see Insert().
 };
 
-SegmentSet::Map      *SegmentSet::map_;
-vector<SegmentSet *> *SegmentSet::vec_;
+SegmentSet         **SegmentSet::chunks_;
+int32_t              SegmentSet::n_segment_sets_;
+int32_t             *SegmentSet::buckets_;
 deque<SSID>         *SegmentSet::ready_to_be_reused_;
 deque<SSID>         *SegmentSet::ready_to_be_recycled_;
 SegmentSet::SsidSidToSidCache    *SegmentSet::add_segment_cache_;
@@ -2669,8 +3115,39 @@ SSID SegmentSet::RemoveSegmentFromTupleSS(SSID ssid, SID sid_to_remove) {
   return res;
 }
 
+SSID SegmentSet::RemoveSegmentsBefore(SSID ssid, const VTS *vts) {
+  DCHECK(ssid.IsValidOrEmpty());
+  if (ssid.IsEmpty()) return ssid;
+  if (ssid.IsSingleton()) {
+    return Segment::HappensBefore(ssid.GetSingleton(), vts) ? SSID(0) : ssid;
+  }
+  AssertLive(ssid, __LINE__);
+  SegmentSet *ss = Get(ssid);
+
+  int32_t old_size = 0, new_size = 0;
+  SegmentSet tmp;
+  SID * tmp_sids = tmp.sids_;
+
+  for (int i = 0; i < kMaxSegmentSetSize; i++, old_size++) {
+    SID sid = ss->GetSID(i);
+    if (sid.raw() == 0) break;
+    if (Segment::HappensBefore(sid, vts))
+      continue;  // Skip this segment from the result.
+    tmp_sids[new_size++] = sid;
+  }
+
+  if (new_size == old_size) return ssid;
+  if (new_size == 0) return SSID(0);
+  if (new_size == 1) return SSID(tmp_sids[0]);
+
+  if (TSAN_DEBUG) tmp.Validate(__LINE__);
+
+  return FindExistingOrAlocateAndCopy(&tmp);
+}
+
 //  static
-SSID SegmentSet::AddSegmentToTupleSS(SSID ssid, SID new_sid) {
+int32_t SegmentSet::AddSegmentToSids(SSID ssid, SID new_sid, SID *res_sids,
+                                     bool locked) {
   DCHECK(ssid.IsTuple());
   DCHECK(ssid.valid());
   AssertLive(ssid, __LINE__);
@@ -2696,7 +3173,7 @@ SSID SegmentSet::AddSegmentToTupleSS(SSID ssid, SID new_sid) {
     if (sid == new_sid) {
       // we are trying to insert a sid which is already there.
       // SS will not change.
-      return ssid;
+      return 0;
     }
 
     if (tid == new_tid) {
@@ -2706,7 +3183,7 @@ SSID SegmentSet::AddSegmentToTupleSS(SSID ssid, SID new_sid) {
         // Optimization: if a segment with the same VTS and LS
         // as in the current is already inside SS, don't modify the SS.
         // Improves performance with --keep-history >= 1.
-        return ssid;
+        return 0;
       }
       // we have another segment from the same thread => replace it.
       tmp_sids[new_size++] = new_sid;
@@ -2720,8 +3197,9 @@ SSID SegmentSet::AddSegmentToTupleSS(SSID ssid, SID new_sid) {
       inserted_new_sid = true;
     }
 
-    if (!Segment::HappensBefore(sid, new_sid)) {
-      DCHECK(!Segment::HappensBefore(new_sid, sid));
+    if (locked ? !Segment::HappensBefore(sid, new_sid)
+               : !Segment::HappensBeforeUnlocked(sid, new_sid)) {
+      DCHECK(!locked || !Segment::HappensBefore(new_sid, sid));
       tmp_sids[new_size++] = sid;
     }
   }
@@ -2731,10 +3209,6 @@ SSID SegmentSet::AddSegmentToTupleSS(SSID ssid, SID new_sid) {
   }
 
   CHECK_GT(new_size, 0);
-  if (new_size == 1) {
-    return SSID(new_sid.raw());  // Singleton.
-  }
-
   if (new_size > kMaxSegmentSetSize) {
     CHECK(new_size == kMaxSegmentSetSize + 1);
     // we need to forget one segment. Which? The oldest one.
@@ -2761,9 +3235,22 @@ SSID SegmentSet::AddSegmentToTupleSS(SSID ssid, SID new_sid) {
   }
 
   CHECK(new_size <= kMaxSegmentSetSize);
-  SegmentSet tmp;
   for (int i = 0; i < new_size; i++)
-    tmp.sids_[i] = tmp_sids[i];  // TODO(timurrrr): avoid copying?
+    res_sids[i] = tmp_sids[i];
+  return new_size;
+}
+
+//  static
+SSID SegmentSet::AddSegmentToTupleSS(SSID ssid, SID new_sid) {
+  SegmentSet tmp;
+  int32_t new_size = AddSegmentToSids(ssid, new_sid, tmp.sids_,
+                                      /*locked=*/true);
+  if (new_size == 0) {
+    return ssid;
+  }
+  if (new_size == 1) {
+    return SSID(new_sid.raw());  // Singleton.
+  }
   if (TSAN_DEBUG) tmp.Validate(__LINE__);
 
   SSID res = FindExistingOrAlocateAndCopy(&tmp);
@@ -2771,6 +3258,37 @@ SSID SegmentSet::AddSegmentToTupleSS(SSID ssid, SID new_sid) {
   return res;
 }
 
+//  static
+SSID SegmentSet::AddSegmentToSSUnlocked(SSID old_ssid, SID new_sid,
+                                        vector<SSID> *dead_ssids) {
+  DCHECK(old_ssid.valid());
+  DCHECK(new_sid.valid());
+  SegmentSet tmp;
+  if (old_ssid.IsSingleton()) {
+    // The same logic as in AddSegmentToSS().
+    SID old_sid = old_ssid.GetSingleton();
+    if (old_sid == new_sid) return old_ssid;
+    TID old_tid = Segment::Get(old_sid)->tid();
+    TID new_tid = Segment::Get(new_sid)->tid();
+    if (old_tid == new_tid ||
+        Segment::HappensBeforeUnlocked(old_sid, new_sid)) {
+      Segment::Ref(new_sid, "SegmentSet::AddSegmentToSSUnlocked");
+      return SSID(new_sid);
+    }
+    tmp.sids_[0] = old_tid < new_tid ? old_sid : new_sid;
+    tmp.sids_[1] = old_tid < new_tid ? new_sid : old_sid;
+  } else {
+    int32_t new_size = AddSegmentToSids(old_ssid, new_sid, tmp.sids_,
+                                        /*locked=*/false);
+    if (new_size == 0) return old_ssid;
+    if (new_size == 1) {
+      Segment::Ref(new_sid, "SegmentSet::AddSegmentToSSUnlocked");
+      return SSID(new_sid);
+    }
+  }
+  return FindOrCreateAndRefUnlocked(&tmp, dead_ssids);
+}
+
 
 
 void NOINLINE SegmentSet::Validate(int line) const {
@@ -2998,15 +3516,15 @@ class CacheLine {
   static const uintptr_t kLineSizeBits = Mask::kNBitsLog;  // Don't change this.
   static const uintptr_t kLineSize = Mask::kNBits;
 
-  static CacheLine *CreateNewCacheLine(uintptr_t tag) {
+  static CacheLine *CreateNewCacheLine(FreeList *free_list, uintptr_t tag) {
     ScopedMallocCostCenter cc("CreateNewCacheLine");
-    void *mem = free_list_->Allocate();
+    void *mem = free_list->Allocate();
     DCHECK(mem);
     return new (mem) CacheLine(tag);
   }
 
-  static void Delete(CacheLine *line) {
-    free_list_->Deallocate(line);
+  static void Delete(FreeList *free_list, CacheLine *line) {
+    free_list->Deallocate(line);
   }
 
   const Mask &has_shadow_value() const { return has_shadow_value_;  }
@@ -3063,6 +3581,14 @@ class CacheLine {
     return true;
   }
 
+  // Forget the shadow value at 'off' which has become empty.
+  // The granularity is kept.
+  void ClearEmptySvalAtOffset(uintptr_t off) {
+    DCHECK(has_shadow_value().Get(off));
+    DCHECK(GetValuePointer(off)->IsNew());
+    has_shadow_value_.Clear(off);
+  }
+
   INLINE Mask ClearRangeAndReturnOldUsed(uintptr_t from, uintptr_t to) {
     traced_.ClearRange(from, to);
     published_.ClearRange(from, to);
@@ -3240,7 +3766,6 @@ class CacheLine {
     if (TSAN_DEBUG) {
       Printf("sizeof(CacheLine) = %ld\n", sizeof(CacheLine));
     }
-    free_list_ = new FreeList(sizeof(CacheLine), 1024);
   }
 
  private:
@@ -3250,6 +3775,9 @@ class CacheLine {
   }
   ~CacheLine() { }
 
+  template <class Line, class LineMask, class Value, int kMaxRuns>
+  friend class CompressedLine;
+
   uintptr_t tag_;
 
   // data members
@@ -3259,12 +3787,26 @@ class CacheLine {
   Mask published_;
   uint16_t granularity_[kLineSize / 8];
   ShadowValue vals_[kLineSize];
-
-  // static data members.
-  static FreeList *free_list_;
 };
 
-FreeList *CacheLine::free_list_;
+// -------- CompressedCacheLine ------------------ {{{1
+// Used with --compress_cache_lines, see ts_compressed_line.h.
+class CompressedCacheLine
+    : public CompressedLine<CacheLine, Mask, ShadowValue, 4> {
+ public:
+  // Return NULL if 'line' has too many different shadow values in a row.
+  static CompressedCacheLine *Compress(FreeList *free_list, CacheLine *line) {
+    CompressedCacheLine res;
+    if (!res.Encode(*line)) return NULL;
+    void *mem = free_list->Allocate();
+    DCHECK(mem);
+    return new (mem) CompressedCacheLine(res);
+  }
+
+  static void Delete(FreeList *free_list, CompressedCacheLine *line) {
+    free_list->Deallocate(line);
+  }
+};
 
 // If range [a,b) fits into one line, return that line's tag.
 // Else range [a,b) is broken into these ranges:
@@ -3285,13 +3827,335 @@ uintptr_t GetCacheLinesForRange(uintptr_t a, uintptr_t b,
 }
 
 
+// -------- CacheLineStorage ------------------ {{{1
+// Storage for all CacheLines (tag => CacheLine).
+//
+// The storage is split into kNumShards shards, each with its own lock and
+// its own free list of CacheLines. A line with a given tag may reside only in
+// one slot of Cache::lines_, so whoever holds that slot (see
+// Cache::TryAcquireLine) is the only user of the line.
+// The shard lock protects only the shard's table and free list,
+// so the storage may be accessed without ts_lock.
+// With --compress_cache_lines, the lines which are not in Cache::lines_
+// may be kept as CompressedCacheLines; they are expanded when fetched.
+class CacheLineStorage {
+ public:
+  CacheLineStorage() : size_(0), n_compressed_(0) {
+    for (int i = 0; i < kNumShards; i++) {
+      shards_[i].lock = new TSLock;
+      shards_[i].free_list = new FreeList(sizeof(CacheLine), 1024);
+      shards_[i].compressed_free_list =
+          new FreeList(sizeof(CompressedCacheLine), 1024);
+    }
+  }
+
+  // Return the line with the given tag or NULL.
+  CacheLine *Find(uintptr_t tag, ThreadLocalStats *stats) {
+    Shard *shard = GetShard(tag);
+    ScopedLock lock(shard->lock);
+    Map::iterator it = shard->map.find(tag);
+    if (it == shard->map.end()) return NULL;
+    return GetFullLine(shard, tag, &it->second, stats);
+  }
+
+  // Return the line with the given tag, create a new one if there is none.
+  CacheLine *FindOrCreate(uintptr_t tag, bool *created,
+                          ThreadLocalStats *stats) {
+    Shard *shard = GetShard(tag);
+    ScopedLock lock(shard->lock);
+    Entry &entry = shard->map[tag];
+    *created = (entry.line == NULL && entry.compressed == NULL);
+    if (*created) {
+      entry.line = CacheLine::CreateNewCacheLine(shard->free_list, tag);
+      NoBarrier_AtomicIncrement(&size_);
+      return entry.line;
+    }
+    return GetFullLine(shard, tag, &entry, stats);
+  }
+
+  void Delete(CacheLine *line) {
+    Shard *shard = GetShard(line->tag());
+    ScopedLock lock(shard->lock);
+    CHECK(shard->map.erase(line->tag()) == 1);
+    CacheLine::Delete(shard->free_list, line);
+    NoBarrier_AtomicDecrement(&size_);
+  }
+
+  // Replace the line which has just left Cache::lines_ with its compressed
+  // version, if it compresses well. The line must not be used afterwards.
+  void Compress(CacheLine *line, ThreadLocalStats *stats) {
+    Shard *shard = GetShard(line->tag());
+    ScopedLock lock(shard->lock);
+    Entry &entry = shard->map[line->tag()];
+    CHECK(entry.line == line);
+    CompressedCacheLine *compressed =
+        CompressedCacheLine::Compress(shard->compressed_free_list, line);
+    if (compressed == NULL) {
+      stats->cache_compress_fail++;
+      return;
+    }
+    stats->cache_compress++;
+    CacheLine::Delete(shard->free_list, line);
+    entry.line = NULL;
+    entry.compressed = compressed;
+    NoBarrier_AtomicIncrement(&n_compressed_);
+  }
+
+  // If the line with the given tag is stored compressed, pass it to
+  // sweeper->SweepCompressedLine() under the shard lock and return true.
+  // Unlike Find(), the line is not expanded. It is deleted if it
+  // becomes empty.
+  template <class Sweeper>
+  bool SweepIfCompressed(uintptr_t tag, Sweeper *sweeper) {
+    Shard *shard = GetShard(tag);
+    ScopedLock lock(shard->lock);
+    Map::iterator it = shard->map.find(tag);
+    if (it == shard->map.end() || it->second.compressed == NULL) return false;
+    CompressedCacheLine *line = it->second.compressed;
+    sweeper->SweepCompressedLine(line);
+    if (line->Empty()) {
+      CompressedCacheLine::Delete(shard->compressed_free_list, line);
+      shard->map.erase(it);
+      NoBarrier_AtomicDecrement(&size_);
+      NoBarrier_AtomicDecrement(&n_compressed_);
+    }
+    return true;
+  }
+
+  // Get the tags of all lines. The lines may be concurrently used.
+  void GetAllTags(vector<uintptr_t> *tags) {
+    for (int i = 0; i < kNumShards; i++) {
+      Shard *shard = &shards_[i];
+      ScopedLock lock(shard->lock);
+      for (Map::iterator it = shard->map.begin(); it != shard->map.end();
+           ++it) {
+        tags->push_back(it->first);
+      }
+    }
+  }
+
+  // The two functions below may be called only when no other thread
+  // can access the storage (e.g. all cache lines are acquired).
+  void GetAllLines(vector<CacheLine*> *lines,
+                   vector<CompressedCacheLine*> *compressed_lines) {
+    for (int i = 0; i < kNumShards; i++) {
+      Map &map = shards_[i].map;
+      for (Map::iterator it = map.begin(); it != map.end(); ++it) {
+        if (it->second.line) {
+          lines->push_back(it->second.line);
+        } else {
+          compressed_lines->push_back(it->second.compressed);
+        }
+      }
+    }
+  }
+
+  void DeleteAllLines() {
+    for (int i = 0; i < kNumShards; i++) {
+      Shard *shard = &shards_[i];
+      for (Map::iterator it = shard->map.begin(); it != shard->map.end();
+           ++it) {
+        if (it->second.line) {
+          CacheLine::Delete(shard->free_list, it->second.line);
+        } else {
+          CompressedCacheLine::Delete(shard->compressed_free_list,
+                                      it->second.compressed);
+        }
+      }
+      shard->map.clear();
+    }
+    size_ = 0;
+    n_compressed_ = 0;
+  }
+
+  // Exact only if no other thread modifies the storage.
+  size_t size() { return size_; }
+  size_t n_compressed() { return n_compressed_; }
+
+  size_t MemoryUsageInBytes() {
+    size_t res = 0;
+    for (int i = 0; i < kNumShards; i++) {
+      res += shards_[i].free_list->allocated_bytes();
+      res += shards_[i].compressed_free_list->allocated_bytes();
+    }
+    return res;
+  }
+
+ private:
+  static const int kNumShards = 64;
+  static const int kRegionSizeBits = 16;
+
+  // Exactly one of the pointers is non-NULL.
+  struct Entry {
+    Entry() : line(NULL), compressed(NULL) { }
+    CacheLine *line;
+    CompressedCacheLine *compressed;
+  };
+
+  typedef unordered_map<uintptr_t, Entry> Map;
+  struct Shard {
+    TSLock   *lock;
+    FreeList *free_list;
+    FreeList *compressed_free_list;
+    Map       map;
+  };
+
+  // Lines from the same 64K region go to the same shard, so that
+  // they are allocated close to each other.
+  INLINE Shard *GetShard(uintptr_t tag) {
+    return &shards_[(tag >> kRegionSizeBits) % kNumShards];
+  }
+
+  // Expand the compressed line, if any. Called under the shard lock.
+  CacheLine *GetFullLine(Shard *shard, uintptr_t tag, Entry *entry,
+                         ThreadLocalStats *stats) {
+    if (entry->line) return entry->line;
+    DCHECK(entry->compressed);
+    CacheLine *line = CacheLine::CreateNewCacheLine(shard->free_list, tag);
+    entry->compressed->Expand(line);
+    CompressedCacheLine::Delete(shard->compressed_free_list,
+                                entry->compressed);
+    entry->compressed = NULL;
+    entry->line = line;
+    NoBarrier_AtomicDecrement(&n_compressed_);
+    stats->cache_expand++;
+    return line;
+  }
+
+  Shard shards_[kNumShards];
+  int32_t size_;
+  int32_t n_compressed_;
+};
+
+// -------- DirectCacheLineMap ------------------ {{{1
+// Used with --shadow_mapping=direct.
+// Every CacheLine below kMaxAddress has its own slot in a huge table
+// reserved with MAP_NORESERVE, so the slot is computed with a shift and
+// the lines never have to be written back to and fetched from
+// CacheLineStorage. Only the touched pages of the table consume memory.
+// The slots are grouped into chunks; we remember the chunks which have ever
+// been used in order to enumerate all lines.
+// Everything except GetSlot() must be called under ts_lock.
+class DirectCacheLineMap {
+ public:
+  static const uint64_t kMaxAddress = 1ULL << 47;
+  static const uint64_t kNumSlots = kMaxAddress >> CacheLine::kLineSizeBits;
+  // One chunk of slots covers 1M of application memory.
+  static const uintptr_t kChunkSizeBits = 14;
+  static const uintptr_t kChunkSize = 1 << kChunkSizeBits;
+  static const uint64_t kNumChunks = kNumSlots >> kChunkSizeBits;
+
+  // Return NULL if the table can not be reserved on this platform.
+  static DirectCacheLineMap *Create() {
+    if (sizeof(uintptr_t) != sizeof(uint64_t)) return NULL;
+    void *slots = ReserveZeroedMemory(kNumSlots * sizeof(CacheLine*));
+    if (slots == NULL) return NULL;
+    void *chunk_is_used = ReserveZeroedMemory(kNumChunks);
+    if (chunk_is_used == NULL) return NULL;
+    return new DirectCacheLineMap((CacheLine**)slots,
+                                  (uint8_t*)chunk_is_used);
+  }
+
+  INLINE static bool Covers(uintptr_t a) { return a < kMaxAddress; }
+
+  INLINE CacheLine **GetSlot(uintptr_t a) {
+    DCHECK(Covers(a));
+    return &slots_[a >> CacheLine::kLineSizeBits];
+  }
+
+  CacheLine *CreateLine(uintptr_t tag) {
+    uintptr_t chunk = tag >> (CacheLine::kLineSizeBits + kChunkSizeBits);
+    if (!chunk_is_used_[chunk]) {
+      chunk_is_used_[chunk] = 1;
+      used_chunks_.push_back(chunk);
+    }
+    n_lines_++;
+    return CacheLine::CreateNewCacheLine(free_list_, tag);
+  }
+
+  void DeleteLine(CacheLine *line) {
+    DCHECK(n_lines_ > 0);
+    n_lines_--;
+    CacheLine::Delete(free_list_, line);
+  }
+
+  size_t NumUsedChunks() { return used_chunks_.size(); }
+  // The first address covered by the i-th used chunk.
+  uintptr_t UsedChunkBegin(size_t i) {
+    return used_chunks_[i] << (CacheLine::kLineSizeBits + kChunkSizeBits);
+  }
+
+  // Get the lines which are currently in the slots (i.e. not acquired).
+  void GetAllLines(vector<CacheLine*> *lines) {
+    for (size_t i = 0; i < used_chunks_.size(); i++) {
+      CacheLine **chunk_slots = &slots_[used_chunks_[i] << kChunkSizeBits];
+      for (uintptr_t j = 0; j < kChunkSize; j++) {
+        if ((uintptr_t)chunk_slots[j] > 1) {  // Neither NULL nor locked.
+          lines->push_back(chunk_slots[j]);
+        }
+      }
+    }
+  }
+
+  // Get the tags of all lines, including the acquired ones.
+  void GetAllTags(vector<uintptr_t> *tags) {
+    for (size_t i = 0; i < used_chunks_.size(); i++) {
+      uintptr_t beg = UsedChunkBegin(i);
+      CacheLine **chunk_slots = &slots_[used_chunks_[i] << kChunkSizeBits];
+      for (uintptr_t j = 0; j < kChunkSize; j++) {
+        if (chunk_slots[j] != NULL) {
+          tags->push_back(beg + (j << CacheLine::kLineSizeBits));
+        }
+      }
+    }
+  }
+
+  // Empty all slots and return the memory of the table to the OS.
+  // The lines must have been deleted already.
+  void ForgetAllState() {
+    CHECK(n_lines_ == 0);
+    for (size_t i = 0; i < used_chunks_.size(); i++) {
+      ReleaseZeroedMemory(&slots_[used_chunks_[i] << kChunkSizeBits],
+                          kChunkSize * sizeof(CacheLine*));
+      chunk_is_used_[used_chunks_[i]] = 0;
+    }
+    used_chunks_.clear();
+  }
+
+  size_t size() { return n_lines_; }
+
+  // The touched pages of the table are not counted.
+  size_t MemoryUsageInBytes() { return free_list_->allocated_bytes(); }
+
+ private:
+  DirectCacheLineMap(CacheLine **slots, uint8_t *chunk_is_used)
+    : slots_(slots),
+      chunk_is_used_(chunk_is_used),
+      free_list_(new FreeList(sizeof(CacheLine), 1024)),
+      n_lines_(0) {
+  }
+
+  CacheLine **slots_;
+  uint8_t *chunk_is_used_;
+  vector<uintptr_t> used_chunks_;
+  FreeList *free_list_;
+  size_t n_lines_;
+};
+
 // -------- Cache ------------------ {{{1
 class Cache {
  public:
-  Cache() {
+  Cache() : direct_map_(NULL) {
     memset(lines_, 0, sizeof(lines_));
     ANNOTATE_BENIGN_RACE_SIZED(lines_, sizeof(lines_),
                                "Cache::lines_ accessed without a lock");
+    if (G_flags->shadow_mapping == "direct") {
+      direct_map_ = DirectCacheLineMap::Create();
+      if (direct_map_ == NULL) {
+        Report("WARNING: --shadow_mapping=direct is not supported here, "
+               "using --shadow_mapping=cache\n");
+      }
+    }
   }
 
   INLINE static CacheLine *kLineIsLocked() {
@@ -3306,11 +4170,17 @@ class Cache {
     return kLineIsLocked();
   }
 
+  // True if the line for 'a' lives in its own slot of the direct map
+  // rather than in a slot of lines_ shared with other lines.
+  INLINE bool IsDirect(uintptr_t a) {
+    return direct_map_ != NULL && DirectCacheLineMap::Covers(a);
+  }
+
   // Try to get a CacheLine for exclusive use.
   // May return NULL or kLineIsLocked.
   INLINE CacheLine *TryAcquireLine(TSanThread *thr, uintptr_t a, int call_site) {
     uintptr_t cli = ComputeCacheLineIndexInCache(a);
-    CacheLine **addr = &lines_[cli];
+    CacheLine **addr = GetSlot(a);
     CacheLine *res = (CacheLine*)AtomicExchange(
            (uintptr_t*)addr, (uintptr_t)kLineIsLocked());
     if (TSAN_DEBUG && debug_cache) {
@@ -3353,7 +4223,7 @@ class Cache {
         CHECK(iter < max_iter);
       }
     }
-    DCHECK(lines_[ComputeCacheLineIndexInCache(a)] == TidMagic(raw_tid(thr)));
+    DCHECK(*GetSlot(a) == TidMagic(raw_tid(thr)));
     return line;
   }
 
@@ -3364,7 +4234,9 @@ class Cache {
     uintptr_t cli = ComputeCacheLineIndexInCache(a);
     DCHECK(line == NULL ||
            cli == ComputeCacheLineIndexInCache(line->tag()));
-    CacheLine **addr = &lines_[cli];
+    DCHECK(line == NULL || !IsDirect(a) ||
+           line->tag() == CacheLine::ComputeTag(a));
+    CacheLine **addr = GetSlot(a);
     DCHECK(*addr == TidMagic(raw_tid(thr)));
     ReleaseStore((uintptr_t*)addr, (uintptr_t)line);
     ANNOTATE_HAPPENS_BEFORE((void*)cli);
@@ -3380,11 +4252,27 @@ class Cache {
 
   void AcquireAllLines(TSanThread *thr) {
     CHECK(TS_SERIALIZED == 0);
+    // With the direct map, lines_ is used only for the addresses
+    // above DirectCacheLineMap::kMaxAddress.
+    uintptr_t base = direct_map_ ? DirectCacheLineMap::kMaxAddress : 0;
     for (size_t i = 0; i < (size_t)kNumLines; i++) {
-      uintptr_t tag = i << CacheLine::kLineSizeBits;
+      uintptr_t tag = base + (i << CacheLine::kLineSizeBits);
       AcquireLine(thr, tag, __LINE__);
       CHECK(lines_[i] == kLineIsLocked());
     }
+    if (direct_map_) {
+      // A NULL slot of the direct map is never filled w/o ts_lock,
+      // so it is enough to acquire the slots of the used chunks.
+      // The lines we get are remembered, ForgetAllState() will delete them.
+      for (size_t c = 0; c < direct_map_->NumUsedChunks(); c++) {
+        uintptr_t beg = direct_map_->UsedChunkBegin(c);
+        for (uintptr_t i = 0; i < DirectCacheLineMap::kChunkSize; i++) {
+          uintptr_t tag = beg + (i << CacheLine::kLineSizeBits);
+          CacheLine *line = AcquireLine(thr, tag, __LINE__);
+          if (line) acquired_direct_lines_.push_back(line);
+        }
+      }
+    }
   }
 
   // Get a CacheLine. This operation should be performed under a lock
@@ -3400,16 +4288,17 @@ class Cache {
     CacheLine *res = NULL;
     CacheLine *line = NULL;
 
-    if (create_new_if_need == false && lines_[cli] == 0) {
+    if (create_new_if_need == false && *GetSlot(a) == 0) {
       // There is no such line in the cache, nor should it be in the storage.
       // Check that the storage indeed does not have this line.
       // Such DCHECK is racey if tsan is multi-threaded.
-      DCHECK(TS_SERIALIZED == 0 || storage_.count(tag) == 0);
+      DCHECK(TS_SERIALIZED == 0 ||
+             storage_.Find(tag, thread_stats(thr)) == NULL);
       return NULL;
     }
 
     if (TS_SERIALIZED) {
-      line = lines_[cli];
+      line = *GetSlot(a);
     } else {
       line = AcquireLine(thr, tag, call_site);
     }
@@ -3439,20 +4328,72 @@ class Cache {
     return GetLine(thr, a, false, call_site);
   }
 
+  // Get a CacheLine for 'a' when the slot has already been acquired by
+  // TryAcquireLine() and holds 'old_line' (possibly NULL) with a wrong tag.
+  // Unlike GetLine(), this does not require ts_lock: the line for 'a' and
+  // 'old_line' can be touched only by the owner of the slot and the storage
+  // has its own locks.
+  INLINE CacheLine *FetchLineUnlocked(TSanThread *thr, CacheLine *old_line,
+                                      uintptr_t a) {
+    DCHECK(TS_SERIALIZED == 0);
+    DCHECK(!IsDirect(a));
+    DCHECK(old_line == NULL || old_line->tag() != CacheLine::ComputeTag(a));
+    return WriteBackAndFetch(thr, old_line, CacheLine::ComputeTag(a),
+                             ComputeCacheLineIndexInCache(a),
+                             /*create_new_if_need=*/true);
+  }
+
+  // Same as ReleaseLine(), but is called under ts_lock after (a part of)
+  // the line has been cleared. The lines of the direct map are never written
+  // back, so this is where the empty ones get deleted.
+  INLINE void ReleaseClearedLine(TSanThread *thr, uintptr_t a,
+                                 CacheLine *line, int call_site) {
+    if (IsDirect(a) && line->Empty()) {
+      direct_map_->DeleteLine(line);
+      line = NULL;
+      if (TS_SERIALIZED) *GetSlot(a) = NULL;
+    }
+    ReleaseLine(thr, a, line, call_site);
+  }
+
   void ForgetAllState(TSanThread *thr) {
     for (int i = 0; i < kNumLines; i++) {
       if (TS_SERIALIZED == 0) CHECK(LineIsNullOrLocked(lines_[i]));
       lines_[i] = NULL;
     }
     map<uintptr_t, Mask> racey_masks;
-    for (Map::iterator i = storage_.begin(); i != storage_.end(); ++i) {
-      CacheLine *line = i->second;
+    vector<CacheLine*> all_lines;
+    vector<CompressedCacheLine*> compressed_lines;
+    storage_.GetAllLines(&all_lines, &compressed_lines);
+    for (size_t i = 0; i < all_lines.size(); i++) {
+      CacheLine *line = all_lines[i];
+      if (!line->racey().Empty()) {
+        racey_masks[line->tag()] = line->racey();
+      }
+    }
+    for (size_t i = 0; i < compressed_lines.size(); i++) {
+      CompressedCacheLine *line = compressed_lines[i];
       if (!line->racey().Empty()) {
         racey_masks[line->tag()] = line->racey();
       }
-      CacheLine::Delete(line);
     }
-    storage_.clear();
+    storage_.DeleteAllLines();
+    if (direct_map_) {
+      vector<CacheLine*> direct_lines;
+      if (TS_SERIALIZED) {
+        direct_map_->GetAllLines(&direct_lines);
+      } else {
+        direct_lines.swap(acquired_direct_lines_);
+      }
+      for (size_t i = 0; i < direct_lines.size(); i++) {
+        CacheLine *line = direct_lines[i];
+        if (!line->racey().Empty()) {
+          racey_masks[line->tag()] = line->racey();
+        }
+        direct_map_->DeleteLine(line);
+      }
+      direct_map_->ForgetAllState();
+    }
     // Restore the racey masks.
     for (map<uintptr_t, Mask>::iterator it = racey_masks.begin();
          it != racey_masks.end(); it++) {
@@ -3463,12 +4404,41 @@ class Cache {
     }
   }
 
+  size_t MemoryUsageInBytes() {
+    size_t res = storage_.MemoryUsageInBytes();
+    if (direct_map_) {
+      res += direct_map_->MemoryUsageInBytes();
+    }
+    return res;
+  }
+
+  // See CacheLineStorage::SweepIfCompressed(). Must be called under ts_lock.
+  template <class Sweeper>
+  bool SweepIfCompressed(uintptr_t tag, Sweeper *sweeper) {
+    return storage_.SweepIfCompressed(tag, sweeper);
+  }
+
+  // Get the tags of all lines. Must be called under ts_lock,
+  // other threads may still use the lines.
+  void GetAllTags(vector<uintptr_t> *tags) {
+    storage_.GetAllTags(tags);
+    if (direct_map_) {
+      direct_map_->GetAllTags(tags);
+    }
+  }
+
   void PrintStorageStats() {
     if (!G_flags->show_stats) return;
     set<ShadowValue> all_svals;
     map<size_t, int> sizes;
-    for (Map::iterator it = storage_.begin(); it != storage_.end(); ++it) {
-      CacheLine *line = it->second;
+    vector<CacheLine*> all_lines;
+    vector<CompressedCacheLine*> compressed_lines;
+    storage_.GetAllLines(&all_lines, &compressed_lines);
+    if (direct_map_) {
+      direct_map_->GetAllLines(&all_lines);
+    }
+    for (size_t line_idx = 0; line_idx < all_lines.size(); line_idx++) {
+      CacheLine *line = all_lines[line_idx];
       // uintptr_t cli = ComputeCacheLineIndexInCache(line->tag());
       //if (lines_[cli] == line) {
         // this line is in cache -- ignore it.
@@ -3486,12 +4456,31 @@ class Cache {
       if (size > 10) size = 10;
       sizes[size]++;
     }
-    Printf("Storage sizes: %ld\n", storage_.size());
+    for (size_t line_idx = 0; line_idx < compressed_lines.size(); line_idx++) {
+      CompressedCacheLine *line = compressed_lines[line_idx];
+      set<ShadowValue> s;
+      for (int r = 0; r < line->n_runs(); r++) {
+        s.insert(line->run_val(r));
+        all_svals.insert(line->run_val(r));
+      }
+      sizes[s.size()]++;
+    }
+    Printf("Storage sizes: %ld\n",
+           all_lines.size() + compressed_lines.size());
     for (size_t size = 0; size <= CacheLine::kLineSize; size++) {
       if (sizes[size]) {
         Printf("  %ld => %d\n", size, sizes[size]);
       }
     }
+    if (compressed_lines.size()) {
+      size_t n_lines = all_lines.size() + compressed_lines.size();
+      size_t full_bytes = n_lines * sizeof(CacheLine);
+      size_t bytes = all_lines.size() * sizeof(CacheLine) +
+          compressed_lines.size() * sizeof(CompressedCacheLine);
+      Printf("Compressed lines: %ld; storage: %ldK instead of %ldK (%ld%%)\n",
+             compressed_lines.size(), bytes >> 10, full_bytes >> 10,
+             (bytes * 100) / full_bytes);
+    }
     Printf("Different svals: %ld\n", all_svals.size());
     set <SSID> all_ssids;
     for (set<ShadowValue>::iterator it = all_svals.begin(); it != all_svals.end(); ++it) {
@@ -3524,48 +4513,71 @@ class Cache {
     return (addr >> CacheLine::kLineSizeBits) & (kNumLines - 1);
   }
 
+  INLINE CacheLine **GetSlot(uintptr_t addr) {
+    if (IsDirect(addr)) return direct_map_->GetSlot(addr);
+    return &lines_[ComputeCacheLineIndexInCache(addr)];
+  }
+
+  // The direct map counterpart of WriteBackAndFetch():
+  // the slot may only be empty, so we never write back anything.
+  CacheLine *CreateDirectLine(TSanThread *thr, CacheLine *old_line,
+                              uintptr_t tag, bool create_new_if_need) {
+    AssertTILHeld();
+    DCHECK(old_line == NULL);
+    if (!create_new_if_need) return NULL;
+    CacheLine *res = direct_map_->CreateLine(tag);
+    thread_stats(thr)->cache_new_line++;
+    if (TS_SERIALIZED) {
+      *GetSlot(tag) = res;
+    } else {
+      DCHECK(*GetSlot(tag) == TidMagic(raw_tid(thr)));
+    }
+    if (G_stats->cache_max_storage_size < direct_map_->size()) {
+      G_stats->cache_max_storage_size = direct_map_->size();
+    }
+    return res;
+  }
+
+  // Put 'old_line' back to storage and fetch the line for 'tag' from it.
+  // The caller must own the slot 'cli'; ts_lock is not required.
   NOINLINE CacheLine *WriteBackAndFetch(TSanThread *thr, CacheLine *old_line,
                                         uintptr_t tag, uintptr_t cli,
                                         bool create_new_if_need) {
     ScopedMallocCostCenter cc("Cache::WriteBackAndFetch");
+    if (IsDirect(tag)) {
+      return CreateDirectLine(thr, old_line, tag, create_new_if_need);
+    }
     CacheLine *res;
-    size_t old_storage_size = storage_.size();
-    (void)old_storage_size;
-    CacheLine **line_for_this_tag = NULL;
+    bool created = false;
+    DCHECK(old_line != kLineIsLocked());
     if (create_new_if_need) {
-      line_for_this_tag = &storage_[tag];
+      res = storage_.FindOrCreate(tag, &created, thread_stats(thr));
     } else {
-      Map::iterator it = storage_.find(tag);
-      if (it == storage_.end()) {
+      res = storage_.Find(tag, thread_stats(thr));
+      if (res == NULL) {
         if (TSAN_DEBUG && debug_cache) {
           Printf("WriteBackAndFetch: old_line=%ld tag=%lx cli=%ld\n",
                  old_line, tag, cli);
         }
         return NULL;
       }
-      line_for_this_tag = &(it->second);
     }
-    CHECK(line_for_this_tag);
-    DCHECK(old_line != kLineIsLocked());
-    if (*line_for_this_tag == NULL) {
+    CHECK(res);
+    if (created) {
       // creating a new cache line
-      CHECK(storage_.size() == old_storage_size + 1);
-      res = CacheLine::CreateNewCacheLine(tag);
       if (TSAN_DEBUG && debug_cache) {
         Printf("%s %d new line %p cli=%lx\n", __FUNCTION__, __LINE__, res, cli);
       }
-      *line_for_this_tag = res;
-      G_stats->cache_new_line++;
+      thread_stats(thr)->cache_new_line++;
     } else {
       // taking an existing cache line from storage.
-      res = *line_for_this_tag;
       if (TSAN_DEBUG && debug_cache) {
         Printf("%s %d exi line %p tag=%lx old=%p empty=%d cli=%lx\n",
              __FUNCTION__, __LINE__, res, res->tag(), old_line,
              res->Empty(), cli);
       }
       DCHECK(!res->Empty());
-      G_stats->cache_fetch++;
+      thread_stats(thr)->cache_fetch++;
     }
 
     if (TS_SERIALIZED) {
@@ -3580,13 +4592,15 @@ class Cache {
                old_line, old_line->Empty());
       }
       if (old_line->Empty()) {
-        storage_.erase(old_line->tag());
-        CacheLine::Delete(old_line);
-        G_stats->cache_delete_empty_line++;
+        storage_.Delete(old_line);
+        thread_stats(thr)->cache_delete_empty_line++;
       } else {
         if (debug_cache) {
           DebugOnlyCheckCacheLineWhichWeReplace(old_line, res);
         }
+        if (G_flags->compress_cache_lines) {
+          storage_.Compress(old_line, thread_stats(thr));
+        }
       }
     }
     DCHECK(res->tag() == tag);
@@ -3625,8 +4639,12 @@ class Cache {
   CacheLine *lines_[kNumLines];
 
   // tag => CacheLine
-  typedef unordered_map<uintptr_t, CacheLine*> Map;
-  Map storage_;
+  CacheLineStorage storage_;
+
+  // Non-NULL with --shadow_mapping=direct.
+  DirectCacheLineMap *direct_map_;
+  // Filled by AcquireAllLines(), emptied by ForgetAllState().
+  vector<CacheLine*> acquired_direct_lines_;
 };
 
 static  Cache *G_cache;
@@ -3812,6 +4830,7 @@ struct ThreadSanitizerReport {
 };
 
 static bool ThreadSanitizerPrintReport(ThreadSanitizerReport *report);
+static void ThreadSanitizerFlushDeferredReports();
 
 // DATA_RACE.
 struct ThreadSanitizerDataRaceReport : public ThreadSanitizerReport {
@@ -4007,8 +5026,10 @@ struct RecentSegmentsCache {
       // occasions but we don't really care that much.
       if (kSizeOfHistoryStackTrace > 0) {
         size_t n = curr_stack->size();
-        uintptr_t *emb_trace = Segment::embedded_stack_trace(sid);
-        if(*emb_trace &&  // This stack trace was filled
+        size_t emb_size;
+        const uintptr_t *emb_trace =
+            G_stack_depot->Get(Segment::stack_id(sid), &emb_size);
+        if(emb_size >= 3 &&  // This stack trace was filled
            curr_stack->size() >= 3 &&
            emb_trace[0] == (*curr_stack)[n-1] &&
            emb_trace[1] == (*curr_stack)[n-2] &&
@@ -4252,6 +5273,7 @@ struct TSanThread {
       fun_r_ignore_(0),
       min_sp_for_ignore_(0),
       n_mops_since_start_(0),
+      n_calls_since_mem_check_(0),
       creation_context_(creation_context),
       announced_(false),
       rd_lockset_(0),
@@ -4259,6 +5281,7 @@ struct TSanThread {
       expensive_bits_(0),
       vts_at_exit_(NULL),
       call_stack_(call_stack),
+      history_stack_id_(0),
       lock_history_(128),
       recent_segments_cache_(G_flags->recent_segments_cache_size),
       inside_atomic_op_(),
@@ -4282,6 +5305,7 @@ struct TSanThread {
     n_threads_ = max(n_threads_, tid.raw() + 1);
     all_threads_[tid.raw()] = this;
     dead_sids_.reserve(kMaxNumDeadSids);
+    dead_ssids_.reserve(kMaxNumDeadSids);
     fresh_sids_.reserve(kMaxNumFreshSids);
     ComputeExpensiveBits();
   }
@@ -4429,8 +5453,15 @@ struct TSanThread {
     call_stack_ = NULL;
   }
 
+  // The thread is blocked in a join until HandleThreadJoinAfter(),
+  // see ComputeMinimalVts().
+  void HandleThreadJoinBefore(TID joined_tid) {
+    joining_tid_ = joined_tid;
+  }
+
   // Return the TID of the joined child and it's vts
   TID HandleThreadJoinAfter(VTS **vts_at_exit, TID joined_tid) {
+    joining_tid_ = TID();
     CHECK(joined_tid.raw() > 0);
     CHECK(GetIfExists(joined_tid) != NULL);
     TSanThread* joined_thread  = TSanThread::Get(joined_tid);
@@ -4456,6 +5487,53 @@ struct TSanThread {
     return INTERNAL_ANNOTATE_UNPROTECTED_READ(n_threads_);
   }
 
+  // The component-wise minimum of the VTSs of the running threads and of
+  // the threads which are being created. The VTSs only grow and a new thread
+  // starts with a VTS greater than its parent's one, so every future segment
+  // will happen-after a segment which happens-before the result (threads
+  // w/o a parent are the exception, we don't know where they come from).
+  // Returns NULL if there is no common thread in these VTSs.
+  //
+  // A thread blocked in a join will continue with a VTS greater than the
+  // VTS of the joined thread at exit. While the joined thread is running,
+  // its VTS is already in the minimum, so the joining thread is skipped:
+  // otherwise a main thread waiting for its workers would hold the minimum
+  // back until the end.
+  static VTS *ComputeMinimalVts() {
+    AssertTILHeld();
+    VTS *res = NULL;
+    for (int i = 0; i < NumberOfThreads(); i++) {
+      TSanThread *thr = Get(TID(i));
+      if (!thr || !thr->is_running()) continue;
+      TSanThread *joined = thr->joining_tid_.valid() ?
+          GetIfExists(thr->joining_tid_) : NULL;
+      if (joined == NULL) {
+        if (!MeetWith(&res, thr->vts())) return NULL;
+      } else if (!joined->is_running()) {
+        if (!MeetWith(&res, joined->vts_at_exit_)) return NULL;
+      }
+      for (map<TID, ThreadCreateInfo>::iterator it =
+               thr->child_tid_to_create_info_.begin();
+           it != thr->child_tid_to_create_info_.end(); ++it) {
+        if (!MeetWith(&res, it->second.vts)) return NULL;
+      }
+    }
+    return res;
+  }
+
+  // Replace *res (may be NULL) with its meet with 'vts'.
+  // Return false if the result is NULL.
+  static bool MeetWith(VTS **res, VTS *vts) {
+    if (*res == NULL) {
+      *res = vts->Clone();
+      return true;
+    }
+    VTS *meet = VTS::Meet(*res, vts);
+    VTS::Unref(*res);
+    *res = meet;
+    return meet != NULL;
+  }
+
   static TSanThread *GetIfExists(TID tid) {
     if (tid.raw() < NumberOfThreads())
       return Get(tid);
@@ -4692,7 +5770,7 @@ struct TSanThread {
     Segment::Ref(new_sid, "TSanThread::NewSegmentWithoutUnrefingOld");
 
     if (kSizeOfHistoryStackTrace > 0) {
-      FillEmbeddedStackTrace(Segment::embedded_stack_trace(sid()));
+      Segment::set_stack_id(sid(), HistoryStackId());
     }
     if (0)
     Printf("2: %s T%d/S%d old_sid=%d NewSegment: %s\n", call_site,
@@ -4758,7 +5836,7 @@ struct TSanThread {
       }
       if (refill_stack) {
         this->stats.history_reuses_segment++;
-        FillEmbeddedStackTrace(Segment::embedded_stack_trace(sid()));
+        Segment::set_stack_id(sid(), HistoryStackId());
       } else {
         this->stats.history_uses_same_segment++;
       }
@@ -4772,7 +5850,7 @@ struct TSanThread {
       Segment::Ref(fresh_sid, "TSanThread::HandleSblockEnter-1");
       sid_ = fresh_sid;
       recent_segments_cache_.Push(sid());
-      FillEmbeddedStackTrace(Segment::embedded_stack_trace(sid()));
+      Segment::set_stack_id(sid(), HistoryStackId());
       this->stats.history_uses_preallocated_segment++;
     } else {
       if (!allow_slow_path) return false;
@@ -5054,16 +6132,28 @@ struct TSanThread {
     return call_stack_->back();
   }
 
-  INLINE void FillEmbeddedStackTrace(uintptr_t *emb_trace) {
+  // The id of the top of the call stack in G_stack_depot. The stack is
+  // often the same as the previous time (e.g. the next segment is created
+  // in the same function), so it is put to the depot only if it changed.
+  INLINE uint32_t HistoryStackId() {
     size_t size = min(call_stack_->size(), (size_t)kSizeOfHistoryStackTrace);
     size_t idx = call_stack_->size() - 1;
     uintptr_t *pcs = call_stack_->pcs();
-    for (size_t i = 0; i < size; i++, idx--) {
-      emb_trace[i] = pcs[idx];
+    size_t i = 0;
+    if (history_stack_.size() == size) {
+      for (; i < size && history_stack_[i] == pcs[idx]; i++, idx--) { }
+      if (i == size) return history_stack_id_;
+    } else {
+      history_stack_.resize(size);
     }
-    if (size < (size_t) kSizeOfHistoryStackTrace) {
-      emb_trace[size] = 0;
+    for (; i < size; i++, idx--) {
+      history_stack_[i] = pcs[idx];
     }
+    uint32_t old_id = history_stack_id_;
+    history_stack_id_ = G_stack_depot->Put(size ? &history_stack_[0] : NULL,
+                                           size);
+    G_stack_depot->Unref(old_id);
+    return history_stack_id_;
   }
 
   INLINE void FillStackTrace(StackTrace *trace, size_t size) {
@@ -5120,6 +6210,7 @@ struct TSanThread {
         thr->vts_at_exit_ = singleton_vts->Clone();
       }
       thr->dead_sids_.clear();
+      thr->dead_ssids_.clear();
       thr->fresh_sids_.clear();
     }
     signaller_map_->ClearAndDeleteElements();
@@ -5138,9 +6229,9 @@ struct TSanThread {
   }
 
   // --------- dead SIDs, fresh SIDs
-  // When running fast path w/o a lock we need to recycle SIDs to a thread-local
-  // pool. HasRoomForDeadSids and AddDeadSid may be called w/o a lock.
-  // FlushDeadSids should be called under a lock.
+  // When running fast path w/o a lock we need to recycle SIDs (and SSIDs)
+  // to a thread-local pool. HasRoomForDeadSids, AddDeadSid and AddDeadSsid
+  // may be called w/o a lock. FlushDeadSids should be called under a lock.
   // When creating a new segment on SBLOCK_ENTER, we need to get a fresh SID
   // from somewhere. We keep a pile of fresh ready-to-use SIDs in
   // a thread-local array.
@@ -5156,6 +6247,15 @@ struct TSanThread {
     }
   }
 
+  INLINE void AddDeadSsid(SSID ssid) {
+    DCHECK(!TS_SERIALIZED);
+    if (SegmentSet::UnrefNoRecycle(ssid) == 0) {
+      dead_ssids_.push_back(ssid);
+    }
+  }
+
+  vector<SSID> *dead_ssids() { return &dead_ssids_; }
+
   INLINE void FlushDeadSids() {
     if (TS_SERIALIZED) return;
     size_t n = dead_sids_.size();
@@ -5166,11 +6266,18 @@ struct TSanThread {
       Segment::RecycleOneSid(sid);
     }
     dead_sids_.clear();
+    // A dead SSID may have been referenced again since then,
+    // FlushRecycleQueue() will check it.
+    for (size_t i = 0; i < dead_ssids_.size(); i++) {
+      SegmentSet::AddToRecycleQueue(dead_ssids_[i]);
+    }
+    dead_ssids_.clear();
   }
 
   INLINE bool HasRoomForDeadSids() const {
     return TS_SERIALIZED ? false :
-        dead_sids_.size() < kMaxNumDeadSids - 2;
+        dead_sids_.size() < kMaxNumDeadSids - 2 &&
+        dead_ssids_.size() < kMaxNumDeadSids - 2;
   }
 
   void GetSomeFreshSids() {
@@ -5186,6 +6293,13 @@ struct TSanThread {
     Segment::AllocateFreshSegments(n_requested_sids, &fresh_sids_[cur_size]);
   }
 
+  // Returns true once per 'period' calls.
+  bool TimeToCheckMemory(uintptr_t period) {
+    if (++n_calls_since_mem_check_ < period) return false;
+    n_calls_since_mem_check_ = 0;
+    return true;
+  }
+
   void ReleaseFreshSids() {
     for (size_t i = 0; i < fresh_sids_.size(); i++) {
       Segment::RecycleOneFreshSid(fresh_sids_[i]);
@@ -5200,6 +6314,7 @@ struct TSanThread {
   TID    tid_;         // This thread's tid.
   SID    sid_;         // Current segment ID.
   TID    parent_tid_;  // Parent's tid.
+  TID    joining_tid_;  // Valid while blocked in a join of this thread.
   bool   thread_local_copy_of_g_has_expensive_flags_;
   uintptr_t  max_sp_;
   uintptr_t  min_sp_;
@@ -5207,6 +6322,7 @@ struct TSanThread {
   uintptr_t  fun_r_ignore_;  // > 0 if we are inside a fun_r-ed function.
   uintptr_t  min_sp_for_ignore_;
   uintptr_t  n_mops_since_start_;
+  uintptr_t  n_calls_since_mem_check_;
   StackTrace *creation_context_;
   bool      announced_;
 
@@ -5227,7 +6343,12 @@ struct TSanThread {
   CallStack *call_stack_;
 
   vector<SID> dead_sids_;
+  vector<SSID> dead_ssids_;
   vector<SID> fresh_sids_;
+  // The top of the call stack last put to G_stack_depot and its id,
+  // which the thread holds a reference to. See HistoryStackId().
+  vector<uintptr_t> history_stack_;
+  uint32_t history_stack_id_;
 
   PtrToBoolCache<251> ignore_below_cache_;
 
@@ -5272,6 +6393,10 @@ INLINE static int32_t raw_tid(TSanThread *t) {
   return t->tid().raw();
 }
 
+INLINE static ThreadLocalStats *thread_stats(TSanThread *t) {
+  return &t->stats;
+}
+
 // TSanThread:: static members
 TSanThread                    **TSanThread::all_threads_;
 int                         TSanThread::n_threads_;
@@ -5379,7 +6504,7 @@ void INLINE ClearMemoryStateInOneLine(TSanThread *thr, uintptr_t addr,
     }
     Mask old_used = line->ClearRangeAndReturnOldUsed(beg, end);
     UnrefSegmentsInMemoryRange(beg, end, old_used, line);
-    G_cache->ReleaseLine(thr, addr, line, __LINE__);
+    G_cache->ReleaseClearedLine(thr, addr, line, __LINE__);
   }
 }
 
@@ -5456,6 +6581,235 @@ struct ThreadStackInfo {
 
 static HeapMap<ThreadStackInfo> *G_thread_stack_map;
 
+// -------- Memory usage -------- {{{1
+// The memory allocated by ThreadSanitizer's own data structures.
+struct MemoryUsage {
+  size_t shadow;  // Cache lines.
+  size_t segments;  // Including the 'previous' stack traces.
+  size_t segment_sets;
+  size_t lock_sets;
+  size_t vts;
+  size_t stack_traces;
+  size_t heap_map;
+
+  void Compute() {
+    shadow = G_cache->MemoryUsageInBytes();
+    segments = Segment::MemoryUsageInBytes();
+    segment_sets = SegmentSet::MemoryUsageInBytes();
+    lock_sets = LockSet::MemoryUsageInBytes();
+    vts = VTS::MemoryUsageInBytes();
+    stack_traces = g_stack_trace_free_list->MemoryUsageInBytes() +
+        G_stack_depot->MemoryUsageInBytes();
+    heap_map = G_heap_map->MemoryUsageInBytes();
+  }
+
+  size_t Total() const {
+    return shadow + segments + segment_sets + lock_sets + vts + stack_traces +
+        heap_map;
+  }
+
+  string ToString() const {
+    char buff[300];
+    snprintf(buff, sizeof(buff),
+             "shadow: %ldM; segments: %ldM; segment sets: %ldM; "
+             "lock sets: %ldM; VTS: %ldM; stack traces: %ldM; heap map: %ldM",
+             shadow >> 20, segments >> 20, segment_sets >> 20,
+             lock_sets >> 20, vts >> 20, stack_traces >> 20, heap_map >> 20);
+    return buff;
+  }
+};
+
+// -------- Incremental state collection -------- {{{1
+// A segment which happens-before the minimal VTS of all threads
+// (see TSanThread::ComputeMinimalVts) can not race with any future access,
+// so it may be removed from all shadow values; the state machine would
+// remove it anyway on the next access to each location. Once the segment
+// is not referenced by shadow values, its SID is recycled.
+//
+// A collection cycle starts when the number of live segments grows enough
+// (see NextCycleAt()) or when Request()-ed. It remembers the tags of all
+// cache lines and the minimal VTS (the horizon) and then sweeps
+// G_flags->gc_slice_lines lines at a time, one slice per locked event,
+// so that the pauses stay short. Only the segments older than the horizon
+// are collected by a cycle. If the cycles do not free enough SIDs, we still
+// call ForgetAllStateAndStartOver().
+class StateCollector {
+ public:
+  StateCollector()
+    : horizon_(NULL), pos_(0), next_cycle_at_(NextCycleAt(0)),
+      requested_(false) { }
+
+  INLINE bool ShouldDoSlice() {
+    if (horizon_ != NULL) return true;  // A cycle is in progress.
+    if (G_flags->gc_slice_lines <= 0) return false;
+    return requested_ || Segment::NumberOfLiveSegments() > next_cycle_at_;
+  }
+
+  // Start a new cycle soon even if we have enough SIDs.
+  void Request() { requested_ = true; }
+
+  // Same as SweepLine(), but for a line kept in CacheLineStorage
+  // compressed. Called by Cache::SweepIfCompressed().
+  void SweepCompressedLine(CompressedCacheLine *line) {
+    bool has_empty_runs = false;
+    for (int r = 0; r < line->n_runs(); r++) {
+      ShadowValue sval = line->run_val(r);
+      ShadowValue new_sval;
+      new_sval.set(Collect(sval.rd_ssid()), Collect(sval.wr_ssid()));
+      if (new_sval == sval) continue;
+      for (int k = 0; k < line->run_len(r); k++) {
+        new_sval.Ref("StateCollector::SweepCompressedLine");
+        sval.Unref("StateCollector::SweepCompressedLine");
+      }
+      line->set_run_val(r, new_sval);
+      if (new_sval.IsNew()) has_empty_runs = true;
+      G_stats->gc_svals_changed += line->run_len(r);
+    }
+    if (has_empty_runs) line->RemoveEmptyRuns();
+  }
+
+  void DoSlice(TSanThread *thr) {
+    AssertTILHeld();
+    size_t start_time = TimeInMicroSeconds();
+    uintptr_t n_recycled = G_stats->seg_recycle;
+    if (horizon_ == NULL && !StartCycle()) return;
+
+    size_t end = min(tags_.size(), pos_ + G_flags->gc_slice_lines);
+    G_stats->gc_lines += end - pos_;
+    for (; pos_ < end; pos_++) {
+      uintptr_t tag = tags_[pos_];
+      // Fetching a compressed line would expand it, and we are often
+      // here because we are short of memory.
+      if (G_cache->SweepIfCompressed(tag, this)) {
+        G_stats->gc_compressed_lines++;
+        continue;
+      }
+      CacheLine *line = G_cache->GetLineIfExists(thr, tag, __LINE__);
+      if (!line) continue;
+      SweepLine(line);
+      G_cache->ReleaseClearedLine(thr, tag, line, __LINE__);
+    }
+    ClearMemo();
+    if (pos_ == tags_.size()) {
+      FinishCycle();
+    }
+
+    G_stats->gc_slices++;
+    n_recycled = G_stats->seg_recycle - n_recycled;
+    G_stats->gc_collected_per_slice[Stats::Log2Bucket(
+        n_recycled, TS_ARRAY_SIZE(G_stats->gc_collected_per_slice))]++;
+    G_stats->gc_pause_us[Stats::Log2Bucket(
+        TimeInMicroSeconds() - start_time,
+        TS_ARRAY_SIZE(G_stats->gc_pause_us))]++;
+  }
+
+  // Called by ForgetAllStateAndStartOver().
+  void ForgetAllState() {
+    if (horizon_) {
+      VTS::Unref(horizon_);
+      horizon_ = NULL;
+    }
+    vector<uintptr_t>().swap(tags_);
+    pos_ = 0;
+    next_cycle_at_ = NextCycleAt(0);
+    requested_ = false;
+  }
+
+ private:
+  bool StartCycle() {
+    requested_ = false;
+    horizon_ = TSanThread::ComputeMinimalVts();
+    if (horizon_ == NULL) {
+      // Nothing can be collected now.
+      SetNextCycle();
+      return false;
+    }
+    G_cache->GetAllTags(&tags_);
+    pos_ = 0;
+    G_stats->gc_cycles++;
+    return true;
+  }
+
+  void FinishCycle() {
+    // Recycle the sets released in this cycle, with their segments.
+    // Not after every slice, so that the SSIDs are not reused too soon.
+    SegmentSet::FlushRecycleQueue(0);
+    VTS::Unref(horizon_);
+    horizon_ = NULL;
+    vector<uintptr_t>().swap(tags_);
+    pos_ = 0;
+    Segment::ReleaseUnusedChunks();
+    SetNextCycle();
+  }
+
+  void SetNextCycle() {
+    next_cycle_at_ = NextCycleAt(Segment::NumberOfLiveSegments());
+  }
+
+  // The next cycle starts when the number of live segments doubles (but
+  // not before kMinSegmentsForCycle), or when it gets close to
+  // kMaxSIDBeforeFlush. In the latter case, if this cycle has not freed
+  // enough SIDs, we wait until some more segments are created.
+  static int32_t NextCycleAt(int32_t n_live) {
+    int64_t doubled = max((int64_t)n_live * 2, (int64_t)kMinSegmentsForCycle);
+    int64_t close_to_flush = max((kMaxSIDBeforeFlush / 4) * 3,
+                                 n_live + kMaxSIDBeforeFlush / 16);
+    return (int32_t)min(doubled, close_to_flush);
+  }
+
+  static const int32_t kMinSegmentsForCycle = 1 << 21;
+
+  void SweepLine(CacheLine *line) {
+    for (uintptr_t i = 0; i < CacheLine::kLineSize; i++) {
+      if (!line->has_shadow_value().Get(i)) continue;
+      ShadowValue *sval = line->GetValuePointer(i);
+      ShadowValue new_sval;
+      new_sval.set(Collect(sval->rd_ssid()), Collect(sval->wr_ssid()));
+      if (new_sval == *sval) continue;
+      new_sval.Ref("StateCollector::SweepLine");
+      sval->Unref("StateCollector::SweepLine");
+      *sval = new_sval;
+      if (new_sval.IsNew()) line->ClearEmptySvalAtOffset(i);
+      G_stats->gc_svals_changed++;
+    }
+  }
+
+  // Remove the segments older than horizon_ from the set.
+  SSID Collect(SSID ssid) {
+    if (ssid.IsEmpty()) return ssid;
+    Memo::iterator it = memo_.find(ssid.raw());
+    if (it != memo_.end()) return SSID(it->second);
+    SSID res = SegmentSet::RemoveSegmentsBefore(ssid, horizon_);
+    // Both sets are referenced until the end of the slice,
+    // so that they are not recycled and reused while they are in memo_.
+    SegmentSet::Ref(ssid, "StateCollector::Collect");
+    if (!res.IsEmpty()) SegmentSet::Ref(res, "StateCollector::Collect");
+    memo_[ssid.raw()] = res.raw();
+    return res;
+  }
+
+  void ClearMemo() {
+    for (Memo::iterator it = memo_.begin(); it != memo_.end(); ++it) {
+      SegmentSet::Unref(SSID(it->first), "StateCollector::ClearMemo");
+      if (it->second != 0) {
+        SegmentSet::Unref(SSID(it->second), "StateCollector::ClearMemo");
+      }
+    }
+    memo_.clear();
+  }
+
+  typedef unordered_map<int32_t, int32_t> Memo;
+
+  VTS *horizon_;  // Non-NULL while a cycle is in progress.
+  vector<uintptr_t> tags_;  // The lines to sweep in this cycle.
+  size_t pos_;
+  int32_t next_cycle_at_;
+  bool requested_;
+  Memo memo_;  // The results of Collect() in the current slice.
+};
+
+static StateCollector *G_state_collector;
+
 // -------- Forget all state -------- {{{1
 // We need to forget all state and start over because we've
 // run out of some resources (most likely, segment IDs).
@@ -5486,6 +6840,9 @@ static void ForgetAllStateAndStartOver(TSanThread *thr, const char *reason) {
 
   G_stats->n_forgets++;
 
+  // The deferred reports refer to the segments.
+  ThreadSanitizerFlushDeferredReports();
+  G_state_collector->ForgetAllState();
   Segment::ForgetAllState();
   SegmentSet::ForgetAllState();
   TSanThread::ForgetAllState();
@@ -5515,8 +6872,84 @@ static void ForgetAllStateAndStartOver(TSanThread *thr, const char *reason) {
   }
 }
 
+// -------- Memory limit -------- {{{1
+// Shed memory in the order of increasing cost: first drop the recycled
+// segment sets, then collect the old segments, and only then forget
+// everything. Each limit is re-armed 1/16 of --max_mem_in_mb above the
+// current size after it fires: RSS does not shrink much after a flush
+// since malloc keeps the pages. No limit is re-armed above --max_mem_in_mb,
+// and above --max_mem_in_mb we forget everything on every check.
+static void FlushIfOutOfMem(TSanThread *thr) {
+  static int max_mem_size;
+  static int soft_limit;
+  static int collect_limit;
+  static int recycle_limit;
+  const int hard_limit = G_flags->max_mem_in_mb;
+  const int minimal_soft_limit = (hard_limit * 13) / 16;
+  const int print_info_limit   = (hard_limit * 12) / 16;
+  const int minimal_collect_limit = (hard_limit * 11) / 16;
+  const int minimal_recycle_limit = (hard_limit * 10) / 16;
+  const int margin = max(hard_limit / 16, 1);
+
+  CHECK(hard_limit > 0);
+  AssertTILHeld();
+  G_stats->mem_checks++;
+
+#if defined(__linux__) && !defined(TS_VALGRIND)
+  // VmSize includes the address space reserved for the shadow memory.
+  int mem_size_in_mb = GetRssInMb();
+#else
+  int mem_size_in_mb = GetVmSizeInMb();
+#endif
+  if (max_mem_size < mem_size_in_mb) {
+    max_mem_size = mem_size_in_mb;
+    if (max_mem_size > print_info_limit) {
+      MemoryUsage usage;
+      usage.Compute();
+      Report("INFO: ThreadSanitizer's memory: %dM (%s)\n",
+             (int)max_mem_size, usage.ToString().c_str());
+    }
+  }
+
+  if (MemLimitExceeded(mem_size_in_mb, minimal_recycle_limit, margin,
+                       hard_limit, &recycle_limit)) {
+    SegmentSet::FlushRecycleQueue(0);
+    G_stats->mem_recycle_requests++;
+  }
+
+  if (MemLimitExceeded(mem_size_in_mb, minimal_collect_limit, margin,
+                       hard_limit, &collect_limit)) {
+    // Try to free some memory w/o forgetting everything.
+    G_state_collector->Request();
+    G_stats->mem_collect_requests++;
+  }
+
+  bool over_soft_limit = MemLimitExceeded(mem_size_in_mb, minimal_soft_limit,
+                                          margin, hard_limit, &soft_limit);
+  if (over_soft_limit || mem_size_in_mb > hard_limit) {
+    ForgetAllStateAndStartOver(thr,
+        "ThreadSanitizer is running close to its memory limit");
+  }
+}
+
+// Called under the lock on the slow paths, which every front end takes:
+// sync events and new segments. The memory is checked once in
+// kLockedCallsPerMemCheck calls.
+static INLINE void FlushIfOutOfMemLocked(TSanThread *thr) {
+  static const int kLockedCallsPerMemCheck = 1024;
+  static int n_calls_since_mem_check;
+  if (G_flags->max_mem_in_mb <= 0) return;
+  if (++n_calls_since_mem_check < kLockedCallsPerMemCheck) return;
+  n_calls_since_mem_check = 0;
+  FlushIfOutOfMem(thr);
+}
+
 static INLINE void FlushStateIfOutOfSegments(TSanThread *thr) {
-  if (Segment::NumberOfSegments() > kMaxSIDBeforeFlush) {
+  FlushIfOutOfMemLocked(thr);
+  if (UNLIKELY(G_state_collector->ShouldDoSlice())) {
+    G_state_collector->DoSlice(thr);
+  }
+  if (Segment::NumberOfLiveSegments() > kMaxSIDBeforeFlush) {
     // too few sids left -- flush state.
     if (TSAN_DEBUG) {
       G_cache->PrintStorageStats();
@@ -5679,21 +7112,9 @@ class ReportStorage {
                           int size,
                           ShadowValue old_sval, ShadowValue new_sval,
                           bool is_published) {
-    {
-      // Check this isn't a "_ZNSs4_Rep20_S_empty_rep_storageE" report.
-      uintptr_t offset;
-      string symbol_descr;
-      if (GetNameAndOffsetOfGlobalObject(addr, &symbol_descr, &offset)) {
-        if (ThreadSanitizerStringMatch("*empty_rep_storage*", symbol_descr))
-          return false;
-        if (ThreadSanitizerStringMatch("_IO_stdfile_*_lock", symbol_descr))
-          return false;
-        if (ThreadSanitizerStringMatch("_IO_*_stdout_", symbol_descr))
-          return false;
-        if (ThreadSanitizerStringMatch("_IO_*_stderr_", symbol_descr))
-          return false;
-      }
-    }
+    // This needs symbols, so deferred reports are checked when flushed.
+    if (G_flags->defer_reports == 0 && IsIgnoredGlobalObject(addr))
+      return false;
 
     bool is_expected = false;
     ExpectedRace *expected_race = G_expected_races_map->GetInfo(addr);
@@ -5752,7 +7173,6 @@ class ReportStorage {
     race_report->is_expected = is_expected;
     race_report->last_access_is_w = is_w;
     race_report->racey_addr = addr;
-    race_report->racey_addr_description = DescribeMemory(addr);
     race_report->last_access_tid = thr->tid();
     race_report->last_access_sid = thr->sid();
     race_report->last_access_size = size;
@@ -5766,9 +7186,86 @@ class ReportStorage {
     CHECK(thr->lsid(false) == seg->lsid(false));
     CHECK(thr->lsid(true) == seg->lsid(true));
 
+    if (G_flags->defer_reports > 0) {
+      DeferRaceReport(race_report);
+      return true;
+    }
+    race_report->racey_addr_description = DescribeMemory(addr);
     return ThreadSanitizerPrintReport(race_report);
   }
 
+  // Races on these objects are not interesting.
+  bool IsIgnoredGlobalObject(uintptr_t addr) {
+    // Check this isn't a "_ZNSs4_Rep20_S_empty_rep_storageE" report.
+    uintptr_t offset;
+    string symbol_descr;
+    if (GetNameAndOffsetOfGlobalObject(addr, &symbol_descr, &offset)) {
+      if (ThreadSanitizerStringMatch("*empty_rep_storage*", symbol_descr))
+        return true;
+      if (ThreadSanitizerStringMatch("_IO_stdfile_*_lock", symbol_descr))
+        return true;
+      if (ThreadSanitizerStringMatch("_IO_*_stdout_", symbol_descr))
+        return true;
+      if (ThreadSanitizerStringMatch("_IO_*_stderr_", symbol_descr))
+        return true;
+    }
+    return false;
+  }
+
+  // With --defer_reports=N the race reports are not printed right away.
+  // The racing thread only records the raw PCs and the segments involved
+  // (which are referenced until the report is printed, so that they are not
+  // recycled) and the part of the memory description which may change
+  // later. Symbolization, suppression matching and printing happen in
+  // FlushDeferredReports(): when N reports are queued, before all state is
+  // forgotten and at the program end.
+  // Only the data races are deferred, so the other reports may be printed
+  // before the races which happened earlier. The flush is not done in the
+  // background: the thread which queues the N-th report flushes all of them
+  // while holding ts_lock.
+  void DeferRaceReport(ThreadSanitizerDataRaceReport *race) {
+    DeferredRace deferred;
+    deferred.report = race;
+    race->racey_addr_description =
+        DescribeStackMemory(race->racey_addr, &deferred.heap_info);
+    if (deferred.heap_info.ptr) {
+      Segment::Ref(deferred.heap_info.sid, "ReportStorage::DeferRaceReport");
+    }
+    Segment::Ref(race->last_access_sid, "ReportStorage::DeferRaceReport");
+    race->new_sval.Ref("ReportStorage::DeferRaceReport");
+    race->old_sval.Ref("ReportStorage::DeferRaceReport");
+    deferred_races_.push_back(deferred);
+    G_stats->reports_deferred++;
+    if ((intptr_t)deferred_races_.size() >= G_flags->defer_reports) {
+      FlushDeferredReports();
+    }
+  }
+
+  void FlushDeferredReports() {
+    if (deferred_races_.empty()) return;
+    G_stats->deferred_report_flushes++;
+    vector<DeferredRace> races;
+    races.swap(deferred_races_);
+    for (size_t i = 0; i < races.size(); i++) {
+      ThreadSanitizerDataRaceReport *race = races[i].report;
+      HeapInfo heap_info = races[i].heap_info;
+      if (!IsIgnoredGlobalObject(race->racey_addr)) {
+        if (race->racey_addr_description.empty()) {
+          race->racey_addr_description =
+              DescribeNonStackMemory(race->racey_addr, heap_info);
+        }
+        ThreadSanitizerPrintReport(race);
+      }
+      if (heap_info.ptr) {
+        Segment::Unref(heap_info.sid, "ReportStorage::FlushDeferredReports");
+      }
+      Segment::Unref(race->last_access_sid,
+                     "ReportStorage::FlushDeferredReports");
+      race->new_sval.Unref("ReportStorage::FlushDeferredReports");
+      race->old_sval.Unref("ReportStorage::FlushDeferredReports");
+    }
+  }
+
   void AnnounceThreadsInSegmentSet(SSID ssid) {
     if (ssid.IsEmpty()) return;
     for (int s = 0; s < SegmentSet::Size(ssid); s++) {
@@ -5834,6 +7331,8 @@ class ReportStorage {
   }
 
   void SetProgramFinished() {
+    // The deferred reports deserve the full version.
+    FlushDeferredReports();
     CHECK(!program_finished_);
     program_finished_ = true;
   }
@@ -5846,7 +7345,7 @@ class ReportStorage {
     for (set<SID>::iterator it = concurrent_sids.begin();
          it != concurrent_sids.end(); ++it) {
       // Take the first pc of the concurrent stack trace.
-      uintptr_t concurrent_pc = *Segment::embedded_stack_trace(*it);
+      uintptr_t concurrent_pc = Segment::StackTopPc(*it);
       snprintf(buf, 100, ",%p", (void*)concurrent_pc);
       s += buf;
     }
@@ -5962,16 +7461,12 @@ class ReportStorage {
 #endif
   }
 
-  bool PrintReport(ThreadSanitizerReport *report) {
-    CHECK(report);
-    // Check if we have a suppression.
-    vector<string> funcs_mangled;
-    vector<string> funcs_demangled;
-    vector<string> objects;
-
-    CHECK(!g_race_verifier_active);
-    CHECK(report->stack_trace);
-    CHECK(report->stack_trace->size());
+  // Symbolizes the frames of the report's stack trace the way they are
+  // matched against the suppressions.
+  void GetFramesForSuppressions(ThreadSanitizerReport *report,
+                                vector<string> *funcs_mangled,
+                                vector<string> *funcs_demangled,
+                                vector<string> *objects) {
     for (size_t i = 0; i < report->stack_trace->size(); i++) {
       uintptr_t pc = report->stack_trace->Get(i);
       string img, rtn, file;
@@ -5980,20 +7475,51 @@ class ReportStorage {
       if (rtn == "(below main)" || rtn == "ThreadSanitizerStartThread")
         break;
 
-      funcs_mangled.push_back(rtn);
-      funcs_demangled.push_back(NormalizeFunctionName(PcToRtnName(pc, true)));
-      objects.push_back(img);
+      funcs_mangled->push_back(rtn);
+      funcs_demangled->push_back(NormalizeFunctionName(PcToRtnName(pc, true)));
+      objects->push_back(img);
 
       if (rtn == "main")
         break;
     }
+  }
+
+  bool PrintReport(ThreadSanitizerReport *report) {
+    CHECK(report);
+    // Check if we have a suppression.
+    vector<string> funcs_mangled;
+    vector<string> funcs_demangled;
+    vector<string> objects;
+
+    CHECK(!g_race_verifier_active);
+    CHECK(report->stack_trace);
+    CHECK(report->stack_trace->size());
+    // A noisy program reports the same stacks over and over, so each distinct
+    // stack is symbolized and matched against the suppressions only once.
+    // The stack is interned in G_stack_depot, so the key has no collisions.
+    // The cache holds a reference to the stack, so the id is not reused.
+    uint32_t stack_id = G_stack_depot->Put(report->stack_trace->pcs(),
+                                           report->stack_trace->size());
+    uint64_t cache_key = ((uint64_t)stack_id << 8) | report->type;
+    SuppressionCache::iterator cached = suppression_cache_.find(cache_key);
     string suppression_name;
-    if (suppressions_.StackTraceSuppressed("ThreadSanitizer",
-                                           report->ReportName(),
-                                           funcs_mangled,
-                                           funcs_demangled,
-                                           objects,
-                                           &suppression_name)) {
+    if (cached != suppression_cache_.end()) {
+      G_stats->supp_check_hit++;
+      G_stack_depot->Unref(stack_id);
+      suppression_name = cached->second;
+    } else {
+      G_stats->supp_check_miss++;
+      GetFramesForSuppressions(report, &funcs_mangled, &funcs_demangled,
+                               &objects);
+      suppressions_.StackTraceSuppressed("ThreadSanitizer",
+                                         report->ReportName(),
+                                         funcs_mangled,
+                                         funcs_demangled,
+                                         objects,
+                                         &suppression_name);
+      suppression_cache_[cache_key] = suppression_name;
+    }
+    if (!suppression_name.empty()) {
       used_suppressions_[suppression_name]++;
       return false;
     }
@@ -6053,6 +7579,10 @@ class ReportStorage {
 
     // Generate a suppression.
     if (G_flags->generate_suppressions) {
+      if (funcs_mangled.empty()) {
+        GetFramesForSuppressions(report, &funcs_mangled, &funcs_demangled,
+                                 &objects);
+      }
       string supp = "{\n";
       supp += "  <Put your suppression name here>\n";
       supp += string("  ThreadSanitizer:") + report->ReportName() + "\n";
@@ -6089,6 +7619,16 @@ class ReportStorage {
 
 
   string DescribeMemory(uintptr_t a) {
+    HeapInfo heap_info;
+    string res = DescribeStackMemory(a, &heap_info);
+    if (!res.empty()) return res;
+    return DescribeNonStackMemory(a, heap_info);
+  }
+
+  // Describes the memory if it is in a thread's stack. Otherwise copies the
+  // info of the heap block containing it (if any) to heap_info.
+  // Does not symbolize anything.
+  string DescribeStackMemory(uintptr_t a, HeapInfo *heap_info) {
     const int kBufLen = 1023;
     char buff[kBufLen+1];
 
@@ -6111,18 +7651,28 @@ class ReportStorage {
       }
     }
 
-    HeapInfo *heap_info = G_heap_map->GetInfo(a);
-    if (heap_info) {
+    HeapInfo *info = G_heap_map->GetInfo(a);
+    if (info) {
+      *heap_info = *info;
+    }
+    return "";
+  }
+
+  string DescribeNonStackMemory(uintptr_t a, HeapInfo heap_info) {
+    const int kBufLen = 1023;
+    char buff[kBufLen+1];
+
+    if (heap_info.ptr) {
       snprintf(buff, sizeof(buff),
              "  %sLocation %p is %ld bytes inside a block starting at %p"
              " of size %ld allocated by T%d from heap:%s\n",
              c_blue,
              reinterpret_cast<void*>(a),
-             static_cast<long>(a - heap_info->ptr),
-             reinterpret_cast<void*>(heap_info->ptr),
-             static_cast<long>(heap_info->size),
-             heap_info->tid().raw(), c_default);
-      return string(buff) + heap_info->StackTraceString().c_str();
+             static_cast<long>(a - heap_info.ptr),
+             reinterpret_cast<void*>(heap_info.ptr),
+             static_cast<long>(heap_info.size),
+             heap_info.tid().raw(), c_default);
+      return string(buff) + heap_info.StackTraceString().c_str();
     }
 
 
@@ -6183,7 +7733,15 @@ class ReportStorage {
   bool program_finished_;
   ThreadSanitizerSuppressions suppressions_;
   map<string, int> used_suppressions_;
+  // Stack id and report type => the name of the matching suppression or "".
+  typedef unordered_map<uint64_t, string> SuppressionCache;
+  SuppressionCache suppression_cache_;
   ThreadSanitizerUnwindCallback unwind_cb_;
+  struct DeferredRace {
+    ThreadSanitizerDataRaceReport *report;
+    HeapInfo heap_info;  // Copied when deferred, the block may be freed.
+  };
+  vector<DeferredRace> deferred_races_;
 };
 
 // -------- Event Sampling ---------------- {{{1
@@ -6378,6 +7936,7 @@ class Detector {
   }
 
   void HandleProgramEnd() {
+    reports_.FlushDeferredReports();
     FlushExpectedRaces(true);
     // ShowUnfreedHeap();
     EventSampler::ShowSamples();
@@ -6389,34 +7948,6 @@ class Detector {
     // Report("ThreadSanitizerValgrind: exiting\n");
   }
 
-  void FlushIfOutOfMem(TSanThread *thr) {
-    static int max_vm_size;
-    static int soft_limit;
-    const int hard_limit = G_flags->max_mem_in_mb;
-    const int minimal_soft_limit = (hard_limit * 13) / 16;
-    const int print_info_limit   = (hard_limit * 12) / 16;
-
-    CHECK(hard_limit > 0);
-
-    int vm_size_in_mb = GetVmSizeInMb();
-    if (max_vm_size < vm_size_in_mb) {
-      max_vm_size = vm_size_in_mb;
-      if (max_vm_size > print_info_limit) {
-        Report("INFO: ThreadSanitizer's VmSize: %dM\n", (int)max_vm_size);
-      }
-    }
-
-    if (soft_limit == 0) {
-      soft_limit = minimal_soft_limit;
-    }
-
-    if (vm_size_in_mb > soft_limit) {
-      ForgetAllStateAndStartOver(thr,
-          "ThreadSanitizer is running close to its memory limit");
-      soft_limit = vm_size_in_mb + 1;
-    }
-  }
-
   // Force state flushing.
   void FlushState(TID tid) {
     ForgetAllStateAndStartOver(TSanThread::Get(tid), 
@@ -6424,21 +7955,12 @@ class Detector {
   }
 
   void FlushIfNeeded(TSanThread *thr) {
-    // Are we out of segment IDs?
-#if defined(TS_VALGRIND) || (defined(_WIN32) && TS_SERIALIZED == 1)
-    // GetVmSizeInMb() is only available on Valgrind and Win32 anyway.
-
-    static int counter;
-#if TS_SERIALIZED == 1
-    counter++;
-#else
-# error The multi-threaded version of FlushIfNeeded is not implemented.
-#endif
-
     // Are we out of memory?
     if (G_flags->max_mem_in_mb > 0) {
       const int kFreq = 1014 * 32;
-      if ((counter % kFreq) == 0) {  // Don't do it too often.
+      // The counter is per-thread so that the check is cheap
+      // in the multi-threaded version too.
+      if (thr->TimeToCheckMemory(kFreq)) {  // Don't do it too often.
         // TODO(kcc): find a way to check memory limit more frequently.
         TIL til(ts_lock, 7);
         AssertTILHeld();
@@ -6453,7 +7975,6 @@ class Detector {
       TraceInfo::PrintTraceProfile();
     }
 #endif
-#endif
 
 #if 0  // do we still need it? Hope not..
     size_t flush_period = G_flags->flush_period * 1000;  // milliseconds.
@@ -6503,6 +8024,15 @@ class Detector {
       case RTN_EXIT:
         thr->HandleRtnExit();
         return;
+      case FREE: {
+        // HandleFree() ignores the pointers which don't start a heap block
+        // (e.g. NULL), so don't take the lock for them.
+        HeapInfo info;
+        if (!debug_free && (!G_heap_map->GetInfoUnlocked(e->a(), &info) ||
+                            info.ptr != e->a()))
+          return;
+        break;
+      }
       default: break;
     }
 
@@ -6538,6 +8068,8 @@ class Detector {
       case THR_FIRST_INSN:
         HandleThreadFirstInsn(TID(e->tid()));
         break;
+      case THR_JOIN_BEFORE    : thr->HandleThreadJoinBefore(TID(e->a()));
+                                break;
       case THR_JOIN_AFTER     : HandleThreadJoinAfter(e);   break;
       case THR_STACK_TOP      : HandleThreadStackTop(e); break;
 
@@ -7141,6 +8673,32 @@ class Detector {
 #undef MSM_STAT
   }
 
+  // Fast path implementation for a read of memory which has been read
+  // by other threads and has not been written since: {rd, 0} => {rd+cur, 0}.
+  // There is no write to race with, so we only need the new read segment
+  // set, which SegmentSet can find or create w/o the lock.
+  // If this function returns true, the ShadowValue *new_sval is updated
+  // in the same way as MemoryStateMachine() would have done it.
+  INLINE bool MemoryStateMachineConcurrentReads(bool is_w,
+                                                ShadowValue old_sval,
+                                                TSanThread *thr,
+                                                ShadowValue *new_sval) {
+    SSID rd_ssid = old_sval.rd_ssid();
+    if (is_w || rd_ssid.IsEmpty() || !old_sval.wr_ssid().IsEmpty())
+      return false;
+    SSID new_rd_ssid = SegmentSet::AddSegmentToSSUnlocked(
+        rd_ssid, thr->sid(), thr->dead_ssids());
+    if (!new_rd_ssid.valid()) return false;
+    if (new_rd_ssid == rd_ssid) return true;
+    new_sval->set(new_rd_ssid, SSID(0));
+    if (rd_ssid.IsSingleton()) {
+      thr->AddDeadSid(rd_ssid.GetSingleton(), "ConcurrentReads");
+    } else {
+      thr->AddDeadSsid(rd_ssid);
+    }
+    return true;
+  }
+
   // return false if we were not able to complete the task (fast_path_only).
   INLINE bool HandleMemoryAccessHelper(bool is_w,
                                        CacheLine *cache_line,
@@ -7169,7 +8727,11 @@ class Detector {
     if (fast_path_ok) {
       res = true;
     } else if (fast_path_only) {
-      res = false;
+      // Publishing and event sampling need the lock.
+      res = !cache_line->published().Get(offset) &&
+          G_flags->sample_events == 0 &&
+          MemoryStateMachineConcurrentReads(is_w, old_sval, thr, sval_p);
+      if (res) thr->stats.unlocked_concurrent_reads++;
     } else {
       bool is_published = cache_line->published().Get(offset);
       // We check only the first bit for publishing, oh well.
@@ -7487,43 +9049,44 @@ one_call:
       if (thr->HasRoomForDeadSids()) {
         // Acquire a line w/o locks.
         cache_line = G_cache->TryAcquireLine(thr, addr, __LINE__);
-        if (!Cache::LineIsNullOrLocked(cache_line)) {
-          // The line is not empty or locked -- check the tag.
-          if (cache_line->tag() == CacheLine::ComputeTag(addr)) {
-            // The line is ours and non-empty -- fire the fast path.
-            if (thr->HandleSblockEnter(*sblock_pc, /*allow_slow_path=*/false)) {
-              *sblock_pc = 0;  // don't do SblockEnter any more.
-              bool res = HandleAccessGranularityAndExecuteHelper(
-                  cache_line, thr, addr,
-                  mop, has_expensive_flags,
-                  /*fast_path_only=*/true);
-              bool traced = IsTraced(cache_line, addr, has_expensive_flags);
-              // release the line.
-              G_cache->ReleaseLine(thr, addr, cache_line, __LINE__);
-              if (res && has_expensive_flags && traced) {
-                DoTrace(thr, addr, mop, /*need_locking=*/true);
-              }
-              if (res) {
-                INC_STAT(thr->stats.unlocked_access_ok);
-                // fast path succeded, we are done.
-                return false;
-              } else {
-                locked_access_case = 1;
-              }
+        if (cache_line == NULL && G_cache->IsDirect(addr)) {
+          locked_access_case = 4;
+          // The direct map does not have this line yet,
+          // it will be created under the lock.
+          G_cache->ReleaseLine(thr, addr, cache_line, __LINE__);
+        } else if (cache_line != Cache::kLineIsLocked()) {
+          if (cache_line == NULL ||
+              cache_line->tag() != CacheLine::ComputeTag(addr)) {
+            // The slot is ours, but it is empty or the line has a wrong tag.
+            // Bring the right line from the storage, still w/o ts_lock.
+            INC_STAT(thr->stats.unlocked_fetch);
+            cache_line = G_cache->FetchLineUnlocked(thr, cache_line, addr);
+          }
+          // The line is ours -- fire the fast path.
+          if (thr->HandleSblockEnter(*sblock_pc, /*allow_slow_path=*/false)) {
+            *sblock_pc = 0;  // don't do SblockEnter any more.
+            bool res = HandleAccessGranularityAndExecuteHelper(
+                cache_line, thr, addr,
+                mop, has_expensive_flags,
+                /*fast_path_only=*/true);
+            bool traced = IsTraced(cache_line, addr, has_expensive_flags);
+            // release the line.
+            G_cache->ReleaseLine(thr, addr, cache_line, __LINE__);
+            if (res && has_expensive_flags && traced) {
+              DoTrace(thr, addr, mop, /*need_locking=*/true);
+            }
+            if (res) {
+              INC_STAT(thr->stats.unlocked_access_ok);
+              // fast path succeded, we are done.
+              return false;
             } else {
-              // we were not able to handle SblockEnter.
-              G_cache->ReleaseLine(thr, addr, cache_line, __LINE__);
-              locked_access_case = 2;
+              locked_access_case = 1;
             }
           } else {
-            locked_access_case = 3;
-            // The line has a wrong tag.
+            // we were not able to handle SblockEnter.
             G_cache->ReleaseLine(thr, addr, cache_line, __LINE__);
+            locked_access_case = 2;
           }
-        } else if (cache_line == NULL) {
-          locked_access_case = 4;
-          // We grabbed the cache slot but it is empty, release it.
-          G_cache->ReleaseLine(thr, addr, cache_line, __LINE__);
         } else {
           locked_access_case = 5;
         }
@@ -8027,6 +9590,11 @@ static size_t GetMemoryLimitInMb() {
   if (from_proc_self && ret > from_proc_self) {
     ret = from_proc_self;
   }
+  // Try the cgroup (container) limit.
+  size_t from_cgroup = GetMemoryLimitInMbFromCgroup();
+  if (from_cgroup && ret > from_cgroup) {
+    ret = from_cgroup;
+  }
   // Try env.
   const char *from_env_str =
     (const char*)getenv("VALGRIND_MEMORY_LIMIT_IN_MB");
@@ -8142,6 +9710,7 @@ void ThreadSanitizerParseFlags(vector<string> *args) {
 
   FindIntFlag("dry_run", 0, args, &G_flags->dry_run);
   FindBoolFlag("report_races", true, args, &G_flags->report_races);
+  FindIntFlag("defer_reports", 0, args, &G_flags->defer_reports);
   FindIntFlag("locking_scheme", 1, args, &G_flags->locking_scheme);
   FindBoolFlag("unlock_on_mutex_destroy", true, args,
                &G_flags->unlock_on_mutex_destroy);
@@ -8230,9 +9799,10 @@ void ThreadSanitizerParseFlags(vector<string> *args) {
     Printf("Error: max-sid should be at least 100000. Exiting\n");
     exit(1);
   }
-  FindIntFlag("max_sid_before_flush", (kMaxSID * 15) / 16, args, 
+  FindIntFlag("max_sid_before_flush", (kMaxSID / 16) * 15, args,
               &G_flags->max_sid_before_flush);
   kMaxSIDBeforeFlush = G_flags->max_sid_before_flush;
+  FindIntFlag("gc_slice_lines", 1024, args, &G_flags->gc_slice_lines);
 
   FindIntFlag("num_callers_in_history", kSizeOfHistoryStackTrace, args,
               &G_flags->num_callers_in_history);
@@ -8247,6 +9817,17 @@ void ThreadSanitizerParseFlags(vector<string> *args) {
 
   FindIntFlag("num_callers", 16, args, &G_flags->num_callers);
 
+  G_flags->shadow_mapping = "cache";
+  FindStringFlag("shadow_mapping", args, &G_flags->shadow_mapping);
+  if (G_flags->shadow_mapping != "cache" &&
+      G_flags->shadow_mapping != "direct") {
+    Printf("Error: --shadow_mapping should be 'cache' or 'direct'. Exiting\n");
+    exit(1);
+  }
+
+  FindBoolFlag("compress_cache_lines", false, args,
+               &G_flags->compress_cache_lines);
+
   G_flags->max_n_threads        = 100000;
 
   if (G_flags->full_output) {
@@ -8430,6 +10011,9 @@ static void SetupIgnore() {
     string str = ThreadSanitizerReadFileToString(file_name, true);
     ReadIgnoresFromString(str, g_white_lists);
   }
+
+  g_compiled_ignore_lists = new CompiledIgnoreLists(*g_ignore_lists);
+  g_compiled_white_lists = new CompiledIgnoreLists(*g_white_lists);
 }
 
 void ThreadSanitizerSetUnwindCallback(ThreadSanitizerUnwindCallback cb) {
@@ -8451,15 +10035,137 @@ bool ThreadSanitizerIgnoreForNacl(uintptr_t addr) {
   return G_flags->nacl_untrusted != AddrIsInNaclUntrustedRegion(addr);
 }
 
-bool ThreadSanitizerWantToInstrumentSblock(uintptr_t pc) {
+// Caches the answers of the ignore/whitelist checks by PC, since each check
+// symbolizes the PC. The table is lock-free. A slot has a PC and a value;
+// the value holds the answers, two bits per question, and the generation
+// of the answers. Flush() starts a new generation: the code at a PC may
+// change when an image is unloaded and another one is loaded at the same
+// address.
+//
+// A slot with the answers of an older generation may be claimed for another
+// PC: a CAS sets the value to the new generation with kClaimedBit, then the
+// PC is written and the bit is cleared. So the PC of a slot changes only
+// while its value has kClaimedBit, and the generation in the value never
+// goes back. A value which was read before the PC and is unchanged after
+// it belongs to that PC. If all slots on the probe sequence of a PC are
+// taken, the answers for it are not cached.
+class PcDecisionCache {
+ public:
+  enum Question {
+    INSTRUMENT_SBLOCK,
+    CREATE_SEGMENTS_ON_SBLOCK_ENTRY,
+    IGNORE_ACCESSES_BELOW,
+  };
+
+  PcDecisionCache() : generation_(1) {
+    slots_ = new Slot[kNumSlots];
+    memset(slots_, 0, kNumSlots * sizeof(Slot));
+  }
+
+  bool Lookup(uintptr_t pc, Question q, bool *answer) {
+    uintptr_t gen = generation();
+    Slot *slot = FindSlot(pc, gen, false);
+    if (!slot) return false;
+    uintptr_t value = AcquireLoad(&slot->value);
+    if ((value >> kGenerationShift) != gen) return false;
+    if (!(value & KnownBit(q))) return false;
+    // The slot may have been claimed for another PC in the meantime.
+    if (AcquireLoad(&slot->pc) != pc) return false;
+    if (AcquireLoad(&slot->value) != value) return false;
+    *answer = (value & AnswerBit(q)) != 0;
+    return true;
+  }
+
+  void Insert(uintptr_t pc, Question q, bool answer) {
+    uintptr_t gen = generation();
+    Slot *slot = FindSlot(pc, gen, true);
+    if (!slot) return;
+    uintptr_t bits = KnownBit(q) | (answer ? AnswerBit(q) : 0);
+    for (;;) {
+      uintptr_t value = AcquireLoad(&slot->value);
+      // Being claimed for another PC, or our answer is already stale.
+      if (value & kClaimedBit) return;
+      uintptr_t value_gen = value >> kGenerationShift;
+      if (value_gen > gen) return;
+      if (AcquireLoad(&slot->pc) != pc) return;
+      uintptr_t new_value = value_gen == gen
+          ? value | bits
+          : (gen << kGenerationShift) | bits;
+      // If the value is unchanged, so is the PC.
+      if (AtomicCompareAndSwap(&slot->value, value, new_value))
+        return;
+    }
+  }
+
+  // Forget all answers.
+  void Flush() {
+    for (;;) {
+      uintptr_t gen = *(volatile uintptr_t*)&generation_;
+      if (AtomicCompareAndSwap(&generation_, gen, gen + 1))
+        return;
+    }
+  }
+
+ private:
+  struct Slot {
+    uintptr_t pc;  // 0 if free.
+    uintptr_t value;
+  };
+
+  static const size_t kNumSlotsBits = 18;
+  static const size_t kNumSlots = 1 << kNumSlotsBits;
+  static const size_t kMaxProbes = 16;
+  // The answer bits are below, the generation is above.
+  static const size_t kGenerationShift = 8;
+  static const uintptr_t kClaimedBit = 1 << (kGenerationShift - 1);
+
+  static uintptr_t KnownBit(Question q) { return 1 << (2 * q); }
+  static uintptr_t AnswerBit(Question q) { return 2 << (2 * q); }
+
+  uintptr_t generation() {
+    uintptr_t gen = *(volatile uintptr_t*)&generation_;
+    return gen & (~(uintptr_t)0 >> kGenerationShift);
+  }
+
+  Slot *FindSlot(uintptr_t pc, uintptr_t gen, bool create) {
+    if (pc == 0) return NULL;
+    size_t idx = (pc * 0x9E3779B1U) >> (32 - kNumSlotsBits);
+    for (size_t i = 0; i < kMaxProbes; i++) {
+      Slot *slot = &slots_[(idx + i) % kNumSlots];
+      uintptr_t slot_pc = AcquireLoad(&slot->pc);
+      if (slot_pc == pc) return slot;
+      if (!create) {
+        if (slot_pc == 0) return NULL;
+        continue;
+      }
+      // Claim a free slot or a slot with the answers of an older generation.
+      uintptr_t value = AcquireLoad(&slot->value);
+      if ((value & kClaimedBit) || (value >> kGenerationShift) >= gen)
+        continue;
+      uintptr_t claimed = (gen << kGenerationShift) | kClaimedBit;
+      if (!AtomicCompareAndSwap(&slot->value, value, claimed)) continue;
+      ReleaseStore(&slot->pc, pc);
+      ReleaseStore(&slot->value, gen << kGenerationShift);
+      return slot;
+    }
+    return NULL;
+  }
+
+  Slot *slots_;
+  uintptr_t generation_;
+};
+
+static PcDecisionCache *G_pc_decision_cache;
+
+static bool ComputeWantToInstrumentSblock(uintptr_t pc) {
   string img_name, rtn_name, file_name;
   int line_no;
   G_stats->pc_to_strings++;
   PcToStrings(pc, false, &img_name, &rtn_name, &file_name, &line_no);
 
   if (g_white_lists->ignores.size() > 0) {
-    bool in_white_list = TripleVectorMatchKnown(g_white_lists->ignores, 
-                                                rtn_name, img_name, file_name);
+    bool in_white_list = g_compiled_white_lists->ignores.Match(
+        rtn_name, img_name, file_name);
     if (in_white_list) {
       if (debug_ignore) {
         Report("INFO: Whitelisted rtn: %s\n", rtn_name.c_str());
@@ -8476,10 +10182,9 @@ bool ThreadSanitizerWantToInstrumentSblock(uintptr_t pc) {
     return false;
   }
 
-  bool ignore = TripleVectorMatchKnown(g_ignore_lists->ignores,
-                                       rtn_name, img_name, file_name) ||
-                TripleVectorMatchKnown(g_ignore_lists->ignores_r,
-                                       rtn_name, img_name, file_name);
+  bool ignore =
+      g_compiled_ignore_lists->ignores.Match(rtn_name, img_name, file_name) ||
+      g_compiled_ignore_lists->ignores_r.Match(rtn_name, img_name, file_name);
   if (debug_ignore) {
     Printf("%s: pc=%p file_name=%s img_name=%s rtn_name=%s ret=%d\n",
            __FUNCTION__, pc, file_name.c_str(), img_name.c_str(),
@@ -8489,34 +10194,45 @@ bool ThreadSanitizerWantToInstrumentSblock(uintptr_t pc) {
   return !(ignore || nacl_ignore);
 }
 
+void ThreadSanitizerForgetPcDecisions() {
+  G_stats->pc_decision_flushes++;
+  G_pc_decision_cache->Flush();
+}
+
+bool ThreadSanitizerWantToInstrumentSblock(uintptr_t pc) {
+  bool ret;
+  if (G_pc_decision_cache->Lookup(pc, PcDecisionCache::INSTRUMENT_SBLOCK,
+                                  &ret))
+    return ret;
+  ret = ComputeWantToInstrumentSblock(pc);
+  G_pc_decision_cache->Insert(pc, PcDecisionCache::INSTRUMENT_SBLOCK, ret);
+  return ret;
+}
+
 bool ThreadSanitizerWantToCreateSegmentsOnSblockEntry(uintptr_t pc) {
-  string rtn_name;
-  rtn_name = PcToRtnName(pc, false);
   if (G_flags->keep_history == 0)
     return false;
-  return !(TripleVectorMatchKnown(g_ignore_lists->ignores_hist,
-                                  rtn_name, "", ""));
+  bool ret;
+  if (G_pc_decision_cache->Lookup(
+          pc, PcDecisionCache::CREATE_SEGMENTS_ON_SBLOCK_ENTRY, &ret))
+    return ret;
+  string rtn_name = PcToRtnName(pc, false);
+  ret = !g_compiled_ignore_lists->ignores_hist.Match(rtn_name, "", "");
+  G_pc_decision_cache->Insert(
+      pc, PcDecisionCache::CREATE_SEGMENTS_ON_SBLOCK_ENTRY, ret);
+  return ret;
 }
 
 // Returns true if function at "pc" is marked as "fun_r" in the ignore file.
 bool NOINLINE ThreadSanitizerIgnoreAccessesBelowFunction(uintptr_t pc) {
-  ScopedMallocCostCenter cc(__FUNCTION__);
-  typedef unordered_map<uintptr_t, bool> Cache;
-  static Cache *cache = NULL;
-  {
-    TIL ignore_below_lock(ts_ignore_below_lock, 18);
-    if (!cache)
-      cache = new Cache;
-
-    // Fast path - check if we already know the answer.
-    Cache::iterator i = cache->find(pc);
-    if (i != cache->end())
-      return i->second;
-  }
+  bool ret;
+  if (G_pc_decision_cache->Lookup(pc, PcDecisionCache::IGNORE_ACCESSES_BELOW,
+                                  &ret))
+    return ret;
 
+  ScopedMallocCostCenter cc(__FUNCTION__);
   string rtn_name = PcToRtnName(pc, false);
-  bool ret =
-      TripleVectorMatchKnown(g_ignore_lists->ignores_r, rtn_name, "", "");
+  ret = g_compiled_ignore_lists->ignores_r.Match(rtn_name, "", "");
 
   if (TSAN_DEBUG) {
     // Heavy test for NormalizeFunctionName: test on all possible inputs in
@@ -8524,13 +10240,12 @@ bool NOINLINE ThreadSanitizerIgnoreAccessesBelowFunction(uintptr_t pc) {
     NormalizeFunctionName(PcToRtnName(pc, true));
   }
 
-  // Grab the lock again
-  TIL ignore_below_lock(ts_ignore_below_lock, 19);
   if (ret && debug_ignore) {
     Report("INFO: ignoring all accesses below the function '%s' (%p)\n",
            PcToRtnNameAndFilePos(pc).c_str(), pc);
   }
-  return ((*cache)[pc] = ret);
+  G_pc_decision_cache->Insert(pc, PcDecisionCache::IGNORE_ACCESSES_BELOW, ret);
+  return ret;
 }
 
 // We intercept a user function with this name
@@ -8567,7 +10282,7 @@ extern "C" const char *ThreadSanitizerQuery(const char *query) {
 extern void ThreadSanitizerInit() {
   ScopedMallocCostCenter cc("ThreadSanitizerInit");
   ts_lock = new TSLock;
-  ts_ignore_below_lock = new TSLock;
+  G_pc_decision_cache = new PcDecisionCache;
   g_so_far_only_one_thread = true;
   ANNOTATE_BENIGN_RACE(&g_so_far_only_one_thread, "real benign race");
   CHECK_EQ(sizeof(ShadowValue), 8);
@@ -8577,6 +10292,7 @@ extern void ThreadSanitizerInit() {
 
   G_detector     = new Detector;
   G_cache        = new Cache;
+  G_state_collector = new StateCollector;
   G_expected_races_map = new ExpectedRacesMap;
   G_heap_map           = new HeapMap<HeapInfo>;
   G_thread_stack_map   = new HeapMap<ThreadStackInfo>;
@@ -8595,6 +10311,7 @@ extern void ThreadSanitizerInit() {
   // each class
   g_publish_info_map = new PublishInfoMap;
   g_stack_trace_free_list = new StackTraceFreeList;
+  G_stack_depot = new StackDepot;
   g_pcq_map = new PCQMap;
   g_atomicCore = new TsanAtomicCore();
 
@@ -8709,6 +10426,10 @@ static bool ThreadSanitizerPrintReport(ThreadSanitizerReport *report) {
   return G_detector->reports_.PrintReport(report);
 }
 
+static void ThreadSanitizerFlushDeferredReports() {
+  G_detector->reports_.FlushDeferredReports();
+}
+
 
 // -------- TsanAtomicImplementation ------------------ {{{1
 
@@ -65,6 +65,7 @@ struct FLAGS {
   string           log_file;
   bool             offline;
   intptr_t         max_n_threads;
+  string           shadow_mapping;  // Possible values: cache, direct.
   bool             compress_cache_lines;
   bool             unlock_on_mutex_destroy;
 
@@ -98,6 +99,7 @@ struct FLAGS {
   intptr_t     dry_run;
   intptr_t     max_sid;
   intptr_t     max_sid_before_flush;
+  intptr_t     gc_slice_lines;  // 0 -- no incremental state collection.
   intptr_t     max_mem_in_mb;
   intptr_t     num_callers_in_history;
   intptr_t     flush_period;
@@ -108,10 +110,19 @@ struct FLAGS {
   intptr_t     locking_scheme;  // Used for internal experiments with locking.
 
   bool         report_races;
+  // 0 -- print the race reports right away.
+  // N > 0 -- queue the data race reports and print them N at a time (see
+  // ReportStorage::DeferRaceReport). Other reports are still printed right
+  // away, so they are not ordered with the deferred races. The flush runs
+  // on the thread which queues the N-th report, under the detector lock,
+  // and that thread pays for symbolizing and printing all N reports.
+  intptr_t     defer_reports;
   bool         thread_coverage;
   bool         atomicity;
   bool         call_coverage;
-  string       dump_events;  // The name of log file. Debug mode only.
+  // The name of log file. For ts_pin it is a text log (debug mode only),
+  // tsan_rtl and ts_offline write an event trace (see ts_event_trace.h).
+  string       dump_events;
   bool         symbolize;
   bool         attach_mode;
 
@@ -226,6 +237,10 @@ void ThreadSanitizerParseFlags(vector<string>* args);
 bool ThreadSanitizerWantToInstrumentSblock(uintptr_t pc);
 bool ThreadSanitizerWantToCreateSegmentsOnSblockEntry(uintptr_t pc);
 bool ThreadSanitizerIgnoreAccessesBelowFunction(uintptr_t pc);
+// The answers of the three functions above are cached by PC.
+// Call this when the code at some PCs may have changed
+// (an image is unloaded, translations are discarded).
+void ThreadSanitizerForgetPcDecisions();
 
 typedef int (*ThreadSanitizerUnwindCallback)(uintptr_t* stack, int size, uintptr_t pc);
 void ThreadSanitizerSetUnwindCallback(ThreadSanitizerUnwindCallback cb);
@@ -34,6 +34,10 @@
 #include "ts_heap_info.h"
 #include "ts_simple_cache.h"
 #include "dense_multimap.h"
+#include "ts_set_table.h"
+#include "ts_vts_kernels.h"
+#include "ts_compressed_line.h"
+#include "ignore.h"
 
 // Testing the HeapMap.
 struct TestHeapInfo {
@@ -137,6 +141,76 @@ TEST(ThreadSanitizer, HeapInfoTest) {
 
 }
 
+TEST(ThreadSanitizer, HeapInfoEraseRangeTest) {
+  HeapMap<TestHeapInfo> map;
+  for (uintptr_t a = 1000; a < 2000; a += 100)
+    map.InsertInfo(a, TestHeapInfo(a, 10, a / 100));
+  EXPECT_EQ(10U, map.size());
+  // Erases the records starting at 1200, 1300 and 1400.
+  map.EraseRange(1150, 1500);
+  EXPECT_EQ(7U, map.size());
+  EXPECT_TRUE(map.GetInfo(1105));
+  EXPECT_FALSE(map.GetInfo(1200));
+  EXPECT_FALSE(map.GetInfo(1405));
+  EXPECT_TRUE(map.GetInfo(1500));
+  TestHeapInfo info;
+  EXPECT_TRUE(map.GetInfoUnlocked(1505, &info));
+  EXPECT_EQ(15, info.val);
+  EXPECT_FALSE(map.GetInfoUnlocked(1300, &info));
+}
+
+// Checks the HeapMap against std::map on enough records to have
+// several levels of inner nodes.
+TEST(ThreadSanitizer, HeapInfoRandomTest) {
+  HeapMap<TestHeapInfo> map;
+  std::map<uintptr_t, TestHeapInfo> model;
+  const uintptr_t kRange = 1 << 20;
+  for (int iter = 0; iter < 300000; iter++) {
+    uintptr_t a = ((rand() % kRange) + 1) * 16;
+    int op = rand() % 10;
+    if (op < 5) {
+      TestHeapInfo info(a, (rand() % 4 + 1) * 4, iter);
+      map.InsertInfo(a, info);
+      model[a] = info;
+    } else if (op < 8) {
+      map.EraseInfo(a);
+      model.erase(a);
+    } else if (op < 9) {
+      uintptr_t end = a + (rand() % 64) * 16;
+      map.EraseRange(a, end);
+      model.erase(model.lower_bound(a), model.lower_bound(end));
+    } else {
+      uintptr_t b = a + rand() % 16;
+      TestHeapInfo *info = map.GetInfo(b);
+      std::map<uintptr_t, TestHeapInfo>::iterator it = model.upper_bound(b);
+      TestHeapInfo *expected = NULL;
+      if (it != model.begin()) {
+        --it;
+        if (it->first == b || it->first + it->second.size > b)
+          expected = &it->second;
+      }
+      ASSERT_EQ(expected == NULL, info == NULL) << b;
+      if (info) {
+        EXPECT_EQ(expected->ptr, info->ptr);
+        EXPECT_EQ(expected->val, info->val);
+      }
+    }
+    if (iter % 50000 == 0 || iter == 300000 - 1) {
+      ASSERT_EQ(model.size(), map.size());
+      std::map<uintptr_t, TestHeapInfo>::iterator it2 = model.begin();
+      for (HeapMap<TestHeapInfo>::iterator it = map.begin(); it != map.end();
+           ++it, ++it2) {
+        ASSERT_EQ(it2->first, it->first);
+        ASSERT_EQ(it2->second.val, it->second.val);
+      }
+    }
+  }
+  map.Clear();
+  EXPECT_EQ(0U, map.size());
+  EXPECT_TRUE(map.begin() == map.end());
+  EXPECT_FALSE(map.GetInfo(1000));
+}
+
 TEST(ThreadSanitizer, PtrToBoolCacheTest) {
   PtrToBoolCache<256> c;
   bool val = false;
@@ -207,6 +281,86 @@ TEST(ThreadSanitizer, IntPairToBoolCacheTest) {
   }
 }
 
+TEST(ThreadSanitizer, AdaptiveIntPairToIntCacheTest) {
+  AdaptiveIntPairToIntCache<16, 1024> c;
+  int32_t val = 0;
+  map<pair<int,int>, int> m;
+
+  EXPECT_FALSE(c.Lookup(0, 0, &val));
+  for (int i = 0; i < 1000000; i++) {
+    int a = (rand() % 1024) + 1;
+    int b = (rand() % 1024) + 1;
+
+    if (c.Lookup(a, b, &val)) {
+      EXPECT_EQ(1U, m.count(make_pair(a,b)));
+      EXPECT_EQ(val, m[make_pair(a,b)]);
+    }
+
+    val = rand();
+    c.Insert(a, b, val);
+    m[make_pair(a,b)] = val;
+  }
+  // The working set does not fit, so the cache has grown to the limit.
+  EXPECT_EQ(1024U, c.size());
+}
+
+TEST(ThreadSanitizer, AdaptiveIntPairToIntCacheHitRateTest) {
+  AdaptiveIntPairToIntCache<16, 1024> c;
+  int32_t val = 0;
+  // A few misses among many hits do not make the cache grow.
+  for (int i = 0; i < 1000000; i++) {
+    int a = (i % 1000 == 0) ? i + 1000 : 1;
+    if (!c.Lookup(a, 2, &val)) {
+      c.Insert(a, 2, 3);
+    }
+  }
+  EXPECT_EQ(16U, c.size());
+}
+
+struct TestSetElement {
+  explicit TestSetElement(int x = 0) : x(x) { }
+  int raw() const { return x; }
+  bool operator == (const TestSetElement &o) const { return x == o.x; }
+  bool operator < (const TestSetElement &o) const { return x < o.x; }
+  int x;
+};
+
+TEST(ThreadSanitizer, SetTableTest) {
+  typedef SetTable<TestSetElement> Table;
+  Table table;
+  map<vector<int>, int32_t> ids;
+  bool is_new;
+
+  for (int i = 0; i < 100000; i++) {
+    vector<int> v;
+    size_t size = (rand() % 6) + 1;
+    if (i % 1000 == 0) size = 3000;  // Not in the arena chunks.
+    for (size_t j = 0; j < size; j++)
+      v.push_back(rand() % 64);
+    sort(v.begin(), v.end());
+    vector<TestSetElement> elements(v.begin(), v.end());
+    int32_t id = table.Intern(&elements[0], size, &is_new);
+    if (ids.count(v)) {
+      EXPECT_FALSE(is_new);
+      EXPECT_EQ(ids[v], id);
+    } else {
+      EXPECT_TRUE(is_new);
+      EXPECT_EQ(ids.size() + 1, (size_t)id);
+      ids[v] = id;
+    }
+  }
+  EXPECT_EQ(ids.size(), table.size());
+
+  for (map<vector<int>, int32_t>::iterator it = ids.begin();
+       it != ids.end(); ++it) {
+    Table::Set set = table.Get(it->second);
+    ASSERT_EQ(it->first.size(), set.size());
+    for (size_t j = 0; j < set.size(); j++)
+      EXPECT_EQ(it->first[j], set[j].raw());
+    EXPECT_TRUE(set.has(TestSetElement(it->first[0])));
+  }
+}
+
 TEST(ThreadSanitizer, DenseMultimapTest) {
   typedef DenseMultimap<int, 3> Map;
 
@@ -393,6 +547,259 @@ TEST(ThreadSanitizer, NormalizeFunctionNameChangingTest) {
   }
 }
 
+// Makes a random VTS: each of the tids [0, max_tid) is present with
+// the probability 1/density.
+static void MakeRandomVts(int max_tid, int density, int max_clk,
+                          vector<VtsEntry> *vts) {
+  vts->clear();
+  for (int tid = 0; tid < max_tid; tid++) {
+    if (rand() % density) continue;
+    VtsEntry e = {tid, 1 + rand() % max_clk};
+    vts->push_back(e);
+  }
+}
+
+TEST(ThreadSanitizer, VtsKernelsTest) {
+  VtsKernel kernels[] = {kVtsKernelSSE2, kVtsKernelAVX2};
+  for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+    VtsKernel kernel = kernels[k];
+    if (kernel > VtsBestKernel()) continue;
+    srand(1);
+    for (int iter = 0; iter < 20000; iter++) {
+      vector<VtsEntry> a, b;
+      int max_tid = 1 + rand() % 40;
+      // Small clocks and dense tid sets give both equal and different VTSs.
+      MakeRandomVts(max_tid, 1 + rand() % 3, 1 + rand() % 3, &a);
+      MakeRandomVts(max_tid, 1 + rand() % 3, 1 + rand() % 3, &b);
+      if (a.empty() || b.empty()) continue;
+      if (rand() % 2) {
+        // Make b >= a.
+        for (size_t i = 0; i < a.size(); i++) {
+          for (size_t j = 0; j < b.size(); j++) {
+            if (b[j].tid == a[i].tid && b[j].clk < a[i].clk)
+              b[j].clk = a[i].clk;
+          }
+        }
+      }
+      EXPECT_EQ(VtsHappensBeforeScalar(&a[0], a.size(), &b[0], b.size()),
+                VtsHappensBefore(kernel, &a[0], a.size(), &b[0], b.size()))
+          << VtsKernelName(kernel);
+      vector<VtsEntry> expected(a.size() + b.size());
+      vector<VtsEntry> res(a.size() + b.size());
+      size_t expected_size = VtsJoinScalar(&a[0], a.size(), &b[0], b.size(),
+                                           &expected[0]);
+      size_t res_size = VtsJoin(kernel, &a[0], a.size(), &b[0], b.size(),
+                                &res[0]);
+      ASSERT_EQ(expected_size, res_size) << VtsKernelName(kernel);
+      for (size_t i = 0; i < res_size; i++) {
+        EXPECT_EQ(expected[i].tid, res[i].tid);
+        EXPECT_EQ(expected[i].clk, res[i].clk);
+      }
+    }
+  }
+}
+
+// The compiled matcher must give the same answers as the linear scan.
+TEST(ThreadSanitizer, IgnoreTripleMatcherTest) {
+  vector<IgnoreTriple> triples;
+  triples.push_back(IgnoreFun("exit"));
+  triples.push_back(IgnoreFun("pthread_create@*"));
+  triples.push_back(IgnoreFun("__lll_*lock_*"));
+  triples.push_back(IgnoreFun("*_locked"));
+  triples.push_back(IgnoreFun("*Mutex*"));
+  triples.push_back(IgnoreFun("f?o"));
+  triples.push_back(IgnoreObj("*/libpthread*"));
+  triples.push_back(IgnoreObj("*ntdll.dll"));
+  triples.push_back(IgnoreObj("/usr/lib/dyld"));
+  triples.push_back(IgnoreFile("*ts_valgrind_intercepts.c"));
+  triples.push_back(IgnoreFile("src/base/*"));
+  triples.push_back(IgnoreTriple("_dispatch_Block_copy", "*/libSystem*", "*"));
+  triples.push_back(IgnoreTriple("*", "*/libc.so*", "*string*"));
+  IgnoreTripleMatcher matcher(triples);
+
+  const char *funs[] = {"", "exit", "exit2", "pthread_create@GLIBC",
+    "pthread_create", "__lll_mutex_lock_wait", "__lll_unlock", "foo_locked",
+    "locked", "SomeMutexLock", "fao", "fo", "_dispatch_Block_copy", "main"};
+  const char *objs[] = {"", "/lib/libpthread.so.0", "C:/Windows/ntdll.dll",
+    "/usr/lib/dyld", "/usr/lib/dyld2", "/usr/lib/libSystem.B.dylib",
+    "/lib/libc.so.6", "a.out"};
+  const char *files[] = {"", "ts_valgrind_intercepts.c", "src/base/lock.cc",
+    "src/net/socket.cc", "string/strlen.c", "*"};
+  for (size_t i = 0; i < TS_ARRAY_SIZE(funs); i++) {
+    for (size_t j = 0; j < TS_ARRAY_SIZE(objs); j++) {
+      for (size_t k = 0; k < TS_ARRAY_SIZE(files); k++) {
+        EXPECT_EQ(TripleVectorMatchKnown(triples, funs[i], objs[j], files[k]),
+                  matcher.Match(funs[i], objs[j], files[k]))
+            << funs[i] << " " << objs[j] << " " << files[k];
+      }
+    }
+  }
+}
+
+TEST(ThreadSanitizer, MemLimitExceededTest) {
+  // minimal = 100, margin = 10, maximal = 160.
+  int limit = 0;
+  // The first call arms the limit at 'minimal'.
+  EXPECT_FALSE(MemLimitExceeded(50, 100, 10, 160, &limit));
+  EXPECT_EQ(100, limit);
+  EXPECT_FALSE(MemLimitExceeded(100, 100, 10, 160, &limit));
+  EXPECT_EQ(100, limit);
+  // Fires and re-arms a margin above the current size.
+  EXPECT_TRUE(MemLimitExceeded(101, 100, 10, 160, &limit));
+  EXPECT_EQ(111, limit);
+  // Does not fire again until the size grows past the new limit.
+  EXPECT_FALSE(MemLimitExceeded(105, 100, 10, 160, &limit));
+  EXPECT_FALSE(MemLimitExceeded(111, 100, 10, 160, &limit));
+  EXPECT_TRUE(MemLimitExceeded(130, 100, 10, 160, &limit));
+  EXPECT_EQ(140, limit);
+  // Follows a decreasing size down, but not below 'minimal'.
+  EXPECT_FALSE(MemLimitExceeded(120, 100, 10, 160, &limit));
+  EXPECT_EQ(130, limit);
+  EXPECT_FALSE(MemLimitExceeded(20, 100, 10, 160, &limit));
+  EXPECT_EQ(100, limit);
+  // Never re-armed above 'maximal', so it keeps firing above it.
+  EXPECT_TRUE(MemLimitExceeded(155, 100, 10, 160, &limit));
+  EXPECT_EQ(160, limit);
+  EXPECT_TRUE(MemLimitExceeded(200, 100, 10, 160, &limit));
+  EXPECT_EQ(160, limit);
+  EXPECT_TRUE(MemLimitExceeded(161, 100, 10, 160, &limit));
+  EXPECT_EQ(160, limit);
+  EXPECT_FALSE(MemLimitExceeded(160, 100, 10, 160, &limit));
+}
+
+// Testing the codec of --compress_cache_lines on a line shaped as CacheLine.
+struct TestLineMask {
+  TestLineMask() : m(0) { }
+  bool Get(uintptr_t i) const { return (m >> i) & 1; }
+  void Set(uintptr_t i) { m |= 1ULL << i; }
+  void Clear(uintptr_t i) { m &= ~(1ULL << i); }
+  bool Empty() const { return m == 0; }
+  uint64_t m;
+};
+
+struct TestLineValue {
+  TestLineValue(int32_t rd = 0, int32_t wr = 0) : rd(rd), wr(wr) { }
+  bool operator == (const TestLineValue &v) const {
+    return rd == v.rd && wr == v.wr;
+  }
+  bool IsNew() const { return rd == 0 && wr == 0; }
+  int32_t rd, wr;
+};
+
+struct TestLine {
+  static const uintptr_t kLineSize = 64;
+  explicit TestLine(uintptr_t tag) {
+    memset(this, 0, sizeof(*this));
+    tag_ = tag;
+  }
+  void SetValue(uintptr_t i, TestLineValue v) {
+    has_shadow_value_.Set(i);
+    vals_[i] = v;
+  }
+  uintptr_t tag_;
+  TestLineMask has_shadow_value_, traced_, racey_, published_;
+  uint16_t granularity_[kLineSize / 8];
+  TestLineValue vals_[kLineSize];
+};
+
+typedef CompressedLine<TestLine, TestLineMask, TestLineValue, 4>
+    TestCompressedLine;
+
+static void ExpectSameLines(const TestLine &a, const TestLine &b) {
+  EXPECT_EQ(a.tag_, b.tag_);
+  EXPECT_EQ(a.has_shadow_value_.m, b.has_shadow_value_.m);
+  EXPECT_EQ(a.traced_.m, b.traced_.m);
+  EXPECT_EQ(a.racey_.m, b.racey_.m);
+  EXPECT_EQ(a.published_.m, b.published_.m);
+  for (uintptr_t i = 0; i < TestLine::kLineSize / 8; i++) {
+    EXPECT_EQ(a.granularity_[i], b.granularity_[i]) << i;
+  }
+  for (uintptr_t i = 0; i < TestLine::kLineSize; i++) {
+    if (!a.has_shadow_value_.Get(i)) continue;
+    EXPECT_TRUE(a.vals_[i] == b.vals_[i]) << i;
+  }
+}
+
+// Encode 'line', expand it to a new line and compare. Return the number of
+// runs or -1 if the line does not compress.
+static int CompressedLineRoundTrip(const TestLine &line) {
+  TestCompressedLine compressed;
+  if (!compressed.Encode(line)) return -1;
+  TestLine expanded(line.tag_);
+  compressed.Expand(&expanded);
+  ExpectSameLines(line, expanded);
+  return compressed.n_runs();
+}
+
+TEST(ThreadSanitizer, CompressedLineTest) {
+  // Uniform: all 8-byte accesses, one value.
+  TestLine uniform(0x1000);
+  for (uintptr_t i = 0; i < TestLine::kLineSize; i += 8) {
+    uniform.SetValue(i, TestLineValue(-1, -2));
+    uniform.granularity_[i / 8] = 1;
+  }
+  uniform.published_.Set(8);
+  EXPECT_EQ(1, CompressedLineRoundTrip(uniform));
+
+  // Run-length: mixed granularity, gaps and four runs, with masks.
+  TestLine runs(0x2000);
+  for (uintptr_t i = 0; i < 16; i += 4) runs.SetValue(i, TestLineValue(-3, 0));
+  runs.granularity_[0] = runs.granularity_[1] = 6;  // 4-byte accesses.
+  for (uintptr_t i = 24; i < 32; i++) runs.SetValue(i, TestLineValue(0, -4));
+  runs.granularity_[3] = 0x7f80;  // 1-byte accesses.
+  for (uintptr_t i = 32; i < 40; i += 2) runs.SetValue(i, TestLineValue(-3, 0));
+  runs.granularity_[4] = 0x78;  // 2-byte accesses.
+  runs.SetValue(56, TestLineValue(-5, -6));
+  runs.granularity_[7] = 1;
+  runs.racey_.Set(26);
+  runs.racey_.Set(27);
+  runs.published_.Set(56);
+  runs.traced_.Set(0);
+  EXPECT_EQ(4, CompressedLineRoundTrip(runs));
+
+  // Mixed: one more different value does not fit.
+  TestLine mixed = runs;
+  mixed.SetValue(60, TestLineValue(-7, 0));
+  EXPECT_EQ(-1, CompressedLineRoundTrip(mixed));
+  // Neither do alternating values.
+  TestLine alternating(0x3000);
+  for (uintptr_t i = 0; i < TestLine::kLineSize; i++) {
+    alternating.SetValue(i, TestLineValue(-1 - (i % 2), 0));
+    alternating.granularity_[i / 8] = 0x7f80;
+  }
+  EXPECT_EQ(-1, CompressedLineRoundTrip(alternating));
+
+  // No shadow values, only a racey mask.
+  TestLine racey_only(0x4000);
+  racey_only.racey_.Set(63);
+  EXPECT_EQ(0, CompressedLineRoundTrip(racey_only));
+}
+
+TEST(ThreadSanitizer, CompressedLineRemoveEmptyRunsTest) {
+  TestLine line(0x1000);
+  for (uintptr_t i = 0; i < 8; i++) line.SetValue(i, TestLineValue(-1, 0));
+  for (uintptr_t i = 8; i < 16; i++) line.SetValue(i, TestLineValue(-2, 0));
+  for (uintptr_t i = 16; i < 24; i++) line.SetValue(i, TestLineValue(-3, 0));
+  TestCompressedLine compressed;
+  ASSERT_TRUE(compressed.Encode(line));
+  ASSERT_EQ(3, compressed.n_runs());
+  // The collector has emptied the middle run.
+  compressed.set_run_val(1, TestLineValue());
+  compressed.RemoveEmptyRuns();
+  EXPECT_EQ(2, compressed.n_runs());
+  for (uintptr_t i = 8; i < 16; i++) line.has_shadow_value_.Clear(i);
+  TestLine expanded(line.tag_);
+  compressed.Expand(&expanded);
+  ExpectSameLines(line, expanded);
+  EXPECT_FALSE(compressed.Empty());
+  // Now all runs are empty.
+  compressed.set_run_val(0, TestLineValue());
+  compressed.set_run_val(1, TestLineValue());
+  compressed.RemoveEmptyRuns();
+  EXPECT_EQ(0, compressed.n_runs());
+  EXPECT_TRUE(compressed.Empty());
+}
+
 int main(int argc, char **argv) {
   testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
@@ -0,0 +1,147 @@
+/* Copyright (c) 2011, Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+// This file is part of ThreadSanitizer, a dynamic data race detector.
+
+// The codec of --compress_cache_lines.
+// A cache line written back to the storage often has all its shadow values
+// identical (e.g. after memset or malloc, or when an array is written by one
+// thread). Such a line is stored as a short sequence of runs of equal
+// shadow values; the masks and the granularity are kept as is.
+//
+// The codec is a template so that it can be tested w/o the detector:
+// 'Line' is CacheLine (which makes CompressedLine a friend), 'Mask' is
+// the type of its masks and 'Value' is ShadowValue.
+
+#ifndef TS_COMPRESSED_LINE_H_
+#define TS_COMPRESSED_LINE_H_
+
+#include "ts_util.h"
+
+template <class Line, class Mask, class Value, int kMaxRuns>
+class CompressedLine {
+ public:
+  // Return false if 'line' has too many different shadow values in a row.
+  // The shadow values are moved, not copied, so their refs are kept too.
+  bool Encode(const Line &line) {
+    n_runs_ = 0;
+    for (uintptr_t i = 0; i < Line::kLineSize; i++) {
+      if (!line.has_shadow_value_.Get(i)) continue;
+      const Value &sval = line.vals_[i];
+      if (n_runs_ > 0 && run_val_[n_runs_ - 1] == sval) {
+        run_len_[n_runs_ - 1]++;
+        continue;
+      }
+      if (n_runs_ == kMaxRuns) return false;
+      run_val_[n_runs_] = sval;
+      run_len_[n_runs_] = 1;
+      n_runs_++;
+    }
+    tag_ = line.tag_;
+    has_shadow_value_ = line.has_shadow_value_;
+    traced_ = line.traced_;
+    racey_ = line.racey_;
+    published_ = line.published_;
+    memcpy(granularity_, line.granularity_, sizeof(granularity_));
+    return true;
+  }
+
+  // Fill a newly created 'line' with our contents.
+  void Expand(Line *line) const {
+    DCHECK(line->tag_ == tag_);
+    line->has_shadow_value_ = has_shadow_value_;
+    line->traced_ = traced_;
+    line->racey_ = racey_;
+    line->published_ = published_;
+    memcpy(line->granularity_, granularity_, sizeof(granularity_));
+    int r = 0;
+    int left_in_run = n_runs_ ? run_len_[0] : 0;
+    for (uintptr_t i = 0; i < Line::kLineSize; i++) {
+      if (!has_shadow_value_.Get(i)) continue;
+      if (left_in_run == 0) {
+        r++;
+        DCHECK(r < n_runs_);
+        left_in_run = run_len_[r];
+      }
+      line->vals_[i] = run_val_[r];
+      left_in_run--;
+    }
+  }
+
+  uintptr_t tag() { return tag_; }
+  Mask &racey() { return racey_; }
+  int n_runs() { return n_runs_; }
+  Value run_val(int r) { return run_val_[r]; }
+  int run_len(int r) { return run_len_[r]; }
+  // The caller moves the refs of all run_len(r) shadow values.
+  void set_run_val(int r, Value sval) { run_val_[r] = sval; }
+
+  // Drop the runs of empty shadow values, with their has_shadow_value bits.
+  void RemoveEmptyRuns() {
+    int r = 0;
+    int left_in_run = n_runs_ ? run_len_[0] : 0;
+    for (uintptr_t i = 0; i < Line::kLineSize; i++) {
+      if (!has_shadow_value_.Get(i)) continue;
+      if (left_in_run == 0) {
+        r++;
+        DCHECK(r < n_runs_);
+        left_in_run = run_len_[r];
+      }
+      if (run_val_[r].IsNew()) has_shadow_value_.Clear(i);
+      left_in_run--;
+    }
+    int n_runs = 0;
+    for (r = 0; r < n_runs_; r++) {
+      if (run_val_[r].IsNew()) continue;
+      run_val_[n_runs] = run_val_[r];
+      run_len_[n_runs] = run_len_[r];
+      n_runs++;
+    }
+    n_runs_ = n_runs;
+  }
+
+  // Same as CacheLine::Empty().
+  bool Empty() {
+    return has_shadow_value_.Empty() && traced_.Empty() &&
+        racey_.Empty() && published_.Empty();
+  }
+
+ private:
+  uintptr_t tag_;
+  Mask has_shadow_value_;
+  Mask traced_;
+  Mask racey_;
+  Mask published_;
+  uint16_t granularity_[Line::kLineSize / 8];
+  Value run_val_[kMaxRuns];
+  uint8_t run_len_[kMaxRuns];
+  uint8_t n_runs_;
+};
+
+#endif  // TS_COMPRESSED_LINE_H_
+// end. {{{1
+// vim:shiftwidth=2:softtabstop=2:expandtab:tw=80
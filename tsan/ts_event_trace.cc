@@ -0,0 +1,471 @@
+/* Copyright (c) 2010-2011, Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// This file is part of ThreadSanitizer, a dynamic data race detector.
+
+#include "ts_event_trace.h"
+
+static const char kEventTraceMagic[8] = {'T', 'S', 'A', 'N', 'T', 'R', 'C', 0};
+
+// The high 2 bits of the event type byte.
+enum EventTraceEventFlags {
+  kPcPredicted = 1 << 6,
+  kHasFields = 1 << 7
+};
+
+// ------------- Encoding ------------- {{{1
+static INLINE unsigned char *PutVarint(unsigned char *p, uint64_t value) {
+  while (value >= 0x80) {
+    *p++ = (unsigned char)(value | 0x80);
+    value >>= 7;
+  }
+  *p++ = (unsigned char)value;
+  return p;
+}
+
+static INLINE uint64_t ZigZag(int64_t value) {
+  return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static INLINE int64_t UnZigZag(uint64_t value) {
+  return (int64_t)((value >> 1) ^ (0 - (value & 1)));
+}
+
+// See "delta" in ts_event_trace.h.
+static INLINE uint64_t EncodeDelta(uintptr_t value, uintptr_t base) {
+  if (value == 0) return 0;
+  return ZigZag((intptr_t)(value - base)) + 1;
+}
+
+static INLINE uintptr_t DecodeDelta(uint64_t delta, uintptr_t base) {
+  if (delta == 0) return 0;
+  return base + (uintptr_t)UnZigZag(delta - 1);
+}
+
+static void PutVarint(string *out, uint64_t value) {
+  unsigned char buf[10];
+  out->append((char*)buf, PutVarint(buf, value) - buf);
+}
+
+static void PutString(string *out, const string &str) {
+  PutVarint(out, str.size());
+  out->append(str);
+}
+
+static INLINE bool IsMemoryAccess(EventType type) {
+  return type == READ || type == WRITE;
+}
+
+static INLINE size_t PcHash(uintptr_t pc) {
+  return (size_t)(((uint64_t)pc * 0x9E3779B97F4A7C15ULL) >> 40);
+}
+
+static INLINE uintptr_t *NextPcSlot(EventTraceDeltaState *state,
+                                    EventType type) {
+  return &state->next_pc[(PcHash(state->pc) ^ type) &
+                         (EventTraceDeltaState::kTableSize - 1)];
+}
+
+static INLINE uintptr_t *PcAddressSlot(EventTraceDeltaState *state,
+                                       uintptr_t pc) {
+  return &state->pc_a[PcHash(pc) & (EventTraceDeltaState::kTableSize - 1)];
+}
+
+static INLINE unsigned char *PutEvent(unsigned char *p,
+                                      EventTraceDeltaState *state,
+                                      EventType type, uintptr_t pc,
+                                      uintptr_t a, uintptr_t info) {
+  unsigned char *type_byte = p++;
+  unsigned char flags = 0;
+  uintptr_t *next_pc = NextPcSlot(state, type);
+  if (*next_pc == pc) {
+    flags |= kPcPredicted;
+  } else {
+    *next_pc = pc;
+    p = PutVarint(p, EncodeDelta(pc, state->pc));
+  }
+  if (pc) state->pc = pc;
+  if (IsMemoryAccess(type)) {
+    uintptr_t *pc_a = PcAddressSlot(state, pc);
+    p = PutVarint(p, EncodeDelta(a, *pc_a ? *pc_a : state->mem_a));
+    if (a) *pc_a = state->mem_a = a;
+    if (info != state->mem_size) {
+      flags |= kHasFields;
+      p = PutVarint(p, info);
+      state->mem_size = info;
+    }
+  } else if (a || info) {
+    flags |= kHasFields;
+    uintptr_t *pc_a = PcAddressSlot(state, pc);
+    p = PutVarint(p, EncodeDelta(a, *pc_a ? *pc_a : state->a));
+    p = PutVarint(p, info);
+    if (a) *pc_a = state->a = a;
+  }
+  *type_byte = (unsigned char)(type | flags);
+  return p;
+}
+
+// ------------- EventTraceCursor ------------- {{{1
+bool EventTraceCursor::ReadByte(unsigned char *res) {
+  if (cur_ >= end_) return false;
+  *res = *cur_++;
+  return true;
+}
+
+bool EventTraceCursor::ReadVarint(uint64_t *res) {
+  uint64_t value = 0;
+  for (int shift = 0; shift < 64 && cur_ < end_; shift += 7) {
+    unsigned char byte = *cur_++;
+    value |= (uint64_t)(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      *res = value;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool EventTraceCursor::ReadString(string *res) {
+  uint64_t size;
+  if (!ReadVarint(&size) || size > (uint64_t)(end_ - cur_)) return false;
+  res->assign((const char*)cur_, size);
+  cur_ += size;
+  return true;
+}
+
+bool EventTraceCursor::Skip(uint64_t n) {
+  if (n > (uint64_t)(end_ - cur_)) return false;
+  cur_ += n;
+  return true;
+}
+
+bool EventTraceCursor::ReadEvent(EventTraceDeltaState *state, EventType *type,
+                                 uintptr_t *pc, uintptr_t *a,
+                                 uintptr_t *info) {
+  unsigned char type_byte;
+  uint64_t value;
+  if (!ReadByte(&type_byte)) return false;
+  *type = (EventType)(type_byte & 63);
+  if (*type >= LAST_EVENT) return false;
+  uintptr_t *next_pc = NextPcSlot(state, *type);
+  if (type_byte & kPcPredicted) {
+    *pc = *next_pc;
+  } else {
+    if (!ReadVarint(&value)) return false;
+    *pc = *next_pc = DecodeDelta(value, state->pc);
+  }
+  if (*pc) state->pc = *pc;
+  *a = 0;
+  *info = 0;
+  if (IsMemoryAccess(*type)) {
+    uintptr_t *pc_a = PcAddressSlot(state, *pc);
+    if (!ReadVarint(&value)) return false;
+    *a = DecodeDelta(value, *pc_a ? *pc_a : state->mem_a);
+    if (*a) *pc_a = state->mem_a = *a;
+    if (type_byte & kHasFields) {
+      if (!ReadVarint(&value)) return false;
+      state->mem_size = (uintptr_t)value;
+    }
+    *info = state->mem_size;
+  } else if (type_byte & kHasFields) {
+    uintptr_t *pc_a = PcAddressSlot(state, *pc);
+    if (!ReadVarint(&value)) return false;
+    *a = DecodeDelta(value, *pc_a ? *pc_a : state->a);
+    if (*a) *pc_a = state->a = *a;
+    if (!ReadVarint(&value)) return false;
+    *info = (uintptr_t)value;
+  }
+  return true;
+}
+
+// ------------- EventTraceWriter ------------- {{{1
+EventTraceWriter::EventTraceWriter(FILE *file)
+    : file_(file), closed_(false), n_events_(0), n_bytes_(0),
+      n_thread_buffers_(0), last_buf_(NULL) {
+  CHECK(file_);
+  // The event type should fit into 6 bits.
+  CHECK(LAST_EVENT <= 64);
+  string header(kEventTraceMagic, sizeof(kEventTraceMagic));
+  PutVarint(&header, kEventTraceVersion);
+  WriteRecord((const unsigned char*)header.data(), header.size());
+}
+
+EventTraceWriter::~EventTraceWriter() {
+  Close();
+}
+
+EventTraceWriter::ThreadBuffer *EventTraceWriter::NewThreadBuffer() {
+  ScopedLock lock(&lock_);
+  return new ThreadBuffer(++n_thread_buffers_);
+}
+
+void EventTraceWriter::DeleteThreadBuffer(ThreadBuffer *buf) {
+  {
+    ScopedLock lock(&lock_);
+    FlushLocked(buf);
+    if (last_buf_ == buf) last_buf_ = NULL;
+  }
+  delete buf;
+}
+
+bool EventTraceWriter::CanRecord(EventType type) {
+  switch (type) {
+    case SET_THREAD_NAME:
+    case SET_LOCK_NAME:
+    case EXPECT_RACE:
+    case BENIGN_RACE:
+    case PC_DESCRIPTION:
+    case PRINT_MESSAGE:
+      return false;
+    default:
+      return type > NOOP && type < LAST_EVENT;
+  }
+}
+
+void EventTraceWriter::Put(ThreadBuffer *buf, EventType type, int32_t tid,
+                           uintptr_t pc, uintptr_t a, uintptr_t info) {
+  if (!CanRecord(type)) return;
+  ScopedLock lock(&lock_);
+  if (closed_) return;
+  if (last_buf_ != buf) {
+    // Keep the order of events across the threads.
+    if (last_buf_) FlushLocked(last_buf_);
+    last_buf_ = buf;
+  }
+  if (buf->tid_ != tid) {
+    FlushLocked(buf);
+    buf->tid_ = tid;
+    buf->state_is_valid_ = false;
+  }
+  if (buf->pos_ == 0) {
+    StartBlock(buf);
+  }
+  unsigned char *p = PutEvent(buf->data_ + buf->pos_, &buf->state_,
+                              type, pc, a, info);
+  buf->pos_ = p - buf->data_;
+  buf->n_events_++;
+
+  uintptr_t &seen = buf->seen_pcs_[(pc ^ (pc >> 12)) &
+                                   (ThreadBuffer::kSeenPcsSize - 1)];
+  if (UNLIKELY(seen != pc)) {
+    seen = pc;
+    buf->new_pcs_[buf->n_new_pcs_++] = pc;
+  }
+
+  if (buf->pos_ >= ThreadBuffer::kSize ||
+      buf->n_new_pcs_ == ThreadBuffer::kMaxNewPcs) {
+    FlushLocked(buf);
+  }
+}
+
+void EventTraceWriter::Flush(ThreadBuffer *buf) {
+  ScopedLock lock(&lock_);
+  FlushLocked(buf);
+}
+
+void EventTraceWriter::StartBlock(ThreadBuffer *buf) {
+  // The reader knows the state at the end of the previous block of tid_
+  // only if this buffer wrote it. Blocks are written in the order they are
+  // started since only last_buf_ may have unwritten events.
+  uint64_t &last_writer = last_writer_[buf->tid_];
+  buf->continued_ = buf->state_is_valid_ && last_writer == buf->id_;
+  if (!buf->continued_) {
+    buf->state_.Reset();
+  }
+  last_writer = buf->id_;
+  buf->state_is_valid_ = true;
+}
+
+void EventTraceWriter::FlushLocked(ThreadBuffer *buf) {
+  if (buf->pos_ && !closed_) {
+    unsigned char header[1 + 10 + 10];
+    unsigned char *p = header;
+    *p++ = buf->continued_ ? kContinuedEventBlockRecord : kEventBlockRecord;
+    p = PutVarint(p, (uint32_t)buf->tid_);
+    p = PutVarint(p, buf->pos_);
+    WriteRecord(header, p - header);
+    WriteRecord(buf->data_, buf->pos_);
+    n_events_ += buf->n_events_;
+  }
+  if (buf->n_new_pcs_) {
+    pcs_.insert(pcs_.end(), buf->new_pcs_, buf->new_pcs_ + buf->n_new_pcs_);
+  }
+  buf->pos_ = 0;
+  buf->n_events_ = 0;
+  buf->n_new_pcs_ = 0;
+}
+
+void EventTraceWriter::GetPcs(vector<uintptr_t> *pcs) {
+  ScopedLock lock(&lock_);
+  if (last_buf_) FlushLocked(last_buf_);
+  sort(pcs_.begin(), pcs_.end());
+  pcs_.erase(unique(pcs_.begin(), pcs_.end()), pcs_.end());
+  *pcs = pcs_;
+  if (!pcs->empty() && pcs->front() == 0) {
+    pcs->erase(pcs->begin());
+  }
+}
+
+void EventTraceWriter::AddPcDescription(uintptr_t pc, const string &img_name,
+                                        const string &rtn_name,
+                                        const string &file_name, int line) {
+  string record(1, (char)kPcDescriptionRecord);
+  PutVarint(&record, pc);
+  PutString(&record, img_name);
+  PutString(&record, rtn_name);
+  PutString(&record, file_name);
+  PutVarint(&record, line);
+  ScopedLock lock(&lock_);
+  if (closed_) return;
+  WriteRecord((const unsigned char*)record.data(), record.size());
+}
+
+void EventTraceWriter::Close() {
+  ScopedLock lock(&lock_);
+  if (closed_) return;
+  if (last_buf_) FlushLocked(last_buf_);
+  WriteOut();
+  closed_ = true;
+  fclose(file_);
+}
+
+void EventTraceWriter::WriteRecord(const unsigned char *data, size_t size) {
+  out_.append((const char*)data, size);
+  n_bytes_ += size;
+  if (out_.size() >= kOutSize) {
+    WriteOut();
+  }
+}
+
+void EventTraceWriter::WriteOut() {
+  CHECK(out_.size() == fwrite(out_.data(), 1, out_.size(), file_));
+  out_.clear();
+}
+
+// ------------- EventTraceReader ------------- {{{1
+EventTraceReader::EventTraceReader(const unsigned char *data, size_t size)
+    : data_(data), size_(size), block_tid_(0), block_state_(NULL) {
+}
+
+bool EventTraceReader::HasHeader(const unsigned char *data, size_t size) {
+  return size >= sizeof(kEventTraceMagic) &&
+      memcmp(data, kEventTraceMagic, sizeof(kEventTraceMagic)) == 0;
+}
+
+bool EventTraceReader::ReadHeader() {
+  if (!HasHeader(data_, size_)) {
+    Printf("ERROR: not an event trace (bad magic)\n");
+    return false;
+  }
+  records_ = EventTraceCursor(data_ + sizeof(kEventTraceMagic),
+                              data_ + size_);
+  uint64_t version;
+  if (!records_.ReadVarint(&version) || version != kEventTraceVersion) {
+    Printf("ERROR: unsupported event trace version (expected %d)\n",
+           kEventTraceVersion);
+    return false;
+  }
+  pc_records_ = records_;
+  return true;
+}
+
+bool EventTraceReader::NextPcDescription(uintptr_t *pc, string *img_name,
+                                         string *rtn_name, string *file_name,
+                                         int *line) {
+  unsigned char kind;
+  while (pc_records_.ReadByte(&kind)) {
+    uint64_t a, b;
+    if (kind == kEventBlockRecord || kind == kContinuedEventBlockRecord) {
+      if (!pc_records_.ReadVarint(&a) || !pc_records_.ReadVarint(&b) ||
+          !pc_records_.Skip(b)) {
+        return false;
+      }
+    } else if (kind == kPcDescriptionRecord) {
+      if (!pc_records_.ReadVarint(&a) || !pc_records_.ReadString(img_name) ||
+          !pc_records_.ReadString(rtn_name) ||
+          !pc_records_.ReadString(file_name) || !pc_records_.ReadVarint(&b)) {
+        return false;
+      }
+      *pc = a;
+      *line = (int)b;
+      return true;
+    } else {
+      return false;
+    }
+  }
+  return false;
+}
+
+bool EventTraceReader::NextBlock() {
+  unsigned char kind;
+  while (records_.ReadByte(&kind)) {
+    uint64_t tid, size, dummy;
+    string str;
+    if (kind == kEventBlockRecord || kind == kContinuedEventBlockRecord) {
+      if (!records_.ReadVarint(&tid) || !records_.ReadVarint(&size)) break;
+      const unsigned char *begin = records_.cur();
+      if (!records_.Skip(size)) break;
+      block_ = EventTraceCursor(begin, begin + size);
+      block_tid_ = (int32_t)tid;
+      block_state_ = &states_[block_tid_];
+      if (kind == kEventBlockRecord) {
+        block_state_->Reset();
+      }
+      return true;
+    } else if (kind == kPcDescriptionRecord) {
+      // Already handled by NextPcDescription().
+      if (!records_.ReadVarint(&dummy) || !records_.ReadString(&str) ||
+          !records_.ReadString(&str) || !records_.ReadString(&str) ||
+          !records_.ReadVarint(&dummy)) {
+        break;
+      }
+    } else {
+      Printf("ERROR: unknown event trace record %d\n", kind);
+      return false;
+    }
+  }
+  if (!records_.empty()) {
+    Printf("WARNING: the event trace is truncated\n");
+  }
+  return false;
+}
+
+bool EventTraceReader::Next(Event *event) {
+  while (block_.empty()) {
+    if (!NextBlock()) return false;
+  }
+  EventType type;
+  uintptr_t pc, a, info;
+  if (!block_.ReadEvent(block_state_, &type, &pc, &a, &info)) {
+    Printf("ERROR: malformed event trace block\n");
+    return false;
+  }
+  event->Init(type, block_tid_, pc, a, info);
+  return true;
+}
+
+// end. {{{1
+// vim:shiftwidth=2:softtabstop=2:expandtab:tw=80
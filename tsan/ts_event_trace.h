@@ -0,0 +1,249 @@
+/* Copyright (c) 2010-2011, Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// This file is part of ThreadSanitizer, a dynamic data race detector.
+
+// Compact event trace: a file format for recording the events of a program
+// (e.g. with --dump_events=<file> in tsan_rtl) and replaying them later
+// in ts_offline (--input_type=trace).
+//
+// The file starts with a header:
+//   "TSANTRC" '\0'     -- magic, 8 bytes.
+//   varint version     -- kEventTraceVersion.
+// followed by records, each starting with a record kind byte:
+//   kEventBlockRecord, kContinuedEventBlockRecord: varint tid, varint size,
+//     then 'size' bytes of events of thread 'tid'.
+//   kPcDescriptionRecord: varint pc, string image, string routine,
+//     string file, varint line. Usually these are written at the end of
+//     the trace, so the reader scans the whole trace for them first.
+// varint is the unsigned LEB128 encoding, string is a varint length followed
+// by the bytes. A "delta" is a varint which is 0 for the value 0 and
+// zigzag(value - base) + 1 otherwise.
+//
+// An event in a block is:
+//   byte: event type in the low 6 bits, kPcPredicted and kHasFields flags;
+//   delta pc from the last non-zero pc, unless kPcPredicted is set: then
+//     the pc is the one which followed the last pc the previous time an event
+//     of this type did (a direct-mapped table in EventTraceDeltaState);
+//   READ and WRITE: delta address from the last address at the same pc
+//     (or from the last address of READ/WRITE if there is none), then
+//     varint size if kHasFields is set, otherwise the size is the same as
+//     in the previous READ/WRITE;
+//   other events, if kHasFields is set: delta address from the last address
+//     at the same pc (or from the last address of such events), varint info;
+//     otherwise both are 0.
+// The state for the deltas and predictions is kept per thread. In a
+// kEventBlockRecord it is reset to 0, in a kContinuedEventBlockRecord it is
+// taken from the end of the previous block of the same thread.
+//
+// The writer keeps the order in which the events were put: when a thread
+// puts an event after another one did, the other thread's buffered events
+// are written first. So the trace replays the events exactly in the order
+// they were passed to ThreadSanitizer.
+
+#ifndef TS_EVENT_TRACE_H_
+#define TS_EVENT_TRACE_H_
+
+#include "ts_util.h"
+#include "ts_events.h"
+#include "ts_lock.h"
+
+static const uint32_t kEventTraceVersion = 2;
+
+enum EventTraceRecordKind {
+  kEventBlockRecord = 1,
+  kContinuedEventBlockRecord = 2,
+  kPcDescriptionRecord = 3
+};
+
+// The last values of one thread's events, for the delta encoding.
+struct EventTraceDeltaState {
+  EventTraceDeltaState() { Reset(); }
+  void Reset() { memset(this, 0, sizeof(*this)); }
+  static const size_t kTableSize = 1 << 12;
+  uintptr_t pc;        // The last non-zero pc.
+  uintptr_t mem_a;     // The last non-zero address of READ or WRITE.
+  uintptr_t a;         // The last non-zero address of other events.
+  uintptr_t mem_size;  // The size of the last READ or WRITE.
+  // Indexed by the hashes of (pc, event type) and of pc respectively.
+  uintptr_t next_pc[kTableSize];
+  uintptr_t pc_a[kTableSize];
+};
+
+// A bounds-checked reader of the encoded data.
+class EventTraceCursor {
+ public:
+  EventTraceCursor() : cur_(NULL), end_(NULL) { }
+  EventTraceCursor(const unsigned char *begin, const unsigned char *end)
+      : cur_(begin), end_(end) { }
+  bool empty() const { return cur_ >= end_; }
+  bool ReadByte(unsigned char *res);
+  bool ReadVarint(uint64_t *res);
+  bool ReadString(string *res);
+  bool Skip(uint64_t n);
+  // Decodes one event of a block.
+  bool ReadEvent(EventTraceDeltaState *state, EventType *type,
+                 uintptr_t *pc, uintptr_t *a, uintptr_t *info);
+  const unsigned char *cur() const { return cur_; }
+ private:
+  const unsigned char *cur_;
+  const unsigned char *end_;
+};
+
+// Writes the compact event trace. Events are put through per-thread buffers
+// (EventTraceWriter::ThreadBuffer), one for each thread which puts events.
+// The buffers and the output file are protected by the writer's lock, so
+// that the buffered events of one thread can be written when another thread
+// puts an event.
+class EventTraceWriter {
+ public:
+  class ThreadBuffer;
+
+  // Takes ownership of 'file' and writes the header.
+  explicit EventTraceWriter(FILE *file);
+  ~EventTraceWriter();
+
+  ThreadBuffer *NewThreadBuffer();
+  // Flushes and deletes the buffer.
+  void DeleteThreadBuffer(ThreadBuffer *buf);
+
+  // Records one event. The events are accumulated in the buffer until
+  // another buffer gets an event or the buffer is full.
+  void Put(ThreadBuffer *buf, EventType type, int32_t tid,
+           uintptr_t pc, uintptr_t a, uintptr_t info);
+
+  // Writes the buffered events of 'buf' to the file.
+  void Flush(ThreadBuffer *buf);
+
+  // Returns the sorted list of distinct pcs seen in the events put so far.
+  void GetPcs(vector<uintptr_t> *pcs);
+
+  void AddPcDescription(uintptr_t pc, const string &img_name,
+                        const string &rtn_name, const string &file_name,
+                        int line);
+
+  // Flushes the buffered events and closes the file. The events put after
+  // Close() are ignored.
+  void Close();
+
+  uint64_t n_events() const { return n_events_; }
+  uint64_t n_bytes() const { return n_bytes_; }
+
+  // Whether an event of this type can be recorded. Events which carry
+  // pointers to strings in the program's memory can not be.
+  static bool CanRecord(EventType type);
+
+ private:
+  // These are called under lock_.
+  void StartBlock(ThreadBuffer *buf);
+  void FlushLocked(ThreadBuffer *buf);
+  // The records are collected in out_ and written to the file in chunks
+  // of about kOutSize bytes.
+  void WriteRecord(const unsigned char *data, size_t size);
+  void WriteOut();
+  static const size_t kOutSize = 1 << 16;
+
+  FILE *file_;
+  string out_;
+  TSLock lock_;
+  bool closed_;
+  uint64_t n_events_;
+  uint64_t n_bytes_;
+  vector<uintptr_t> pcs_;
+  // For each tid, the id of the buffer which wrote the last block.
+  unordered_map<int32_t, uint64_t> last_writer_;
+  uint64_t n_thread_buffers_;
+  // The buffer which got the last event. Only this one may have events
+  // which are not written yet.
+  ThreadBuffer *last_buf_;
+};
+
+class EventTraceWriter::ThreadBuffer {
+ public:
+  explicit ThreadBuffer(uint64_t id)
+      : id_(id), tid_(-1), pos_(0), n_events_(0), continued_(false),
+        state_is_valid_(false), n_new_pcs_(0) {
+    memset(seen_pcs_, 0, sizeof(seen_pcs_));
+  }
+
+ private:
+  friend class EventTraceWriter;
+  // One event takes at most 1 + 3 * 10 bytes.
+  static const size_t kMaxEventSize = 31;
+  static const size_t kSize = (1 << 16) - kMaxEventSize;
+  static const size_t kSeenPcsSize = 1 << 12;
+  static const size_t kMaxNewPcs = 1 << 10;
+
+  uint64_t id_;
+  int32_t tid_;
+  size_t pos_;
+  size_t n_events_;
+  // The block continues the previous block of tid_, which was written by
+  // this buffer, and is encoded starting from its state (see StartBlock).
+  bool continued_;
+  bool state_is_valid_;
+  EventTraceDeltaState state_;
+  // A direct-mapped cache of recently seen pcs and the pcs that missed it.
+  uintptr_t seen_pcs_[kSeenPcsSize];
+  size_t n_new_pcs_;
+  uintptr_t new_pcs_[kMaxNewPcs];
+  unsigned char data_[kSize + kMaxEventSize];
+};
+
+// Reads the compact event trace from memory.
+class EventTraceReader {
+ public:
+  EventTraceReader(const unsigned char *data, size_t size);
+
+  // Returns false if the data does not start with a valid header.
+  bool ReadHeader();
+
+  // Finds the next pc description record (in the whole trace, independently
+  // of Next()).
+  bool NextPcDescription(uintptr_t *pc, string *img_name, string *rtn_name,
+                         string *file_name, int *line);
+
+  // Decodes the next event.
+  bool Next(Event *event);
+
+  static bool HasHeader(const unsigned char *data, size_t size);
+
+ private:
+  bool NextBlock();
+
+  const unsigned char *data_;
+  size_t size_;
+  EventTraceCursor records_;     // The next record for Next().
+  EventTraceCursor pc_records_;  // The next record for NextPcDescription().
+  EventTraceCursor block_;       // The rest of the current block.
+  int32_t block_tid_;
+  EventTraceDeltaState *block_state_;
+  unordered_map<int32_t, EventTraceDeltaState> states_;
+};
+
+#endif  // TS_EVENT_TRACE_H_
+// end. {{{1
+// vim:shiftwidth=2:softtabstop=2:expandtab:tw=80
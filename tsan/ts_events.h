@@ -93,6 +93,7 @@ enum EventType {
   PC_DESCRIPTION,     // {0, pc, descr_str, 0}, for ts_offline.
   PRINT_MESSAGE,      // {tid, pc, message_str, 0}, for ts_offline.
   FLUSH_EXPECTED_RACES,  // {0, 0, 0, 0}
+  THR_JOIN_BEFORE,    // {tid, pc, joined_tid}
   LAST_EVENT          // Should not appear.
 };
 
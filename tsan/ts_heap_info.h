@@ -31,86 +31,442 @@
 #define TS_HEAP_INFO_
 
 #include "ts_util.h"
+#include "ts_lock.h"
 
 // Information about heap memory.
 // For each heap allocation we create a struct HeapInfo.
 // This struct should have fields 'uintptr_t ptr' and 'uintptr_t size',
 // a default CTOR and a copy CTOR.
-
+//
+// The records are kept in a B+-tree ordered by 'ptr'. A leaf holds up to
+// kLeafSize records in place, so there is no allocation per record, and the
+// leaves are linked for iteration. An inner node routes by the smallest key
+// of each child: keys[i] <= any key in children[i] and keys[i] > any key in
+// children[i - 1]. Erasing a record does not rebalance the tree, only the
+// empty nodes are removed.
+//
+// All modifications should be serialized by the caller. GetInfoUnlocked()
+// may run concurrently with them: the nodes are never returned to malloc
+// (only to the free lists), so a reader may walk a changing tree and retry
+// if the sequence counter has changed meanwhile.
 template<class HeapInfo>
 class HeapMap {
  public:
-  typedef map<uintptr_t, HeapInfo> map_t;
-  typedef typename map_t::iterator iterator;
+  typedef pair<uintptr_t, HeapInfo> value_type;
+
+ private:
+  enum {
+    kLeafSize = 32,
+    kFanout = 32,
+    kMaxHeight = 16
+  };
+
+  struct Node {
+    bool is_leaf;
+    uint32_t n;
+  };
+
+  struct Leaf : public Node {
+    Leaf *prev;
+    Leaf *next;
+    value_type entries[kLeafSize];
+  };
+
+  struct Inner : public Node {
+    uintptr_t keys[kFanout];
+    Node *children[kFanout];
+  };
+
+ public:
+  class iterator {
+   public:
+    iterator() : leaf_(NULL), pos_(0) { }
+    value_type &operator*() { return leaf_->entries[pos_]; }
+    value_type *operator->() { return &leaf_->entries[pos_]; }
+    iterator &operator++() {
+      if (++pos_ == leaf_->n) {
+        leaf_ = leaf_->next;
+        pos_ = 0;
+      }
+      return *this;
+    }
+    bool operator==(const iterator &other) const {
+      return leaf_ == other.leaf_ && pos_ == other.pos_;
+    }
+    bool operator!=(const iterator &other) const { return !(*this == other); }
+   private:
+    friend class HeapMap;
+    iterator(Leaf *leaf, size_t pos) : leaf_(leaf), pos_(pos) { }
+    Leaf *leaf_;
+    size_t pos_;
+  };
 
-  HeapMap() { Reset(); }
+  HeapMap() : root_(NULL), first_leaf_(NULL), size_(0), seq_(0),
+      free_leaves_(NULL), free_inners_(NULL), n_node_bytes_(0) { }
 
-  iterator begin() { return ++map_.begin(); }
-  iterator end() { return --map_.end(); }
+  iterator begin() { return iterator(size_ ? first_leaf_ : NULL, 0); }
+  iterator end() { return iterator(NULL, 0); }
 
-  size_t size() { return map_.size() - 2; }
+  size_t size() { return size_; }
+
+  // The memory taken by the nodes, including the free ones.
+  size_t MemoryUsageInBytes() { return n_node_bytes_; }
 
   void InsertInfo(uintptr_t a, HeapInfo info) {
     CHECK(IsValidPtr(a));
     CHECK(info.ptr == a);
-    map_[a] = info;
+    BeginWrite();
+    Insert(a, info);
+    EndWrite();
   }
 
   void EraseInfo(uintptr_t a) {
     CHECK(IsValidPtr(a));
-    map_.erase(a);
+    BeginWrite();
+    Erase(a);
+    EndWrite();
   }
 
+  // Erases all records which start in [start, end).
   void EraseRange(uintptr_t start, uintptr_t end) {
     CHECK(IsValidPtr(start));
     CHECK(IsValidPtr(end));
-    // TODO(glider): the [start, end) range may cover several map_ records.
-    EraseInfo(start);
+    BeginWrite();
+    for (;;) {
+      const value_type *e = FindLowerBound(start);
+      if (!e || e->first >= end) break;
+      Erase(e->first);
+    }
+    EndWrite();
   }
 
   HeapInfo *GetInfo(uintptr_t a) {
     CHECK(this);
     CHECK(IsValidPtr(a));
-    typename map_t::iterator it = map_.lower_bound(a);
-    CHECK(it != map_.end());
-    if (it->second.ptr == a) {
-      // Exact match. 'a' is the beginning of a heap-allocated address.
-      return &it->second;
-    }
-    CHECK(a < it->second.ptr);
-    CHECK(it != map_.begin());
-    // not an exact match, try the previous iterator.
-    --it;
-    HeapInfo *info = &it->second;
-    CHECK(info->ptr < a);
-    if (info->ptr + info->size > a) {
-      // within the range.
+    value_type *e = FindLessOrEqual(a);
+    if (!e) return NULL;
+    HeapInfo *info = &e->second;
+    CHECK(info->ptr <= a);
+    if (info->ptr == a || info->ptr + info->size > a) {
+      // Exact match or within the range.
       return info;
     }
     return NULL;
   }
 
+  // Same as GetInfo(), but may be called while another thread modifies
+  // the map. Copies the record to *res.
+  bool GetInfoUnlocked(uintptr_t a, HeapInfo *res) {
+    if (!IsValidPtr(a)) return false;
+    for (;;) {
+      uintptr_t seq = AcquireLoad(&seq_);
+      if (seq & 1) {
+        YIELD();
+        continue;
+      }
+      bool found = false;
+      value_type *e = FindLessOrEqual(a);
+      if (e) {
+        *res = e->second;
+        found = res->ptr == a || (res->ptr < a && res->ptr + res->size > a);
+      }
+      if (AcquireLoad(&seq_) == seq)
+        return found;
+    }
+  }
+
   void Clear() {
-    map_.clear();
-    Reset();
+    BeginWrite();
+    if (root_) FreeSubtree(root_);
+    root_ = NULL;
+    first_leaf_ = NULL;
+    size_ = 0;
+    EndWrite();
   }
 
  private:
   bool IsValidPtr(uintptr_t a) {
     return a != 0 && a != (uintptr_t) -1;
   }
-  void Reset() {
-    // Insert a maximal and minimal possible values to make GetInfo simpler.
-    HeapInfo max_info;
-    memset(&max_info, 0, sizeof(HeapInfo));
-    max_info.ptr = (uintptr_t)-1;
-    map_[max_info.ptr] = max_info;
 
-    HeapInfo min_info;
-    memset(&min_info, 0, sizeof(HeapInfo));
-    map_[min_info.ptr] = min_info;
+  void BeginWrite() {
+    DCHECK(!(seq_ & 1));
+    AtomicExchange(&seq_, seq_ + 1);
+  }
+
+  void EndWrite() {
+    ReleaseStore(&seq_, seq_ + 1);
+  }
+
+  // The index of the last child whose key is <= a, or 0.
+  static size_t ChildIndex(const Inner *node, uintptr_t a, size_t n) {
+    size_t lo = 1, hi = n;
+    while (lo < hi) {
+      size_t mid = (lo + hi) / 2;
+      if (node->keys[mid] <= a) lo = mid + 1;
+      else hi = mid;
+    }
+    return lo - 1;
+  }
+
+  // The number of entries with keys <= a.
+  static size_t UpperBound(const Leaf *leaf, uintptr_t a, size_t n) {
+    size_t lo = 0, hi = n;
+    while (lo < hi) {
+      size_t mid = (lo + hi) / 2;
+      if (leaf->entries[mid].first <= a) lo = mid + 1;
+      else hi = mid;
+    }
+    return lo;
+  }
+
+  // Descends to the leaf which should contain 'a'. The walk is bounded, so
+  // that it ends even if the tree is being changed by another thread.
+  Leaf *FindLeaf(uintptr_t a) {
+    Node *node = root_;
+    for (size_t h = 0; node && h < kMaxHeight; h++) {
+      if (node->is_leaf) return static_cast<Leaf*>(node);
+      Inner *inner = static_cast<Inner*>(node);
+      size_t n = min<size_t>(inner->n, kFanout);
+      if (n == 0) return NULL;
+      node = inner->children[ChildIndex(inner, a, n)];
+    }
+    return NULL;
+  }
+
+  // The entry with the largest key <= a.
+  value_type *FindLessOrEqual(uintptr_t a) {
+    Leaf *leaf = FindLeaf(a);
+    if (!leaf) return NULL;
+    size_t n = min<size_t>(leaf->n, kLeafSize);
+    size_t i = UpperBound(leaf, a, n);
+    if (i > 0) return &leaf->entries[i - 1];
+    // 'a' is less than all keys of this leaf, but not less than its key in
+    // the parent, so the answer is the last entry of the previous leaf.
+    Leaf *prev = leaf->prev;
+    if (!prev) return NULL;
+    n = min<size_t>(prev->n, kLeafSize);
+    return n ? &prev->entries[n - 1] : NULL;
+  }
+
+  // The entry with the smallest key >= a.
+  const value_type *FindLowerBound(uintptr_t a) {
+    Leaf *leaf = FindLeaf(a);
+    if (!leaf) return NULL;
+    size_t i = UpperBound(leaf, a, leaf->n);
+    if (i > 0 && leaf->entries[i - 1].first == a) return &leaf->entries[i - 1];
+    if (i < leaf->n) return &leaf->entries[i];
+    return leaf->next ? &leaf->next->entries[0] : NULL;
+  }
+
+  void Insert(uintptr_t a, const HeapInfo &info) {
+    if (!root_) {
+      Leaf *leaf = NewLeaf();
+      leaf->prev = leaf->next = NULL;
+      root_ = first_leaf_ = leaf;
+    }
+    // The path from the root; path_pos[h] is the child index in path[h].
+    Inner *path[kMaxHeight];
+    size_t path_pos[kMaxHeight];
+    size_t height = 0;
+    Node *node = root_;
+    while (!node->is_leaf) {
+      Inner *inner = static_cast<Inner*>(node);
+      size_t i = ChildIndex(inner, a, inner->n);
+      if (i == 0 && a < inner->keys[0]) inner->keys[0] = a;
+      CHECK(height < kMaxHeight);
+      path[height] = inner;
+      path_pos[height] = i;
+      height++;
+      node = inner->children[i];
+    }
+    Leaf *leaf = static_cast<Leaf*>(node);
+    size_t i = UpperBound(leaf, a, leaf->n);
+    if (i > 0 && leaf->entries[i - 1].first == a) {
+      leaf->entries[i - 1].second = info;
+      return;
+    }
+    size_++;
+    if (leaf->n < kLeafSize) {
+      InsertIntoLeaf(leaf, i, a, info);
+      return;
+    }
+    // Split the leaf in halves and insert into one of them.
+    Leaf *right = NewLeaf();
+    size_t half = kLeafSize / 2;
+    for (size_t j = half; j < kLeafSize; j++)
+      right->entries[j - half] = leaf->entries[j];
+    right->n = kLeafSize - half;
+    right->prev = leaf;
+    right->next = leaf->next;
+    if (leaf->next) leaf->next->prev = right;
+    leaf->next = right;
+    leaf->n = half;
+    if (i <= half)
+      InsertIntoLeaf(leaf, i, a, info);
+    else
+      InsertIntoLeaf(right, i - half, a, info);
+
+    // Insert the new node into the parents, splitting them as needed.
+    Node *new_node = right;
+    uintptr_t new_key = right->entries[0].first;
+    while (height > 0) {
+      height--;
+      Inner *parent = path[height];
+      size_t pos = path_pos[height] + 1;
+      if (parent->n < kFanout) {
+        InsertIntoInner(parent, pos, new_key, new_node);
+        return;
+      }
+      Inner *right_inner = NewInner();
+      size_t half = kFanout / 2;
+      for (size_t j = half; j < kFanout; j++) {
+        right_inner->keys[j - half] = parent->keys[j];
+        right_inner->children[j - half] = parent->children[j];
+      }
+      right_inner->n = kFanout - half;
+      parent->n = half;
+      if (pos <= half)
+        InsertIntoInner(parent, pos, new_key, new_node);
+      else
+        InsertIntoInner(right_inner, pos - half, new_key, new_node);
+      new_node = right_inner;
+      new_key = right_inner->keys[0];
+    }
+    // The root was split.
+    Inner *new_root = NewInner();
+    new_root->n = 2;
+    new_root->keys[0] = min(a, MinKey(root_));
+    new_root->children[0] = root_;
+    new_root->keys[1] = new_key;
+    new_root->children[1] = new_node;
+    root_ = new_root;
+  }
+
+  uintptr_t MinKey(Node *node) {
+    if (node->is_leaf) return static_cast<Leaf*>(node)->entries[0].first;
+    return static_cast<Inner*>(node)->keys[0];
+  }
+
+  void InsertIntoLeaf(Leaf *leaf, size_t i, uintptr_t a,
+                      const HeapInfo &info) {
+    for (size_t j = leaf->n; j > i; j--)
+      leaf->entries[j] = leaf->entries[j - 1];
+    leaf->entries[i] = value_type(a, info);
+    leaf->n++;
+  }
+
+  void InsertIntoInner(Inner *node, size_t i, uintptr_t key, Node *child) {
+    for (size_t j = node->n; j > i; j--) {
+      node->keys[j] = node->keys[j - 1];
+      node->children[j] = node->children[j - 1];
+    }
+    node->keys[i] = key;
+    node->children[i] = child;
+    node->n++;
+  }
+
+  void Erase(uintptr_t a) {
+    if (!root_) return;
+    Inner *path[kMaxHeight];
+    size_t path_pos[kMaxHeight];
+    size_t height = 0;
+    Node *node = root_;
+    while (!node->is_leaf) {
+      Inner *inner = static_cast<Inner*>(node);
+      size_t i = ChildIndex(inner, a, inner->n);
+      CHECK(height < kMaxHeight);
+      path[height] = inner;
+      path_pos[height] = i;
+      height++;
+      node = inner->children[i];
+    }
+    Leaf *leaf = static_cast<Leaf*>(node);
+    size_t i = UpperBound(leaf, a, leaf->n);
+    if (i == 0 || leaf->entries[i - 1].first != a) return;
+    for (size_t j = i; j < leaf->n; j++)
+      leaf->entries[j - 1] = leaf->entries[j];
+    leaf->n--;
+    size_--;
+    if (leaf->n > 0) return;
+
+    // Remove the empty leaf and the inner nodes which become empty.
+    if (leaf->prev) leaf->prev->next = leaf->next;
+    else first_leaf_ = leaf->next;
+    if (leaf->next) leaf->next->prev = leaf->prev;
+    FreeNode(leaf);
+    while (height > 0) {
+      height--;
+      Inner *parent = path[height];
+      size_t pos = path_pos[height];
+      for (size_t j = pos + 1; j < parent->n; j++) {
+        parent->keys[j - 1] = parent->keys[j];
+        parent->children[j - 1] = parent->children[j];
+      }
+      parent->n--;
+      if (parent->n > 0) return;
+      FreeNode(parent);
+    }
+    root_ = NULL;
+    first_leaf_ = NULL;
+  }
+
+  Leaf *NewLeaf() {
+    Leaf *leaf = free_leaves_;
+    if (leaf) {
+      free_leaves_ = leaf->next;
+    } else {
+      leaf = new Leaf;
+      n_node_bytes_ += sizeof(Leaf);
+    }
+    leaf->is_leaf = true;
+    leaf->n = 0;
+    return leaf;
+  }
+
+  Inner *NewInner() {
+    Inner *inner = free_inners_;
+    if (inner) {
+      free_inners_ = static_cast<Inner*>(inner->children[0]);
+    } else {
+      inner = new Inner;
+      n_node_bytes_ += sizeof(Inner);
+    }
+    inner->is_leaf = false;
+    inner->n = 0;
+    return inner;
+  }
+
+  // A free node keeps its type, so that a concurrent reader never
+  // mistakes a leaf for an inner node.
+  void FreeNode(Node *node) {
+    if (node->is_leaf) {
+      Leaf *leaf = static_cast<Leaf*>(node);
+      leaf->next = free_leaves_;
+      free_leaves_ = leaf;
+    } else {
+      Inner *inner = static_cast<Inner*>(node);
+      inner->children[0] = free_inners_;
+      free_inners_ = inner;
+    }
   }
-  map_t map_;
+
+  void FreeSubtree(Node *node) {
+    if (!node->is_leaf) {
+      Inner *inner = static_cast<Inner*>(node);
+      for (size_t i = 0; i < inner->n; i++)
+        FreeSubtree(inner->children[i]);
+    }
+    FreeNode(node);
+  }
+
+  Node *root_;
+  Leaf *first_leaf_;
+  size_t size_;
+  uintptr_t seq_;  // Odd while the map is being changed.
+  Leaf *free_leaves_;
+  Inner *free_inners_;
+  size_t n_node_bytes_;
 };
 
 #endif  // TS_HEAP_INFO_
@@ -35,12 +35,25 @@
 // ------------- Includes ------------- {{{1
 #include "thread_sanitizer.h"
 #include "ts_events.h"
+#include "ts_event_trace.h"
 
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
 #include <ctype.h>
 #include <time.h>
 
+#ifndef _WIN32
+# include <sys/mman.h>
+# include <sys/stat.h>
+#endif
+
+#if defined(__GNUC__) && !defined(_WIN32)
+# define TS_OFFLINE_THREADED_ANALYSIS 1
+# include <pthread.h>
+#endif
+
 // ------------- Globals ------------- {{{1
 static map<string, int> *g_event_type_map;
 struct PcInfo {
@@ -52,6 +65,40 @@ struct PcInfo {
 
 static map<uintptr_t, PcInfo> *g_pc_info_map;
 
+// With --threaded_analysis g_pc_info_map is filled by the reader thread
+// and used by the analysis thread.
+#ifdef TS_OFFLINE_THREADED_ANALYSIS
+static pthread_mutex_t g_pc_info_map_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void AddPcInfo(uintptr_t pc, const PcInfo &pc_info) {
+#ifdef TS_OFFLINE_THREADED_ANALYSIS
+  pthread_mutex_lock(&g_pc_info_map_lock);
+#endif
+  (*g_pc_info_map)[pc] = pc_info;
+#ifdef TS_OFFLINE_THREADED_ANALYSIS
+  pthread_mutex_unlock(&g_pc_info_map_lock);
+#endif
+}
+
+static bool FindPcInfo(uintptr_t pc, PcInfo *pc_info) {
+#ifdef TS_OFFLINE_THREADED_ANALYSIS
+  pthread_mutex_lock(&g_pc_info_map_lock);
+#endif
+  map<uintptr_t, PcInfo>::iterator it = g_pc_info_map->find(pc);
+  bool found = it != g_pc_info_map->end();
+  if (found) {
+    *pc_info = it->second;
+  }
+#ifdef TS_OFFLINE_THREADED_ANALYSIS
+  pthread_mutex_unlock(&g_pc_info_map_lock);
+#endif
+  return found;
+}
+
+// Prints a '#>' comment or a PRINT_MESSAGE of the input.
+static void PrintMessage(const char *str);
+
 unsigned long offline_line_n;
 //------------- Read binary file Utils ------------ {{{1
 static const int kBufSize = 65536;
@@ -80,6 +127,110 @@ static bool ReadANSI(FILE *file, string *res) {
   *res = (char *)buf;
   return size == length;
 }
+
+//------------- Memory-mapped input ------------ {{{1
+// The whole input mapped into memory (or read into memory if it can not be
+// mapped, e.g. if it is a pipe). Used by --input_type=mmap which decodes
+// the same binary format as --input_type=bin w/o calling fread() per field.
+class MappedInput {
+ public:
+  explicit MappedInput(FILE *file)
+      : begin_(NULL), cur_(NULL), end_(NULL), mapped_size_(0) {
+#ifndef _WIN32
+    struct stat st;
+    int fd = fileno(file);
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+        ftell(file) == 0) {
+      void *mem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (mem != MAP_FAILED) {
+        madvise(mem, st.st_size, MADV_SEQUENTIAL);
+        mapped_size_ = st.st_size;
+        begin_ = (const unsigned char*)mem;
+        cur_ = begin_;
+        end_ = begin_ + mapped_size_;
+        return;
+      }
+    }
+#endif
+    size_t capacity = kBufSize, size = 0;
+    unsigned char *buf = (unsigned char*)malloc(capacity);
+    CHECK(buf);
+    while (true) {
+      size += fread(buf + size, 1, capacity - size, file);
+      if (size < capacity) break;
+      capacity *= 2;
+      buf = (unsigned char*)realloc(buf, capacity);
+      CHECK(buf);
+    }
+    begin_ = buf;
+    cur_ = begin_;
+    end_ = begin_ + size;
+  }
+
+  ~MappedInput() {
+#ifndef _WIN32
+    if (mapped_size_) {
+      munmap((void*)begin_, mapped_size_);
+      return;
+    }
+#endif
+    free((void*)begin_);
+  }
+
+  // Consumes n bytes and returns a pointer to them, or NULL if the input
+  // has less than n bytes left.
+  const unsigned char *Consume(size_t n) {
+    if (UNLIKELY((size_t)(end_ - cur_) < n)) {
+      cur_ = end_;
+      return NULL;
+    }
+    const unsigned char *res = cur_;
+    cur_ += n;
+    return res;
+  }
+
+  void PrefetchAhead() {
+#ifdef __GNUC__
+    __builtin_prefetch(cur_ + kPrefetchDistance);
+#endif
+  }
+
+  const unsigned char *data() const { return begin_; }
+  size_t size() const { return end_ - begin_; }
+
+ private:
+  static const int kPrefetchDistance = 512;
+
+  const unsigned char *begin_;
+  const unsigned char *cur_;
+  const unsigned char *end_;
+  size_t mapped_size_;
+};
+
+template<typename T>
+static bool Read(MappedInput *input, T *res) {
+  const unsigned char *buf = input->Consume(sizeof(T));
+  *res = 0;
+  if (!buf) return false;
+  for (unsigned int i=0; i<sizeof(T); i++) {
+    *res <<= 8;
+    *res += buf[i];
+  }
+  return true;
+}
+
+static bool ReadANSI(MappedInput *input, string *res) {
+  unsigned short length;
+  if (!Read<unsigned short>(input, &length)) {
+    return false;
+  }
+  const char *buf = (const char*)input->Consume(length);
+  if (!buf) return false;
+  // Like the FILE* version, stop at the first zero byte.
+  const char *zero = (const char*)memchr(buf, 0, length);
+  res->assign(buf, zero ? zero - buf : length);
+  return true;
+}
 //------------- Utils ------------------- {{{1
 static EventType EventNameToEventType(const char *name) {
   map<string, int>::iterator it = g_event_type_map->find(name);
@@ -126,13 +277,13 @@ static void SkipCommentText(FILE *file) {
       pc_info.rtn_name = rtn;
       pc_info.file_name = file;
       pc_info.line = line;
-      (*g_pc_info_map)[pc] = pc_info;
+      AddPcInfo(pc, pc_info);
       // Printf("***** PC %lx %s\n", pc, rtn);
     }
   }
   if (buff[0] == '>') {
     // Just print the rest of comment.
-    Printf("%s\n", buff + 2);
+    PrintMessage(buff + 2);
   }
 }
 
@@ -167,18 +318,21 @@ bool ReadOneStrEventFromFile(FILE *file, Event *event) {
   return false;
 }
 
-bool ProcessCodePosition(FILE *input, int *pc, string *str) {
+template<class Input>
+bool ProcessCodePosition(Input *input, int *pc, string *str) {
   bool ok = Read<int>(input, pc);
   ok &= ReadANSI(input, str);
   return ok;
 }
 
-bool ProcessMessage(FILE *input, string *str) {
+template<class Input>
+bool ProcessMessage(Input *input, string *str) {
   return ReadANSI(input, str);
 }
 
 // Read information about event in format: [[[info] address] pc] tid.
-bool ProcessEvent(FILE *input, EventType type, Event *event) {
+template<class Input>
+bool ProcessEvent(Input *input, EventType type, Event *event) {
   bool ok = true;
   unsigned short tid = 0;
   int pc = 0;
@@ -192,6 +346,7 @@ bool ProcessEvent(FILE *input, EventType type, Event *event) {
     case READ:
     case READER_LOCK:
     case SIGNAL:
+    case THR_JOIN_BEFORE:
     case THR_JOIN_AFTER:
     case UNLOCK:
     case WAIT:
@@ -223,7 +378,8 @@ bool ProcessEvent(FILE *input, EventType type, Event *event) {
   return ok;
 }
 
-bool ReadOneBinEventFromFile(FILE *input, Event *event) {
+template<class Input>
+static bool ReadOneBinEvent(Input *input, Event *event) {
   CHECK(event);
   bool ok = true;
   EventType type;
@@ -248,13 +404,13 @@ bool ReadOneBinEventFromFile(FILE *input, Event *event) {
           pc_info.rtn_name = rtn;
           pc_info.file_name = file;
           pc_info.line = line;
-          (*g_pc_info_map)[pc] = pc_info;
+          AddPcInfo(pc, pc_info);
         }
         break;
       case PRINT_MESSAGE:
         ok &= ProcessMessage(input, &str);
         // Just print the rest of comment.
-        Printf("%s\n", str.c_str());
+        PrintMessage(str.c_str());
         break;
       default:
         ok &= ProcessEvent(input, type, event);
@@ -264,6 +420,10 @@ bool ReadOneBinEventFromFile(FILE *input, Event *event) {
   return false;
 }
 
+bool ReadOneBinEventFromFile(FILE *input, Event *event) {
+  return ReadOneBinEvent(input, event);
+}
+
 void DecodeEventsFromFile(FILE *input, FILE *output) {
   offline_line_n = 0;
   bool ok = true;
@@ -297,15 +457,219 @@ void DecodeEventsFromFile(FILE *input, FILE *output) {
   Printf("INFO: ThreadSanitizer write %ld lines.\n", offline_line_n);
 }
 
+//------------- Threaded analysis ------------ {{{1
+#ifdef TS_OFFLINE_THREADED_ANALYSIS
+// With --threaded_analysis the events are read and parsed by the main thread
+// and handled by a separate analysis thread, so that parsing of the input
+// (which is often as expensive as the analysis itself) uses another core.
+// The threads communicate via a single-producer/single-consumer ring.
+// The events are handled in exactly the same order as w/o the flag.
+// The messages of the input are passed through the ring as well (see
+// PrintMessage), so the output is also the same.
+class EventRing {
+ public:
+  EventRing() : head_(0), write_pos_(0), cached_head_(0),
+                tail_(0), read_pos_(0), cached_tail_(0), closed_(0) { }
+
+  // Producer side. The new events become visible to the consumer in batches.
+  void Push(const Event &event) {
+    while (write_pos_ - cached_head_ == kSize) {
+      Publish(&tail_, write_pos_);
+      cached_head_ = AcquireLoad(&head_);
+      if (write_pos_ - cached_head_ == kSize) YIELD();
+    }
+    events_[write_pos_ & (kSize - 1)] = event;
+    write_pos_++;
+    if ((write_pos_ & (kBatchSize - 1)) == 0)
+      Publish(&tail_, write_pos_);
+  }
+
+  void Close() {
+    Publish(&tail_, write_pos_);
+    Publish(&closed_, 1);
+  }
+
+  // Consumer side. Returns false if the ring is closed and empty.
+  bool Pop(Event *event) {
+    while (read_pos_ == cached_tail_) {
+      Publish(&head_, read_pos_);
+      // Read 'closed_' before 'tail_' so that we don't miss the last events.
+      bool closed = AcquireLoad(&closed_);
+      cached_tail_ = AcquireLoad(&tail_);
+      if (read_pos_ != cached_tail_) break;
+      if (closed) return false;
+      YIELD();
+    }
+    *event = events_[read_pos_ & (kSize - 1)];
+    read_pos_++;
+    if ((read_pos_ & (kBatchSize - 1)) == 0)
+      Publish(&head_, read_pos_);
+    return true;
+  }
+
+ private:
+  static const uintptr_t kSize = 1 << 16;
+  static const uintptr_t kBatchSize = 256;
+
+  static uintptr_t AcquireLoad(volatile uintptr_t *ptr) {
+#ifdef __ATOMIC_ACQUIRE
+    return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+#else
+    uintptr_t res = *ptr;
+    __sync_synchronize();
+    return res;
+#endif
+  }
+
+  static void Publish(volatile uintptr_t *ptr, uintptr_t value) {
+#ifdef __ATOMIC_RELEASE
+    __atomic_store_n(ptr, value, __ATOMIC_RELEASE);
+#else
+    __sync_synchronize();
+    *ptr = value;
+#endif
+  }
+
+  // Keep the consumer's and the producer's data in different cache lines.
+  volatile uintptr_t head_;
+  char pad0_[64];
+  uintptr_t write_pos_;
+  uintptr_t cached_head_;
+  volatile uintptr_t tail_;
+  char pad1_[64];
+  uintptr_t read_pos_;
+  uintptr_t cached_tail_;
+  volatile uintptr_t closed_;
+  char pad2_[64];
+  Event events_[kSize];
+};
+
+// The ring of ReadEvents() if the analysis thread is running.
+static EventRing *g_ring;
+
+static void *AnalysisThread(void *arg) {
+  EventRing *ring = (EventRing*)arg;
+  Event event;
+  while (ring->Pop(&event)) {
+    if (event.type() == PRINT_MESSAGE) {
+      char *str = (char*)event.a();
+      Printf("%s\n", str);
+      delete [] str;
+      continue;
+    }
+    ThreadSanitizerHandleOneEvent(&event);
+  }
+  return NULL;
+}
+#endif  // TS_OFFLINE_THREADED_ANALYSIS
+
+static void PrintMessage(const char *str) {
+#ifdef TS_OFFLINE_THREADED_ANALYSIS
+  if (g_ring) {
+    // The events read before the message may still be in the ring.
+    size_t size = strlen(str) + 1;
+    char *copy = new char[size];
+    memcpy(copy, str, size);
+    Event event;
+    event.Init(PRINT_MESSAGE, 0, 0, (uintptr_t)copy, 0);
+    g_ring->Push(event);
+    return;
+  }
+#endif
+  Printf("%s\n", str);
+}
+
+//------------- Read events ------------ {{{1
 static const uint32_t max_unknown_thread = 10000;
 
 static bool known_threads[max_unknown_thread] = {};
 
-INLINE void ReadEventsFromFile(FILE *file, EventReader event_reader_cb) {
+// Reads events from a FILE* using one of the EventReader functions.
+class FileEventReader {
+ public:
+  FileEventReader(FILE *file, EventReader event_reader_cb)
+      : file_(file), event_reader_cb_(event_reader_cb) { }
+  bool Next(Event *event) { return event_reader_cb_(file_, event); }
+ private:
+  FILE *file_;
+  EventReader event_reader_cb_;
+};
+
+// Reads events in the binary format from a MappedInput.
+class MappedBinEventReader {
+ public:
+  explicit MappedBinEventReader(MappedInput *input) : input_(input) { }
+  bool Next(Event *event) {
+    input_->PrefetchAhead();
+    return ReadOneBinEvent(input_, event);
+  }
+ private:
+  MappedInput *input_;
+};
+
+// With --dump_events=<file> the events are also written to an event trace,
+// e.g. to convert the old formats into the compact one. Like in tsan_rtl,
+// each thread has its own buffer.
+static EventTraceWriter *g_trace_writer;
+static map<int32_t, EventTraceWriter::ThreadBuffer*> *g_trace_buffers;
+
+static void PutEventToTrace(const Event &event) {
+  EventTraceWriter::ThreadBuffer *&buf = (*g_trace_buffers)[event.tid()];
+  if (!buf) {
+    buf = g_trace_writer->NewThreadBuffer();
+  }
+  g_trace_writer->Put(buf, event.type(), event.tid(),
+                      event.pc(), event.a(), event.info());
+}
+
+static void OpenTraceWriter() {
+  if (G_flags->dump_events.empty()) return;
+  FILE *file = fopen(G_flags->dump_events.c_str(), "wb");
+  if (!file) {
+    Printf("Error: can not open %s\n", G_flags->dump_events.c_str());
+    exit(5);
+  }
+  g_trace_writer = new EventTraceWriter(file);
+  g_trace_buffers = new map<int32_t, EventTraceWriter::ThreadBuffer*>;
+}
+
+static void CloseTraceWriter() {
+  if (!g_trace_writer) return;
+  for (map<int32_t, EventTraceWriter::ThreadBuffer*>::iterator it =
+       g_trace_buffers->begin(); it != g_trace_buffers->end(); ++it) {
+    g_trace_writer->DeleteThreadBuffer(it->second);
+  }
+  delete g_trace_buffers;
+  for (map<uintptr_t, PcInfo>::iterator it = g_pc_info_map->begin();
+       it != g_pc_info_map->end(); ++it) {
+    const PcInfo &info = it->second;
+    g_trace_writer->AddPcDescription(it->first, info.img_name, info.rtn_name,
+                                     info.file_name, info.line);
+  }
+  g_trace_writer->Close();
+  Printf("INFO: ThreadSanitizerOffline: %ld events (%ld bytes) written to %s\n",
+         (long)g_trace_writer->n_events(), (long)g_trace_writer->n_bytes(),
+         G_flags->dump_events.c_str());
+  delete g_trace_writer;
+  g_trace_writer = NULL;
+}
+
+template<class Reader>
+static void ReadEvents(Reader *reader) {
   Event event;
   uint64_t n_events = 0;
   offline_line_n = 0;
-  while (event_reader_cb(file, &event)) {
+  size_t start_time = TimeInMilliSeconds();
+#ifdef TS_OFFLINE_THREADED_ANALYSIS
+  EventRing *ring = NULL;
+  pthread_t analysis_thread;
+  if (G_flags->threaded_analysis) {
+    ring = new EventRing;
+    g_ring = ring;
+    CHECK(0 == pthread_create(&analysis_thread, NULL, AnalysisThread, ring));
+  }
+#endif
+  while (reader->Next(&event)) {
     //event.Print();
     n_events++;
     uint32_t tid = event.tid();
@@ -313,24 +677,74 @@ INLINE void ReadEventsFromFile(FILE *file, EventReader event_reader_cb) {
       known_threads[tid] = true;
     }
     if (tid >= max_unknown_thread || known_threads[tid]) {
+      if (g_trace_writer) {
+        PutEventToTrace(event);
+      }
+#ifdef TS_OFFLINE_THREADED_ANALYSIS
+      if (ring) {
+        ring->Push(event);
+        continue;
+      }
+#endif
       ThreadSanitizerHandleOneEvent(&event);
     }
   }
+#ifdef TS_OFFLINE_THREADED_ANALYSIS
+  if (ring) {
+    ring->Close();
+    CHECK(0 == pthread_join(analysis_thread, NULL));
+    g_ring = NULL;
+    delete ring;
+  }
+#endif
   Printf("INFO: ThreadSanitizerOffline: %ld events read\n", n_events);
+  size_t time_ms = TimeInMilliSeconds() - start_time;
+  Printf("INFO: ThreadSanitizerOffline: %ld ms, %ld events/sec\n",
+         (long)time_ms, (long)(n_events * 1000 / (time_ms ? time_ms : 1)));
+}
+
+static void ReadEventsFromFile(FILE *file, EventReader event_reader_cb) {
+  FileEventReader reader(file, event_reader_cb);
+  ReadEvents(&reader);
+}
+
+static void ReadEventsFromMappedFile(FILE *file) {
+  MappedInput input(file);
+  Printf("INFO: ThreadSanitizerOffline: %ld bytes of input\n",
+         (long)input.size());
+  MappedBinEventReader reader(&input);
+  ReadEvents(&reader);
+}
+
+static void ReadEventsFromTraceFile(FILE *file) {
+  MappedInput input(file);
+  Printf("INFO: ThreadSanitizerOffline: %ld bytes of input\n",
+         (long)input.size());
+  EventTraceReader reader(input.data(), input.size());
+  if (!reader.ReadHeader()) {
+    exit(5);
+  }
+  uintptr_t pc;
+  PcInfo pc_info;
+  while (reader.NextPcDescription(&pc, &pc_info.img_name, &pc_info.rtn_name,
+                                  &pc_info.file_name, &pc_info.line)) {
+    AddPcInfo(pc, pc_info);
+  }
+  ReadEvents(&reader);
 }
 //------------- ThreadSanitizer exports ------------ {{{1
 
 void PcToStrings(uintptr_t pc, bool demangle,
                 string *img_name, string *rtn_name,
                 string *file_name, int *line_no) {
-  if (g_pc_info_map->count(pc) == 0) {
+  PcInfo info;
+  if (!FindPcInfo(pc, &info)) {
     *img_name = "";
     *rtn_name = "";
     *file_name = "";
     *line_no = 0;
     return;
   }
-  PcInfo &info = (*g_pc_info_map)[pc];
   *img_name = info.img_name;
   *rtn_name = info.rtn_name;
   *file_name = info.file_name;
@@ -358,8 +772,19 @@ int main(int argc, char *argv[]) {
   ThreadSanitizerInit();
 
   CHECK(G_flags);
+#ifndef TS_OFFLINE_THREADED_ANALYSIS
+  if (G_flags->threaded_analysis) {
+    Printf("INFO: --threaded_analysis is not supported on this platform\n");
+    G_flags->threaded_analysis = false;
+  }
+#endif
+  OpenTraceWriter();
   if (G_flags->input_type == "bin") {
     ReadEventsFromFile(stdin, ReadOneBinEventFromFile);
+  } else if (G_flags->input_type == "mmap") {
+    ReadEventsFromMappedFile(stdin);
+  } else if (G_flags->input_type == "trace") {
+    ReadEventsFromTraceFile(stdin);
   } else if (G_flags->input_type == "decode") {
     FILE* output;
     if (G_flags->log_file.size() > 0) {
@@ -374,6 +799,7 @@ int main(int argc, char *argv[]) {
     Printf("Error: Unknown input_type value %s\n", G_flags->input_type.c_str());
     exit(5);
   }
+  CloseTraceWriter();
 
   ThreadSanitizerFini();
   if (G_flags->error_exitcode && GetNumberOfFoundErrors() > 0) {
@@ -3437,6 +3437,15 @@ static void MaybeInstrumentOneRoutine(IMG img, RTN rtn) {
   INSERT_BEFORE_0("exit", On_exit);
 }
 
+// Pin calls this function every time an img is unloaded.
+// Another img may be loaded at the same address later.
+static void CallbackForIMGUnload(IMG img, void *v) {
+  if (debug_wrap) {
+    Printf("CallbackForIMGUnload %s\n", IMG_Name(img).c_str());
+  }
+  ThreadSanitizerForgetPcDecisions();
+}
+
 // Pin calls this function every time a new img is loaded.
 static void CallbackForIMG(IMG img, void *v) {
   if (debug_wrap) {
@@ -3651,6 +3660,7 @@ int main(INT32 argc, CHAR **argv) {
   PIN_AddThreadFiniFunction(CallbackForThreadFini, 0);
   PIN_AddFiniFunction(CallbackForFini, 0);
   IMG_AddInstrumentFunction(CallbackForIMG, 0);
+  IMG_AddUnloadFunction(CallbackForIMGUnload, 0);
   TRACE_AddInstrumentFunction(CallbackForTRACE, 0);
   PIN_AddFollowChildProcessFunction(CallbackForExec, NULL);
 
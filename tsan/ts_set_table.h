@@ -0,0 +1,169 @@
+/* Copyright (c) 2011, Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// This file is part of ThreadSanitizer, a dynamic data race detector.
+#ifndef TS_SET_TABLE_
+#define TS_SET_TABLE_
+
+#include "ts_util.h"
+
+// -------- SetTable ------ {{{1
+// Hash-consed storage of immutable sorted arrays of T ("sets").
+// Every distinct set gets a positive id, ids are allocated consecutively
+// starting from 1. The elements of all sets are kept in a bump arena
+// allocated in big chunks and never freed, so looking up a set which is
+// already in the table does not allocate.
+// T must be a POD type with operator== and a raw() accessor.
+template <class T>
+class SetTable {
+ public:
+  // A view of one set in the table.
+  class Set {
+   public:
+    typedef const T *const_iterator;
+    Set() : ptr_(NULL), size_(0) { }
+    Set(const T *ptr, size_t size) : ptr_(ptr), size_(size) { }
+    size_t size() const { return size_; }
+    const_iterator begin() const { return ptr_; }
+    const_iterator end()   const { return ptr_ + size_; }
+    const T &operator [] (size_t i) const {
+      DCHECK(i < size_);
+      return ptr_[i];
+    }
+    bool has(const T &t) const {
+      return binary_search(begin(), end(), t);
+    }
+   private:
+    const T *ptr_;
+    size_t size_;
+  };
+
+  SetTable()
+      : table_(kInitialTableSize, 0),
+        chunk_pos_(kChunkSize),
+        chunk_(NULL),
+        n_bytes_(0) { }
+
+  // Number of distinct sets in the table.
+  size_t size() const { return entries_.size(); }
+
+  // Total size of the memory allocated for the elements.
+  size_t n_bytes() const { return n_bytes_; }
+
+  Set Get(int32_t id) const {
+    DCHECK(id > 0 && id <= static_cast<int32_t>(entries_.size()));
+    const Entry &e = entries_[id - 1];
+    return Set(e.elements, e.size);
+  }
+
+  // Returns the id of the set [begin, begin + size), adding the set to
+  // the table if it is not there yet. *is_new is set if it was added.
+  int32_t Intern(const T *begin, size_t size, bool *is_new) {
+    uint32_t hash = Hash(begin, size);
+    size_t mask = table_.size() - 1;
+    size_t i = hash & mask;
+    for (; table_[i] != 0; i = (i + 1) & mask) {
+      const Entry &e = entries_[table_[i] - 1];
+      if (e.hash == hash && e.size == size &&
+          equal(begin, begin + size, e.elements)) {
+        *is_new = false;
+        return table_[i];
+      }
+    }
+    *is_new = true;
+    Entry e;
+    e.hash = hash;
+    e.size = size;
+    e.elements = Allocate(size);
+    copy(begin, begin + size, e.elements);
+    entries_.push_back(e);
+    int32_t id = entries_.size();
+    table_[i] = id;
+    // Keep the load factor of the table below 1/2.
+    if (entries_.size() * 2 > table_.size()) {
+      Rehash(table_.size() * 2);
+    }
+    return id;
+  }
+
+ private:
+  struct Entry {
+    uint32_t hash;
+    uint32_t size;
+    T *elements;
+  };
+
+  static const size_t kInitialTableSize = 1024;
+  static const size_t kChunkSize = 1 << 14;  // In elements.
+
+  static uint32_t Hash(const T *begin, size_t size) {
+    uint32_t hash = static_cast<uint32_t>(size) * 0x9e3779b9U;
+    for (size_t i = 0; i < size; i++) {
+      hash = (hash ^ static_cast<uint32_t>(begin[i].raw())) * 0x01000193U;
+      hash ^= hash >> 15;
+    }
+    return hash;
+  }
+
+  void Rehash(size_t new_size) {
+    table_.assign(new_size, 0);
+    size_t mask = new_size - 1;
+    for (size_t id = 1; id <= entries_.size(); id++) {
+      size_t i = entries_[id - 1].hash & mask;
+      while (table_[i] != 0)
+        i = (i + 1) & mask;
+      table_[i] = id;
+    }
+  }
+
+  T *Allocate(size_t size) {
+    // Big sets get their own block.
+    if (size > kChunkSize / 16) {
+      n_bytes_ += size * sizeof(T);
+      return new T[size];
+    }
+    if (chunk_pos_ + size > kChunkSize) {
+      chunk_ = new T[kChunkSize];
+      chunk_pos_ = 0;
+      n_bytes_ += kChunkSize * sizeof(T);
+    }
+    T *res = chunk_ + chunk_pos_;
+    chunk_pos_ += size;
+    return res;
+  }
+
+  vector<Entry> entries_;  // Indexed by id - 1.
+  // Open addressing hash table of ids, 0 means an empty slot.
+  // The size is a power of two.
+  vector<int32_t> table_;
+  size_t chunk_pos_;
+  T *chunk_;
+  size_t n_bytes_;
+};
+
+// end. {{{1
+#endif  // TS_SET_TABLE_
+// vim:shiftwidth=2:softtabstop=2:expandtab:tw=80
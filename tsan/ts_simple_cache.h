@@ -105,6 +105,74 @@ class IntPairToBoolCache {
   uint32_t arr_[kSize * 2];
 };
 
+// -------- AdaptiveIntPairToIntCache ------ {{{1
+// Maps two integers to an integer; (0, 0) is never found.
+// A direct-mapped cache which starts with kMinSize entries and doubles
+// (dropping its contents) when more than 1/8 of the lookups miss, until it
+// reaches kMaxSize entries. The miss rate is computed over windows of
+// 4 * size() lookups.
+// kMinSize and kMaxSize must be powers of two.
+template <int32_t kMinSize, int32_t kMaxSize>
+class AdaptiveIntPairToIntCache {
+ public:
+  AdaptiveIntPairToIntCache()
+    : arr_(NULL), size_(0), n_lookups_(0), n_misses_(0) {
+    Resize(kMinSize);
+  }
+  ~AdaptiveIntPairToIntCache() {
+    delete [] arr_;
+  }
+  void Flush() {
+    memset(arr_, 0, size_ * sizeof(Entry));
+  }
+  void Insert(int32_t a, int32_t b, int32_t val) {
+    Entry &e = arr_[idx(a, b)];
+    e.a = a;
+    e.b = b;
+    e.val = val;
+  }
+  bool Lookup(int32_t a, int32_t b, int32_t *val) {
+    n_lookups_++;
+    const Entry &e = arr_[idx(a, b)];
+    if (e.a == a && e.b == b && (a | b) != 0) {
+      *val = e.val;
+      return true;
+    }
+    n_misses_++;
+    if (n_lookups_ >= 4 * size_) {
+      if (n_misses_ > n_lookups_ / 8 && size_ < (uint32_t)kMaxSize) {
+        Resize(size_ * 2);
+      }
+      n_lookups_ = n_misses_ = 0;
+    }
+    return false;
+  }
+  uint32_t size() const { return size_; }
+ private:
+  struct Entry {
+    int32_t a, b, val;
+  };
+  void Resize(uint32_t size) {
+    DCHECK((size & (size - 1)) == 0);
+    delete [] arr_;
+    arr_ = new Entry[size];
+    size_ = size;
+    n_lookups_ = n_misses_ = 0;
+    Flush();
+  }
+  uint32_t idx(int32_t a, int32_t b) const {
+    uint32_t h = (uint32_t)a * 0x9e3779b1U + (uint32_t)b;
+    h ^= h >> 16;
+    h *= 0x85ebca6bU;
+    h ^= h >> 13;
+    return h & (size_ - 1);
+  }
+  Entry *arr_;
+  uint32_t size_;
+  uint32_t n_lookups_;  // Since the start of the window.
+  uint32_t n_misses_;
+};
+
 // end. {{{1
 #endif  // TS_SIMPLE_CACHE_
 // vim:shiftwidth=2:softtabstop=2:expandtab:tw=80
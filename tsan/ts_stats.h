@@ -44,6 +44,13 @@ struct ThreadLocalStats {
   uintptr_t memory_access_sizes[18];
   uintptr_t events[LAST_EVENT];
   uintptr_t unlocked_access_ok;
+  uintptr_t unlocked_fetch;
+  // Cache lines are fetched and written back w/o the global lock.
+  uintptr_t cache_new_line;
+  uintptr_t cache_delete_empty_line;
+  uintptr_t cache_fetch;
+  uintptr_t cache_compress, cache_compress_fail, cache_expand;
+  uintptr_t unlocked_concurrent_reads;
   uintptr_t n_fast_access1, n_fast_access2, n_fast_access4, n_fast_access8,
             n_slow_access1, n_slow_access2, n_slow_access4, n_slow_access8,
             n_very_slow_access, n_access_slow_iter;
@@ -72,6 +79,10 @@ struct Stats : private ThreadLocalStats {
                          "Race on ignore_below_cache_miss");
     ANNOTATE_BENIGN_RACE_SIZED(msm_branch_count, sizeof(msm_branch_count),
                                "Race on msm_branch_count[]");
+    // Cache lines may be fetched w/o the global lock, the maximum is
+    // approximate.
+    ANNOTATE_BENIGN_RACE(&cache_max_storage_size,
+                         "Race on cache_max_storage_size");
   }
 
   void Add(const ThreadLocalStats &s) {
@@ -115,7 +126,12 @@ struct Stats : private ThreadLocalStats {
     Printf("   Publish: set: %'ld; get: %'ld; clear: %'ld\n",
            publish_set, publish_get, publish_clear);
 
-    Printf("   PcTo: all: %'ld\n", pc_to_strings);
+    Printf("   PcTo: all: %'ld; decision cache flushes: %'ld\n",
+           pc_to_strings, pc_decision_flushes);
+    Printf("   Suppression checks: matched: %'ld; cached: %'ld\n",
+           supp_check_miss, supp_check_hit);
+    Printf("   Deferred reports: %'ld; flushes: %'ld\n",
+           reports_deferred, deferred_report_flushes);
 
     Printf("   StackTrace: create: %'ld; delete %'ld\n",
            stack_trace_create, stack_trace_delete);
@@ -125,6 +141,7 @@ struct Stats : private ThreadLocalStats {
            history_uses_same_segment, history_reuses_segment,
            history_uses_preallocated_segment, history_creates_new_segment);
     Printf("   Forget all history: %'ld\n", n_forgets);
+    PrintStatsForCollector();
 
     PrintStatsForSeg();
     PrintStatsForSS();
@@ -162,15 +179,47 @@ struct Stats : private ThreadLocalStats {
            "    new       = %'ld\n"
            "    delete    = %'ld\n"
            "    fetch     = %'ld\n"
+           "    compress  = %'ld (failed: %'ld)\n"
+           "    expand    = %'ld\n"
            "    storage   = %'ld\n",
            cache_new_line,
            cache_delete_empty_line, cache_fetch,
+           cache_compress, cache_compress_fail, cache_expand,
            cache_max_storage_size);
   }
 
   void PrintStatsForSeg() {
-    Printf("   Segment: created: %'ld; reused: %'ld\n",
-           seg_create, seg_reuse);
+    Printf("   Segment: created: %'ld; reused: %'ld; recycled: %'ld\n",
+           seg_create, seg_reuse, seg_recycle);
+  }
+
+  // Bucket 0 counts zeros, bucket i counts values in [2**(i-1), 2**i),
+  // the last bucket counts all larger values.
+  static size_t Log2Bucket(uintptr_t value, size_t n_buckets) {
+    size_t bucket = 0;
+    while (value && bucket + 1 < n_buckets) {
+      value >>= 1;
+      bucket++;
+    }
+    return bucket;
+  }
+
+  void PrintStatsForCollector() {
+    if (gc_slices == 0) return;
+    Printf("   Collector: cycles: %'ld; slices: %'ld; lines: %'ld"
+           " (compressed: %'ld); svals: %'ld\n",
+           gc_cycles, gc_slices, gc_lines, gc_compressed_lines,
+           gc_svals_changed);
+    for (size_t i = 0; i < TS_ARRAY_SIZE(gc_collected_per_slice); i++) {
+      if (gc_collected_per_slice[i])
+        Printf("     collected per slice < %'ld: %'ld\n",
+               (uintptr_t)1 << i, gc_collected_per_slice[i]);
+    }
+    for (size_t i = 0; i < TS_ARRAY_SIZE(gc_pause_us); i++) {
+      if (gc_pause_us[i])
+        Printf("     pause < %'ldus: %'ld\n",
+               (uintptr_t)1 << i, gc_pause_us[i]);
+    }
   }
 
   void PrintStatsForLS() {
@@ -215,6 +264,8 @@ struct Stats : private ThreadLocalStats {
     Printf("lock_sites[*]=%ld\n", total_locks);
     Printf("futex_wait   =%ld\n", futex_wait);
     Printf("unlocked_access_ok =%'ld\n", unlocked_access_ok);
+    Printf("unlocked_fetch     =%'ld\n", unlocked_fetch);
+    Printf("unlocked_concurrent_reads =%'ld\n", unlocked_concurrent_reads);
     uintptr_t all_locked_access = 0;
     for (size_t i = 0; i < TS_ARRAY_SIZE(locked_access); i++) {
       uintptr_t t = locked_access[i];
@@ -238,6 +289,9 @@ struct Stats : private ThreadLocalStats {
     }
     if (read_proc_self_stats)
       Printf("read_proc_self_stats   =%ld\n", read_proc_self_stats);
+    if (mem_checks)
+      Printf("mem_checks=%ld recycle_requests=%ld collect_requests=%ld\n",
+             mem_checks, mem_recycle_requests, mem_collect_requests);
   }
 
 
@@ -252,9 +306,6 @@ struct Stats : private ThreadLocalStats {
             ls_cache_fast,
             ls_size_2, ls_size_3, ls_size_4, ls_size_5, ls_size_other;
 
-  uintptr_t cache_new_line;
-  uintptr_t cache_delete_empty_line;
-  uintptr_t cache_fetch;
   uintptr_t cache_max_storage_size;
 
   uintptr_t mops_total;
@@ -269,16 +320,27 @@ struct Stats : private ThreadLocalStats {
 
   uintptr_t sshash_calls, sseq_calls;
 
-  uintptr_t seg_create, seg_reuse;
+  uintptr_t seg_create, seg_reuse, seg_recycle;
 
   uintptr_t publish_set, publish_get, publish_clear;
 
   uintptr_t pc_to_strings;
+  uintptr_t pc_decision_flushes;
+
+  uintptr_t supp_check_hit, supp_check_miss;
+
+  uintptr_t reports_deferred, deferred_report_flushes;
 
   uintptr_t stack_trace_create, stack_trace_delete;
 
   uintptr_t n_forgets;
 
+  // Incremental state collection, see StateCollector.
+  uintptr_t gc_cycles, gc_slices, gc_lines, gc_svals_changed;
+  uintptr_t gc_compressed_lines;  // Swept w/o expanding.
+  uintptr_t gc_collected_per_slice[20];  // Log2Bucket(SIDs recycled).
+  uintptr_t gc_pause_us[20];             // Log2Bucket(microseconds).
+
   uintptr_t lock_sites[20];
 
   uintptr_t tleb_flush[10];
@@ -288,6 +350,9 @@ struct Stats : private ThreadLocalStats {
   uintptr_t try_acquire_line_spin;
   uintptr_t futex_wait;
   uintptr_t read_proc_self_stats;
+
+  // FlushIfOutOfMem.
+  uintptr_t mem_checks, mem_recycle_requests, mem_collect_requests;
 };
 
 
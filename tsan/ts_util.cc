@@ -57,15 +57,32 @@ int getpid() { return WINDOWS::GetCurrentProcessId(); }
 size_t TimeInMilliSeconds() {
   return VG_(read_millisecond_timer)();
 }
+// Valgrind has no finer timer.
+size_t TimeInMicroSeconds() {
+  return (size_t)VG_(read_millisecond_timer)() * 1000;
+}
 #else
-// TODO(kcc): implement this.
+#ifdef __GNUC__
+#include <sys/time.h>
+#endif
 size_t TimeInMilliSeconds() {
 #ifdef __GNUC__
-  return time(0) * 1000;
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (size_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
 #else
   return WINDOWS::timeGetTime();
 #endif
 }
+size_t TimeInMicroSeconds() {
+#ifdef __GNUC__
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (size_t)tv.tv_sec * 1000000 + tv.tv_usec;
+#else
+  return (size_t)WINDOWS::timeGetTime() * 1000;
+#endif
+}
 #endif
 
 Stats *G_stats;
@@ -220,20 +237,50 @@ long my_strtol(const char *str, char **end, int base) {
 // malloc to be called concurrently.
 MallocCostCenterStack g_malloc_stack;
 
-size_t GetVmSizeInMb() {
-#ifdef VGO_linux
-  const char *path ="/proc/self/statm";  // see 'man proc'
+#if defined(VGO_linux) || (defined(__linux__) && !defined(TS_VALGRIND))
+// Read the VM size and the resident set size (in pages) from
+// /proc/self/statm (see 'man proc'). The file is opened once per process,
+// reading it from the beginning gives the current values. A forked child
+// inherits the descriptor, which still describes the parent, so we reopen
+// the file when the pid changes.
+static bool ReadProcSelfStatm(size_t *vm_size_in_pages,
+                              size_t *rss_in_pages) {
+  const char *path ="/proc/self/statm";
+  static int fd = -1;
+  static int fd_pid = -1;
   uintptr_t counter = G_stats->read_proc_self_stats++;
   if (counter >= 1024 && ((counter & (counter - 1)) == 0))
     Report("INFO: reading %s for %ld'th time\n", path, counter);
-  int  fd = ThreadSanitizerOpenFileReadOnly(path, false);
-  if (fd < 0) return 0;
+  int pid = getpid();
+  if (fd >= 0 && fd_pid != pid) {
+    close(fd);
+    fd = -1;
+  }
+  if (fd < 0) {
+    fd = ThreadSanitizerOpenFileReadOnly(path, false);
+    if (fd < 0) return false;
+    fd_pid = pid;
+  }
   char buff[128];
+#ifdef VGO_linux
+  VG_(lseek)(fd, 0, VKI_SEEK_SET);
   int n_read = read(fd, buff, sizeof(buff) - 1);
+#else
+  int n_read = pread(fd, buff, sizeof(buff) - 1, 0);
+#endif
+  if (n_read <= 0) return false;
   buff[n_read] = 0;
-  close(fd);
   char *end;
-  size_t vm_size_in_pages = my_strtol(buff, &end, 10);
+  *vm_size_in_pages = my_strtol(buff, &end, 10);
+  *rss_in_pages = my_strtol(end, &end, 10);
+  return true;
+}
+#endif
+
+size_t GetVmSizeInMb() {
+#if defined(VGO_linux) || (defined(__linux__) && !defined(TS_VALGRIND))
+  size_t vm_size_in_pages, rss_in_pages;
+  if (!ReadProcSelfStatm(&vm_size_in_pages, &rss_in_pages)) return 0;
   return vm_size_in_pages >> 8;
 #elif defined(_WIN32)
   WINDOWS::MEMORYSTATUS ms;
@@ -244,6 +291,47 @@ size_t GetVmSizeInMb() {
 #endif
 }
 
+size_t GetRssInMb() {
+#if defined(VGO_linux) || (defined(__linux__) && !defined(TS_VALGRIND))
+  size_t vm_size_in_pages, rss_in_pages;
+  if (!ReadProcSelfStatm(&vm_size_in_pages, &rss_in_pages)) return 0;
+  return rss_in_pages >> 8;
+#else
+  return 0;
+#endif
+}
+
+bool MemLimitExceeded(int mem_size_in_mb, int minimal, int margin,
+                      int maximal, int *limit) {
+  if (*limit == 0) *limit = minimal;
+  if (mem_size_in_mb > *limit) {
+    *limit = min(mem_size_in_mb + margin, maximal);
+    return true;
+  }
+  *limit = min(*limit, max(minimal, mem_size_in_mb + margin));
+  return false;
+}
+
+size_t GetMemoryLimitInMbFromCgroup() {
+#if defined(__linux__) && !defined(TS_VALGRIND)
+  // cgroup v2, then cgroup v1. "max" or a huge number means no limit.
+  const char *paths[] = {
+    "/sys/fs/cgroup/memory.max",
+    "/sys/fs/cgroup/memory/memory.limit_in_bytes"
+  };
+  for (size_t i = 0; i < TS_ARRAY_SIZE(paths); i++) {
+    string contents = ThreadSanitizerReadFileToString(paths[i], false);
+    if (contents.empty()) continue;
+    if (contents[0] < '0' || contents[0] > '9') return 0;
+    char *end;
+    uint64_t limit = strtoull(contents.c_str(), &end, 10);
+    if (limit >= (1ULL << 50)) return 0;
+    return limit >> 20;
+  }
+#endif
+  return 0;
+}
+
 size_t GetMemoryLimitInMbFromProcSelfLimits() {
 #ifdef VGO_linux
   // Parse the memory limit section of /proc/self/limits.
@@ -501,6 +589,29 @@ void OpenFileWriteStringAndClose(const string &file_name, const string &str) {
 #endif
 }
 
+//--------- Reserved memory ------------------ {{{1
+#if defined(__linux__) && defined(__x86_64__) && \
+    !defined(TS_VALGRIND) && !defined(TS_PIN)
+#include <sys/mman.h>
+void *ReserveZeroedMemory(size_t size) {
+  void *res = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  return res == MAP_FAILED ? NULL : res;
+}
+
+void ReleaseZeroedMemory(void *ptr, size_t size) {
+  madvise(ptr, size, MADV_DONTNEED);
+}
+#else
+void *ReserveZeroedMemory(size_t size) {
+  return NULL;  // unimplemented.
+}
+
+void ReleaseZeroedMemory(void *ptr, size_t size) {
+  CHECK(0);
+}
+#endif
+
 //--------- Sockets ------------------ {{{1
 #if defined(TS_PIN) && defined(__GNUC__)
 #include <sys/types.h>
@@ -810,6 +921,10 @@ void ReleaseStore(uintptr_t *ptr, uintptr_t value) {
   // TODO(kcc): anything to add here?
 }
 
+uintptr_t AcquireLoad(const uintptr_t *ptr) {
+  return *(const volatile uintptr_t*)ptr;
+}
+
 int32_t NoBarrier_AtomicIncrement(int32_t* ptr) {
   return _InterlockedIncrement((volatile WINDOWS::LONG *)ptr);
 }
@@ -817,6 +932,17 @@ int32_t NoBarrier_AtomicIncrement(int32_t* ptr) {
 int32_t NoBarrier_AtomicDecrement(int32_t* ptr) {
   return _InterlockedDecrement((volatile WINDOWS::LONG *)ptr);
 }
+
+bool AtomicCompareAndSwap(int32_t *ptr, int32_t old_value, int32_t new_value) {
+  return _InterlockedCompareExchange((volatile WINDOWS::LONG *)ptr,
+                                     new_value, old_value) == old_value;
+}
+
+bool AtomicCompareAndSwap(uintptr_t *ptr, uintptr_t old_value,
+                          uintptr_t new_value) {
+  return (uintptr_t)_InterlockedCompareExchangePointer(
+      (void *volatile *)ptr, (void*)new_value, (void*)old_value) == old_value;
+}
 #endif  // _MSC_VER && TS_SERIALIZED
 //--------------- YIELD ----------------- {{{1
 #if defined (_MSC_VER)
@@ -205,6 +205,8 @@ using STD::set_intersection;
 using STD::lower_bound;
 using STD::copy;
 using STD::binary_search;
+using STD::upper_bound;
+using STD::equal;
 
 #ifdef TS_LLVM
 # include "tsan_rtl_wrap.h"
@@ -355,6 +357,7 @@ struct ThreadSanitizerReport;
 
 // Time since some moment before the program start.
 extern size_t TimeInMilliSeconds();
+extern size_t TimeInMicroSeconds();
 extern void YIELD();
 extern void PROCESSOR_YIELD();
 
@@ -366,9 +369,25 @@ string NormalizeFunctionName(const string &mangled_fname);
 
 string ThreadSanitizerReadFileToString(const string &file_name, bool die_if_failed);
 
-// Get the current memory footprint of myself (parse /proc/self/status).
+// Get the current memory footprint of myself (parse /proc/self/statm).
 size_t GetVmSizeInMb();
+// Same, but only the resident memory. Linux only, returns 0 elsewhere.
+size_t GetRssInMb();
 size_t GetMemoryLimitInMbFromProcSelfLimits();
+// The memory limit of our container (cgroup), if any. Linux only.
+size_t GetMemoryLimitInMbFromCgroup();
+
+// If 'mem_size_in_mb' is above '*limit', re-arms the limit 'margin' above
+// it, but not above 'maximal', and returns true. Otherwise the limit follows
+// a decreasing memory size down, but not below 'minimal'.
+bool MemLimitExceeded(int mem_size_in_mb, int minimal, int margin,
+                      int maximal, int *limit);
+
+// Reserve 'size' bytes of zero-filled address space. The memory is
+// committed lazily, when it is touched. Returns NULL if not supported.
+void *ReserveZeroedMemory(size_t size);
+// Give the pages of [ptr, ptr+size) back to the OS. They read as zeros again.
+void ReleaseZeroedMemory(void *ptr, size_t size);
 
 // Sets the contents of the file 'file_name' to 'str'.
 void OpenFileWriteStringAndClose(const string &file_name, const string &str);
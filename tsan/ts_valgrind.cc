@@ -1402,6 +1402,12 @@ static IRSB* ts_instrument ( VgCallbackClosure* closure,
 }
 
 extern "C"
+// Valgrind calls this when it discards a translation, e.g. when the code
+// is unmapped. New code may appear at the same address later.
+static void ts_discard_superblock(Addr64 orig_addr, VexGuestExtents vge) {
+  ThreadSanitizerForgetPcDecisions();
+}
+
 void ts_pre_clo_init(void) {
   VG_(details_name)            ((Char*)"ThreadSanitizer");
   VG_(details_version)         ((Char*)NULL);
@@ -1415,6 +1421,7 @@ void ts_pre_clo_init(void) {
                                 ts_fini);
 
   VG_(needs_client_requests)     (ts_handle_client_request);
+  VG_(needs_superblock_discards)(ts_discard_superblock);
 
   VG_(needs_command_line_options)(ts_process_cmd_line_option,
                                   ts_print_usage,
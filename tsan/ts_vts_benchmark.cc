@@ -0,0 +1,101 @@
+/* Copyright (c) 2011, Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+// This file is part of ThreadSanitizer, a dynamic data race detector.
+
+// Micro-benchmark of the VTS kernels (ts_vts_kernels.h).
+// Usage: ts_vts_benchmark [min_ms_per_measurement]
+//
+// For each VTS size, two kinds of inputs are measured:
+//   same:  b has the same tids as a and greater or equal clocks
+//          (e.g. two segments of the same set of threads);
+//   mixed: a and b have different tids in every 8th position.
+
+#include "ts_util.h"
+#include "ts_vts_kernels.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+static void MakeVtsPair(size_t size, bool same, vector<VtsEntry> *a,
+                        vector<VtsEntry> *b) {
+  a->clear();
+  b->clear();
+  for (size_t i = 0; i < size; i++) {
+    VtsEntry e = {(int32_t)i * 2, 1 + rand() % 1000};
+    a->push_back(e);
+    if (!same && i % 8 == 7) e.tid++;
+    e.clk += rand() % 2;
+    b->push_back(e);
+  }
+}
+
+// Returns nanoseconds per operation.
+static double Measure(VtsKernel kernel, bool join, size_t min_ms,
+                      const vector<VtsEntry> &a, const vector<VtsEntry> &b) {
+  vector<VtsEntry> res(a.size() + b.size());
+  size_t n_ops = 0, sum = 0;
+  size_t start = TimeInMilliSeconds(), now = start;
+  for (size_t batch = 1; now - start < min_ms; batch *= 2) {
+    for (size_t i = 0; i < batch; i++) {
+      if (join) {
+        sum += VtsJoin(kernel, &a[0], a.size(), &b[0], b.size(), &res[0]);
+      } else {
+        sum += VtsHappensBefore(kernel, &a[0], a.size(), &b[0], b.size());
+      }
+    }
+    n_ops += batch;
+    now = TimeInMilliSeconds();
+  }
+  if (sum == 1) printf(" ");  // Don't let the compiler drop the calls.
+  return (now - start) * 1e6 / n_ops;
+}
+
+int main(int argc, char **argv) {
+  size_t min_ms = argc > 1 ? atoi(argv[1]) : 100;
+  VtsKernel best = VtsBestKernel();
+  printf("best kernel: %s\n", VtsKernelName(best));
+  printf("%-6s %5s %-5s", "op", "size", "input");
+  for (int k = kVtsKernelScalar; k <= best; k++)
+    printf(" %9s", VtsKernelName((VtsKernel)k));
+  printf("   (ns/op)\n");
+  for (int join = 0; join <= 1; join++) {
+    for (size_t size = 1; size <= 512; size *= 2) {
+      for (int same = 1; same >= 0; same--) {
+        vector<VtsEntry> a, b;
+        MakeVtsPair(size, same, &a, &b);
+        printf("%-6s %5d %-5s", join ? "Join" : "HB", (int)size,
+               same ? "same" : "mixed");
+        for (int k = kVtsKernelScalar; k <= best; k++)
+          printf(" %9.1f", Measure((VtsKernel)k, join, min_ms, a, b));
+        printf("\n");
+      }
+    }
+  }
+  return 0;
+}
+// end. {{{1
+// vim:shiftwidth=2:softtabstop=2:expandtab:tw=80
@@ -0,0 +1,319 @@
+/* Copyright (c) 2011, Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+// This file is part of ThreadSanitizer, a dynamic data race detector.
+
+// Kernels of the vector time stamp (VTS) operations.
+// A VTS is an array of {tid, clk} pairs sorted by tid.
+// Each operation has a scalar version, an SSE2 version (x86 with gcc) and an
+// AVX2 version (gcc >= 4.9; selected at run time if the CPU supports it).
+//
+// The SIMD versions are a merge with a fast path: if the next 2 (SSE2) or
+// 4 (AVX2) entries of both arrays have the same tids, they are handled with
+// a couple of vector instructions. Since the pairs are stored as adjacent
+// int32s, tids and clocks are compared by the same vector compare, so the
+// array-of-structures layout needs no conversion. Otherwise one scalar
+// merge step is done. VTSs of related segments usually share long runs
+// of tids, so most of the work goes through the fast path.
+
+#ifndef TS_VTS_KERNELS_H_
+#define TS_VTS_KERNELS_H_
+
+#include "ts_util.h"
+
+#if defined(__GNUC__) && defined(__SSE2__) && !defined(TS_VALGRIND)
+# define TS_VTS_SSE2 1
+# include <emmintrin.h>
+# if (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)) && \
+     !defined(__clang__)
+#  define TS_VTS_AVX2 1
+#  include <immintrin.h>
+# endif
+#endif
+
+struct VtsEntry {
+  int32_t tid;
+  int32_t clk;
+};
+
+enum VtsKernel {
+  kVtsKernelScalar,
+  kVtsKernelSSE2,
+  kVtsKernelAVX2
+};
+
+// The best kernel supported by the compiler and the CPU.
+// The dispatchers below use a SIMD kernel only if both VTSs have at least
+// one vector of entries, the scalar one is faster for the smaller VTSs.
+static inline VtsKernel VtsBestKernel() {
+#ifdef TS_VTS_AVX2
+  if (__builtin_cpu_supports("avx2")) return kVtsKernelAVX2;
+#endif
+#ifdef TS_VTS_SSE2
+  return kVtsKernelSSE2;
+#else
+  return kVtsKernelScalar;
+#endif
+}
+
+static inline const char *VtsKernelName(VtsKernel kernel) {
+  switch (kernel) {
+    case kVtsKernelSSE2: return "sse2";
+    case kVtsKernelAVX2: return "avx2";
+    default: return "scalar";
+  }
+}
+
+// -------- HappensBefore ------------- {{{1
+// Returns true if 'a' happens-before 'b' (a < b).
+
+// One step of the scalar merge. Returns false if the answer is 'false'.
+static inline bool VtsHappensBeforeStep(const VtsEntry **a,
+                                        const VtsEntry **b,
+                                        bool *a_less_than_b) {
+  if ((*a)->tid < (*b)->tid) {
+    // a->tid is not present in b.
+    return false;
+  } else if ((*a)->tid > (*b)->tid) {
+    // b->tid is not present in a.
+    *a_less_than_b = true;
+    (*b)++;
+  } else {
+    // this tid is present in both VTSs. Compare clocks.
+    if ((*a)->clk > (*b)->clk) return false;
+    if ((*a)->clk < (*b)->clk) *a_less_than_b = true;
+    (*a)++;
+    (*b)++;
+  }
+  return true;
+}
+
+static inline bool VtsHappensBeforeTail(const VtsEntry *a,
+                                        const VtsEntry *a_max,
+                                        const VtsEntry *b,
+                                        const VtsEntry *b_max,
+                                        bool a_less_than_b) {
+  if (a < a_max) {
+    // Some tids are present in a and not in b
+    return false;
+  }
+  if (b < b_max) {
+    return true;
+  }
+  return a_less_than_b;
+}
+
+static inline bool VtsHappensBeforeScalar(const VtsEntry *a, size_t a_size,
+                                          const VtsEntry *b, size_t b_size) {
+  const VtsEntry *a_max = a + a_size;
+  const VtsEntry *b_max = b + b_size;
+  bool a_less_than_b = false;
+  while (a < a_max && b < b_max) {
+    if (!VtsHappensBeforeStep(&a, &b, &a_less_than_b)) return false;
+  }
+  return VtsHappensBeforeTail(a, a_max, b, b_max, a_less_than_b);
+}
+
+#ifdef TS_VTS_SSE2
+static inline bool VtsHappensBeforeSSE2(const VtsEntry *a, size_t a_size,
+                                        const VtsEntry *b, size_t b_size) {
+  const VtsEntry *a_max = a + a_size;
+  const VtsEntry *b_max = b + b_size;
+  bool a_less_than_b = false;
+  while (a < a_max && b < b_max) {
+    if (a + 2 <= a_max && b + 2 <= b_max) {
+      __m128i va = _mm_loadu_si128((const __m128i*)a);
+      __m128i vb = _mm_loadu_si128((const __m128i*)b);
+      int eq = _mm_movemask_epi8(_mm_cmpeq_epi32(va, vb));
+      if ((eq & 0x0F0F) == 0x0F0F) {
+        // Same tids; the tid lanes can not be greater.
+        if (_mm_movemask_epi8(_mm_cmpgt_epi32(va, vb))) return false;
+        if (eq != 0xFFFF) a_less_than_b = true;
+        a += 2;
+        b += 2;
+        continue;
+      }
+    }
+    if (!VtsHappensBeforeStep(&a, &b, &a_less_than_b)) return false;
+  }
+  return VtsHappensBeforeTail(a, a_max, b, b_max, a_less_than_b);
+}
+#endif  // TS_VTS_SSE2
+
+#ifdef TS_VTS_AVX2
+__attribute__((target("avx2")))
+static inline bool VtsHappensBeforeAVX2(const VtsEntry *a, size_t a_size,
+                                        const VtsEntry *b, size_t b_size) {
+  const VtsEntry *a_max = a + a_size;
+  const VtsEntry *b_max = b + b_size;
+  bool a_less_than_b = false;
+  while (a < a_max && b < b_max) {
+    if (a + 4 <= a_max && b + 4 <= b_max) {
+      __m256i va = _mm256_loadu_si256((const __m256i*)a);
+      __m256i vb = _mm256_loadu_si256((const __m256i*)b);
+      uint32_t eq = _mm256_movemask_epi8(_mm256_cmpeq_epi32(va, vb));
+      if ((eq & 0x0F0F0F0FU) == 0x0F0F0F0FU) {
+        if (_mm256_movemask_epi8(_mm256_cmpgt_epi32(va, vb))) return false;
+        if (eq != 0xFFFFFFFFU) a_less_than_b = true;
+        a += 4;
+        b += 4;
+        continue;
+      }
+    }
+    if (!VtsHappensBeforeStep(&a, &b, &a_less_than_b)) return false;
+  }
+  return VtsHappensBeforeTail(a, a_max, b, b_max, a_less_than_b);
+}
+#endif  // TS_VTS_AVX2
+
+static inline bool VtsHappensBefore(VtsKernel kernel,
+                                    const VtsEntry *a, size_t a_size,
+                                    const VtsEntry *b, size_t b_size) {
+#ifdef TS_VTS_AVX2
+  if (kernel == kVtsKernelAVX2 && a_size >= 4 && b_size >= 4)
+    return VtsHappensBeforeAVX2(a, a_size, b, b_size);
+#endif
+#ifdef TS_VTS_SSE2
+  if (kernel == kVtsKernelSSE2 && a_size >= 2 && b_size >= 2)
+    return VtsHappensBeforeSSE2(a, a_size, b, b_size);
+#endif
+  return VtsHappensBeforeScalar(a, a_size, b, b_size);
+}
+
+// -------- Join ------------- {{{1
+// Writes the join (element-wise maximum) of 'a' and 'b' to 'res', which
+// must have room for a_size + b_size entries. Returns the size of the join.
+
+static inline void VtsJoinStep(const VtsEntry **a, const VtsEntry **b,
+                               VtsEntry **res) {
+  if ((*a)->tid < (*b)->tid) {
+    *(*res)++ = *(*a)++;
+  } else if ((*a)->tid > (*b)->tid) {
+    *(*res)++ = *(*b)++;
+  } else {
+    *(*res)++ = (*a)->clk >= (*b)->clk ? **a : **b;
+    (*a)++;
+    (*b)++;
+  }
+}
+
+static inline size_t VtsJoinTail(const VtsEntry *a, const VtsEntry *a_max,
+                                 const VtsEntry *b, const VtsEntry *b_max,
+                                 VtsEntry *res, VtsEntry *res_begin) {
+  while (a < a_max) *res++ = *a++;
+  while (b < b_max) *res++ = *b++;
+  return res - res_begin;
+}
+
+static inline size_t VtsJoinScalar(const VtsEntry *a, size_t a_size,
+                                   const VtsEntry *b, size_t b_size,
+                                   VtsEntry *res) {
+  VtsEntry *res_begin = res;
+  const VtsEntry *a_max = a + a_size;
+  const VtsEntry *b_max = b + b_size;
+  while (a < a_max && b < b_max) {
+    VtsJoinStep(&a, &b, &res);
+  }
+  return VtsJoinTail(a, a_max, b, b_max, res, res_begin);
+}
+
+#ifdef TS_VTS_SSE2
+static inline size_t VtsJoinSSE2(const VtsEntry *a, size_t a_size,
+                                 const VtsEntry *b, size_t b_size,
+                                 VtsEntry *res) {
+  VtsEntry *res_begin = res;
+  const VtsEntry *a_max = a + a_size;
+  const VtsEntry *b_max = b + b_size;
+  while (a < a_max && b < b_max) {
+    if (a + 2 <= a_max && b + 2 <= b_max) {
+      __m128i va = _mm_loadu_si128((const __m128i*)a);
+      __m128i vb = _mm_loadu_si128((const __m128i*)b);
+      int eq = _mm_movemask_epi8(_mm_cmpeq_epi32(va, vb));
+      if ((eq & 0x0F0F) == 0x0F0F) {
+        // Same tids, so the maximum of all lanes is the join.
+        // SSE2 has no _mm_max_epi32.
+        __m128i gt = _mm_cmpgt_epi32(va, vb);
+        __m128i max = _mm_or_si128(_mm_and_si128(gt, va),
+                                   _mm_andnot_si128(gt, vb));
+        _mm_storeu_si128((__m128i*)res, max);
+        a += 2;
+        b += 2;
+        res += 2;
+        continue;
+      }
+    }
+    VtsJoinStep(&a, &b, &res);
+  }
+  return VtsJoinTail(a, a_max, b, b_max, res, res_begin);
+}
+#endif  // TS_VTS_SSE2
+
+#ifdef TS_VTS_AVX2
+__attribute__((target("avx2")))
+static inline size_t VtsJoinAVX2(const VtsEntry *a, size_t a_size,
+                                 const VtsEntry *b, size_t b_size,
+                                 VtsEntry *res) {
+  VtsEntry *res_begin = res;
+  const VtsEntry *a_max = a + a_size;
+  const VtsEntry *b_max = b + b_size;
+  while (a < a_max && b < b_max) {
+    if (a + 4 <= a_max && b + 4 <= b_max) {
+      __m256i va = _mm256_loadu_si256((const __m256i*)a);
+      __m256i vb = _mm256_loadu_si256((const __m256i*)b);
+      uint32_t eq = _mm256_movemask_epi8(_mm256_cmpeq_epi32(va, vb));
+      if ((eq & 0x0F0F0F0FU) == 0x0F0F0F0FU) {
+        _mm256_storeu_si256((__m256i*)res, _mm256_max_epi32(va, vb));
+        a += 4;
+        b += 4;
+        res += 4;
+        continue;
+      }
+    }
+    VtsJoinStep(&a, &b, &res);
+  }
+  return VtsJoinTail(a, a_max, b, b_max, res, res_begin);
+}
+#endif  // TS_VTS_AVX2
+
+static inline size_t VtsJoin(VtsKernel kernel,
+                             const VtsEntry *a, size_t a_size,
+                             const VtsEntry *b, size_t b_size,
+                             VtsEntry *res) {
+#ifdef TS_VTS_AVX2
+  if (kernel == kVtsKernelAVX2 && a_size >= 4 && b_size >= 4)
+    return VtsJoinAVX2(a, a_size, b, b_size, res);
+#endif
+#ifdef TS_VTS_SSE2
+  if (kernel == kVtsKernelSSE2 && a_size >= 2 && b_size >= 2)
+    return VtsJoinSSE2(a, a_size, b, b_size, res);
+#endif
+  return VtsJoinScalar(a, a_size, b, b_size, res);
+}
+
+#endif  // TS_VTS_KERNELS_H_
+// end. {{{1
+// vim:shiftwidth=2:softtabstop=2:expandtab:tw=80
@@ -31,6 +31,7 @@
 #include "tsan_rtl_symbolize.h"
 #include "ts_trace_info.h"
 #include "ts_lock.h"
+#include "ts_event_trace.h"
 
 #include <sys/mman.h>
 #include <sys/stat.h>
@@ -126,18 +127,117 @@ static int RTL_INIT = 0;
 static int PTH_INIT = 0;
 static int HAVE_THREAD_0 = 0;
 
-static map<pthread_t, ThreadInfo*> ThreadInfoMap;
-static map<pthread_t, tid_t> Tids;
-static map<tid_t, pthread_t> PThreads;
-static map<tid_t, bool> Finished;
-// TODO(glider): before spawning a new child thread its parent creates a
-// pthread barrier which is used to guarantee that the child has already
-// initialized before exiting pthread_create.
-static map<tid_t, pthread_barrier_t*> ChildThreadStartBarriers;
-// TODO(glider): we shouldn't need InitConds (and maybe FinishConds).
-// How about using barriers here as well?
-static map<pthread_t, pthread_cond_t*> InitConds;
-static map<tid_t, pthread_cond_t*> FinishConds;
+// The threads started by pthread_create(), kept in a fixed-size table
+// of slots hashed by pthread_t. A thread takes a free slot when it starts
+// and gives it back when it is joined, or when it finishes if it is detached.
+// The slot states are changed atomically, so that pthread_create(),
+// pthread_join() and pthread_detach() do not need the GIL.
+// A registered thread stays in the slot it has taken, and the lookup never
+// stops at a free slot, so no tombstones are needed.
+// If more than kNumSlots threads are alive, the new ones are not registered:
+// they are joined w/o the THR_JOIN events and are not affected by
+// set_global_ignore(), so there may be false reports about them.
+class ThreadRegistry {
+ public:
+  enum State {
+    FREE = 0,
+    CLAIMED,   // Being filled by Register().
+    RUNNING,   // Running and joinable.
+    DETACHED,  // Running and detached.
+    FINISHED   // Finished, but not joined yet.
+  };
+
+  struct Slot {
+    uintptr_t state;
+    pthread_t pt;
+    tid_t tid;
+    ThreadInfo *info;
+  };
+
+  static const size_t kNumSlots = 1 << 14;
+
+  // Called by the new thread under the GIL. Returns NULL if there is no
+  // free slot.
+  Slot *Register(pthread_t pt, tid_t tid, ThreadInfo *info, bool detached) {
+    size_t home = Hash(pt);
+    for (size_t i = 0; i < kNumSlots; i++) {
+      Slot *slot = &slots_[(home + i) % kNumSlots];
+      if (!AtomicCompareAndSwap(&slot->state, (uintptr_t)FREE,
+                                (uintptr_t)CLAIMED)) {
+        continue;
+      }
+      slot->pt = pt;
+      slot->tid = tid;
+      slot->info = info;
+      ReleaseStore(&slot->state, detached ? DETACHED : RUNNING);
+      return slot;
+    }
+    static bool warned;
+    if (!warned) {
+      warned = true;
+      Printf("WARNING: more than %ld threads are alive, "
+             "joins of the new threads are not tracked\n", (long)kNumSlots);
+    }
+    return NULL;
+  }
+
+  // Returns the slot of a thread which is not joined yet, or NULL.
+  Slot *Find(pthread_t pt) {
+    size_t home = Hash(pt);
+    for (size_t i = 0; i < kNumSlots; i++) {
+      Slot *slot = &slots_[(home + i) % kNumSlots];
+      uintptr_t state = AcquireLoad(&slot->state);
+      if (state != FREE && state != CLAIMED && slot->pt == pt) return slot;
+    }
+    return NULL;
+  }
+
+  // Called by the thread when it finishes.
+  void Finish(Slot *slot) {
+    if (slot == NULL) return;
+    if (AtomicCompareAndSwap(&slot->state, (uintptr_t)RUNNING,
+                             (uintptr_t)FINISHED)) {
+      return;
+    }
+    CHECK(AcquireLoad(&slot->state) == DETACHED);
+    Release(slot);
+  }
+
+  void Detach(Slot *slot) {
+    if (AtomicCompareAndSwap(&slot->state, (uintptr_t)RUNNING,
+                             (uintptr_t)DETACHED)) {
+      return;
+    }
+    CHECK(AcquireLoad(&slot->state) == FINISHED);
+    Release(slot);
+  }
+
+  // Called when the thread is joined.
+  void Release(Slot *slot) {
+    slot->info = NULL;
+    ReleaseStore(&slot->state, FREE);
+  }
+
+  // Returns the ThreadInfo of the i-th slot if its thread is running.
+  // The caller should hold the GIL, so that the thread can not finish.
+  ThreadInfo *GetRunningThread(size_t i) {
+    uintptr_t state = AcquireLoad(&slots_[i].state);
+    if (state != RUNNING && state != DETACHED) return NULL;
+    return slots_[i].info;
+  }
+
+ private:
+  static size_t Hash(pthread_t pt) {
+    // pthread_t is the address of the thread descriptor, which is
+    // at least page-aligned.
+    return (size_t)(((uintptr_t)pt >> 12) * 2654435761U) % kNumSlots;
+  }
+
+  Slot slots_[kNumSlots];
+};
+
+// Zero-initialized, i.e. all the slots are FREE before any constructor runs.
+static ThreadRegistry thread_registry;
 static tid_t max_tid;
 
 static __thread  sigset_t glob_sig_blocked, glob_sig_old;
@@ -150,6 +250,76 @@ static __thread pending_signal_flag_t pending_signal_flags[NSIG];
 static __thread bool have_pending_signals;
 static void clear_pending_signals();
 
+// Event trace (--dump_events) {{{1
+// If --dump_events=<file> is given, all the events passed to ThreadSanitizer
+// are also written to <file> in the compact trace format (ts_event_trace.h),
+// which can be analyzed later with ts_offline --input_type=trace.
+static EventTraceWriter *g_trace_writer = NULL;
+static __thread EventTraceWriter::ThreadBuffer *trace_buffer;
+
+// Must be called with IN_RTL > 0.
+static void TracePut(EventType type, tid_t tid, pc_t pc,
+                     uintptr_t a, uintptr_t info) {
+  DCHECK(g_trace_writer);
+  if (!EventTraceWriter::CanRecord(type)) return;
+  if (!trace_buffer) trace_buffer = g_trace_writer->NewThreadBuffer();
+  g_trace_writer->Put(trace_buffer, type, tid, pc, a, info);
+  if (type == THR_END) {
+    g_trace_writer->DeleteThreadBuffer(trace_buffer);
+    trace_buffer = NULL;
+  }
+}
+
+static void TracePutMops(tid_t tid, TraceInfoPOD *trace, uintptr_t *addr) {
+  DCHECK(g_trace_writer);
+  for (size_t i = 0; i < trace->n_mops_; i++) {
+    if (!addr[i]) continue;
+    MopInfo *mop = &trace->mops_[i];
+    TracePut(mop->is_write() ? WRITE : READ, tid, mop->pc(), addr[i],
+             mop->size());
+  }
+}
+
+static void OpenEventTrace() {
+  if (G_flags->dump_events.empty()) return;
+  FILE *f = fopen(G_flags->dump_events.c_str(), "wb");
+  if (!f) {
+    Printf("WARNING: can not open %s, --dump_events is ignored\n",
+           G_flags->dump_events.c_str());
+    return;
+  }
+  // The writer collects the records itself, and an unbuffered file is not
+  // written twice if the program forks.
+  setvbuf(f, NULL, _IONBF, 0);
+  g_trace_writer = new EventTraceWriter(f);
+}
+
+// Called from finalize(), when no other threads put events.
+static void CloseEventTrace() {
+  if (!g_trace_writer) return;
+  if (trace_buffer) {
+    g_trace_writer->DeleteThreadBuffer(trace_buffer);
+    trace_buffer = NULL;
+  }
+  vector<uintptr_t> pcs;
+  g_trace_writer->GetPcs(&pcs);
+  for (size_t i = 0; i < pcs.size(); i++) {
+    string img_name, rtn_name, file_name;
+    int line = 0;
+    PcToStrings(pcs[i], true, &img_name, &rtn_name, &file_name, &line);
+    g_trace_writer->AddPcDescription(pcs[i], img_name, rtn_name,
+                                     file_name, line);
+  }
+  g_trace_writer->Close();
+  Report("INFO: %lld events (%lld bytes) written to %s\n",
+         (long long)g_trace_writer->n_events(),
+         (long long)g_trace_writer->n_bytes(),
+         G_flags->dump_events.c_str());
+  delete g_trace_writer;
+  g_trace_writer = NULL;
+}
+// }}}
+
 // Stats {{{1
 #undef ENABLE_STATS
 #ifdef ENABLE_STATS
@@ -235,6 +405,15 @@ int GIL::GetDepth() {
 }
 #endif
 
+RTLScope::RTLScope() {
+  ENTER_RTL();
+}
+
+RTLScope::~RTLScope() {
+  LEAVE_RTL();
+  if (!IN_RTL) clear_pending_signals();
+}
+
 void *sys_mmap(void *addr, size_t length, int prot, int flags,
                int fd, off_t offset) {
   return (void*)syscall(SYS_mmap, addr, length, prot, flags, fd, offset);
@@ -304,6 +483,10 @@ INLINE void SPut(EventType type, tid_t tid, pc_t pc,
 
   ENTER_RTL();
   {
+    if (UNLIKELY(g_trace_writer != NULL)) {
+      // The pc of THR_START is a pointer to the shadow stack.
+      TracePut(type, tid, type == THR_START ? 0 : pc, a, info);
+    }
     ThreadSanitizerHandleOneEvent(&event);
   }
   LEAVE_RTL();
@@ -373,6 +556,8 @@ void INLINE flush_trace(TraceInfoPOD *trace) {
     {
       ENTER_RTL();
       DCHECK(__tsan_shadow_stack.pcs_ <= __tsan_shadow_stack.end_);
+      // ThreadSanitizerHandleTrace() clears the TLEB, so record it first.
+      if (UNLIKELY(g_trace_writer != NULL)) TracePutMops(tid, trace, TLEB);
       ThreadSanitizerHandleTrace(tid,
                                  trace_info,
                                  TLEB);
@@ -453,6 +638,7 @@ void INLINE flush_single_mop(TraceInfoPOD *trace, uintptr_t addr) {
     {
       ENTER_RTL();
       DCHECK(__tsan_shadow_stack.pcs_ <= __tsan_shadow_stack.end_);
+      if (UNLIKELY(g_trace_writer != NULL)) TracePutMops(tid, trace, &addr);
       ThreadSanitizerHandleOneMemoryAccess(INFO.thread,
                                            trace_info->mops_[0],
                                            addr);
@@ -477,6 +663,11 @@ INLINE void RPut(EventType type, tid_t tid, pc_t pc,
 #endif
   DCHECK(HAVE_THREAD_0 || ((type == THR_START) && (tid == 0)));
   DCHECK(RTL_INIT == 1);
+  if (UNLIKELY(g_trace_writer != NULL)) {
+    ENTER_RTL();
+    TracePut(type, tid, pc, a, info);
+    LEAVE_RTL();
+  }
   if (type == RTN_CALL) {
     rtn_call((void*)a, (void*)pc);
   } else {
@@ -488,6 +679,7 @@ void finalize() {
   ENTER_RTL();
   // atexit hooks are ran from a single thread.
   ThreadSanitizerFini();
+  CloseEventTrace();
   SymbolizeFini(GetNumberOfFoundErrors());
   LEAVE_RTL();
 #if ENABLE_STATS
@@ -693,6 +885,7 @@ static bool initialize() {
   SetupLogFile(args);
   ThreadSanitizerParseFlags(&args);
   ThreadSanitizerInit();
+  OpenEventTrace();
   if (G_flags->dry_run) {
     Printf("WARNING: the --dry_run flag is not supported anymore. "
            "Ignoring.\n");
@@ -797,22 +990,16 @@ __tsan_init() {
   InitRTLAndTid0();
 }
 
-INLINE void InitTid() {
+INLINE ThreadRegistry::Slot *InitTid(bool detached) {
   DCHECK(RTL_INIT == 1);
   GIL scoped;
   // thread initialization
   pthread_t pt = pthread_self();
   INFO.tid = max_tid;
   max_tid++;
-  // TODO(glider): remove InitConds.
-  if (InitConds.find(pt) != InitConds.end()) {
-    __real_pthread_cond_signal(InitConds[pt]);
-  }
   DDPrintf("T%d: pthread_self()=%p\n", INFO.tid, (void*)pt);
   UnsafeInitTidCommon();
-  Tids[pt] = INFO.tid;
-  PThreads[INFO.tid] = pt;
-  ThreadInfoMap[pt] = &INFO;
+  return thread_registry.Register(pt, INFO.tid, &INFO, detached);
 }
 
 INLINE tid_t GetTid() {
@@ -825,29 +1012,23 @@ extern tid_t ExGetTid() {
 
 typedef void *(pthread_worker)(void*);
 
+// Lives on the parent's stack: the parent waits in pthread_create() until
+// the child sets |child_tid|, and the child does not touch it after that.
 struct callback_arg {
   pthread_worker *routine;
   void *arg;
   tid_t parent;
-  pthread_attr_t *attr;
+  bool detached;
+  uintptr_t child_tid;
 };
 
-// TODO(glider): we should get rid of Finished[],
-// as FinishConds should guarantee that the thread has finished.
-void dump_finished() {
-  map<tid_t, bool>::iterator iter;
-  for (iter = Finished.begin(); iter != Finished.end(); ++iter) {
-    DDPrintf("Finished[%d] = %d\n", iter->first, iter->second);
-  }
-}
-
 void set_global_ignore(bool new_value) {
   GIL scoped;
   global_ignore = new_value;
   int add = new_value ? 1 : -1;
-  map<pthread_t, ThreadInfo*>::iterator iter;
-  for (iter = ThreadInfoMap.begin(); iter != ThreadInfoMap.end(); ++iter) {
-    *(iter->second->thread_local_ignore) += add;
+  for (size_t i = 0; i < ThreadRegistry::kNumSlots; i++) {
+    ThreadInfo *info = thread_registry.GetRunningThread(i);
+    if (info) *(info->thread_local_ignore) += add;
   }
 }
 
@@ -857,7 +1038,8 @@ void *pthread_callback(void *arg) {
 
   CHECK((PTH_INIT == 1) && (RTL_INIT == 1));
   CHECK(INIT == 0);
-  InitTid();
+  callback_arg *cb_arg = (callback_arg*)arg;
+  ThreadRegistry::Slot *slot = InitTid(cb_arg->detached);
   DECLARE_TID_AND_PC();
   DCHECK(INIT == 1);
   DCHECK(tid != 0);
@@ -877,19 +1059,13 @@ void *pthread_callback(void *arg) {
 #endif
   memset(TLEB, '\0', kTLEBSize);
 
-  callback_arg *cb_arg = (callback_arg*)arg;
   pthread_worker *routine = cb_arg->routine;
   void *routine_arg = cb_arg->arg;
+  tid_t parent = cb_arg->parent;
   pthread_attr_t attr;
   size_t stack_size = 8 << 20;  // 8M
   void *stack_bottom = NULL;
 
-  // We already know the child pid -- get the parent condvar to signal.
-  tid_t parent = cb_arg->parent;
-  CHECK(ChildThreadStartBarriers.find(parent) !=
-         ChildThreadStartBarriers.end());
-  pthread_barrier_t *parent_barrier = ChildThreadStartBarriers[parent];
-
   // Get the stack size and stack top for the current thread.
   // TODO(glider): do something if pthread_getattr_np() is not supported.
   //
@@ -918,7 +1094,6 @@ void *pthread_callback(void *arg) {
   SPut(THR_START, INFO.tid, (pc_t) &__tsan_shadow_stack, 0, parent);
 
   INFO.thread = ThreadSanitizerGetThreadByTid(INFO.tid);
-  delete cb_arg;
 
   if (stack_bottom) {
     // We don't intercept the mmap2 syscall that allocates thread stack, so pass
@@ -937,12 +1112,8 @@ void *pthread_callback(void *arg) {
   unsafeMapTls(tid, pc);
   DDPrintf("Before routine() in T%d\n", tid);
 
-  Finished[tid] = false;
-#if (DEBUG)
-  dump_finished();
-#endif
-  // Wait for the parent.
-  __real_pthread_barrier_wait(parent_barrier);
+  // Let the parent return from pthread_create().
+  ReleaseStore(&cb_arg->child_tid, tid);
   GIL::Unlock();
 
   result = (*routine)(routine_arg);
@@ -979,21 +1150,12 @@ void *pthread_callback(void *arg) {
   GIL::Unlock();
 
   GIL::Lock();
-  Finished[tid] = true;
-#if (DEBUG)
-  dump_finished();
-#endif
-  DDPrintf("After routine() in T%d\n", tid);
+  DDPrintf("After routine() in T%d (child of T%d)\n", tid, parent);
 
   SPut(THR_END, tid, 0, 0, 0);
-  if (FinishConds.find(tid) != FinishConds.end()) {
-    DDPrintf("T%d (child of T%d): Signaling on %p\n",
-             tid, parent, FinishConds[tid]);
-    __real_pthread_cond_signal(FinishConds[tid]);
-  } else {
-    DDPrintf("T%d (child of T%d): Not signaling, condvar not ready\n",
-             tid, parent);
-  }
+  // pthread_join() waits for the thread to exit, so the slot may be
+  // released as soon as THR_END is passed.
+  thread_registry.Finish(slot);
   // can't process signals after THR_END
   GIL::UnlockNoSignals();
 
@@ -1008,20 +1170,6 @@ void *pthread_callback(void *arg) {
   return result;
 }
 
-// Erase the information about the deleted thread. This function should be
-// always called after a lock.
-void unsafe_forget_thread(tid_t tid, tid_t from) {
-  DDPrintf("T%d: forgetting about T%d\n", from, tid);
-  CHECK(PThreads.find(tid) != PThreads.end());
-  pthread_t pt = PThreads[tid];
-  Tids.erase(pt);
-  PThreads.erase(tid);
-  Finished.erase(tid);
-  InitConds.erase(pt);
-  FinishConds.erase(tid);
-  ThreadInfoMap.erase(pt);
-}
-
 // To declare a wrapper for foo(bar) you should:
 //  -- add the __wrap_foo(bar) prototype to tsan_rtl_wrap.h
 //  -- implement __wrap_foo(bar) somewhere below using __real_foo(bar) as the
@@ -1066,40 +1214,23 @@ static int tsan_pthread_create(pthread_t *thread,
       }
     }
   }
-  callback_arg *cb_arg = new callback_arg;
-  cb_arg->routine = start_routine;
-  cb_arg->arg = arg;
-  cb_arg->parent = tid;
-  cb_arg->attr = attr;
+  int detach_state = PTHREAD_CREATE_JOINABLE;
+  if (attr) pthread_attr_getdetachstate(attr, &detach_state);
+  callback_arg cb_arg;
+  cb_arg.routine = start_routine;
+  cb_arg.arg = arg;
+  cb_arg.parent = tid;
+  cb_arg.detached = (detach_state == PTHREAD_CREATE_DETACHED);
+  cb_arg.child_tid = 0;
   SPut(THR_CREATE_BEFORE, tid, 0, 0, 0);
   PTH_INIT = 1;
-  pthread_barrier_t *barrier;
-  {
-    GIL scoped;
-    // |barrier| escapes to the child thread via ChildThreadStartBarriers.
-    barrier = (pthread_barrier_t*) __real_malloc(sizeof(pthread_barrier_t));
-    __real_pthread_barrier_init(barrier, NULL, 2);
-    ChildThreadStartBarriers[tid] = barrier;
-    DDPrintf("Setting ChildThreadStartBarriers[%d]\n", tid);
-  }
-  int result = real_pthread_create(thread, attr, pthread_callback, cb_arg);
-  tid_t child_tid = 0;
+  int result = real_pthread_create(thread, attr, pthread_callback, &cb_arg);
   if (result == 0) {
-    __real_pthread_barrier_wait(barrier);
-    GIL scoped;  // Should be strictly after pthread_barrier_wait()
-    child_tid = Tids[*thread];
-    ChildThreadStartBarriers.erase(tid);
-    pthread_barrier_destroy(barrier);
-    __real_free(barrier);
-  } else {
-    // Do not wait on the barrier.
-    GIL scoped;
-    child_tid = Tids[*thread];
-    ChildThreadStartBarriers.erase(tid);
-    pthread_barrier_destroy(barrier);
-    __real_free(barrier);
-  }
-  if (!result) SPut(THR_CREATE_AFTER, tid, 0, 0, child_tid);
+    // Wait until the child registers itself, so that it can be joined
+    // right away.
+    while (AcquireLoad(&cb_arg.child_tid) == 0) __real_sched_yield();
+    SPut(THR_CREATE_AFTER, tid, 0, 0, cb_arg.child_tid);
+  }
   DDPrintf("pthread_create(%p)\n", *thread);
   RPut(RTN_EXIT, tid, pc, 0, 0);
   return result;
@@ -1191,11 +1322,16 @@ int __wrap_pthread_once(pthread_once_t *once_control,
 // }}}
 
 // Memory allocation routines {{{1
+// The allocation wrappers do not take the GIL: the allocator is thread-safe,
+// and ThreadSanitizer serializes the MALLOC/FREE events on its own.
+// FREE and MUNMAP are passed before the memory is released and MALLOC and
+// MMAP after it is obtained, so another thread can not reuse a block or
+// a range before it is freed in the event stream.
 
 #if (DEBUG)
 # define ALLOC_STAT_COUNTER(X) X##_stat_counter
 # define DECLARE_ALLOC_STATS(X) int ALLOC_STAT_COUNTER(X) = 0
-# define RECORD_ALLOC(X) ALLOC_STAT_COUNTER(X)++
+# define RECORD_ALLOC(X) __sync_fetch_and_add(&ALLOC_STAT_COUNTER(X), 1)
 # define QUOTE(X) #X
 # define STR(X) QUOTE(X)
 # define PRINT_ALLOC_STATS(X) Printf(STR(X)": %d\n", ALLOC_STAT_COUNTER(X))
@@ -1239,7 +1375,7 @@ extern "C" void *__libc_realloc(void *ptr, size_t size);
 extern "C"
 void *calloc(size_t nmemb, size_t size) {
   if (IN_RTL) return __libc_calloc(nmemb, size);
-  GIL scoped;
+  RTLScope scoped;
   RECORD_ALLOC(calloc);
   DECLARE_TID_AND_PC();
   pc_t const mypc = (pc_t)calloc;
@@ -1255,7 +1391,7 @@ void *calloc(size_t nmemb, size_t size) {
 extern "C"
 void *__wrap_calloc(size_t nmemb, size_t size) {
   if (IN_RTL) return __real_calloc(nmemb, size);
-  GIL scoped;
+  RTLScope scoped;
   RECORD_ALLOC(__wrap_calloc);
   DECLARE_TID_AND_PC();
   pc_t const mypc = (pc_t)__real_calloc;
@@ -1271,7 +1407,7 @@ void *__wrap_calloc(size_t nmemb, size_t size) {
 extern "C"
 void *__wrap_malloc(size_t size) {
   if (IN_RTL) return __real_malloc(size);
-  GIL scoped;
+  RTLScope scoped;
   RECORD_ALLOC(__wrap_malloc);
   void *result;
   DECLARE_TID_AND_PC();
@@ -1290,7 +1426,7 @@ void *__wrap_malloc(size_t size) {
 extern "C"
 void *malloc(size_t size) {
   if (IN_RTL || !RTL_INIT || !INIT) return __libc_malloc(size);
-  GIL scoped;
+  RTLScope scoped;
   RECORD_ALLOC(malloc);
   void *result;
   DECLARE_TID_AND_PC();
@@ -1307,7 +1443,7 @@ void *malloc(size_t size) {
 extern "C"
 int posix_memalign(void **memptr, size_t alignment, size_t size) {
   if (IN_RTL) return real_posix_memalign(memptr, alignment, size);
-  GIL scoped;
+  RTLScope scoped;
   DECLARE_TID_AND_PC();
   RPut(RTN_CALL, tid, pc, (uintptr_t)real_posix_memalign, 0);
   int result = real_posix_memalign(memptr, alignment, size);
@@ -1319,7 +1455,7 @@ int posix_memalign(void **memptr, size_t alignment, size_t size) {
 extern "C"
 void* valloc(size_t size) {
   if (IN_RTL) return real_valloc(size);
-  GIL scoped;
+  RTLScope scoped;
   DECLARE_TID_AND_PC();
   RPut(RTN_CALL, tid, pc, (uintptr_t)real_valloc, 0);
   void* result = real_valloc(size);
@@ -1331,7 +1467,7 @@ void* valloc(size_t size) {
 extern "C"
 void* memalign(size_t boundary, size_t size) {
   if (IN_RTL) return real_memalign(boundary, size);
-  GIL scoped;
+  RTLScope scoped;
   DECLARE_TID_AND_PC();
   RPut(RTN_CALL, tid, pc, (uintptr_t)real_memalign, 0);
   void* result = real_memalign(boundary, size);
@@ -1345,7 +1481,7 @@ void __wrap_free(void *ptr) {
   if (ptr == 0)
     return;
   if (IN_RTL || INFO.thread == NULL) return __real_free(ptr);
-  GIL scoped;
+  RTLScope scoped;
   RECORD_ALLOC(__wrap_free);
   DECLARE_TID_AND_PC();
   pc_t const mypc = (pc_t)__real_free;
@@ -1369,7 +1505,7 @@ void __wrap_free(void *ptr) {
 extern "C"
 void free(void *ptr) {
   if (IN_RTL || !RTL_INIT || !INIT) return __libc_free(ptr);
-  GIL scoped;
+  RTLScope scoped;
   RECORD_ALLOC(free);
   DECLARE_TID_AND_PC();
   pc_t const mypc = (pc_t)free;
@@ -1387,7 +1523,7 @@ void free(void *ptr) {
 extern "C"
 void *__wrap_realloc(void *ptr, size_t size) {
   if (IN_RTL) return __real_realloc(ptr, size);
-  GIL scoped;
+  RTLScope scoped;
   RECORD_ALLOC(__wrap_realloc);
   void *result;
   DECLARE_TID_AND_PC();
@@ -1407,7 +1543,7 @@ void *__wrap_realloc(void *ptr, size_t size) {
 extern "C"
 void *realloc(void *ptr, size_t size) {
   if (IN_RTL || !RTL_INIT || !INIT) return __libc_realloc(ptr, size);
-  GIL scoped;
+  RTLScope scoped;
   RECORD_ALLOC(realloc);
   void *result;
   DECLARE_TID_AND_PC();
@@ -1428,7 +1564,7 @@ void *realloc(void *ptr, size_t size) {
 extern "C"
 void *__wrap__Znwj(unsigned int size) {
   if (IN_RTL) return __real__Znwj(size);
-  GIL scoped;
+  RTLScope scoped;
   RECORD_ALLOC(__wrap__Znwj);
   DECLARE_TID_AND_PC();
   pc_t const mypc = (pc_t)__real__Znwj;
@@ -1444,7 +1580,7 @@ void *__wrap__Znwj(unsigned int size) {
 extern "C"
 void *__wrap__ZnwjRKSt9nothrow_t(unsigned size, nothrow_t &nt) {
   if (IN_RTL) return __real__ZnwjRKSt9nothrow_t(size, nt);
-  GIL scoped;
+  RTLScope scoped;
   RECORD_ALLOC(__wrap__ZnwjRKSt9nothrow_t);
   DECLARE_TID_AND_PC();
   pc_t const mypc = (pc_t)__real__ZnwjRKSt9nothrow_t;
@@ -1460,7 +1596,7 @@ void *__wrap__ZnwjRKSt9nothrow_t(unsigned size, nothrow_t &nt) {
 extern "C"
 void *__wrap__Znaj(unsigned int size) {
   if (IN_RTL) return __real__Znaj(size);
-  GIL scoped;
+  RTLScope scoped;
   RECORD_ALLOC(__wrap__Znaj);
   DECLARE_TID_AND_PC();
   pc_t const mypc = (pc_t)__real__Znaj;
@@ -1476,7 +1612,7 @@ void *__wrap__Znaj(unsigned int size) {
 extern "C"
 void *__wrap__ZnajRKSt9nothrow_t(unsigned size, nothrow_t &nt) {
   if (IN_RTL) return __real__ZnajRKSt9nothrow_t(size, nt);
-  GIL scoped;
+  RTLScope scoped;
   RECORD_ALLOC(__wrap__ZnajRKSt9nothrow_t);
   DECLARE_TID_AND_PC();
   pc_t const mypc = (pc_t)__real__ZnajRKSt9nothrow_t;
@@ -1494,7 +1630,7 @@ void *__wrap__ZnajRKSt9nothrow_t(unsigned size, nothrow_t &nt) {
 extern "C"
 void *__wrap__Znwm(unsigned long size) {
   if (IN_RTL) return __real__Znwm(size);
-  GIL scoped;
+  RTLScope scoped;
   RECORD_ALLOC(__wrap__Znwm);
   DECLARE_TID_AND_PC();
   pc_t const mypc = (pc_t)__real__Znwm;
@@ -1510,7 +1646,7 @@ void *__wrap__Znwm(unsigned long size) {
 extern "C"
 void *__wrap__ZnwmRKSt9nothrow_t(unsigned long size, nothrow_t &nt) {
   if (IN_RTL) return __real__ZnwmRKSt9nothrow_t(size, nt);
-  GIL scoped;
+  RTLScope scoped;
   RECORD_ALLOC(__wrap__ZnwmRKSt9nothrow_t);
   DECLARE_TID_AND_PC();
   pc_t const mypc = (pc_t)__real__ZnwmRKSt9nothrow_t;
@@ -1526,7 +1662,7 @@ void *__wrap__ZnwmRKSt9nothrow_t(unsigned long size, nothrow_t &nt) {
 extern "C"
 void *__wrap__Znam(unsigned long size) {
   if (IN_RTL) return __real__Znam(size);
-  GIL scoped;
+  RTLScope scoped;
   RECORD_ALLOC(__wrap__Znam);
   DECLARE_TID_AND_PC();
   pc_t const mypc = (pc_t)__real__Znam;
@@ -1542,7 +1678,7 @@ void *__wrap__Znam(unsigned long size) {
 extern "C"
 void *__wrap__ZnamRKSt9nothrow_t(unsigned long size, nothrow_t &nt) {
   if (IN_RTL) return __real__ZnamRKSt9nothrow_t(size, nt);
-  GIL scoped;
+  RTLScope scoped;
   RECORD_ALLOC(__wrap__ZnamRKSt9nothrow_t);
   DECLARE_TID_AND_PC();
   pc_t const mypc = (pc_t)__real__ZnamRKSt9nothrow_t;
@@ -1561,7 +1697,7 @@ void *__wrap__ZnamRKSt9nothrow_t(unsigned long size, nothrow_t &nt) {
 extern "C"
 void __wrap__ZdlPv(void *ptr) {
   if (IN_RTL) return __real__ZdlPv(ptr);
-  GIL scoped;
+  RTLScope scoped;
   RECORD_ALLOC(__wrap__ZdlPv);
   DECLARE_TID_AND_PC();
   pc_t const mypc = (pc_t)__real__ZdlPv;
@@ -1578,7 +1714,7 @@ void __wrap__ZdlPv(void *ptr) {
 extern "C"
 void __wrap__ZdlPvRKSt9nothrow_t(void *ptr, nothrow_t &nt) {
   if (IN_RTL) return __real__ZdlPvRKSt9nothrow_t(ptr, nt);
-  GIL scoped;
+  RTLScope scoped;
   RECORD_ALLOC(__wrap__ZdlPvRKSt9nothrow_t);
   DECLARE_TID_AND_PC();
   pc_t const mypc = (pc_t)__real__ZdlPvRKSt9nothrow_t;
@@ -1595,7 +1731,7 @@ void __wrap__ZdlPvRKSt9nothrow_t(void *ptr, nothrow_t &nt) {
 extern "C"
 void __wrap__ZdaPv(void *ptr) {
   if (IN_RTL) return __real__ZdaPv(ptr);
-  GIL scoped;
+  RTLScope scoped;
   RECORD_ALLOC(__wrap__ZdaPv);
   DECLARE_TID_AND_PC();
   pc_t const mypc = (pc_t)__real__ZdaPv;
@@ -1612,7 +1748,7 @@ void __wrap__ZdaPv(void *ptr) {
 extern "C"
 void __wrap__ZdaPvRKSt9nothrow_t(void *ptr, nothrow_t &nt) {
   if (IN_RTL) return __real__ZdaPvRKSt9nothrow_t(ptr, nt);
-  GIL scoped;
+  RTLScope scoped;
   RECORD_ALLOC(__wrap__ZdaPvRKSt9nothrow_t);
   DECLARE_TID_AND_PC();
   pc_t const mypc = (pc_t)__real__ZdaPvRKSt9nothrow_t;
@@ -1630,7 +1766,7 @@ extern "C"
 void *__wrap_mmap(void *addr, size_t length, int prot, int flags,
                   int fd, off_t offset) {
   if (IN_RTL) return __real_mmap(addr, length, prot, flags, fd, offset);
-  GIL scoped;
+  RTLScope scoped;
   DECLARE_TID_AND_PC();
   RPut(RTN_CALL, tid, pc, (uintptr_t)__real_mmap, 0);
   IGNORE_ALL_ACCESSES_AND_SYNC_BEGIN();
@@ -1646,7 +1782,7 @@ extern "C"
 void *__wrap_mmap64(void *addr, size_t length, int prot, int flags,
                     int fd, __off64_t offset) {
   if (IN_RTL) return __real_mmap64(addr, length, prot, flags, fd, offset);
-  GIL scoped;
+  RTLScope scoped;
   DECLARE_TID_AND_PC();
   RPut(RTN_CALL, tid, pc, (uintptr_t)__real_mmap64, 0);
   IGNORE_ALL_ACCESSES_AND_SYNC_BEGIN();
@@ -1661,14 +1797,16 @@ void *__wrap_mmap64(void *addr, size_t length, int prot, int flags,
 extern "C"
 int __wrap_munmap(void *addr, size_t length) {
   if (IN_RTL) return __real_munmap(addr, length);
-  GIL scoped;
+  RTLScope scoped;
   DECLARE_TID_AND_PC();
   RPut(RTN_CALL, tid, pc, (uintptr_t)__real_munmap, 0);
+  // Like FREE, MUNMAP is passed before the range may be mapped again by
+  // another thread. munmap() fails only on invalid arguments, for which
+  // the detector has no mapping to forget.
+  SPut(MUNMAP, tid, pc, (uintptr_t)addr, (uintptr_t)length);
   IGNORE_ALL_ACCESSES_AND_SYNC_BEGIN();
   int result = __real_munmap(addr, length);
   IGNORE_ALL_ACCESSES_AND_SYNC_END();
-  if (result == 0)
-    SPut(MUNMAP, tid, pc, (uintptr_t)addr, (uintptr_t)length);
   RPut(RTN_EXIT, tid, pc, 0, 0);
   return result;
 }
@@ -2146,38 +2284,22 @@ int __wrap_pthread_join(pthread_t thread, void **value_ptr) {
   // Note that the ThreadInfo of |thread| is valid no more.
   DECLARE_TID_AND_PC();
   RPut(RTN_CALL, tid, pc, (uintptr_t)__real_pthread_join, 0);
-  tid_t joined_tid = -1;
-  {
-    GIL scoped;
-    if (Tids.find(thread) == Tids.end()) {
-      InitConds[thread] = new pthread_cond_t;
-      pthread_cond_init(InitConds[thread], NULL);
-      DDPrintf("T%d: Initializing InitConds[%p]=%p\n",
-               tid, thread, InitConds[thread]);
-      DDPrintf("T%d (parent of %p): Waiting on InitConds[%p]=%p\n",
-               tid, thread, thread, InitConds[thread]);
-      __real_pthread_cond_wait(InitConds[thread], &global_lock);
-    }
-    DCHECK(Tids.find(thread) != Tids.end());
-    joined_tid = Tids[thread];
-    DDPrintf("T%d: Finished[T%d]=%d\n", tid, joined_tid, Finished[joined_tid]);
-    if (Finished.find(joined_tid) == Finished.end()) {
-      Finished[joined_tid] = false;
-      DDPrintf("T%d: setting Finished[T%d]=false\n", tid, joined_tid);
-    }
-    if (!Finished[joined_tid]) {
-      FinishConds[joined_tid] = new pthread_cond_t;
-      pthread_cond_init(FinishConds[joined_tid], NULL);
-      DDPrintf("T%d: Initializing FinishConds[%d]=%p\n",
-               tid, joined_tid, FinishConds[joined_tid]);
-      DDPrintf("T%d (parent of T%d): Waiting on FinishConds[%d]=%p\n",
-               tid, joined_tid, joined_tid, FinishConds[joined_tid]);
-      __real_pthread_cond_wait(FinishConds[joined_tid], &global_lock);
-    }
-    unsafe_forget_thread(joined_tid, tid);  // TODO(glider): earlier?
+  // pthread_create() returns only after the child is registered.
+  // The threads started before the RTL or not by pthread_create() (and
+  // the ones which did not fit into the registry) are not registered.
+  ThreadRegistry::Slot *slot = thread_registry.Find(thread);
+  if (slot == NULL) {
+    int result = __real_pthread_join(thread, value_ptr);
+    RPut(RTN_EXIT, tid, pc, 0, 0);
+    return result;
   }
+  tid_t joined_tid = slot->tid;
+  DDPrintf("T%d: joining T%d\n", tid, joined_tid);
+  SPut(THR_JOIN_BEFORE, tid, pc, joined_tid, 0);
 
+  // The thread passes THR_END before it exits.
   int result = __real_pthread_join(thread, value_ptr);
+  if (result == 0) thread_registry.Release(slot);
   {
     DCHECK(joined_tid > 0);
     pc_t pc = (pc_t)__builtin_return_address(0);
@@ -2187,6 +2309,20 @@ int __wrap_pthread_join(pthread_t thread, void **value_ptr) {
   return result;
 }
 
+extern "C"
+int __wrap_pthread_detach(pthread_t thread) {
+  CHECK(!IN_RTL);
+  DECLARE_TID_AND_PC();
+  RPut(RTN_CALL, tid, pc, (uintptr_t)__real_pthread_detach, 0);
+  // The threads not started by pthread_create() (e.g. T0) and the ones
+  // which did not fit into the registry are not registered.
+  ThreadRegistry::Slot *slot = thread_registry.Find(thread);
+  int result = __real_pthread_detach(thread);
+  if (result == 0 && slot) thread_registry.Detach(slot);
+  RPut(RTN_EXIT, tid, pc, 0, 0);
+  return result;
+}
+
 extern "C"
 int __wrap_pthread_spin_init(pthread_spinlock_t *lock, int pshared) {
   if (IN_RTL) return __real_pthread_spin_init(lock, pshared);
@@ -2527,6 +2663,8 @@ pid_t __wrap_fork() {
     // Haha, all our resources that address the TLS of other threads are valid
     // no more!
     FORKED_CHILD = true;
+    // The event trace belongs to the parent.
+    g_trace_writer = NULL;
     //DECLARE_TID_AND_PC();
     //SPut(FLUSH_STATE, tid, pc, 0, 0);
     LEAVE_RTL();
@@ -3010,16 +3148,20 @@ void process_dtleb_events(int start, int end) {
   TraceInfoPOD *current_passport = NULL;
   bool is_split = false;
   int current_mop = -1, current_size = 0;
+  bool dump_events = g_trace_writer != NULL;
+  if (UNLIKELY(dump_events)) ENTER_RTL();
 
   for (int i = start; i < end; ++i) {
     int iter = i % kDoubleDTLEBSize;
     if (DTLEB[iter] & kRtnMask) {
       if (DTLEB[iter] == kRtnMask) {
         //fprintf(stderr, "DTLEB[%d] = RTN_EXIT\n", iter);
+        if (UNLIKELY(dump_events)) TracePut(RTN_EXIT, INFO.tid, 0, 0, 0);
         rtn_exit();
       } else {
         uintptr_t addr = DTLEB[iter] & (~kRtnMask);
         //fprintf(stderr, "DTLEB[%d] = RTN_CALL(%p)\n", iter, (void*)addr);
+        if (UNLIKELY(dump_events)) TracePut(RTN_CALL, INFO.tid, 0, addr, 0);
         rtn_call((void*)addr, NULL);  // TODO(glider): should pc be NULL?
       }
       current_passport = NULL;
@@ -3035,6 +3177,7 @@ void process_dtleb_events(int start, int end) {
       if (end - i <= current_size) {
         // Unfinished block. Let's process it next time.
         OldDTlebIndex = iter;
+        if (UNLIKELY(dump_events)) LEAVE_RTL();
         return;
       }
       if (iter + current_size > (int)kDoubleDTLEBSize) {
@@ -3046,6 +3189,9 @@ void process_dtleb_events(int start, int end) {
         // The mops are consequent in the buffer, pass them to TSan.
         ///fprintf(stderr, "ThreadSanitizerHandleTrace(tid=%d, passport=%p, DTLEB=%p, iter=%d\n",
         ///        (int)INFO.tid, current_passport, &(DTLEB[iter+1]), iter);
+        if (UNLIKELY(dump_events)) {
+          TracePutMops(INFO.tid, current_passport, &(DTLEB[iter+1]));
+        }
         ThreadSanitizerHandleTrace(
             INFO.tid, reinterpret_cast<TraceInfo*>(current_passport),
             &(DTLEB[iter+1]));
@@ -3059,6 +3205,11 @@ void process_dtleb_events(int start, int end) {
     // If the block is split, pass the mops one by one.
     // TODO(glider): while-loop here.
     if (is_split) {
+      if (UNLIKELY(dump_events) && DTLEB[iter]) {
+        MopInfo *mop = &current_passport->mops_[current_mop];
+        TracePut(mop->is_write() ? WRITE : READ, INFO.tid, mop->pc(),
+                 DTLEB[iter], mop->size());
+      }
       ThreadSanitizerHandleOneMemoryAccess(INFO.thread,
                                            current_passport->mops_[current_mop],
                                            DTLEB[iter]);
@@ -3066,6 +3217,7 @@ void process_dtleb_events(int start, int end) {
       CHECK(current_mop < current_size);
     }
   }
+  if (UNLIKELY(dump_events)) LEAVE_RTL();
 #endif
 }
 #endif  // defined(USE_DYNAMIC_TLEB)
@@ -3236,6 +3388,10 @@ __tsan_handle_mop(void *addr, unsigned flags) {
     uint64_t mop = (uint64_t)(uintptr_t)pc | ((uint64_t)flags) << 58;
     MopInfo mop2;
     memcpy(&mop2, &mop, sizeof(mop));
+    if (UNLIKELY(g_trace_writer != NULL)) {
+      TracePut(mop2.is_write() ? WRITE : READ, INFO.tid, mop2.pc(),
+               (uintptr_t)addr, mop2.size());
+    }
     ThreadSanitizerHandleOneMemoryAccess(INFO.thread,
                                          mop2,
                                          (uintptr_t)addr);
@@ -108,6 +108,16 @@ class GIL {
 #endif
 };
 
+// Marks the current thread as being inside the RTL without taking the GIL:
+// the calls made by the wrapped function are not intercepted and the signals
+// are delayed until the scope is left. Used by the wrappers which only pass
+// events to ThreadSanitizer, which serializes them itself.
+class RTLScope {
+ public:
+  RTLScope();
+  ~RTLScope();
+};
+
 typedef uintptr_t pc_t;
 typedef uintptr_t tid_t;
 typedef map<pc_t, string> PcToStringMap;
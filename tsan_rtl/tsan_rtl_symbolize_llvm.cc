@@ -53,18 +53,6 @@ class DbgInfoLock {
   }
 };
 
-struct LLVMDebugInfo {
-  LLVMDebugInfo()
-    : pc(0), line(0) { }
-  pc_t pc;
-  string symbol;
-  string demangled_symbol;
-  string file;
-  string path;
-  string fullpath;  // = path + "/" + file
-  uintptr_t line;
-};
-
 struct PcInfo {
   uintptr_t pc;
   uintptr_t symbol;
@@ -73,7 +61,40 @@ struct PcInfo {
   uintptr_t line;
 };
 
-static map<pc_t, LLVMDebugInfo> *debug_info = NULL;
+// The debug info section consists of blocks, one per compilation unit.
+// A block starts with a header (magic number and the sizes of the tables)
+// followed by the tables of paths, files and symbols (null-terminated
+// strings) and by the array of PcInfo referring to those strings by number.
+//
+// The section is not parsed at startup: it is mapped and used in place.
+// On the first lookup we find the blocks, and for each block that is
+// looked up we index its string tables. Symbols are demangled on demand.
+struct DbgInfoBlock {
+  const char *paths, *files, *symbols;
+  uintptr_t paths_size, files_size, symbols_size;
+  const PcInfo *pcs;
+  uintptr_t pcs_size;
+  uintptr_t min_pc, max_pc;
+  // Indices of |pcs| sorted by pc, empty if |pcs| is already sorted.
+  vector<uint32_t> order;
+  // The string tables, built on the first lookup in this block.
+  bool strings_indexed;
+  vector<const char*> path_strings, file_strings, symbol_strings;
+};
+
+static const char *dbg_section = NULL;
+static const char *dbg_section_end = NULL;
+static bool dbg_blocks_found = false;
+static vector<DbgInfoBlock> *dbg_blocks = NULL;
+// Indices of dbg_blocks sorted by min_pc.
+static vector<uint32_t> *dbg_blocks_by_pc = NULL;
+// max_end_pc[i] = max(dbg_blocks[dbg_blocks_by_pc[j]].max_pc), j <= i.
+static vector<uintptr_t> *max_end_pc = NULL;
+// The wrappers of the functions from libc et. al.
+static map<pc_t, const char*> *wrapper_dbg_info = NULL;
+// mangled name => demangled name.
+static map<const char*, string> *demangled_symbols = NULL;
+
 // end of section : start of section
 static map<uintptr_t, uintptr_t> *data_sections = NULL;
 
@@ -83,129 +104,169 @@ void ReadDbgInfoFromSection(char* start, char* end) {
   if (G_flags->verbosity >= 1) {
     Printf("ReadDbgInfoFromSection: %p to %p\n", start, end);
   }
-  DCHECK(IN_RTL); // operator new and map are used below.
+  dbg_section = start;
+  dbg_section_end = end;
+}
+
+static void IndexStrings(const char *raw, uintptr_t size,
+                         vector<const char*> *res) {
+  const char *start = raw;
+  for (uintptr_t i = 0; i < size; i++) {
+    if (!start) start = raw + i;
+    if (raw[i] == '\0') {
+      res->push_back(start);
+      start = NULL;
+    }
+  }
+}
+
+static const char *GetString(const vector<const char*> &strings, uintptr_t n) {
+  return n < strings.size() ? strings[n] : "";
+}
+
+struct BlockPcLess {
+  explicit BlockPcLess(const PcInfo *pcs) : pcs_(pcs) { }
+  bool operator()(uint32_t a, uint32_t b) const {
+    return pcs_[a].pc < pcs_[b].pc;
+  }
+  const PcInfo *pcs_;
+};
+
+struct BlockMinPcLess {
+  bool operator()(uint32_t a, uint32_t b) const {
+    return (*dbg_blocks)[a].min_pc < (*dbg_blocks)[b].min_pc;
+  }
+};
+
+// Finds the block boundaries in the section. Called on the first lookup.
+static void FindDbgInfoBlocks() {
   static const int kDebugInfoMagicNumber = 0xdb914f0;
-  char *p = start;
-  debug_info = new map<pc_t, LLVMDebugInfo>;
+  dbg_blocks_found = true;
+  dbg_blocks = new vector<DbgInfoBlock>;
+  dbg_blocks_by_pc = new vector<uint32_t>;
+  max_end_pc = new vector<uintptr_t>;
+  const char *p = dbg_section;
+  const char *end = dbg_section_end;
   while (p < end) {
     while ((p < end) && (*((int*)p) != kDebugInfoMagicNumber)) p++;
     if (p >= end) break;
     uintptr_t *head = (uintptr_t*)p;
-    uintptr_t paths_size = head[1];
-    uintptr_t files_size = head[2];
-    uintptr_t symbols_size = head[3];
-    uintptr_t pcs_size = head[4];
-    p += 5 * sizeof(uintptr_t);
-
-    char *paths_raw = p;
-    map<uintptr_t, string> paths;
-    uintptr_t paths_count = 0;
-    char *pstart = paths_raw;
-    for (size_t i = 0; i < paths_size; i++) {
-      if (!pstart) pstart = paths_raw + i;
-      if (paths_raw[i] == '\0') {
-        paths[paths_count++] = string(pstart);
-        DDPrintf("path: %s\n", paths[paths_count-1].c_str());
-        pstart = NULL;
-      }
+    DbgInfoBlock block;
+    block.paths_size = head[1];
+    block.files_size = head[2];
+    block.symbols_size = head[3];
+    block.pcs_size = head[4];
+    block.paths = p + 5 * sizeof(uintptr_t);
+    block.files = block.paths + block.paths_size;
+    block.symbols = block.files + block.files_size;
+    size_t pad = (uintptr_t)(block.symbols + block.symbols_size) %
+        sizeof(uintptr_t);
+    if (pad) pad = sizeof(uintptr_t) - pad;
+    block.pcs = (PcInfo*)(block.symbols + block.symbols_size + pad);
+    block.strings_indexed = false;
+    p = (const char*)(block.pcs + block.pcs_size);
+    if (block.pcs_size == 0 || p > end) continue;
+
+    bool sorted = true;
+    block.min_pc = block.max_pc = block.pcs[0].pc;
+    for (uintptr_t i = 1; i < block.pcs_size; i++) {
+      uintptr_t pc = block.pcs[i].pc;
+      if (pc < block.pcs[i - 1].pc) sorted = false;
+      block.min_pc = min(block.min_pc, pc);
+      block.max_pc = max(block.max_pc, pc);
+    }
+    dbg_blocks->push_back(block);
+    if (!sorted) {
+      vector<uint32_t> &order = dbg_blocks->back().order;
+      order.resize(block.pcs_size);
+      for (uintptr_t i = 0; i < block.pcs_size; i++) order[i] = i;
+      stable_sort(order.begin(), order.end(), BlockPcLess(block.pcs));
     }
+  }
+  for (uint32_t i = 0; i < dbg_blocks->size(); i++) {
+    dbg_blocks_by_pc->push_back(i);
+  }
+  stable_sort(dbg_blocks_by_pc->begin(), dbg_blocks_by_pc->end(),
+              BlockMinPcLess());
+  uintptr_t max_end = 0;
+  for (size_t i = 0; i < dbg_blocks_by_pc->size(); i++) {
+    max_end = max(max_end, (*dbg_blocks)[(*dbg_blocks_by_pc)[i]].max_pc);
+    max_end_pc->push_back(max_end);
+  }
+  if (G_flags->verbosity >= 1) {
+    Printf("Found %ld debug info blocks\n", dbg_blocks->size());
+  }
+}
 
-    char *files_raw = paths_raw + paths_size;
-    map<uintptr_t, string> files;
-    uintptr_t files_count = 0;
-    char *fstart = files_raw;
-    for (size_t i = 0; i < files_size; i++) {
-      if (!fstart) fstart = files_raw + i;
-      if (files_raw[i] == '\0') {
-        files[files_count++] = string(fstart);
-        DDPrintf("file: %s\n", files[files_count-1].c_str());
-        fstart = NULL;
-      }
+// Returns the first PcInfo for |pc| in the block, or NULL.
+static const PcInfo *FindPcInBlock(const DbgInfoBlock &block, uintptr_t pc) {
+  size_t lo = 0, hi = block.pcs_size;
+  bool sorted = block.order.empty();
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    uintptr_t mid_pc = block.pcs[sorted ? mid : block.order[mid]].pc;
+    if (mid_pc < pc) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
     }
+  }
+  if (lo == block.pcs_size) return NULL;
+  const PcInfo *res = &block.pcs[sorted ? lo : block.order[lo]];
+  return res->pc == pc ? res : NULL;
+}
 
-    map<uintptr_t, string> symbols;
-    uintptr_t symbols_count = 0;
-    char *symbols_raw = files_raw + files_size;
-    char *sstart = symbols_raw;
-    for (size_t i = 0; i < symbols_size; i++) {
-      if (!sstart) sstart = symbols_raw + i;
-      if (symbols_raw[i] == '\0') {
-        symbols[symbols_count++] = string(sstart);
-        DDPrintf("symbol: %s\n", symbols[symbols_count-1].c_str());
-        sstart = NULL;
-      }
+// If the same pc is described by several blocks, the first one wins.
+// TODO(glider): generate more correct debug info.
+static const PcInfo *FindPc(uintptr_t pc, DbgInfoBlock **res_block) {
+  if (!dbg_blocks_found) FindDbgInfoBlocks();
+  // The blocks which start at or before pc.
+  size_t i = upper_bound(max_end_pc->begin(), max_end_pc->end(), pc - 1) -
+      max_end_pc->begin();
+  const PcInfo *res = NULL;
+  uint32_t res_idx = 0;
+  for (; i < dbg_blocks_by_pc->size(); i++) {
+    uint32_t idx = (*dbg_blocks_by_pc)[i];
+    DbgInfoBlock &block = (*dbg_blocks)[idx];
+    if (block.min_pc > pc) break;
+    if (block.max_pc < pc || (res && idx > res_idx)) continue;
+    const PcInfo *info = FindPcInBlock(block, pc);
+    if (info) {
+      res = info;
+      res_idx = idx;
+      *res_block = &block;
     }
-    size_t pad = (uintptr_t)(symbols_raw + symbols_size) % sizeof(uintptr_t);
-    if (pad) pad = sizeof(uintptr_t) - pad;
-    PcInfo *pcs = (PcInfo*)(symbols_raw + symbols_size + pad);
-    for (size_t i = 0; i < pcs_size; i++) {
-      DDPrintf("pc: %p, sym: %s, file: %s, path: %s, line: %d\n",
-             pcs[i].pc, symbols[pcs[i].symbol].c_str(),
-             files[pcs[i].file].c_str(), paths[pcs[i].path].c_str(),
-             pcs[i].line);
-      // If we've already seen this pc, check that it is inside the same
-      // function, but do not update the debug info (it may be different).
-      // TODO(glider): generate more correct debug info.
-      if ((*debug_info).find(pcs[i].pc) != (*debug_info).end()) {
-        if ((*debug_info)[pcs[i].pc].symbol != symbols[pcs[i].symbol]) {
-          DPrintf("ERROR: conflicting symbols for pc %p:\n  %s\n  %s\n",
-                 pcs[i].pc,
-                 (*debug_info)[pcs[i].pc].symbol.c_str(),
-                 symbols[pcs[i].symbol].c_str());
-///          CHECK(false);
-        }
-      } else {
-        (*debug_info)[pcs[i].pc].pc = pcs[i].pc;
-        (*debug_info)[pcs[i].pc].symbol = symbols[pcs[i].symbol];
+  }
+  return res;
+}
+
+static const char *DemangleCached(const char *symbol) {
 #if defined(__GNUC__)
-        char *demangled = NULL;
-        int status;
-        demangled = __cxxabiv1::__cxa_demangle(symbols[pcs[i].symbol].c_str(),
-                                               0, 0, &status);
-        if (demangled) {
-          (*debug_info)[pcs[i].pc].demangled_symbol = demangled;
-          __real_free(demangled);
-        } else {
-          (*debug_info)[pcs[i].pc].demangled_symbol = symbols[pcs[i].symbol];
-        }
+  map<const char*, string>::iterator it = demangled_symbols->find(symbol);
+  if (it != demangled_symbols->end()) return it->second.c_str();
+  int status;
+  char *demangled = __cxxabiv1::__cxa_demangle(symbol, 0, 0, &status);
+  string &res = (*demangled_symbols)[symbol];
+  if (demangled) {
+    res = demangled;
+    __real_free(demangled);
+  } else {
+    res = symbol;
+  }
+  return res.c_str();
 #else
-        (*debug_info)[pcs[i].pc].demangled_symbol = symbols[pcs[i].symbol];
+  return symbol;
 #endif
-        (*debug_info)[pcs[i].pc].file = files[pcs[i].file];
-        (*debug_info)[pcs[i].pc].path = paths[pcs[i].path];
-        // TODO(glider): move the path-related logic to the compiler.
-        if ((files[pcs[i].file] != "")  && (paths[pcs[i].path] != "")) {
-          if (paths[pcs[i].path][paths[pcs[i].path].size() - 1] != '/') {
-            (*debug_info)[pcs[i].pc].fullpath =
-                paths[pcs[i].path] + "/" + files[pcs[i].file];
-          } else {
-            (*debug_info)[pcs[i].pc].fullpath =
-                paths[pcs[i].path] + files[pcs[i].file];
-          }
-        } else {
-          (*debug_info)[pcs[i].pc].fullpath = files[pcs[i].file];
-        }
-        (*debug_info)[pcs[i].pc].line = pcs[i].line;
-      }
-    }
-  }
 }
 
 void AddOneWrapperDbgInfo(pc_t pc, const char *symbol) {
-  if (debug_info == 0)
+  if (dbg_section == NULL)
     return;
   char const* prefix = "__real_";
   size_t const prefix_len = strlen(prefix);
   if (strncmp(symbol, prefix, prefix_len) == 0)
     symbol = symbol + prefix_len;
-  (*debug_info)[pc].pc = pc;
-  (*debug_info)[pc].symbol = symbol;
-  (*debug_info)[pc].demangled_symbol = symbol;
-  (*debug_info)[pc].fullpath = __FILE__;
-  (*debug_info)[pc].file = __FILE__;
-  (*debug_info)[pc].path = "";
-  // TODO(glider): we need exact line numbers.
-  (*debug_info)[pc].line = 0;
+  (*wrapper_dbg_info)[pc] = symbol;
 }
 
 #define WRAPPER_DBG_INFO(fun) AddOneWrapperDbgInfo((pc_t)fun, #fun)
@@ -379,7 +440,7 @@ void ReadElf() {
   char *hdr_strings = map + shdrs[ehdr->e_shstrndx].sh_offset;
   int shnum = ehdr->e_shnum;
 
-  char* debug_info_section = NULL;
+  Elf_Off debug_info_offset = 0;
   size_t debug_info_size = 0;
 
   ENTER_RTL();
@@ -392,7 +453,7 @@ void ReadElf() {
     Elf_Addr vma = shdr->sh_addr;
     DDPrintf("Section name: %d, %s\n", name, hdr_strings + name);
     if (strcmp(hdr_strings + name, "tsan_rtl_debug_info") == 0) {
-      debug_info_section = map + off;
+      debug_info_offset = off;
       debug_info_size = size;
       continue;
     }
@@ -407,15 +468,25 @@ void ReadElf() {
       }
     }
   }
+  LEAVE_RTL();
+  sys_munmap(map, st.st_size);
 
-  if (debug_info_section) {
-    // Parse the debug info section.
-    ReadDbgInfoFromSection(debug_info_section,
-                           debug_info_section + debug_info_size);
+  if (debug_info_size) {
+    // Keep the debug info section mapped, it is used in place.
+    Elf_Off page_offset = debug_info_offset % getpagesize();
+    char *section = (char*)sys_mmap(NULL, debug_info_size + page_offset,
+                                    PROT_READ, MAP_PRIVATE, fd,
+                                    debug_info_offset - page_offset);
+    if (section == MAP_FAILED) {
+      perror("mmap");
+      Printf("Could not map the debug info. "
+             "Debug info will be unavailable.\n");
+    } else {
+      section += page_offset;
+      ReadDbgInfoFromSection(section, section + debug_info_size);
+    }
   }
-  LEAVE_RTL();
   // Finalize.
-  sys_munmap(map, st.st_size);
   close(fd);
 }
 
@@ -441,6 +512,8 @@ bool IsAddrFromDataSections(uintptr_t addr) {
 void __tsan::SymbolizeInit() {
   CHECK(DBG_INIT == 0);
   data_sections = new map<uintptr_t, uintptr_t>;
+  wrapper_dbg_info = new map<pc_t, const char*>;
+  demangled_symbols = new map<const char*, string>;
   ReadElf();
   AddWrappersDbgInfo();
   DBG_INIT = 1;
@@ -469,24 +542,40 @@ bool __tsan::SymbolizeCode(void *pc, bool demangle,
   if (symbol && symbol_sz) symbol[0] = 0;
   if (file && file_sz) file[0] = 0;
   if (line) *line = 0;
-  if (debug_info) {
-    if (debug_info->find((uintptr_t)pc) != debug_info->end()) {
-      if (symbol) {
-        if (demangle) {
-          strncpy(symbol,
-                  (*debug_info)[(uintptr_t)pc].demangled_symbol.c_str(),
-                  symbol_sz);
-        } else {
-          strncpy(symbol,
-                  (*debug_info)[(uintptr_t)pc].symbol.c_str(),
-                  symbol_sz);
-        }
-      }
-      if (file) strncpy(file,
-                        (*debug_info)[(uintptr_t)pc].fullpath.c_str(),
-                        file_sz);
-      if (line) *line = ((*debug_info)[(uintptr_t)pc].line);
+  if (dbg_section == NULL) return true;
+  map<pc_t, const char*>::iterator it = wrapper_dbg_info->find((pc_t)pc);
+  if (it != wrapper_dbg_info->end()) {
+    if (symbol) strncpy(symbol, it->second, symbol_sz);
+    if (file) strncpy(file, __FILE__, file_sz);
+    // TODO(glider): we need exact line numbers.
+    return true;
+  }
+  DbgInfoBlock *block = NULL;
+  const PcInfo *info = FindPc((uintptr_t)pc, &block);
+  if (!info) return true;
+  if (!block->strings_indexed) {
+    IndexStrings(block->paths, block->paths_size, &block->path_strings);
+    IndexStrings(block->files, block->files_size, &block->file_strings);
+    IndexStrings(block->symbols, block->symbols_size, &block->symbol_strings);
+    block->strings_indexed = true;
+  }
+  if (symbol) {
+    const char *mangled = GetString(block->symbol_strings, info->symbol);
+    strncpy(symbol, demangle ? DemangleCached(mangled) : mangled, symbol_sz);
+  }
+  if (file) {
+    // TODO(glider): move the path-related logic to the compiler.
+    const char *path = GetString(block->path_strings, info->path);
+    const char *fname = GetString(block->file_strings, info->file);
+    size_t path_len = strlen(path);
+    if (*fname && path_len && path[path_len - 1] != '/') {
+      snprintf(file, file_sz, "%s/%s", path, fname);
+    } else if (*fname && path_len) {
+      snprintf(file, file_sz, "%s%s", path, fname);
+    } else {
+      strncpy(file, fname, file_sz);
     }
   }
+  if (line) *line = info->line;
   return true;
 }
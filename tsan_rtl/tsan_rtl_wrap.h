@@ -62,6 +62,7 @@ int __real_pthread_create(pthread_t *thread,
                           const pthread_attr_t *attr,
                           void *(*start_routine)(void*), void *arg);
 int __real_pthread_join(pthread_t thread, void **value_ptr);
+int __real_pthread_detach(pthread_t thread);
 
 int __real_pthread_mutex_init(pthread_mutex_t *mutex,
                               const pthread_mutexattr_t *mutexattr);
@@ -203,6 +204,7 @@ int __wrap_pthread_create(pthread_t *thread,
                           const pthread_attr_t *attr,
                           void *(*start_routine)(void*), void *arg);
 int __wrap_pthread_join(pthread_t thread, void **value_ptr);
+int __wrap_pthread_detach(pthread_t thread);
 
 int __wrap_pthread_mutex_init(pthread_mutex_t *mutex,
                               const pthread_mutexattr_t *mutexattr);
@@ -7725,6 +7725,38 @@ void Run() {
 REGISTER_TEST2(Run, 513, PERFORMANCE | PRINT_STATS | EXCLUDE_FROM_ALL)
 }  // namespace test513
 
+// test514: Thread creation/join benchmark {{{1
+namespace test514 {
+// Creates and joins many short-lived threads, like a thread-per-request
+// server does.
+const int N_ROUNDS = 2000;
+const int N_THREADS = 8;
+
+int GLOB[N_THREADS];
+
+void Worker(void *arg) {
+  GLOB[(intptr_t)arg]++;
+}
+
+void Run() {
+  printf("test514: thread creation/join benchmark\n");
+  for (int i = 0; i < N_ROUNDS; i++) {
+    MyThread *t[N_THREADS];
+    for (intptr_t j = 0; j < N_THREADS; j++) {
+      t[j] = new MyThread(Worker, (void*)j);
+      t[j]->Start();
+    }
+    for (int j = 0; j < N_THREADS; j++) {
+      t[j]->Join();
+      delete t[j];
+    }
+  }
+  CHECK(GLOB[0] == N_ROUNDS);
+}
+
+REGISTER_TEST2(Run, 514, PERFORMANCE | EXCLUDE_FROM_ALL)
+}  // namespace test514
+
 namespace ThreadChainTest {  // {{{1 Reg test for thread creation
 void Thread1() { }
 void Thread2() {